@@ -0,0 +1,285 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// Jobs are started while fewer than max_running are running in total and
+// fewer than max_running_per_host and max_running_per_command are running
+// for their host and executable. The rest wait in a priority queue, host
+// checks ahead of service checks and older jobs ahead of newer ones. Once
+// max_queued jobs are waiting the job socket isn't read any more, so the
+// broker or PUSH socket hands new work to other executors. A limit of 0
+// means no limit.
+
+int max_running = 0, max_running_per_host = 0, max_running_per_command = 0;
+int max_queued = 10000;
+
+extern __thread ev_io pullio;
+extern __thread void * pullsock;
+
+#define COUNT_BUCKETS 1024
+// How many blocked jobs a drain will step over looking for one it can run
+#define MAX_BLOCKED_SCAN 64
+
+struct run_count {
+	char * key;
+	size_t keylen;
+	uint32_t hash;
+	int count;
+	struct run_count * next;
+};
+
+// Each worker thread admits and queues its own jobs
+static __thread struct run_count * host_counts[COUNT_BUCKETS];
+static __thread struct run_count * command_counts[COUNT_BUCKETS];
+static __thread int admitted = 0;
+static __thread struct child_job ** heap = NULL;
+static __thread size_t heaplen = 0, heapsize = 0;
+static __thread unsigned long next_seq = 0;
+static __thread int draining = 0;
+
+static uint32_t key_hash(const char * key, size_t len) {
+	uint32_t hash = 2166136261;
+	while(len--) {
+		hash ^= (uint8_t)*key++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static struct run_count ** find_count(struct run_count ** table,
+	const char * key, size_t len) {
+	uint32_t hash = key_hash(key, len);
+	struct run_count ** link = &table[hash % COUNT_BUCKETS];
+
+	while(*link && ((*link)->hash != hash || (*link)->keylen != len ||
+		memcmp((*link)->key, key, len) != 0))
+		link = &(*link)->next;
+	return link;
+}
+
+static int get_count(struct run_count ** table, const char * key, size_t len) {
+	struct run_count ** link = find_count(table, key, len);
+	return *link ? (*link)->count : 0;
+}
+
+static void add_count(struct run_count ** table, const char * key,
+	size_t len, int delta) {
+	struct run_count ** link = find_count(table, key, len), *c = *link;
+
+	if(c == NULL) {
+		c = calloc(1, sizeof(struct run_count));
+		c->key = malloc(len);
+		memcpy(c->key, key, len);
+		c->keylen = len;
+		c->hash = key_hash(key, len);
+		*link = c;
+	}
+	if((c->count += delta) <= 0) {
+		*link = c->next;
+		free(c->key);
+		free(c);
+	}
+}
+
+// The executable is the command line up to the first space
+static size_t command_len(const char * command_line) {
+	size_t len = 0;
+	while(command_line[len] && !isspace(command_line[len]))
+		len++;
+	return len;
+}
+
+static const char * host_key(struct child_job * j) {
+	return j->host_name ? j->host_name : "";
+}
+
+static int can_admit(struct child_job * j) {
+	const char * host = host_key(j);
+
+	if(max_running > 0 && admitted >= max_running)
+		return 0;
+	if(max_running_per_host > 0 && get_count(host_counts,
+		host, strlen(host)) >= max_running_per_host)
+		return 0;
+	if(max_running_per_command > 0 && get_count(command_counts,
+		j->command_line, command_len(j->command_line)) >=
+		max_running_per_command)
+		return 0;
+	return 1;
+}
+
+// The limits can change on a reload while jobs are running, so a job
+// remembers which counts it was added to.
+#define COUNTED_HOST 2
+#define COUNTED_COMMAND 4
+
+static void admit(struct child_job * j) {
+	const char * host = host_key(j);
+
+	admitted++;
+	j->admitted = 1;
+	if(max_running_per_host > 0) {
+		add_count(host_counts, host, strlen(host), 1);
+		j->admitted |= COUNTED_HOST;
+	}
+	if(max_running_per_command > 0) {
+		add_count(command_counts, j->command_line,
+			command_len(j->command_line), 1);
+		j->admitted |= COUNTED_COMMAND;
+	}
+}
+
+static void unadmit(struct child_job * j) {
+	const char * host = host_key(j);
+
+	admitted--;
+	if(j->admitted & COUNTED_HOST)
+		add_count(host_counts, host, strlen(host), -1);
+	if(j->admitted & COUNTED_COMMAND)
+		add_count(command_counts, j->command_line,
+			command_len(j->command_line), -1);
+	j->admitted = 0;
+}
+
+static int job_before(struct child_job * a, struct child_job * b) {
+	if(a->priority != b->priority)
+		return a->priority < b->priority;
+	return a->seq < b->seq;
+}
+
+static void heap_set(size_t i, struct child_job * j) {
+	heap[i] = j;
+	j->heap_index = i;
+}
+
+static void heap_push(struct child_job * j) {
+	size_t i;
+
+	if(heaplen == heapsize) {
+		heapsize = heapsize ? heapsize * 2 : 256;
+		heap = realloc(heap, heapsize * sizeof(struct child_job*));
+	}
+	for(i = heaplen++; i > 0 && job_before(j, heap[(i - 1) / 2]);
+		i = (i - 1) / 2)
+		heap_set(i, heap[(i - 1) / 2]);
+	heap_set(i, j);
+}
+
+static struct child_job * heap_pop() {
+	struct child_job * top = heap[0], *last = heap[--heaplen];
+	size_t i = 0, child;
+
+	while((child = (i * 2) + 1) < heaplen) {
+		if(child + 1 < heaplen && job_before(heap[child + 1], heap[child]))
+			child++;
+		if(!job_before(heap[child], last))
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	if(heaplen > 0)
+		heap_set(i, last);
+	return top;
+}
+
+static void pause_jobs(struct ev_loop * loop) {
+	if(!ev_is_active(&pullio))
+		return;
+	ev_io_stop(loop, &pullio);
+	logit(DEBUG, "Job queue is full (%lu jobs). Not taking new jobs",
+		(unsigned long)heaplen);
+}
+
+static void resume_jobs(struct ev_loop * loop) {
+	if(ev_is_active(&pullio) || !pullsock)
+		return;
+	ev_io_start(loop, &pullio);
+	// The ZMQ fd is edge triggered, so anything that arrived while the
+	// watcher was stopped wouldn't wake it up again.
+	ev_feed_event(loop, &pullio, EV_READ);
+	logit(DEBUG, "Job queue has room again (%lu jobs). Taking new jobs",
+		(unsigned long)heaplen);
+}
+
+static void drain(struct ev_loop * loop) {
+	struct child_job * blocked[MAX_BLOCKED_SCAN];
+	int nblocked = 0, i;
+
+	if(draining)
+		return;
+	draining = 1;
+
+	while(heaplen > 0 && (max_running == 0 || admitted < max_running)) {
+		struct child_job * j = heap_pop();
+
+		if(j->timeout > 0 && ev_now(loop) - j->queued_at >= j->timeout) {
+			if(j->service >= 0)
+				obj_for_ending(loop, j, "Check timed out while queued", 3, 1, 0);
+			job_done(loop, j);
+			continue;
+		}
+		if(!can_admit(j)) {
+			blocked[nblocked++] = j;
+			if(nblocked == MAX_BLOCKED_SCAN)
+				break;
+			continue;
+		}
+		admit(j);
+		start_job(loop, j);
+	}
+
+	for(i = 0; i < nblocked; i++)
+		heap_push(blocked[i]);
+	draining = 0;
+
+	if(max_queued > 0 && heaplen <= max_queued / 2)
+		resume_jobs(loop);
+}
+
+size_t queue_length() {
+	return heaplen;
+}
+
+void queue_job(struct ev_loop * loop, struct child_job * j) {
+	j->priority = j->service == 0 ? 0 : (j->service == 1 ? 1 : 2);
+	j->seq = next_seq++;
+
+	if(heaplen == 0 && can_admit(j)) {
+		admit(j);
+		start_job(loop, j);
+		return;
+	}
+
+	j->queued_at = ev_now(loop);
+	heap_push(j);
+	drain(loop);
+	if(max_queued > 0 && heaplen >= max_queued)
+		pause_jobs(loop);
+}
+
+// Applies reloaded limits: starts whatever queued jobs they now allow,
+// and takes jobs again if the queue is no longer full.
+void admission_reload(struct ev_loop * loop) {
+	drain(loop);
+	if(max_queued == 0 || heaplen < max_queued)
+		resume_jobs(loop);
+}
+
+// Releases a job that has finished or failed to start, and starts
+// whatever queued jobs now fit.
+void job_done(struct ev_loop * loop, struct child_job * j) {
+	if(j->admitted)
+		unadmit(j);
+	if(j->credit_id)
+		credit_done(j->credit_id);
+	output_release(j);
+	// Kills anything the check left behind in its cgroup
+	cgroup_release(loop, j->cgroup);
+	json_decref(j->input);
+	free(j);
+	drain(loop);
+}
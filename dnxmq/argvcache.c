@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wordexp.h>
+#include <pthread.h>
+#include "mqexec.h"
+
+// Checks are rescheduled with the same command line every interval, so
+// the wordexp() result for each command line is kept in a small LRU
+// cache instead of being re-expanded for every spawn.
+
+#define ARGV_BUCKETS 2048
+
+struct argv_entry {
+	char * command_line;
+	uint32_t hash;
+	wordexp_t exp;
+	struct argv_entry * next;
+	struct argv_entry * lru_prev, *lru_next;
+};
+
+// Each worker thread has its own cache
+static __thread struct argv_entry * buckets[ARGV_BUCKETS];
+static __thread struct argv_entry * lru_head = NULL, *lru_tail = NULL;
+static __thread size_t nentries = 0;
+size_t argv_cache_size = 1024;
+__thread unsigned long argv_cache_hits = 0, argv_cache_misses = 0;
+
+// wordexp() isn't thread-safe in glibc (it reads the environment and
+// locale and keeps internal state), and every worker thread expands its
+// own command lines, so all expansions go through one lock.
+static pthread_mutex_t wordexp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int wordexp_locked(const char * words, wordexp_t * exp, int flags) {
+	int rc;
+
+	pthread_mutex_lock(&wordexp_lock);
+	rc = wordexp(words, exp, flags);
+	pthread_mutex_unlock(&wordexp_lock);
+	return rc;
+}
+
+void wordfree_locked(wordexp_t * exp) {
+	pthread_mutex_lock(&wordexp_lock);
+	wordfree(exp);
+	pthread_mutex_unlock(&wordexp_lock);
+}
+
+static uint32_t command_hash(const char * str) {
+	uint32_t hash = 2166136261;
+	while(*str) {
+		hash ^= (uint8_t)*str++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static void lru_unlink(struct argv_entry * e) {
+	if(e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if(e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct argv_entry * e) {
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = e;
+	lru_head = e;
+	if(!lru_tail)
+		lru_tail = e;
+}
+
+static void evict(struct argv_entry * e) {
+	struct argv_entry ** link = &buckets[e->hash % ARGV_BUCKETS];
+
+	while(*link != e)
+		link = &(*link)->next;
+	*link = e->next;
+	lru_unlink(e);
+	wordfree_locked(&e->exp);
+	free(e->command_line);
+	free(e);
+	nentries--;
+}
+
+// Returns the expanded argv for command_line, or NULL with the wordexp
+// error in *err. The argv belongs to the cache and stays valid until the
+// next call.
+char ** get_argv(const char * command_line, int * err) {
+	uint32_t hash = command_hash(command_line);
+	struct argv_entry * e;
+	size_t limit = argv_cache_size > 0 ? argv_cache_size : 1;
+
+	for(e = buckets[hash % ARGV_BUCKETS]; e != NULL; e = e->next) {
+		if(e->hash == hash && strcmp(e->command_line, command_line) == 0) {
+			lru_unlink(e);
+			lru_push(e);
+			argv_cache_hits++;
+			return e->exp.we_wordv;
+		}
+	}
+
+	argv_cache_misses++;
+	e = calloc(1, sizeof(struct argv_entry));
+	if(e == NULL) {
+		*err = WRDE_NOSPACE;
+		return NULL;
+	}
+	if((*err = wordexp_locked(command_line, &e->exp, WRDE_NOCMD)) != 0) {
+		if(*err == WRDE_NOSPACE)
+			wordfree_locked(&e->exp);
+		free(e);
+		return NULL;
+	}
+	if(e->exp.we_wordc == 0) {
+		wordfree_locked(&e->exp);
+		free(e);
+		*err = WRDE_SYNTAX;
+		return NULL;
+	}
+	e->command_line = strdup(command_line);
+	e->hash = hash;
+	e->next = buckets[hash % ARGV_BUCKETS];
+	buckets[hash % ARGV_BUCKETS] = e;
+	lru_push(e);
+	nentries++;
+
+	while(nentries > limit)
+		evict(lru_tail);
+	return e->exp.we_wordv;
+}
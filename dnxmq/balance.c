@@ -0,0 +1,696 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mqbroker.h"
+
+// A "balance" device hands each job from its frontend to one mqexec with
+// room for it, instead of round-robin like a PUSH socket. Its backend is a
+// ROUTER socket, and each mqexec with "credits" set connects to it with a
+// DEALER socket and sends:
+//
+//   READY <free> <outstanding> [name]
+//                                how many more jobs it will take, how many
+//                                it has that aren't done yet, and what
+//                                it's called
+//   DONE <id>...                 jobs it has finished, freeing their credit
+//   HEARTBEAT                    still alive, every so often
+//   DISCONNECT <id>...           shutting down once the jobs it lists are
+//                                done; it won't take any others
+//
+// The broker sends "JOB <id>" followed by the frames of the job,
+// "HEARTBEAT" every "heartbeat" milliseconds, and "RESET" to an mqexec it
+// doesn't know, which answers with READY. Each job goes to the executor
+// with the smallest share of its credits in use. One that hasn't been
+// heard from in "liveness" heartbeats is dropped, and the jobs it hadn't
+// finished are sent to the others first. A job can run twice that way,
+// but it won't be lost. New jobs are only read from the frontend while
+// some executor has credit, so they wait in the frontend's queue.
+//
+// A "shard" device speaks the same protocol, but sends each job to the
+// executor its key hashes to (see shard.c). Jobs for an executor without
+// credit wait at the broker in its own queue, and new jobs are read until
+// "max_waiting" jobs (default 1000) are waiting across all of them.
+
+#define DEFAULT_HEARTBEAT 1000
+#define DEFAULT_LIVENESS 3
+#define DEFAULT_MAX_WAITING 1000
+
+struct lb_job {
+	uint64_t id;
+	uint32_t hash;
+	int nframes;
+	zmq_msg_t * frames;
+	struct lb_job * next;
+};
+
+struct lb_worker {
+	char * identity;
+	size_t idlen;
+	int credits;
+	int outstanding;
+	int leaving;
+	int inring;
+	// The name the worker is on the ring by
+	char * name;
+	size_t namelen;
+	double expires;
+	struct lb_job * jobs;
+	// Jobs sharded to this worker that it has no credit for yet
+	struct lb_job * waiting, **waiting_tail;
+	struct lb_worker * next;
+};
+
+struct balancer {
+	struct lb_worker * workers;
+	struct lb_job * requeued, **requeued_tail;
+	int nworkers, credits, frontrouter;
+	uint64_t next_id;
+	double heartbeat, timeout, next_heartbeat;
+	// Set for "shard" devices
+	struct shard * shard;
+	int waiting, max_waiting;
+	// Counters
+	uint64_t requeues, expired, unkeyed;
+};
+
+static void free_job(struct lb_job * j) {
+	int i;
+
+	for(i = 0; i < j->nframes; i++)
+		zmq_msg_close(&j->frames[i]);
+	free(j->frames);
+	free(j);
+}
+
+// Reads all the frames of one message. Returns 1 if a message was read, 0
+// if none was waiting, and -1 on error.
+static int recv_frames(void * sock, zmq_msg_t ** framesp, int * nframesp,
+	struct traffic * t) {
+	zmq_msg_t * frames = NULL;
+	int rc, nframes = 0, flags = ZMQ_DONTWAIT;
+#if ZMQ_VERSION_MAJOR == 2
+	int64_t rcvmore;
+#elif ZMQ_VERSION_MAJOR >= 3
+	int rcvmore;
+#endif
+	size_t size;
+
+	do {
+		frames = realloc(frames, sizeof(zmq_msg_t) * (nframes + 1));
+		zmq_msg_init(&frames[nframes]);
+		while((rc = zmq_msg_recv(&frames[nframes], sock, flags)) == -1 &&
+			errno == EINTR)
+			;
+		if(rc == -1) {
+			rc = errno;
+			while(nframes >= 0)
+				zmq_msg_close(&frames[nframes--]);
+			free(frames);
+			if(rc == EAGAIN && flags == ZMQ_DONTWAIT)
+				return 0;
+			if(rc != ETERM)
+				logit(WARN, "Error receiving message: %s", zmq_strerror(rc));
+			return -1;
+		}
+		flags = 0;
+		t->bytes += zmq_msg_size(&frames[nframes++]);
+		size = sizeof(rcvmore);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &rcvmore, &size);
+	} while(rcvmore);
+
+	t->messages++;
+	*framesp = frames;
+	*nframesp = nframes;
+	return 1;
+}
+
+static void close_frames(zmq_msg_t * frames, int nframes) {
+	int i;
+
+	for(i = 0; i < nframes; i++)
+		zmq_msg_close(&frames[i]);
+	free(frames);
+}
+
+static int frame_is(zmq_msg_t * msg, const char * str) {
+	size_t len = strlen(str);
+	return zmq_msg_size(msg) == len && memcmp(zmq_msg_data(msg), str, len) == 0;
+}
+
+static uint64_t frame_number(zmq_msg_t * msg) {
+	char buf[24];
+	size_t len = zmq_msg_size(msg);
+
+	if(len >= sizeof(buf))
+		return 0;
+	memcpy(buf, zmq_msg_data(msg), len);
+	buf[len] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+static int send_bytes(void * sock, const void * data, size_t len, int flags) {
+	zmq_msg_t msg;
+	int rc;
+
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	while((rc = zmq_msg_send(&msg, sock, flags | ZMQ_DONTWAIT)) == -1 &&
+		errno == EINTR)
+		;
+	zmq_msg_close(&msg);
+	return rc == -1 ? -1 : 0;
+}
+
+// Sends a command to a worker. The identity is the first frame, and with
+// ZMQ_ROUTER_MANDATORY sending it fails if the worker has gone away; the
+// rest of a message can't fail once its first frame is sent.
+static int send_command(struct device * d, struct lb_worker * w,
+	const char * command, int more) {
+	if(send_bytes(d->backend, w->identity, w->idlen, ZMQ_SNDMORE) != 0)
+		return -1;
+	send_bytes(d->backend, command, strlen(command), more ? ZMQ_SNDMORE : 0);
+	return 0;
+}
+
+static struct lb_worker * find_worker(struct balancer * lb, zmq_msg_t * id) {
+	struct lb_worker * w;
+
+	for(w = lb->workers; w != NULL; w = w->next) {
+		if(w->idlen == zmq_msg_size(id) &&
+			memcmp(w->identity, zmq_msg_data(id), w->idlen) == 0)
+			return w;
+	}
+	return NULL;
+}
+
+static void requeue(struct balancer * lb, struct lb_job * j) {
+	j->next = NULL;
+	*lb->requeued_tail = j;
+	lb->requeued_tail = &j->next;
+}
+
+// Takes a worker off the ring, so its keys go to the others
+static void leave_ring(struct balancer * lb, struct lb_worker * w) {
+	struct lb_job * j;
+
+	if(!lb->shard || !w->inring)
+		return;
+	shard_remove(lb->shard, w);
+	w->inring = 0;
+	while((j = w->waiting) != NULL) {
+		w->waiting = j->next;
+		lb->waiting--;
+		requeue(lb, j);
+	}
+	w->waiting_tail = &w->waiting;
+}
+
+// Forgets a worker. Jobs it hadn't finished go ahead of new ones.
+static void remove_worker(struct device * d, struct lb_worker * w,
+	const char * why) {
+	struct balancer * lb = d->lb;
+	struct lb_worker ** link;
+	struct lb_job * j;
+	int n = 0;
+
+	for(link = &lb->workers; *link != w; link = &(*link)->next)
+		;
+	*link = w->next;
+	leave_ring(lb, w);
+	while((j = w->jobs) != NULL) {
+		w->jobs = j->next;
+		requeue(lb, j);
+		n++;
+	}
+	if(why) {
+		logit(INFO, "Dropping worker from device %s (%s). Requeueing %d jobs",
+			d->name, why, n);
+		lb->expired++;
+	}
+	lb->requeues += n;
+	lb->credits -= w->credits;
+	lb->nworkers--;
+	free(w->identity);
+	free(w->name);
+	free(w);
+}
+
+// The worker using the smallest share of its credits
+static struct lb_worker * least_loaded(struct balancer * lb) {
+	struct lb_worker * w, *best = NULL;
+
+	for(w = lb->workers; w != NULL; w = w->next) {
+		if(w->credits < 1 || w->leaving)
+			continue;
+		if(best == NULL || (uint64_t)w->outstanding *
+			(best->outstanding + best->credits) <
+			(uint64_t)best->outstanding * (w->outstanding + w->credits))
+			best = w;
+	}
+	return best;
+}
+
+static int send_job(struct device * d, struct lb_worker * w,
+	struct lb_job * j) {
+	char id[24];
+	int i;
+
+	if(send_command(d, w, "JOB", 1) != 0)
+		return -1;
+	snprintf(id, sizeof(id), "%llu", (unsigned long long)j->id);
+	send_bytes(d->backend, id, strlen(id), j->nframes ? ZMQ_SNDMORE : 0);
+	for(i = 0; i < j->nframes; i++) {
+		// The job keeps its frames until it's done, so it can be resent
+		zmq_msg_t copy;
+		zmq_msg_init(&copy);
+		zmq_msg_copy(&copy, &j->frames[i]);
+		while(zmq_msg_send(&copy, d->backend,
+			i + 1 < j->nframes ? ZMQ_SNDMORE : 0) == -1 && errno == EINTR)
+			;
+		zmq_msg_close(&copy);
+	}
+	return 0;
+}
+
+static void job_sent(struct balancer * lb, struct lb_worker * w,
+	struct lb_job * j) {
+	j->next = w->jobs;
+	w->jobs = j;
+	w->credits--;
+	w->outstanding++;
+	lb->credits--;
+}
+
+// A worker that's backed up gets credit back as it finishes jobs
+static void send_failed(struct device * d, struct lb_worker * w) {
+	d->lb->credits -= w->credits;
+	w->credits = 0;
+}
+
+// Sends a job to the worker for its shard, or the least loaded one.
+// Returns -1 if no worker can take it yet.
+static int dispatch(struct device * d, struct lb_job * j) {
+	struct balancer * lb = d->lb;
+	struct lb_worker * w;
+
+	for(;;) {
+		if(lb->shard)
+			w = shard_owner(lb->shard, j->hash);
+		else
+			w = least_loaded(lb);
+		if(w == NULL)
+			return -1;
+		// A sharded job waits behind the others for its worker
+		if(lb->shard && (w->credits < 1 || w->waiting)) {
+			j->next = NULL;
+			*w->waiting_tail = j;
+			w->waiting_tail = &j->next;
+			lb->waiting++;
+			return 0;
+		}
+		if(send_job(d, w, j) == 0) {
+			job_sent(lb, w, j);
+			return 0;
+		}
+		if(errno == EAGAIN)
+			send_failed(d, w);
+		else
+			remove_worker(d, w, zmq_strerror(errno));
+	}
+}
+
+// Sends a worker the jobs sharded to it while it has credit
+static void send_waiting(struct device * d, struct lb_worker * w) {
+	struct balancer * lb = d->lb;
+	struct lb_job * j;
+
+	while(!d->paused && w->credits > 0 && (j = w->waiting) != NULL) {
+		// If the worker has gone, the next heartbeat finds out
+		if(send_job(d, w, j) != 0) {
+			if(errno == EAGAIN)
+				send_failed(d, w);
+			break;
+		}
+		if((w->waiting = j->next) == NULL)
+			w->waiting_tail = &w->waiting;
+		lb->waiting--;
+		job_sent(lb, w, j);
+	}
+}
+
+static int can_dispatch(struct balancer * lb) {
+	if(lb->shard)
+		return !shard_empty(lb->shard);
+	return lb->credits > 0;
+}
+
+static void drain_requeued(struct device * d) {
+	struct balancer * lb = d->lb;
+
+	while(!d->paused && lb->requeued && can_dispatch(lb)) {
+		struct lb_job * j = lb->requeued;
+		if((lb->requeued = j->next) == NULL)
+			lb->requeued_tail = &lb->requeued;
+		if(dispatch(d, j) != 0) {
+			// Back to the front of the queue
+			if((j->next = lb->requeued) == NULL)
+				lb->requeued_tail = &j->next;
+			lb->requeued = j;
+			break;
+		}
+	}
+}
+
+int lb_wants_jobs(struct device * d) {
+	struct balancer * lb = d->lb;
+
+	if(d->paused || lb->requeued || !can_dispatch(lb))
+		return 0;
+	return !lb->shard || lb->waiting < lb->max_waiting;
+}
+
+// Reads one job from the frontend and sends it on. Returns 1 if a job was
+// read, 0 if there wasn't one or no worker has room, and -1 on error.
+int lb_take_job(struct device * d) {
+	struct balancer * lb = d->lb;
+	struct lb_job * j;
+	zmq_msg_t * frames;
+	int nframes, rc, skip = 0;
+
+	if(!lb_wants_jobs(d))
+		return 0;
+	if((rc = recv_frames(d->frontend, &frames, &nframes, &d->fromfront)) < 1)
+		return rc;
+
+	// Jobs from a ROUTER frontend start with the sender's identity and
+	// maybe an empty delimiter, which the workers don't need.
+	if(lb->frontrouter) {
+		skip = 1;
+		if(nframes > 1 && zmq_msg_size(&frames[1]) == 0)
+			skip = 2;
+	}
+	if(skip >= nframes) {
+		close_frames(frames, nframes);
+		return 1;
+	}
+
+	j = calloc(1, sizeof(struct lb_job));
+	j->id = lb->next_id++;
+	j->nframes = nframes - skip;
+	j->frames = malloc(sizeof(zmq_msg_t) * j->nframes);
+	for(rc = 0; rc < nframes; rc++) {
+		if(rc < skip)
+			zmq_msg_close(&frames[rc]);
+		else {
+			zmq_msg_init(&j->frames[rc - skip]);
+			zmq_msg_move(&j->frames[rc - skip], &frames[rc]);
+			zmq_msg_close(&frames[rc]);
+		}
+	}
+	free(frames);
+	if(lb->shard && !shard_key(lb->shard, j->frames, j->nframes, &j->hash))
+		lb->unkeyed++;
+	if(dispatch(d, j) != 0)
+		requeue(lb, j);
+	return 1;
+}
+
+static void join_ring(struct device * d, struct lb_worker * w,
+	zmq_msg_t * name) {
+	struct balancer * lb = d->lb;
+	struct lb_worker * other;
+	size_t len = name ? zmq_msg_size(name) : 0;
+
+	free(w->name);
+	w->name = NULL;
+	w->namelen = 0;
+	for(other = lb->workers; len > 0 && other != NULL; other = other->next) {
+		if(other != w && other->inring && other->namelen == len &&
+			memcmp(other->name, zmq_msg_data(name), len) == 0) {
+			logit(WARN, "Two workers on device %s are called %.*s. Placing "
+				"the new one by its identity", d->name, (int)len,
+				(char*)zmq_msg_data(name));
+			len = 0;
+			break;
+		}
+	}
+	if(len > 0) {
+		w->name = malloc(len);
+		memcpy(w->name, zmq_msg_data(name), len);
+		w->namelen = len;
+		shard_add(lb->shard, w->name, w->namelen, w);
+	} else
+		shard_add(lb->shard, w->identity, w->idlen, w);
+	w->inring = 1;
+}
+
+// Applies READY: the worker has free credits, and outstanding jobs it
+// knows about. Jobs the broker counts beyond those are still on their
+// way to it, and use up some of the credits. A shard device places the
+// worker on the ring by the name that follows, so an executor that
+// reconnects gets the same keys back. Without a name, or with one another
+// worker already has, it goes by its identity instead, since two workers
+// with one name would land on the same points.
+static void worker_ready(struct device * d, struct lb_worker * w,
+	zmq_msg_t * frames, int nframes) {
+	struct balancer * lb = d->lb;
+	int avail = 0, known = 0, inflight, credits;
+
+	if(nframes > 2)
+		avail = frame_number(&frames[2]);
+	if(nframes > 3)
+		known = frame_number(&frames[3]);
+	inflight = w->outstanding - known;
+	credits = avail - (inflight > 0 ? inflight : 0);
+	if(credits < 0)
+		credits = 0;
+	lb->credits += credits - w->credits;
+	w->credits = credits;
+	w->leaving = 0;
+	if(lb->shard && !w->inring)
+		join_ring(d, w, nframes > 4 ? &frames[4] : NULL);
+	logit(DEBUG, "Worker on device %s is ready for %d jobs", d->name, credits);
+}
+
+static struct lb_job * take_outstanding(struct lb_worker * w, uint64_t id) {
+	struct lb_job ** link, *j;
+
+	for(link = &w->jobs; *link != NULL; link = &(*link)->next) {
+		if((*link)->id == id) {
+			j = *link;
+			*link = j->next;
+			return j;
+		}
+	}
+	return NULL;
+}
+
+// Applies DISCONNECT: the jobs the worker lists will still be finished,
+// and the rest, which were on their way to it, are given to others.
+static void worker_leaving(struct device * d, struct lb_worker * w,
+	zmq_msg_t * frames, int nframes) {
+	struct balancer * lb = d->lb;
+	struct lb_job * keep = NULL, *j;
+	int i;
+
+	leave_ring(lb, w);
+	for(i = 2; i < nframes; i++) {
+		if((j = take_outstanding(w, frame_number(&frames[i]))) != NULL) {
+			j->next = keep;
+			keep = j;
+		}
+	}
+	while((j = w->jobs) != NULL) {
+		w->jobs = j->next;
+		w->outstanding--;
+		lb->requeues++;
+		requeue(lb, j);
+	}
+	w->jobs = keep;
+	lb->credits -= w->credits;
+	w->credits = 0;
+	w->leaving = 1;
+	logit(INFO, "Worker on device %s is leaving after %d jobs", d->name,
+		w->outstanding);
+}
+
+// Handles one message from a worker. Returns 1 if a message was read, 0
+// if there wasn't one, and -1 on error.
+int lb_handle_worker(struct device * d) {
+	struct balancer * lb = d->lb;
+	struct lb_worker * w;
+	zmq_msg_t * frames;
+	int nframes, rc, i;
+
+	if((rc = recv_frames(d->backend, &frames, &nframes, &d->fromback)) < 1)
+		return rc;
+	if(nframes < 2) {
+		close_frames(frames, nframes);
+		return 1;
+	}
+
+	w = find_worker(lb, &frames[0]);
+	if(w == NULL && frame_is(&frames[1], "READY")) {
+		w = calloc(1, sizeof(struct lb_worker));
+		w->idlen = zmq_msg_size(&frames[0]);
+		w->identity = malloc(w->idlen);
+		memcpy(w->identity, zmq_msg_data(&frames[0]), w->idlen);
+		w->waiting_tail = &w->waiting;
+		w->next = lb->workers;
+		lb->workers = w;
+		lb->nworkers++;
+		logit(INFO, "New worker on device %s", d->name);
+	} else if(w == NULL) {
+		// Probably this broker restarted and the worker doesn't know yet
+		if(!frame_is(&frames[1], "DISCONNECT") &&
+			send_bytes(d->backend, zmq_msg_data(&frames[0]),
+			zmq_msg_size(&frames[0]), ZMQ_SNDMORE) == 0)
+			send_bytes(d->backend, "RESET", 5, 0);
+		close_frames(frames, nframes);
+		return 1;
+	}
+	w->expires = now() + lb->timeout;
+
+	if(frame_is(&frames[1], "READY"))
+		worker_ready(d, w, frames, nframes);
+	else if(frame_is(&frames[1], "DONE")) {
+		for(i = 2; i < nframes; i++) {
+			struct lb_job * j = take_outstanding(w, frame_number(&frames[i]));
+			if(j == NULL)
+				continue;
+			free_job(j);
+			w->outstanding--;
+			if(!w->leaving) {
+				w->credits++;
+				lb->credits++;
+			}
+		}
+	} else if(frame_is(&frames[1], "DISCONNECT"))
+		worker_leaving(d, w, frames, nframes);
+	else if(!frame_is(&frames[1], "HEARTBEAT"))
+		logit(WARN, "Unknown command from worker on device %s", d->name);
+
+	if(w->leaving && w->outstanding == 0) {
+		logit(INFO, "Worker on device %s has left", d->name);
+		remove_worker(d, w, NULL);
+	} else
+		send_waiting(d, w);
+	close_frames(frames, nframes);
+	drain_requeued(d);
+	return 1;
+}
+
+// Sends heartbeats and drops workers that haven't sent one, when it's
+// time to. Returns when it should be called again.
+double lb_timer(struct device * d, double at) {
+	struct balancer * lb = d->lb;
+	struct lb_worker * w, *next;
+
+	if(at >= lb->next_heartbeat) {
+		for(w = lb->workers; w != NULL; w = next) {
+			next = w->next;
+			if(at > w->expires)
+				remove_worker(d, w, "no heartbeat");
+			else if(send_command(d, w, "HEARTBEAT", 0) != 0 && errno != EAGAIN)
+				remove_worker(d, w, zmq_strerror(errno));
+		}
+		lb->next_heartbeat = at + lb->heartbeat;
+	}
+	// Picks up after a pause
+	for(w = lb->workers; w != NULL; w = w->next)
+		send_waiting(d, w);
+	drain_requeued(d);
+	return lb->next_heartbeat;
+}
+
+void lb_stats(struct device * d, json_t * stats) {
+	struct balancer * lb = d->lb;
+	struct lb_worker * w;
+	struct lb_job * j;
+	int outstanding = 0, queued = 0;
+
+	for(w = lb->workers; w != NULL; w = w->next)
+		outstanding += w->outstanding;
+	for(j = lb->requeued; j != NULL; j = j->next)
+		queued++;
+	json_object_set_new(stats, "workers", json_integer(lb->nworkers));
+	json_object_set_new(stats, "credits", json_integer(lb->credits));
+	json_object_set_new(stats, "outstanding", json_integer(outstanding));
+	json_object_set_new(stats, "queued", json_integer(queued));
+	json_object_set_new(stats, "requeued", json_integer(lb->requeues));
+	json_object_set_new(stats, "expired", json_integer(lb->expired));
+	if(lb->shard) {
+		json_object_set_new(stats, "waiting", json_integer(lb->waiting));
+		json_object_set_new(stats, "unkeyed", json_integer(lb->unkeyed));
+	}
+}
+
+struct balancer * lb_new(json_t * def, struct device * d, int sharded) {
+	struct balancer * lb;
+	struct shard * shard = NULL;
+	int heartbeat = DEFAULT_HEARTBEAT, liveness = DEFAULT_LIVENESS, type = -1;
+	int max_waiting = DEFAULT_MAX_WAITING;
+	size_t typesize = sizeof(type);
+
+	if(json_unpack(def, "{s?i s?i s?i}", "heartbeat", &heartbeat,
+		"liveness", &liveness, "max_waiting", &max_waiting) != 0 ||
+		heartbeat < 1 || liveness < 1 || max_waiting < 1) {
+		logit(ERR, "Invalid heartbeat, liveness or max_waiting for device %s",
+			d->name);
+		return NULL;
+	}
+	zmq_getsockopt(d->backend, ZMQ_TYPE, &type, &typesize);
+	if(type != ZMQ_ROUTER || !d->frontread) {
+		logit(ERR, "Balancing device %s needs a router backend and a "
+			"frontend it can read jobs from", d->name);
+		return NULL;
+	}
+	if(sharded && (shard = shard_new(def, d->name)) == NULL)
+		return NULL;
+#ifdef ZMQ_ROUTER_MANDATORY
+	type = 1;
+	zmq_setsockopt(d->backend, ZMQ_ROUTER_MANDATORY, &type, sizeof(type));
+#endif
+
+	lb = calloc(1, sizeof(struct balancer));
+	lb->requeued_tail = &lb->requeued;
+	lb->next_id = 1;
+	lb->heartbeat = heartbeat / 1000.0;
+	lb->timeout = lb->heartbeat * liveness;
+	lb->shard = shard;
+	lb->max_waiting = max_waiting;
+	lb->next_heartbeat = now() + lb->heartbeat;
+	typesize = sizeof(type);
+	zmq_getsockopt(d->frontend, ZMQ_TYPE, &type, &typesize);
+	lb->frontrouter = type == ZMQ_ROUTER;
+	return lb;
+}
+
+void lb_free(struct balancer * lb) {
+	struct lb_job * j;
+
+	if(lb == NULL)
+		return;
+	while(lb->workers) {
+		struct lb_worker * w = lb->workers;
+		lb->workers = w->next;
+		while((j = w->jobs) != NULL) {
+			w->jobs = j->next;
+			free_job(j);
+		}
+		while((j = w->waiting) != NULL) {
+			w->waiting = j->next;
+			free_job(j);
+		}
+		free(w->identity);
+		free(w->name);
+		free(w);
+	}
+	while((j = lb->requeued) != NULL) {
+		lb->requeued = j->next;
+		free_job(j);
+	}
+	shard_free(lb->shard);
+	free(lb);
+}
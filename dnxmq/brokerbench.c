@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <zmq.h>
+#include "zmq3compat.h"
+
+// Measures how many messages per second an mqbroker device moves. It
+// pushes messages into the device's frontend and pulls them back out of
+// its backend, checking that every message comes out with all its frames.
+// Running it against a device with "budget" set to 1 shows how the broker
+// does moving one message per poll.
+//
+//   brokerbench [-n messages] [-p parts] [-s size] frontend backend
+//
+// The frontend should be a PULL socket and the backend a PUSH socket.
+
+static long messages = 1000000;
+static int parts = 2, size = 256;
+static void * zmqctx;
+static const char * frontaddr;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static void * sender(void * arg) {
+	void * sock = zmq_socket(zmqctx, ZMQ_PUSH);
+	char * payload = calloc(1, size);
+	int hwm = 100000;
+	long i;
+
+	zmq_setsockopt(sock, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+	if(zmq_connect(sock, frontaddr) != 0) {
+		fprintf(stderr, "Error connecting to %s: %s\n", frontaddr,
+			zmq_strerror(errno));
+		exit(1);
+	}
+	for(i = 0; i < messages; i++) {
+		int p;
+		for(p = 0; p < parts; p++) {
+			zmq_msg_t msg;
+			zmq_msg_init_size(&msg, size);
+			memcpy(zmq_msg_data(&msg), payload, size);
+			while(zmq_msg_send(&msg, sock,
+				p + 1 < parts ? ZMQ_SNDMORE : 0) == -1 && errno == EINTR)
+				;
+			zmq_msg_close(&msg);
+		}
+	}
+	free(payload);
+	zmq_close(sock);
+	return NULL;
+}
+
+int main(int argc, char ** argv) {
+	void * sock;
+	pthread_t thread;
+	long received = 0, broken = 0;
+	int frames = 0, hwm = 100000, ch;
+	double start = 0, elapsed;
+
+	while((ch = getopt(argc, argv, "n:p:s:")) != -1) {
+		switch(ch) {
+			case 'n':
+				messages = atol(optarg);
+				break;
+			case 'p':
+				parts = atoi(optarg);
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 2 || messages < 1 || parts < 1 || size < 0) {
+		fprintf(stderr, "brokerbench [-n messages] [-p parts] [-s size] "
+			"frontend backend\n");
+		return 1;
+	}
+	frontaddr = argv[0];
+
+	zmqctx = zmq_init(1);
+	sock = zmq_socket(zmqctx, ZMQ_PULL);
+	zmq_setsockopt(sock, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+	if(zmq_connect(sock, argv[1]) != 0) {
+		fprintf(stderr, "Error connecting to %s: %s\n", argv[1],
+			zmq_strerror(errno));
+		return 1;
+	}
+	pthread_create(&thread, NULL, sender, NULL);
+
+	while(received < messages) {
+		zmq_msg_t msg;
+#if ZMQ_VERSION_MAJOR == 2
+		int64_t rcvmore;
+#else
+		int rcvmore;
+#endif
+		size_t optsize = sizeof(rcvmore);
+
+		zmq_msg_init(&msg);
+		if(zmq_msg_recv(&msg, sock, 0) == -1) {
+			zmq_msg_close(&msg);
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "Error receiving: %s\n", zmq_strerror(errno));
+			return 1;
+		}
+		zmq_msg_close(&msg);
+		// Timing starts with the first message out, so connecting
+		// doesn't count
+		if(start == 0)
+			start = now();
+		frames++;
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &rcvmore, &optsize);
+		if(rcvmore)
+			continue;
+		if(frames != parts)
+			broken++;
+		frames = 0;
+		received++;
+	}
+	elapsed = now() - start;
+
+	printf("%ld messages of %d x %d bytes in %.2f seconds\n", messages,
+		parts, size, elapsed);
+	printf("%.0f messages/sec, %ld with the wrong number of frames\n",
+		messages / elapsed, broken);
+	pthread_join(thread, NULL);
+	zmq_close(sock);
+	zmq_term(zmqctx);
+	return broken > 0;
+}
@@ -0,0 +1,115 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include "mqexec.h"
+
+// With "cgroup" set to a cgroup v2 directory mqexec may write to, every
+// check runs in a leaf cgroup of its own. The child joins the leaf before
+// it execs, so nothing it starts can escape, and whatever is still in the
+// leaf when the check ends is killed before the leaf is removed.
+
+char * cgroup_root = NULL;
+
+struct dead_leaf {
+	char * path;
+	struct dead_leaf * next;
+};
+
+static __thread unsigned long next_leaf = 0;
+// Leaves whose processes hadn't all gone when the check ended
+static __thread struct dead_leaf * dead_leaves = NULL;
+static __thread ev_timer rmdir_timer;
+
+// Creates a leaf for j and returns an fd for its cgroup.procs, which the
+// child writes to join it. Returns -1 if the leaf can't be set up.
+int cgroup_create(struct child_job * j) {
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/check.%ld.%lu", cgroup_root,
+		(long)syscall(SYS_gettid), next_leaf++);
+	if(mkdir(path, 0755) < 0) {
+		logit(ERR, "Error creating cgroup %s: %s", path, strerror(errno));
+		return -1;
+	}
+	j->cgroup = strdup(path);
+	strncat(path, "/cgroup.procs", sizeof(path) - strlen(path) - 1);
+	if((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+		logit(ERR, "Error opening %s: %s", path, strerror(errno));
+		rmdir(j->cgroup);
+		free(j->cgroup);
+		j->cgroup = NULL;
+	}
+	return fd;
+}
+
+// Kills everything in a leaf. cgroup.kill needs Linux 5.14; before that
+// the members are killed one at a time.
+void cgroup_kill(const char * leaf) {
+	char path[PATH_MAX];
+	FILE * procs;
+	int fd, pid;
+
+	snprintf(path, sizeof(path), "%s/cgroup.kill", leaf);
+	if((fd = open(path, O_WRONLY | O_CLOEXEC)) >= 0) {
+		int rc = write(fd, "1", 1);
+		close(fd);
+		if(rc == 1)
+			return;
+	}
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", leaf);
+	if((procs = fopen(path, "re")) == NULL)
+		return;
+	while(fscanf(procs, "%d", &pid) == 1)
+		kill(pid, SIGKILL);
+	fclose(procs);
+}
+
+static void rmdir_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	struct dead_leaf ** link = &dead_leaves, *l;
+
+	while((l = *link) != NULL) {
+		if(rmdir(l->path) == 0 || errno != EBUSY) {
+			*link = l->next;
+			free(l->path);
+			free(l);
+		} else
+			link = &l->next;
+	}
+	if(dead_leaves == NULL)
+		ev_timer_stop(loop, t);
+}
+
+// Kills whatever is left in a check's leaf and removes it, taking over
+// the path. Killed processes take a moment to leave, so busy leaves are
+// retried.
+void cgroup_release(struct ev_loop * loop, char * leaf) {
+	struct dead_leaf * l;
+
+	if(leaf == NULL)
+		return;
+	cgroup_kill(leaf);
+	if(rmdir(leaf) == 0 || errno != EBUSY) {
+		free(leaf);
+		return;
+	}
+
+	l = malloc(sizeof(struct dead_leaf));
+	l->path = leaf;
+	l->next = dead_leaves;
+	dead_leaves = l;
+	if(!ev_is_active(&rmdir_timer)) {
+		ev_timer_init(&rmdir_timer, rmdir_cb, 0.1, 0.1);
+		ev_timer_start(loop, &rmdir_timer);
+	}
+}
@@ -1,17 +1,62 @@
+#include "config.h"
 #include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <jansson.h>
 #include "mqexec.h"
 
+// Children are tracked one of two ways. On Linux 5.3 and later each child
+// gets a pidfd that's watched like any other fd, so its exit goes straight
+// to its job and nothing else waits for it; the event loop isn't the
+// default loop, so libev doesn't install a SIGCHLD handler that reaps
+// everything. On older kernels the default loop's child watcher reaps
+// children and they're looked up by pid in runningtable.
+
+#if defined(__linux__) && !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+#if defined(__linux__) && !defined(SYS_pidfd_send_signal)
+#define SYS_pidfd_send_signal 424
+#endif
+
+int use_pidfd = 0;
+// Checks run in their own process group, so a timeout can kill the
+// whole group. Whatever is left kill_grace seconds after the SIGTERM
+// gets a SIGKILL.
+int process_groups = 1, kill_grace = 5;
+
 static struct child_job * runningtable[2048];
 
-void add_child(struct child_job * job) {
+// A child that timed out and was sent SIGTERM after its job was finished.
+// In pidfd mode it isn't reaped until after the grace period, so its pid
+// and process group id stay reserved for the SIGKILL. In SIGCHLD mode the
+// default loop reaps it whenever it exits, and then it's forgotten.
+struct orphan {
+	ev_timer grace;
+	ev_io exitio;
+	pid_t pid;
+	int pidfd;
+	char * cgroup;
+	struct orphan * next;
+};
+
+// Only used in SIGCHLD mode, which only runs one thread
+static struct orphan * orphans = NULL;
+
+static void add_child(struct child_job * job) {
 	uint32_t hash = job->pid * 0x9e370001UL;
 	hash >>= 21;
 	job->next = runningtable[hash];
 	runningtable[hash] = job;
 }
 
-struct child_job * get_child(pid_t pid) {
+static struct child_job * get_child(pid_t pid) {
 	uint32_t hash = pid * 0x9e370001UL;
 	hash >>= 21; //(32 bits - 11)
 	struct child_job * ret = runningtable[hash], *last = NULL;
@@ -25,5 +70,173 @@ struct child_job * get_child(pid_t pid) {
 		runningtable[hash] = ret->next;
 	else
 		last->next = ret->next;
-	return ret; 
-}
\ No newline at end of file
+	return ret;
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int pidfd_supported() {
+	int fd = open_pidfd(getpid());
+	if(fd < 0)
+		return 0;
+	close(fd);
+	return 1;
+}
+
+// Reaps a child that has already exited, so this doesn't block
+static int reap(pid_t pid, struct rusage * ru) {
+	int status = 0;
+	while(wait4(pid, &status, 0, ru) < 0 && errno == EINTR)
+		;
+	return status;
+}
+
+// Signals a child, and its process group, before it has been reaped
+static void signal_group(pid_t pid, int pidfd, int sig) {
+	if(process_groups && kill(-pid, sig) == 0)
+		return;
+#ifdef SYS_pidfd_send_signal
+	if(pidfd >= 0) {
+		syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+		return;
+	}
+#endif
+	kill(pid, sig);
+}
+
+static void child_exit_cb(struct ev_loop * loop, ev_io * w, int event) {
+	struct child_job * j = w->data;
+	int status;
+
+	ev_io_stop(loop, w);
+	status = reap(j->pid, &j->rusage);
+	j->have_rusage = 1;
+	close(j->pidfd);
+	j->pidfd = -1;
+	child_exited(loop, j, status);
+}
+
+static void free_orphan(struct ev_loop * loop, struct orphan * o) {
+	cgroup_release(loop, o->cgroup);
+	free(o);
+}
+
+// The killed child has exited. A child stuck in the kernel can take a
+// while to go after SIGKILL, so this waits for its pidfd instead of
+// blocking in wait4.
+static void orphan_exit_cb(struct ev_loop * loop, ev_io * w, int event) {
+	struct orphan * o = w->data;
+	struct rusage ru;
+	int status;
+	pid_t rc;
+
+	while((rc = wait4(o->pid, &status, WNOHANG, &ru)) < 0 && errno == EINTR)
+		;
+	if(rc == 0)
+		return;
+	ev_io_stop(loop, w);
+	close(o->pidfd);
+	if(rc > 0)
+		logit(DEBUG, "Timed out child %d used %ld.%06lds user %ld.%06lds "
+			"system", o->pid, (long)ru.ru_utime.tv_sec,
+			(long)ru.ru_utime.tv_usec, (long)ru.ru_stime.tv_sec,
+			(long)ru.ru_stime.tv_usec);
+	free_orphan(loop, o);
+}
+
+// The grace period is over: kill what's left of the child and its group.
+// It hasn't been reaped yet, so neither id can have been reused.
+static void orphan_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	struct orphan * o = t->data;
+
+	signal_group(o->pid, o->pidfd, SIGKILL);
+	// In SIGCHLD mode child_end_cb cleans up once the child is reaped
+	if(o->pidfd < 0)
+		return;
+	ev_io_init(&o->exitio, orphan_exit_cb, o->pidfd, EV_READ);
+	o->exitio.data = o;
+	ev_io_start(loop, &o->exitio);
+}
+
+// A timed out child has been reaped in SIGCHLD mode. Its pid can be
+// reused from now on, so it mustn't be signalled again.
+static void forget_orphan(struct ev_loop * loop, pid_t pid) {
+	struct orphan ** link, *o;
+
+	for(link = &orphans; *link != NULL; link = &(*link)->next) {
+		if((*link)->pid != pid)
+			continue;
+		o = *link;
+		*link = o->next;
+		ev_timer_stop(loop, &o->grace);
+		free_orphan(loop, o);
+		return;
+	}
+}
+
+void child_end_cb(struct ev_loop * loop, ev_child * c, int event) {
+	struct child_job * j = get_child(c->rpid);
+	if(!j) {
+		forget_orphan(loop, c->rpid);
+		return;
+	}
+	child_exited(loop, j, c->rstatus);
+}
+
+// Starts watching a freshly spawned child. Returns 0 or an errno.
+int watch_child(struct ev_loop * loop, struct child_job * j) {
+	if(!use_pidfd) {
+		add_child(j);
+		return 0;
+	}
+
+	// Nothing else reaps our children, so the pid can't have been reused
+	// even if the child has already exited.
+	if((j->pidfd = open_pidfd(j->pid)) < 0)
+		return errno;
+	ev_io_init(&j->exitio, child_exit_cb, j->pidfd, EV_READ);
+	j->exitio.data = j;
+	ev_io_start(loop, &j->exitio);
+	return 0;
+}
+
+// Sends SIGTERM to a child that's still running, and its process group,
+// and stops tracking it so its job can be finished now. A small orphan
+// sends SIGKILL after the grace period and cleans up. Returns 1 if the
+// child was still running.
+int kill_child(struct ev_loop * loop, struct child_job * j) {
+	struct orphan * o;
+
+	if(!use_pidfd) {
+		// This also removes the child from the list of children.
+		if(get_child(j->pid) == NULL)
+			return 0;
+	} else {
+		if(!ev_is_active(&j->exitio))
+			return 0;
+		ev_io_stop(loop, &j->exitio);
+	}
+	signal_group(j->pid, j->pidfd, SIGTERM);
+
+	o = calloc(1, sizeof(struct orphan));
+	o->pid = j->pid;
+	o->pidfd = j->pidfd;
+	o->cgroup = j->cgroup;
+	j->pidfd = -1;
+	j->cgroup = NULL;
+	ev_timer_init(&o->grace, orphan_cb, kill_grace, 0);
+	o->grace.data = o;
+	ev_timer_start(loop, &o->grace);
+	if(o->pidfd < 0) {
+		o->next = orphans;
+		orphans = o;
+	}
+	return 1;
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// With "coalesce" on, a check whose command line is already running in
+// this thread doesn't start a child of its own. It waits on the running
+// check (the leader) and gets a copy of its result, sent with its own
+// host, service and latency. A waiter is only attached if the leader will
+// finish or time out before the waiter's own timeout would have passed.
+
+#define LEADER_BUCKETS 1024
+
+int coalesce_checks = 0;
+__thread unsigned long coalesce_hits = 0, coalesce_misses = 0;
+
+static __thread struct child_job * leaders[LEADER_BUCKETS];
+
+static uint32_t command_hash(const char * command_line) {
+	uint32_t hash = 2166136261;
+	while(*command_line) {
+		hash ^= (uint8_t)*command_line++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static double deadline(struct child_job * j) {
+	return j->start.tv_sec + (j->start.tv_usec / 1000000.0) + j->timeout;
+}
+
+static int compatible(struct child_job * leader, struct child_job * j) {
+	struct timeval now;
+
+	if(j->timeout <= 0)
+		return 1;
+	if(leader->timeout <= 0)
+		return 0;
+	gettimeofday(&now, NULL);
+	return deadline(leader) <=
+		now.tv_sec + (now.tv_usec / 1000000.0) + j->timeout;
+}
+
+// Returns 1 if the job is now waiting on a running check
+int coalesce_job(struct child_job * j) {
+	struct child_job * leader;
+
+	if(!coalesce_checks || j->service < 0)
+		return 0;
+
+	j->command_hash = command_hash(j->command_line);
+	for(leader = leaders[j->command_hash % LEADER_BUCKETS]; leader;
+		leader = leader->coalesce_next) {
+		if(leader->command_hash == j->command_hash &&
+			strcmp(leader->command_line, j->command_line) == 0 &&
+			compatible(leader, j))
+			break;
+	}
+	if(leader == NULL) {
+		coalesce_misses++;
+		return 0;
+	}
+
+	mark_job_start(j);
+	j->coalesce_next = leader->waiters;
+	leader->waiters = j;
+	coalesce_hits++;
+	logit(DEBUG, "Coalesced %s %s with running child %d",
+		j->host_name, j->service_description, leader->pid);
+	return 1;
+}
+
+void add_leader(struct child_job * j) {
+	struct child_job ** bucket;
+
+	if(!coalesce_checks || j->service < 0)
+		return;
+	if(j->command_hash == 0)
+		j->command_hash = command_hash(j->command_line);
+	bucket = &leaders[j->command_hash % LEADER_BUCKETS];
+	j->coalesce_next = *bucket;
+	*bucket = j;
+	j->leader = 1;
+}
+
+// Sends the leader's result for each job waiting on it. The leader's own
+// result is sent by the caller.
+void finish_waiters(struct ev_loop * loop, struct child_job * j,
+	const char * output, int return_code, int early_timeout, int exited_ok) {
+	struct child_job ** link, *w;
+
+	if(!j->leader)
+		return;
+	for(link = &leaders[j->command_hash % LEADER_BUCKETS]; *link != j;
+		link = &(*link)->coalesce_next)
+		;
+	*link = j->coalesce_next;
+	j->leader = 0;
+
+	while((w = j->waiters) != NULL) {
+		j->waiters = w->coalesce_next;
+		obj_for_ending(loop, w, output, return_code, early_timeout, exited_ok);
+		job_done(loop, w);
+	}
+}
@@ -0,0 +1,293 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// With "credits" set, mqexec takes jobs from an mqbroker "balance" device
+// over a DEALER socket instead of a PULL socket, and tells the broker how
+// many jobs it has room for, so a busy executor isn't handed more jobs
+// while others are idle. It starts with READY and the number of credits,
+// and the broker sends each job as "JOB <id>" followed by the job. Once a
+// job's result has been sent (or the job was dropped) its id goes back in
+// a DONE message, which frees the credit. Heartbeats go both ways every
+// "credit_heartbeat" milliseconds, and if the broker misses
+// "credit_liveness" of them in a row, or says RESET, mqexec sends READY
+// again, so a restarted broker finds out about it. READY also carries
+// "credit_name" (the host name and config object name by default), which a
+// "shard" device uses to give the executor the same share of hosts each
+// time it connects.
+//
+// Jobs can finish in any thread, but the socket belongs to the main one,
+// so finished ids are collected under a lock and sent from the main loop.
+
+int credits = 0, credit_heartbeat = 1000, credit_liveness = 3;
+char * credit_name = NULL;
+// The id of the job being kicked off in this thread, until a child_job
+// takes it over
+__thread uint64_t credit_id = 0;
+
+extern __thread ev_io pullio;
+extern __thread unsigned long jobs_received;
+
+static pthread_mutex_t credit_lock = PTHREAD_MUTEX_INITIALIZER;
+// Ids of the jobs taken and not done yet, and of those done but not yet
+// reported
+static uint64_t * held = NULL, *done = NULL;
+static size_t nheld = 0, heldsize = 0, ndone = 0, donesize = 0;
+
+static void * creditsock = NULL;
+static struct ev_loop * creditloop;
+static ev_timer heartbeat_timer;
+static ev_async done_async;
+static ev_tstamp broker_expires;
+static int leaving = 0;
+
+static void add_id(uint64_t ** ids, size_t * n, size_t * size, uint64_t id) {
+	if(*n == *size) {
+		*size = *size ? *size * 2 : 64;
+		*ids = realloc(*ids, sizeof(uint64_t) * *size);
+	}
+	(*ids)[(*n)++] = id;
+}
+
+static void send_frame(const char * data, size_t len, int more) {
+	zmq_msg_t msg;
+
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	while(zmq_msg_send(&msg, creditsock, more ? ZMQ_SNDMORE : 0) == -1) {
+		if(errno == EINTR)
+			continue;
+		if(errno != ETERM)
+			logit(ERR, "Error sending to broker: %s", zmq_strerror(errno));
+		break;
+	}
+	zmq_msg_close(&msg);
+}
+
+static void send_number(uint64_t n, int more) {
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+	send_frame(buf, strlen(buf), more);
+}
+
+// Sends a command followed by a list of ids
+static void send_ids(const char * command, uint64_t * ids, size_t n) {
+	size_t i;
+
+	send_frame(command, strlen(command), n > 0);
+	for(i = 0; i < n; i++)
+		send_number(ids[i], i + 1 < n);
+}
+
+static void send_ready() {
+	const char * name = credit_name ? credit_name : "";
+	size_t outstanding;
+
+	pthread_mutex_lock(&credit_lock);
+	outstanding = nheld;
+	pthread_mutex_unlock(&credit_lock);
+	send_frame("READY", 5, 1);
+	send_number(outstanding < (size_t)credits ? credits - outstanding : 0, 1);
+	send_number(outstanding, 1);
+	send_frame(name, strlen(name), 0);
+	logit(DEBUG, "Told the broker we have %lu jobs and room for %d",
+		(unsigned long)outstanding, credits);
+}
+
+// Reports a job as done, from whichever thread it finished in
+void credit_done(uint64_t id) {
+	size_t i;
+
+	pthread_mutex_lock(&credit_lock);
+	for(i = 0; i < nheld; i++) {
+		if(held[i] == id) {
+			held[i] = held[--nheld];
+			break;
+		}
+	}
+	add_id(&done, &ndone, &donesize, id);
+	pthread_mutex_unlock(&credit_lock);
+	ev_async_send(creditloop, &done_async);
+}
+
+static void send_done() {
+	uint64_t * ids;
+	size_t n;
+
+	pthread_mutex_lock(&credit_lock);
+	ids = done;
+	n = ndone;
+	done = NULL;
+	ndone = donesize = 0;
+	pthread_mutex_unlock(&credit_lock);
+	if(n > 0)
+		send_ids("DONE", ids, n);
+	free(ids);
+}
+
+static void done_cb(struct ev_loop * loop, ev_async * a, int event) {
+	send_done();
+}
+
+static void heartbeat_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	send_frame("HEARTBEAT", 9, 0);
+	// Heartbeats aren't read while taking jobs is paused, so the broker
+	// only counts as gone if it's quiet while they are.
+	if(leaving || !ev_is_active(&pullio))
+		broker_expires = ev_now(loop) +
+			(credit_heartbeat * credit_liveness) / 1000.0;
+	else if(ev_now(loop) > broker_expires) {
+		logit(INFO, "No heartbeat from the broker. Saying we're ready again");
+		broker_expires = ev_now(loop) +
+			(credit_heartbeat * credit_liveness) / 1000.0;
+		send_ready();
+	}
+}
+
+static int frame_is(zmq_msg_t * msg, const char * str) {
+	size_t len = strlen(str);
+	return zmq_msg_size(msg) == len && memcmp(zmq_msg_data(msg), str, len) == 0;
+}
+
+static uint64_t frame_number(zmq_msg_t * msg) {
+	char buf[24];
+	size_t len = zmq_msg_size(msg);
+
+	if(len >= sizeof(buf))
+		return 0;
+	memcpy(buf, zmq_msg_data(msg), len);
+	buf[len] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+// Parses the id frame in front of a job handed to a worker thread
+void credit_read_id(zmq_msg_t * msg) {
+	credit_id = frame_number(msg);
+}
+
+// Reads commands and jobs from the broker. A job is "JOB", its id, and
+// then the job, of which only the last frame is used.
+static void credit_recv_cb(struct ev_loop * loop, ev_io * i, int event) {
+	while(ev_is_active(i)) {
+		zmq_msg_t frames[3];
+		int nframes = 0, n;
+		uint64_t id = 0;
+
+		zmq_msg_init(&frames[0]);
+		if(zmq_msg_recv(&frames[0], creditsock, ZMQ_DONTWAIT) == -1) {
+			zmq_msg_close(&frames[0]);
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != ETERM)
+				logit(ERR, "Error receiving message from broker %s",
+					zmq_strerror(errno));
+			break;
+		}
+		nframes = 1;
+		while(zmq_msg_more(&frames[nframes - 1])) {
+			// Only the command, the id and the last frame are kept
+			if(nframes == 3)
+				zmq_msg_close(&frames[--nframes]);
+			zmq_msg_init(&frames[nframes]);
+			while(zmq_msg_recv(&frames[nframes], creditsock, 0) == -1 &&
+				errno == EINTR)
+				;
+			nframes++;
+		}
+		broker_expires = ev_now(loop) +
+			(credit_heartbeat * credit_liveness) / 1000.0;
+
+		if(frame_is(&frames[0], "RESET"))
+			send_ready();
+		else if(frame_is(&frames[0], "JOB") && (nframes != 3 || leaving)) {
+			// The broker has charged a credit for the job, so it's reported
+			// done even though it won't run. One sent after DISCONNECT has
+			// already been given to another executor.
+			if(nframes < 2)
+				logit(ERR, "Received a job without an id from the broker");
+			else {
+				id = frame_number(&frames[1]);
+				if(nframes != 3)
+					logit(ERR, "Received malformed job %llu from the broker",
+						(unsigned long long)id);
+				else
+					logit(DEBUG, "Refusing job %llu while leaving",
+						(unsigned long long)id);
+				send_ids("DONE", &id, 1);
+			}
+		} else if(frame_is(&frames[0], "JOB")) {
+			id = frame_number(&frames[1]);
+			pthread_mutex_lock(&credit_lock);
+			add_id(&held, &nheld, &heldsize, id);
+			pthread_mutex_unlock(&credit_lock);
+			if(forwarding_jobs)
+				forward_job(loop, &frames[2], id);
+			else {
+				jobs_received++;
+				credit_id = id;
+				do_kickoff(loop, &frames[2]);
+			}
+			// The job frame has been handed on
+			nframes = 2;
+		} else if(!frame_is(&frames[0], "HEARTBEAT"))
+			logit(ERR, "Unknown message from the broker");
+		for(n = 0; n < nframes; n++)
+			zmq_msg_close(&frames[n]);
+	}
+}
+
+// Takes jobs from sock, a DEALER socket connected to the broker. It's read
+// through the same watcher as a PULL socket would be, so admission control
+// can still pause it.
+void credit_start(struct ev_loop * loop, void * sock) {
+	creditsock = sock;
+	creditloop = loop;
+	ev_set_cb(&pullio, credit_recv_cb);
+	ev_async_init(&done_async, done_cb);
+	ev_async_start(loop, &done_async);
+	ev_timer_init(&heartbeat_timer, heartbeat_cb, credit_heartbeat / 1000.0,
+		credit_heartbeat / 1000.0);
+	ev_timer_start(loop, &heartbeat_timer);
+	broker_expires = ev_now(loop) +
+		(credit_heartbeat * credit_liveness) / 1000.0;
+	send_ready();
+	logit(INFO, "Taking up to %d jobs at a time from the broker", credits);
+}
+
+// Stops taking jobs. The broker is told which jobs will still be
+// finished, and gives the rest to other executors. The socket stays open
+// until credit_close so the finished jobs can be reported.
+void credit_stop(struct ev_loop * loop) {
+	uint64_t * ids;
+	size_t n;
+
+	leaving = 1;
+	ev_io_stop(loop, &pullio);
+	pthread_mutex_lock(&credit_lock);
+	n = nheld;
+	ids = malloc(sizeof(uint64_t) * (n ? n : 1));
+	memcpy(ids, held, sizeof(uint64_t) * n);
+	pthread_mutex_unlock(&credit_lock);
+	// Jobs that finish from here on may be on the list and reported done
+	// as well, which the broker doesn't mind
+	send_done();
+	send_ids("DISCONNECT", ids, n);
+	free(ids);
+	logit(INFO, "Told the broker we're leaving after %lu jobs",
+		(unsigned long)n);
+}
+
+void credit_close(struct ev_loop * loop) {
+	if(creditsock == NULL)
+		return;
+	send_done();
+	ev_timer_stop(loop, &heartbeat_timer);
+	ev_async_stop(loop, &done_async);
+	zmq_close(creditsock);
+	creditsock = NULL;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mqexec.h"
+
+// Measures how many check jobs per second can be run through a compiled
+// filter. Jobs cycle through a set of host names, the way they come from
+// a Nagios instance checking the same hosts over and over.
+//
+//   filterbench [iterations] [hosts] [filter JSON]
+
+static const char * default_filter =
+	"[ { \"field\": \"host_name\", \"match\": \"^(web|db)[0-9]+\\\\.example\\\\.com$\","
+	"\"caseless\": true, \"or\": { \"field\": \"host_name\", \"fqdn\": true } },"
+	"{ \"field\": \"service_description\", \"match\": \"^Backup\", \"not\": true } ]";
+
+static const char * services[] = {
+	"HTTP Response Time", "Disk Usage", "Load", "Backup Status", "SSH"
+};
+
+char myfqdn[255] = "bench.example.com", mynodename[255] = "bench";
+
+void logit(int level, char * fmt, ...) { }
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+int main(int argc, char ** argv) {
+	long iterations = 1000000, i, accepted = 0;
+	int hosts = 500, nservices = sizeof(services) / sizeof(services[0]);
+	const char * filtertext = default_filter;
+	json_t ** jobs, *filter;
+	json_error_t err;
+	struct filter * compiled;
+	double start, elapsed;
+	int rc;
+
+	if(argc > 1)
+		iterations = atol(argv[1]);
+	if(argc > 2)
+		hosts = atoi(argv[2]);
+	if(argc > 3)
+		filtertext = argv[3];
+	if(hosts < 1)
+		hosts = 1;
+
+	if((filter = json_loads(filtertext, 0, &err)) == NULL) {
+		fprintf(stderr, "Error parsing filter: %s\n", err.text);
+		return 1;
+	}
+	if((compiled = compile_filter(filter, &rc)) == NULL) {
+		fprintf(stderr, "Error compiling filter\n");
+		return 1;
+	}
+
+	jobs = malloc(sizeof(json_t*) * hosts * nservices);
+	for(i = 0; i < hosts * nservices; i++) {
+		char host[64];
+		snprintf(host, sizeof(host), "%s%ld.example.com",
+			i % 3 == 0 ? "app" : (i % 3 == 1 ? "web" : "db"), i / nservices);
+		jobs[i] = json_pack("{s:s s:s s:s s:s}",
+			"type", "service_check_initiate", "host_name", host,
+			"service_description", services[i % nservices],
+			"command_line", "/usr/lib/nagios/plugins/check_dummy 0");
+	}
+
+	start = now();
+	for(i = 0; i < iterations; i++)
+		accepted += match_filter(compiled, jobs[i % (hosts * nservices)]);
+	elapsed = now() - start;
+
+	printf("%d hosts, %d services, %ld iterations\n", hosts, nservices,
+		iterations);
+	printf("%.0f jobs/sec, %ld accepted\n", iterations / elapsed, accepted);
+	printf("cache hits/misses: %lu/%lu\n", filter_cache_hits,
+		filter_cache_misses);
+	return 0;
+}
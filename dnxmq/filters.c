@@ -1,5 +1,6 @@
 #include "config.h"
 #include <stdlib.h>
+#include <stdint.h>
 #ifdef HAVE_PCRE
 #include <pcre.h>
 #else
@@ -8,137 +9,384 @@
 #include <string.h>
 #include "mqexec.h"
 
-struct filter {
+// The filter config is compiled into a flat program of tests. Each test
+// looks at one field of the job and says where to go next when it matches
+// and when it doesn't: another test, or accept or reject the job. The
+// fields a program uses are looked up once per job, and the result of each
+// regex is cached per thread by value, since the same host names and
+// service descriptions come by over and over.
+//
+// A list of filters must all match. A filter with "or" set to true accepts
+// the job on its own when it matches, and is passed over when it doesn't.
+// When "or" is another filter (or a list of them) either that or this
+// filter has to match. Filters on a field the job doesn't have, or that
+// isn't a string, are passed over.
+
+#define ACCEPT -1
+#define REJECT -2
+
+enum test_kind { TEST_REGEX, TEST_FQDN, TEST_NODENAME, TEST_ANY };
+
+struct filter_test {
+	enum test_kind kind;
+	int field;
+	int isnot;
+	// The first and last tests of a filter and its "or" alternatives
+	int first, last;
+	int onmatch, onfail, onskip;
 #ifdef HAVE_PCRE
 	pcre * regex;
 	pcre_extra * extra;
 #else
 	regex_t regex;
 #endif
-	char field[64];
-	char or;
-	int fqdn;
-	int nodename;
-	int isnot;
-	struct filter * next;
-} *filterhead = NULL, *filtertail = NULL;
+};
+
+// A compiled filter. The filter and jail rules are swapped as a whole when
+// the config is reloaded, so each thread keeps using the one it has until
+// it picks up the new one.
+struct filter {
+	struct filter_test * tests;
+	int ntests, testsize;
+	char ** fields;
+	int nfields;
+	// Tells the verdict cache which filter a test number belongs to
+	unsigned long id;
+};
+
+static unsigned long next_filter_id = 1;
+
+// Each value can go in one of VERDICT_WAYS slots, and the least recently
+// used one is replaced, so a thread never holds more than VERDICT_SLOTS
+// values. Values longer than VERDICT_MAX_VALUE aren't worth keeping.
+#define VERDICT_SLOTS 4096
+#define VERDICT_WAYS 4
+#define VERDICT_MAX_VALUE 256
+
+struct verdict {
+	char * value;
+	size_t len;
+	uint32_t hash;
+	unsigned long filter;
+	int test;
+	int matched;
+	unsigned long used;
+};
+
+static __thread struct verdict * verdicts = NULL;
+static __thread unsigned long verdict_clock = 0;
+__thread unsigned long filter_cache_hits = 0, filter_cache_misses = 0;
 
 extern char myfqdn[255], mynodename[255];
 
-int parse_filter(json_t * in, int or) {
-	if(json_is_object(in)) {
-		char * field = NULL;
-		char * match = NULL;
-		int icase = 0, dotall = 0;
-		json_t * orobj = NULL;
-
-		struct filter * newfilt = calloc(1, sizeof(struct filter));
-		if(json_unpack(in, "{ s?:s s:s s?:o s?:b s?:b s?:b s?:b s?b }",
-			"match", &match, "field", &field, "or", &orobj,
-			"caseless", &icase, "dotall", &dotall, "not", &newfilt->isnot,
-			"fqdn", &newfilt->fqdn, "nodename", &newfilt->nodename) < 0) {
-			logit(ERR, "Error parsing filter definition.");
-			free(newfilt);
-			return -1;
-		}
+static int field_index(struct filter * f, const char * name) {
+	int i;
+
+	for(i = 0; i < f->nfields; i++) {
+		if(strcmp(f->fields[i], name) == 0)
+			return i;
+	}
+	f->fields = realloc(f->fields, sizeof(char*) * (f->nfields + 1));
+	f->fields[f->nfields] = strdup(name);
+	return f->nfields++;
+}
+
+static int add_test(struct filter * f, json_t * in) {
+	struct filter_test * t;
+	char * field = NULL, *match = NULL;
+	int icase = 0, dotall = 0, isnot = 0, fqdn = 0, nodename = 0;
+	json_t * orobj = NULL;
 
-		strncpy(newfilt->field, field, sizeof(newfilt->field) - 1);
-		if(match) {
+	if(json_unpack(in, "{ s?:s s:s s?:o s?:b s?:b s?:b s?:b s?b }",
+		"match", &match, "field", &field, "or", &orobj,
+		"caseless", &icase, "dotall", &dotall, "not", &isnot,
+		"fqdn", &fqdn, "nodename", &nodename) < 0) {
+		logit(ERR, "Error parsing filter definition.");
+		return -1;
+	}
+
+	if(f->ntests == f->testsize) {
+		f->testsize = f->testsize ? f->testsize * 2 : 16;
+		f->tests = realloc(f->tests, sizeof(struct filter_test) * f->testsize);
+	}
+	t = &f->tests[f->ntests];
+	memset(t, 0, sizeof(struct filter_test));
+	t->field = field_index(f, field);
+	if(fqdn)
+		t->kind = TEST_FQDN;
+	else if(nodename)
+		t->kind = TEST_NODENAME;
+	else if(match == NULL)
+		t->kind = TEST_ANY;
+	else {
+		t->kind = TEST_REGEX;
 #ifdef HAVE_PCRE
-			const char * errptr = NULL;
-			int errofft = 0, options = PCRE_NO_AUTO_CAPTURE;
-			if(icase)
-				options |= PCRE_CASELESS;
-			if(dotall)
-				options |= PCRE_DOTALL;
-			newfilt->regex = pcre_compile(match, options, &errptr,
-				&errofft, NULL);
-			if(newfilt->regex == NULL) {
-				logit(ERR, "Error compiling regex for %s at position %d: %s",
-					field, errptr, errofft);
-				free(newfilt);
-				return -1;
-			}
-			
-			newfilt->extra = pcre_study(newfilt->regex, 0, &errptr);
-			if(errptr != NULL) {
-				logit(ERR, "Error studying regex: %s", errptr);
-				free(newfilt);
-				return -1;
-			}
-#else
-			int options = REG_EXTENDED | REG_NOSUB;
-			if(icase)
-				options |= REG_ICASE;
-			int rc = regcomp(&newfilt->regex, match, options);
-			if(rc != 0) {
-				logit(ERR, "Error compiling regex for %s: %s",
-					field, strerror(rc));
-				free(newfilt);
-				return -1;
-			}
+		const char * errptr = NULL;
+		int errofft = 0, options = PCRE_NO_AUTO_CAPTURE, study = 0;
+		if(icase)
+			options |= PCRE_CASELESS;
+		if(dotall)
+			options |= PCRE_DOTALL;
+		t->regex = pcre_compile(match, options, &errptr, &errofft, NULL);
+		if(t->regex == NULL) {
+			logit(ERR, "Error compiling regex for %s at position %d: %s",
+				field, errofft, errptr);
+			return -1;
+		}
+#ifdef PCRE_STUDY_JIT_COMPILE
+		study = PCRE_STUDY_JIT_COMPILE;
 #endif
+		t->extra = pcre_study(t->regex, study, &errptr);
+		if(errptr != NULL) {
+			logit(ERR, "Error studying regex: %s", errptr);
+			pcre_free(t->regex);
+			return -1;
 		}
-		if(!filterhead) {
-			filterhead = newfilt;
-			filtertail = newfilt;
-		} else
-			filtertail->next = newfilt;
-
-		if(json_is_true(orobj))
-			newfilt->or = 1;	
-		else if(orobj)
-			parse_filter(orobj, 1);
-	} else if(json_is_array(in)) {
-		int x;
+#else
+		int options = REG_EXTENDED | REG_NOSUB;
+		if(icase)
+			options |= REG_ICASE;
+		int rc = regcomp(&t->regex, match, options);
+		if(rc != 0) {
+			char errbuf[256];
+			regerror(rc, &t->regex, errbuf, sizeof(errbuf));
+			logit(ERR, "Error compiling regex for %s: %s", field, errbuf);
+			return -1;
+		}
+#endif
+	}
+	t->isnot = isnot;
+	f->ntests++;
+	return 0;
+}
+
+// Compiles a filter and the alternatives chained off it with "or" into
+// consecutive tests. Returns the "or" flag of the filter, or -1.
+static int compile_alternatives(struct filter * f, json_t * in) {
+	json_t * orobj;
+	size_t x;
+
+	if(json_is_array(in)) {
 		for(x = 0; x < json_array_size(in); x++) {
-			json_t * t = json_array_get(in, x);
-			if(parse_filter(t, or) < 0)
+			if(compile_alternatives(f, json_array_get(in, x)) < 0)
 				return -1;
 		}
+		return 0;
 	}
+	if(!json_is_object(in)) {
+		logit(ERR, "Error parsing filter definition.");
+		return -1;
+	}
+	if(add_test(f, in) < 0)
+		return -1;
+	orobj = json_object_get(in, "or");
+	if(json_is_true(orobj))
+		return 1;
+	if(orobj && !json_is_boolean(orobj) && compile_alternatives(f, orobj) < 0)
+		return -1;
 	return 0;
 }
 
-int match_filter(json_t * input) {
-	if(filterhead == NULL)
-		return 1;
+// Points the tests of one clause, first through last - 1, at their
+// targets. Any test of the clause matching passes it, and it fails if
+// none do. A clause whose fields are all missing is passed over.
+static void link_clause(struct filter * f, int first, int last, int pass,
+	int fail) {
+	int i;
 
-	struct filter *cur;
-	for(cur = filterhead; cur != NULL; cur = cur->next) {
-		int res = 1;
-		const char * tomatch;
-		json_t * field;
-		if((field = json_object_get(input, cur->field)) == NULL)
-			continue;
-		if(!json_is_string(field))
+	for(i = first; i < last; i++) {
+		struct filter_test * t = &f->tests[i];
+		t->onmatch = pass;
+		t->onfail = i + 1 < last ? i + 1 : fail;
+		t->onskip = i + 1 < last ? i + 1 : last;
+	}
+	f->tests[first].first = 1;
+	f->tests[last - 1].last = 1;
+}
+
+static int compile_clause(struct filter * f, json_t * in) {
+	int first = f->ntests, orflag;
+
+	if((orflag = compile_alternatives(f, in)) < 0)
+		return -1;
+	if(orflag)
+		link_clause(f, first, f->ntests, ACCEPT, f->ntests);
+	else
+		link_clause(f, first, f->ntests, f->ntests, REJECT);
+	return 0;
+}
+
+// The job is accepted when the program runs off its end
+static void finish_program(struct filter * f) {
+	int i;
+
+	for(i = 0; i < f->ntests; i++) {
+		if(f->tests[i].onmatch == f->ntests)
+			f->tests[i].onmatch = ACCEPT;
+		if(f->tests[i].onfail == f->ntests)
+			f->tests[i].onfail = ACCEPT;
+		if(f->tests[i].onskip == f->ntests)
+			f->tests[i].onskip = ACCEPT;
+	}
+	logit(DEBUG, "Compiled filter into %d tests on %d fields",
+		f->ntests, f->nfields);
+}
+
+void free_filter(struct filter * f) {
+	int i;
+
+	if(f == NULL)
+		return;
+	for(i = 0; i < f->ntests; i++) {
+		struct filter_test * t = &f->tests[i];
+		if(t->kind != TEST_REGEX)
 			continue;
-		tomatch = json_string_value(field);
-		if(cur->fqdn)
-			res = strcasecmp(tomatch, myfqdn);
-		else if(cur->nodename)
-			res = strcasecmp(tomatch, mynodename);
-		else {
 #ifdef HAVE_PCRE
-			int ovec[33];
-			res = pcre_exec(cur->regex, cur->extra,
-				tomatch, strlen(tomatch), 0, 0, ovec, 33);
-			res = res < 0 ? 1 : 0;
+#ifdef PCRE_STUDY_JIT_COMPILE
+		pcre_free_study(t->extra);
 #else
-			regmatch_t ovec[33];
-			res = regexec(&cur->regex, tomatch, 33, ovec, 0);
+		pcre_free(t->extra);
 #endif
+		pcre_free(t->regex);
+#else
+		regfree(&t->regex);
+#endif
+	}
+	for(i = 0; i < f->nfields; i++)
+		free(f->fields[i]);
+	free(f->fields);
+	free(f->tests);
+	free(f);
+}
+
+// Compiles a filter definition. A missing definition lets every job
+// through, and compiles to NULL like a broken one does, so the error is
+// reported in *err.
+struct filter * compile_filter(json_t * in, int * err) {
+	struct filter * f;
+	size_t x;
+
+	*err = 0;
+	if(in == NULL)
+		return NULL;
+	f = calloc(1, sizeof(struct filter));
+	f->id = __sync_fetch_and_add(&next_filter_id, 1);
+	if(json_is_array(in)) {
+		for(x = 0; x < json_array_size(in); x++) {
+			if(compile_clause(f, json_array_get(in, x)) < 0)
+				break;
 		}
-		if(cur->isnot == 1) {
-			res = res == 0 ? 1 : 0;
-			logit(DEBUG, "Inverting filter because of not clause");
+		*err = x < json_array_size(in);
+	} else
+		*err = compile_clause(f, in) < 0;
+	if(*err) {
+		free_filter(f);
+		return NULL;
+	}
+	finish_program(f);
+	return f;
+}
+
+static uint32_t value_hash(const char * value, size_t len, int test) {
+	uint32_t hash = 2166136261 ^ test;
+	while(len--) {
+		hash ^= (uint8_t)*value++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static int run_regex(struct filter_test * t, const char * value, size_t len) {
+#ifdef HAVE_PCRE
+	// With a JIT-compiled pattern pcre_exec runs the machine code
+	return pcre_exec(t->regex, t->extra, value, len, 0, 0, NULL, 0) >= 0;
+#else
+	return regexec(&t->regex, value, 0, NULL, 0) == 0;
+#endif
+}
+
+static int regex_matches(struct filter * f, int test, const char * value) {
+	size_t len = strlen(value);
+	struct verdict * set, *v;
+	uint32_t hash;
+	int i;
+
+	if(len > VERDICT_MAX_VALUE)
+		return run_regex(&f->tests[test], value, len);
+	if(verdicts == NULL)
+		verdicts = calloc(VERDICT_SLOTS, sizeof(struct verdict));
+
+	hash = value_hash(value, len, test + (f->id << 16));
+	set = &verdicts[(hash % (VERDICT_SLOTS / VERDICT_WAYS)) * VERDICT_WAYS];
+	v = set;
+	for(i = 0; i < VERDICT_WAYS; i++) {
+		struct verdict * cur = &set[i];
+		if(cur->value && cur->hash == hash && cur->test == test &&
+			cur->filter == f->id && cur->len == len &&
+			memcmp(cur->value, value, len) == 0) {
+			cur->used = ++verdict_clock;
+			filter_cache_hits++;
+			return cur->matched;
+		}
+		if(cur->used < v->used)
+			v = cur;
+	}
+
+	filter_cache_misses++;
+	v->used = ++verdict_clock;
+	v->value = realloc(v->value, len + 1);
+	memcpy(v->value, value, len + 1);
+	v->len = len;
+	v->hash = hash;
+	v->test = test;
+	v->filter = f->id;
+	v->matched = run_regex(&f->tests[test], value, len);
+	return v->matched;
+}
+
+int match_filter(struct filter * f, json_t * input) {
+	int i, pc = 0, failed = 0;
+
+	if(f == NULL || f->ntests == 0)
+		return 1;
+	const char * values[f->nfields];
+
+	for(i = 0; i < f->nfields; i++) {
+		json_t * field = json_object_get(input, f->fields[i]);
+		values[i] = json_is_string(field) ? json_string_value(field) : NULL;
+	}
+
+	while(pc >= 0) {
+		struct filter_test * t = &f->tests[pc];
+		const char * value = values[t->field];
+		int matched;
+
+		if(t->first)
+			failed = 0;
+		if(value == NULL) {
+			pc = t->last && failed ? t->onfail : t->onskip;
+			continue;
+		}
+		switch(t->kind) {
+			case TEST_FQDN:
+				matched = strcasecmp(value, myfqdn) == 0;
+				break;
+			case TEST_NODENAME:
+				matched = strcasecmp(value, mynodename) == 0;
+				break;
+			case TEST_ANY:
+				matched = 1;
+				break;
+			default:
+				matched = regex_matches(f, pc, value);
+				break;
+		}
+		if(matched != t->isnot)
+			pc = t->onmatch;
+		else {
+			failed = 1;
+			pc = t->onfail;
 		}
-		if(cur->or == 1 && res == 0)
-			return 1;
-		else if(cur->or == 0 && res != 0)
-			return 0;
-		else
-			break;
 	}
-	return 1;
-}
\ No newline at end of file
+	return pc == ACCEPT;
+}
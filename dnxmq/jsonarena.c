@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mqexec.h"
+
+// A bump allocator for jansson. Messages are parsed, looked at once, and
+// thrown away, so while an arena is running every node and string is
+// carved out of a chunk and json_decref is a no-op. arena_reset gives the
+// whole message back at once.
+//
+// Values that have to outlive the message must be copied with
+// json_deep_copy after arena_pause and before arena_reset.
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_MAX_RETAIN (4 * 1024 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk * next;
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & \
+	~(ARENA_ALIGN - 1))
+#define chunk_data(c) ((char*)(c) + ARENA_HEADER)
+
+static __thread struct arena_chunk * chunks = NULL;
+static __thread int arena_running = 0;
+
+static struct arena_chunk * new_chunk(size_t size) {
+	struct arena_chunk * c = malloc(ARENA_HEADER + size);
+	if(c == NULL)
+		return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static void * arena_malloc(size_t size) {
+	struct arena_chunk * c = chunks;
+
+	if(!arena_running)
+		return malloc(size);
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if(c == NULL || c->size - c->used < size) {
+		c = new_chunk(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+		if(c == NULL)
+			return NULL;
+		c->next = chunks;
+		chunks = c;
+	}
+
+	void * ret = chunk_data(c) + c->used;
+	c->used += size;
+	return ret;
+}
+
+// Anything allocated before the hooks were installed, or while the arena
+// was paused, came from malloc and goes back to free.
+static void arena_free(void * ptr) {
+	struct arena_chunk * c;
+
+	for(c = chunks; c != NULL; c = c->next) {
+		char * start = chunk_data(c);
+		if((char*)ptr >= start && (char*)ptr < start + c->size)
+			return;
+	}
+	free(ptr);
+}
+
+void arena_install() {
+	json_set_alloc_funcs(arena_malloc, arena_free);
+}
+
+void arena_uninstall() {
+	arena_reset();
+	free(chunks);
+	chunks = NULL;
+	json_set_alloc_funcs(malloc, free);
+}
+
+void arena_begin() {
+	arena_running = 1;
+}
+
+void arena_pause() {
+	arena_running = 0;
+}
+
+void arena_reset() {
+	struct arena_chunk * c, *next;
+	size_t total = 0;
+
+	arena_running = 0;
+	if(chunks == NULL)
+		return;
+	if(chunks->next == NULL) {
+		chunks->used = 0;
+		return;
+	}
+
+	// The last message needed more than one chunk; replace them with a
+	// single chunk big enough to hold it all next time.
+	for(c = chunks; c != NULL; c = next) {
+		next = c->next;
+		total += c->size;
+		free(c);
+	}
+	if(total > ARENA_MAX_RETAIN)
+		total = ARENA_CHUNK_SIZE;
+	chunks = new_chunk(total);
+}
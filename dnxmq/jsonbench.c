@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mqexec.h"
+
+// Measures how many check job messages per second can be parsed and
+// released with plain malloc and with the jansson arena.
+//
+//   jsonbench [iterations] [message file]
+
+static const char * sample_job =
+	"{\"type\":\"service_check_initiate\",\"host_name\":\"web01.example.com\","
+	"\"service_description\":\"HTTP Response Time\","
+	"\"command_line\":\"/usr/lib/nagios/plugins/check_http -H web01.example.com "
+	"-u /healthcheck -w 2 -c 5 -t 10\",\"command_name\":\"check_http\","
+	"\"command_args\":\"-u /healthcheck -w 2 -c 5\",\"check_type\":0,"
+	"\"check_options\":0,\"scheduled_check\":1,\"reschedule_check\":1,"
+	"\"current_attempt\":1,\"max_attempts\":3,\"state\":0,\"last_state\":0,"
+	"\"last_hard_state\":0,\"last_check\":1500000000,"
+	"\"last_state_change\":1499990000,\"latency\":0.012,\"timeout\":60,"
+	"\"early_timeout\":0,\"timestamp\":{\"tv_sec\":1500000060,\"tv_usec\":1234},"
+	"\"plugin_output\":\"HTTP OK: HTTP/1.1 200 OK - 1543 bytes in 0.021 second "
+	"response time\",\"long_plugin_output\":null,"
+	"\"perf_data\":\"time=0.021s;2.000;5.000;0.000 size=1543B;;;0\"}";
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static double run(const char * msg, size_t len, long iterations, int arena) {
+	json_error_t err;
+	char * type, *command_line;
+	long i;
+	double start = now();
+
+	for(i = 0; i < iterations; i++) {
+		if(arena)
+			arena_begin();
+		json_t * input = json_loadb(msg, len, 0, &err);
+		if(input == NULL) {
+			fprintf(stderr, "Error parsing message: %s\n", err.text);
+			exit(1);
+		}
+		json_unpack(input, "{ s:s s:s }", "type", &type,
+			"command_line", &command_line);
+		json_decref(input);
+		if(arena)
+			arena_reset();
+	}
+
+	return iterations / (now() - start);
+}
+
+static char * read_file(const char * path, size_t * len) {
+	FILE * fp = fopen(path, "r");
+	char * buf;
+	long size;
+
+	if(fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	buf = malloc(size + 1);
+	*len = fread(buf, 1, size, fp);
+	buf[*len] = '\0';
+	fclose(fp);
+	return buf;
+}
+
+int main(int argc, char ** argv) {
+	long iterations = 200000;
+	const char * msg = sample_job;
+	size_t len = strlen(sample_job);
+
+	if(argc > 1)
+		iterations = atol(argv[1]);
+	if(argc > 2)
+		msg = read_file(argv[2], &len);
+
+	arena_install();
+	// Warm up both paths so the arena has its chunk before timing starts
+	run(msg, len, iterations / 10, 0);
+	run(msg, len, iterations / 10, 1);
+
+	double plain = run(msg, len, iterations, 0);
+	double arena = run(msg, len, iterations, 1);
+
+	printf("%lu byte message, %ld iterations\n", (unsigned long)len, iterations);
+	printf("malloc: %.0f msgs/sec\n", plain);
+	printf("arena:  %.0f msgs/sec (%.2fx)\n", arena, arena / plain);
+	return 0;
+}
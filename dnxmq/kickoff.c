@@ -12,20 +12,24 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <wordexp.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include "mqexec.h"
 
-extern char * unprivpath, *rootpath;
-extern size_t unprivpathlen, rootpathlen;
-extern uid_t runas;
-extern uint32_t runningjobs;
+extern __thread uint32_t runningjobs;
+extern char ** environ;
 
 int check_jail(const char * cmdline) {
-	if(!unprivpath && !rootpath)
+	struct job_rules * r = rules;
+
+	if(!r->unprivpath && !r->rootpath)
 		return 1;
-	if(rootpath && strncmp(cmdline, rootpath, rootpathlen) == 0)
+	if(r->rootpath && strncmp(cmdline, r->rootpath, r->rootpathlen) == 0)
 		return 1;
-	else if(unprivpath && strncmp(cmdline, unprivpath, unprivpathlen) == 0)
+	else if(r->unprivpath &&
+		strncmp(cmdline, r->unprivpath, r->unprivpathlen) == 0)
 		return 2;
 	return 0;
 }
@@ -60,27 +64,139 @@ struct timeval *result, *x, *y;
 	return x->tv_sec < y->tv_sec;
 }
 
-void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg) {
+#ifdef TEST
+static char * test_argv[] = { "/bin/echo", "Testing testing testing!", NULL };
+#endif
+
+// Spawns argv with stdin from /dev/null and stdout/stderr going to outfd.
+// posix_spawn avoids copying mqexec's page tables for every check.
+// Checks start with no signals blocked, whatever the spawning thread has
+// blocked, so they can still be killed with SIGTERM when they time out.
+static int spawn_child(pid_t * pid, char ** argv, int outfd) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t nomask;
+	short flags = POSIX_SPAWN_SETSIGMASK;
+	int rc;
+
+	sigemptyset(&nomask);
+	if(process_groups)
+		flags |= POSIX_SPAWN_SETPGROUP;
+	if((rc = posix_spawnattr_init(&attr)) != 0)
+		return rc;
+	if((rc = posix_spawnattr_setsigmask(&attr, &nomask)) != 0 ||
+		(rc = posix_spawnattr_setpgroup(&attr, 0)) != 0 ||
+		(rc = posix_spawnattr_setflags(&attr, flags)) != 0 ||
+		(rc = posix_spawn_file_actions_init(&actions)) != 0) {
+		posix_spawnattr_destroy(&attr);
+		return rc;
+	}
+	if((rc = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+			"/dev/null", O_RDONLY, 0)) != 0 ||
+		(rc = posix_spawn_file_actions_adddup2(&actions,
+			outfd, STDOUT_FILENO)) != 0 ||
+		(rc = posix_spawn_file_actions_adddup2(&actions,
+			outfd, STDERR_FILENO)) != 0 ||
+		(rc = posix_spawn_file_actions_addclose(&actions, outfd)) != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		return rc;
+	}
+
+	rc = posix_spawn(pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	return rc;
+}
+
+static void child_error(const char * msg, const char * arg) {
+	if(write(STDOUT_FILENO, msg, strlen(msg)) < 0 ||
+		write(STDOUT_FILENO, arg, strlen(arg)) < 0)
+		_exit(127);
+	_exit(127);
+}
+
+// posix_spawn can't change the uid or join a cgroup, so jobs in the
+// unprivileged path or with a cgroup are started with vfork. The child
+// shares our memory until it execs, so it only makes raw system calls;
+// setuid goes straight to the kernel so that libc doesn't try to change
+// the uid of our other threads too.
+//
+// Like posix_spawn, every signal is blocked around the vfork, and the child
+// puts back the default action for the signals we handle before it
+// unblocks them. Otherwise a signal arriving in between would run one of
+// libev's handlers in the child, on our stack and with our loop's memory.
+static int spawn_vfork(pid_t * pid, char ** argv, int outfd, uid_t uid,
+	int procsfd) {
+	sigset_t allmask, nomask, oldmask;
+	pid_t child;
+	int err;
+
+	sigfillset(&allmask);
+	sigemptyset(&nomask);
+	pthread_sigmask(SIG_SETMASK, &allmask, &oldmask);
+	child = vfork();
+	if(child == 0) {
+		struct sigaction sa;
+		int dn, sig;
+
+		for(sig = 1; sig < NSIG; sig++) {
+			if(sigaction(sig, NULL, &sa) != 0 ||
+				sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL)
+				continue;
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			sigaction(sig, &sa, NULL);
+		}
+		sigprocmask(SIG_SETMASK, &nomask, NULL);
+		dn = open("/dev/null", O_RDONLY);
+		if(dn < 0 || dup2(dn, STDIN_FILENO) < 0 ||
+			dup2(outfd, STDOUT_FILENO) < 0 ||
+			dup2(outfd, STDERR_FILENO) < 0)
+			_exit(127);
+		if(dn != STDIN_FILENO)
+			close(dn);
+		close(outfd);
+		if(process_groups)
+			setpgid(0, 0);
+		if(procsfd >= 0 && write(procsfd, "0", 1) != 1)
+			child_error("Error joining cgroup for ", argv[0]);
+		if(uid != 0 && syscall(SYS_setuid, uid) != 0)
+			child_error("Error dropping privileges for ", argv[0]);
+		execv(argv[0], argv);
+		child_error("Error executing shell for ", argv[0]);
+	}
+	err = errno;
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if(child < 0)
+		return err;
+	*pid = child;
+	return 0;
+}
+
+static void kickoff_job(struct ev_loop * loop, zmq_msg_t * inmsg) {
 	json_t * input;
 	struct child_job * j;
 	char * type, *command_line, *hostname = NULL, *svcdesc = NULL;
 	json_error_t err;
-	int fds[2];
-	pid_t pid;
-	int timeout = 0, okay_to_run;
-	struct timeval server_starttime = {0, 0}, latencytv = { 0, 0 };
+	int timeout = 0, rc;
+	struct timeval server_starttime = {0, 0};
 	double server_latency = 0.0;
+	double received = stats_clock(), parsed, filtered;
 
+	thread_stats->received++;
 	input = json_loadb(zmq_msg_data(inmsg), zmq_msg_size(inmsg), 0, &err);
 	zmq_msg_close(inmsg);
 	if(input == NULL) {
 		logit(ERR, "Error loading request from broker: %s (line %d col %d)",
 			err.text, err.line, err.column);
+		thread_stats->parse_errors++;
 		return;
 	}
 
 	if(json_unpack(input, "{ s:s }", "type", &type) != 0) {
 		logit(ERR, "Job message doesn't have a type header");
+		thread_stats->parse_errors++;
 		json_decref(input);
 		return;
 	}
@@ -93,12 +209,32 @@ void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg) {
 		"tv_usec", &server_starttime.tv_usec,
 		"latency", &server_latency) != 0) {
 		logit(ERR, "Error unpacking JSON payload during kickoff");
+		thread_stats->parse_errors++;
 		json_decref(input);
 		return;
 	}
+	parsed = stats_clock();
+	stats_record(STAGE_PARSE, parsed - received);
 
-	if(match_filter(input) != 1) {
+	rc = match_filter(rules->filter, input);
+	filtered = stats_clock();
+	stats_record(STAGE_FILTER, filtered - parsed);
+	if(rc != 1) {
 		logit(DEBUG, "Not running %s because of filtering", command_line);
+		thread_stats->filtered++;
+		json_decref(input);
+		return;
+	}
+
+	// The job's input is kept until the child exits, so it has to be
+	// copied out of the arena. Everything from here on uses the copy.
+	arena_pause();
+	input = json_deep_copy(input);
+	if(input == NULL ||
+		json_unpack(input, "{ s:s s:s s?:s s?:s }", "type", &type,
+		"command_line", &command_line, "host_name", &hostname,
+		"service_description", &svcdesc) != 0) {
+		logit(ERR, "Error copying job for %s", command_line);
 		json_decref(input);
 		return;
 	}
@@ -110,6 +246,8 @@ void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg) {
 		type, command_line);
 
 	j = calloc(1, sizeof(struct child_job));
+	j->pidfd = -1;
+	output_init(j);
 	if(strcmp(type, "service_check_initiate") == 0)
 		j->service = 1;
 	else if(strcmp(type, "host_check_initiate") == 0)
@@ -121,111 +259,176 @@ void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg) {
 	j->host_name = hostname;
 	j->service_description = svcdesc;
 
-	okay_to_run = check_jail(command_line);
-	if(okay_to_run == 0) {
-		logit(ERR, "Refusing to execute job outside sandbox %s", command_line);
-		obj_for_ending(j, "Command line outside sandbox", 3, 0, 0);
-		free(j);
-		json_decref(input);
+	j->command_line = command_line;
+	j->timeout = timeout;
+	j->server_start = server_starttime;
+	j->latency = server_latency;
+	j->times.received = received;
+	j->times.parsed = parsed;
+	j->times.filtered = filtered;
+	j->credit_id = credit_id;
+	credit_id = 0;
+	if(coalesce_job(j))
 		return;
+	queue_job(loop, j);
+}
+
+// Records when a job started running and adds the time it spent getting
+// here to the latency the server reported.
+void mark_job_start(struct child_job * j) {
+	struct timeval latencytv = { 0, 0 };
+	double server_latency = j->latency;
+
+	gettimeofday(&j->start, NULL);
+	if(timeval_subtract(&latencytv, &j->start, &j->server_start) == 1 &&
+		latencytv.tv_sec < -1) {
+		logit(INFO, "Time skew detected in latency calculation: tv_sec: %d, tv_usec: %d",
+			latencytv.tv_sec, latencytv.tv_usec);
+	} else {
+		server_latency += latencytv.tv_sec + (latencytv.tv_usec / 1000000.0);
+		logit(DEBUG, "Network latency was %f seconds", server_latency);
 	}
+	j->latency = server_latency;
+}
 
-	if(pipe(fds) < 0 ||
-		fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
-		logit(ERR, "Error creating pipe for %s: %s",
-			command_line, strerror(errno));
-		obj_for_ending(j, "Error creating pipe", 3, 0, 0);
-		free(j);
-		json_decref(input);
+// Runs an admitted job, either in a plugin host or as a new child
+void start_job(struct ev_loop * loop, struct child_job * j) {
+	char * command_line = j->command_line;
+	int fds[2], procsfd = -1;
+	pid_t pid;
+	int okay_to_run, rc;
+	char ** argv, errbuf[512];
+
+	j->times.started = stats_clock();
+	okay_to_run = check_jail(command_line);
+	if(okay_to_run == 0) {
+		logit(ERR, "Refusing to execute job outside sandbox %s", command_line);
+		obj_for_ending(loop, j, "Command line outside sandbox", 3, 0, 0);
+		job_done(loop, j);
 		return;
 	}
 
-	ev_io_init(&j->io, child_io_cb, fds[0], EV_READ);
-	j->io.data = j;
-	ev_io_start(loop, &j->io);
-
-	gettimeofday(&j->start, NULL);
-	pid = fork();
-	if(pid == 0) {
-		wordexp_t expvec;
-		int dn = open("/dev/null", O_RDONLY);
-		if(dn < 0) {
-			printf("Error redirecting stdin: %s\n", strerror(errno));
-			exit(127);
-		}
-		dup2(fds[1], fileno(stdout));
-		dup2(fds[1], fileno(stderr));
-		dup2(dn, fileno(stdin));
-		close(dn);
-		close(fds[1]);
 #ifdef TEST
-		printf("Testing testing testing!\n");
-		exit(0);
+	argv = test_argv;
 #else
-
-		if(geteuid() == 0 && runas != 0 && okay_to_run == 2)
-			setuid(runas);
-
-		switch(wordexp(command_line, &expvec, WRDE_NOCMD)) {
-			case 0:
-				break;
-			case WRDE_SYNTAX:
-				printf("Error executing \"%s\". Bad syntax\n", command_line);
-				exit(127);
-				break;
+	argv = get_argv(command_line, &rc);
+	if(argv == NULL) {
+		const char * msg;
+		switch(rc) {
 			case WRDE_CMDSUB:
-				printf("Command \"%s\" uses unsafe command substitution.\n", command_line);
-				exit(127);
+				msg = "Command \"%s\" uses unsafe command substitution.";
 				break;
 			case WRDE_BADVAL:
 			case WRDE_BADCHAR:
-				printf("Command \"%s\" uses invalid characters or variables\n", command_line);
-				exit(127);
+				msg = "Command \"%s\" uses invalid characters or variables";
 				break;
 			case WRDE_NOSPACE:
-				printf("Out of memory while parsing command line\n");
-				exit(127);
+				msg = "Out of memory while parsing command line %s";
+				break;
+			default:
+				msg = "Error executing \"%s\". Bad syntax";
 				break;
 		}
-
-		execv(expvec.we_wordv[0], expvec.we_wordv);
-		printf("Error executing shell for %s: %m", command_line);
-		exit(127);
-#endif
+		snprintf(errbuf, sizeof(errbuf), msg, command_line);
+		obj_for_ending(loop, j, errbuf, 127, 0, 1);
+		job_done(loop, j);
+		return;
 	}
-	else if(pid < 0) {
-		logit(ERR, "Error forking for %s: %s",
+#endif
+
+	// A job given back by a plugin host pool that was disabled has been
+	// marked already
+	if(j->start.tv_sec == 0)
+		mark_job_start(j);
+
+	// Plugin hosts run as mqexec's own user, so jobs that have to drop
+	// privileges are always spawned
+	if(okay_to_run != 2 && submit_plugin_job(loop, j, argv, j->timeout))
+		return;
+
+	// Both ends are close-on-exec so checks spawned by other threads
+	// don't hold this check's pipe open; the spawn dups the write end
+	// onto the child's stdout.
+	if(pipe2(fds, O_CLOEXEC) < 0 ||
+		fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+		logit(ERR, "Error creating pipe for %s: %s",
 			command_line, strerror(errno));
-		obj_for_ending(j, "Error forking", 3, 0, 0);
-		json_decref(input);
+		thread_stats->spawn_failures++;
+		obj_for_ending(loop, j, "Error creating pipe", 3, 0, 0);
+		job_done(loop, j);
+		return;
+	}
+
+	ev_io_init(&j->io, child_io_cb, fds[0], EV_READ);
+	j->io.data = j;
+	ev_io_start(loop, &j->io);
+
+	if(cgroup_root)
+		procsfd = cgroup_create(j);
+	if(geteuid() == 0 && rules->runas != 0 && okay_to_run == 2)
+		rc = spawn_vfork(&pid, argv, fds[1], rules->runas, procsfd);
+	else if(procsfd >= 0)
+		rc = spawn_vfork(&pid, argv, fds[1], 0, procsfd);
+	else
+		rc = spawn_child(&pid, argv, fds[1]);
+	if(procsfd >= 0)
+		close(procsfd);
+	if(rc != 0) {
+		logit(ERR, "Error spawning %s: %s",
+			command_line, strerror(rc));
+		thread_stats->spawn_failures++;
 		ev_io_stop(loop, &j->io);
 		close(fds[1]);
 		close(fds[0]);
-		free(j);
+		// A missing or non-executable plugin is reported the way a
+		// child failing to exec it used to be.
+		if(rc == ENOENT || rc == EACCES || rc == ENOEXEC) {
+			snprintf(errbuf, sizeof(errbuf),
+				"Error executing shell for %s: %s", command_line, strerror(rc));
+			obj_for_ending(loop, j, errbuf, 127, 0, 1);
+		} else
+			obj_for_ending(loop, j, "Error forking", 3, 0, 0);
+		job_done(loop, j);
 		return;
 	}
 
-	if(timeval_subtract(&latencytv, &j->start, &server_starttime) == 1 &&
-		latencytv.tv_sec < -1) {
-		logit(INFO, "Time skew detected in latency calculation: tv_sec: %d, tv_usec: %d",
-			latencytv.tv_sec, latencytv.tv_usec);
-	} else {
-		server_latency += latencytv.tv_sec + (latencytv.tv_usec / 1000000.0);
-		logit(DEBUG, "Network latency was %f seconds", server_latency);
-	}
-	j->latency = server_latency;
-
 	j->pid = pid;
-	add_child(j);
+	j->times.spawned = stats_clock();
 	close(fds[1]);
+	if((rc = watch_child(loop, j)) != 0) {
+		logit(ERR, "Error watching child %d for %s: %s",
+			pid, command_line, strerror(rc));
+		thread_stats->spawn_failures++;
+		kill(pid, SIGKILL);
+		while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		ev_io_stop(loop, &j->io);
+		close(fds[0]);
+		obj_for_ending(loop, j, "Error forking", 3, 0, 0);
+		job_done(loop, j);
+		return;
+	}
 
-	if(timeout > 0) {
-		ev_timer_init(&j->timer, child_timeout_cb, timeout, 0);
+	if(j->timeout > 0) {
+		ev_timer_init(&j->timer, child_timeout_cb, j->timeout, 0);
 		j->timer.data = j;
 		ev_timer_start(loop, &j->timer);
-		j->timeout = timeout;
 	}
+	add_leader(j);
 
-	logit(DEBUG, "Kicked off %d for %s %s", pid, hostname, svcdesc);
+	logit(DEBUG, "Kicked off %d for %s %s", pid, j->host_name, j->service_description);
 	runningjobs++;
 }
+
+// Most jobs are parsed, filtered and dropped, so the parse happens in the
+// jansson arena and is released in one go once the job is handled.
+void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg) {
+	arena_begin();
+	kickoff_job(loop, inmsg);
+	arena_reset();
+	// A job that was dropped is done as far as the broker is concerned
+	if(credit_id) {
+		credit_done(credit_id);
+		credit_id = 0;
+	}
+}
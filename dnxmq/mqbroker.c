@@ -1,23 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zmq.h>
-#include <jansson.h>
 #include <syslog.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
-#include "zmq3compat.h"
+#include <stdint.h>
+#include <time.h>
+#include "mqbroker.h"
 
 void * zmqctx;
 int usesyslog = 0, verbose = 0;
 volatile sig_atomic_t keeprunning = 1;
 volatile sig_atomic_t reload = 0;
 
-#define WARN 3
-#define ERR 2
-#define DEBUG 1
-#define INFO 0
 void logit(int level, char * fmt, ...) {
 	int err;
 	va_list ap;
@@ -123,6 +119,8 @@ void parse_sock_directive(json_t * arg, zmq_pollitem_t * pollable, int * noblock
 		ntype = ZMQ_PULL;
 	else if(strcasecmp(type, "push") == 0)
 		ntype = ZMQ_PUSH;
+	else if(strcasecmp(type, "rep") == 0)
+		ntype = ZMQ_REP;
 
 	if(ntype == -1) {
 		logit(ERR, "Invalid socket type: %s", type);
@@ -189,80 +187,327 @@ void parse_sock_directive(json_t * arg, zmq_pollitem_t * pollable, int * noblock
 		case ZMQ_DEALER:
 		case ZMQ_SUB:
 		case ZMQ_PULL:
+		case ZMQ_REP:
 			pollable->events = ZMQ_POLLIN;
 			break;
 	}
 }
 
-void do_forward(void * in, void *out, void *mon, int noblock, int monnoblock) {
+// Sends one frame on, or drops it if an earlier frame of the same message
+// couldn't be sent. ZMQ delivers all the frames of a message or none of
+// them, so once one is refused the rest of the message can't be sent either.
+static void send_frame(zmq_msg_t * msg, void * out, int more, int noblock,
+	int * failed) {
+	int flags = (more ? ZMQ_SNDMORE : 0) | (noblock ? ZMQ_NOBLOCK : 0);
+
+	if(*failed)
+		return;
+	while(zmq_msg_send(msg, out, flags) == -1) {
+		if(errno == EINTR)
+			continue;
+		logit(errno == EAGAIN ? DEBUG : WARN, "Error sending message: %s",
+			zmq_strerror(errno));
+		*failed = 1;
+		break;
+	}
+}
+
+// Forwards one complete message from in to out, and a copy to mon. Returns
+// 1 if a message was read, 0 if none was waiting, and -1 on error.
+int do_forward(void * in, void *out, void *mon, int noblock, int monnoblock,
+	struct traffic * t) {
 	zmq_msg_t tmpmsg;
-	int rc;
+	int rc, flags = ZMQ_DONTWAIT, outfailed = 0, monfailed = 0;
 #if ZMQ_VERSION_MAJOR == 2
 	int64_t rcvmore;
 #elif ZMQ_VERSION_MAJOR >= 3
 	int rcvmore;
 #endif
-	size_t size = sizeof(rcvmore);
-	int flags = 0;
+	size_t size;
 
-	zmq_msg_init(&tmpmsg);
-	if(zmq_msg_recv(&tmpmsg, in, 0) == -1) {
-		rc = errno;
+	do {
+		zmq_msg_init(&tmpmsg);
+		while((rc = zmq_msg_recv(&tmpmsg, in, flags)) == -1 && errno == EINTR)
+			;
+		if(rc == -1) {
+			rc = errno;
+			zmq_msg_close(&tmpmsg);
+			if(rc == EAGAIN && flags == ZMQ_DONTWAIT)
+				return 0;
+			if(rc != ETERM)
+				logit(WARN, "Error receiving message: %s", zmq_strerror(rc));
+			return -1;
+		}
+		// The rest of a message is already here once its first frame is
+		flags = 0;
+		t->bytes += zmq_msg_size(&tmpmsg);
+
+		size = sizeof(rcvmore);
+		zmq_getsockopt(in, ZMQ_RCVMORE, &rcvmore, &size);
+		if(mon) {
+			zmq_msg_t monmsg;
+			zmq_msg_init(&monmsg);
+			zmq_msg_copy(&monmsg, &tmpmsg);
+			send_frame(&monmsg, mon, rcvmore, monnoblock, &monfailed);
+			zmq_msg_close(&monmsg);
+		}
+		send_frame(&tmpmsg, out, rcvmore, noblock, &outfailed);
 		zmq_msg_close(&tmpmsg);
-		logit(WARN, "Error receiving message: %s", zmq_strerror(rc));
-		return;
+	} while(rcvmore);
+
+	t->messages++;
+	if(outfailed)
+		t->dropped++;
+	if(monfailed)
+		t->monitor_dropped++;
+	return 1;
+}
+
+void handle_kill(int signum) {
+	keeprunning = 0;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+// How many messages a device moves from each of its sockets every time
+// the broker polls, unless the device sets its own "budget"
+#define DEFAULT_BUDGET 100
+
+// The "stats" socket is shared by every broker thread
+static void * statssock = NULL;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+static int stats_interval = 10;
+
+static json_t * traffic_json(struct traffic * t) {
+	return json_pack("{s:I s:I s:I s:I}",
+		"messages", (json_int_t)t->messages, "bytes", (json_int_t)t->bytes,
+		"dropped", (json_int_t)t->dropped,
+		"monitor_dropped", (json_int_t)t->monitor_dropped);
+}
+
+static char * device_stats(struct device * d) {
+	json_t * stats = json_pack("{s:s s:s s:b s:o s:o}",
+		"type", "mqbroker_stats", "device", d->name, "paused", d->paused,
+		"frontend", traffic_json(&d->fromfront),
+		"backend", traffic_json(&d->fromback));
+	char * ret;
+
+	if(d->lb)
+		lb_stats(d, stats);
+	ret = json_dumps(stats, JSON_COMPACT);
+	json_decref(stats);
+	return ret;
+}
+
+static void free_cb(void * data, void * hint) {
+	free(data);
+}
+
+int send_string(void * sock, char * str, int flags, int owned) {
+	zmq_msg_t msg;
+	int rc;
+
+	if(owned)
+		zmq_msg_init_data(&msg, str, strlen(str), free_cb, NULL);
+	else {
+		zmq_msg_init_size(&msg, strlen(str));
+		memcpy(zmq_msg_data(&msg), str, strlen(str));
 	}
+	while((rc = zmq_msg_send(&msg, sock, flags)) == -1 && errno == EINTR)
+		;
+	if(rc == -1 && errno != ETERM)
+		logit(WARN, "Error sending message: %s", zmq_strerror(errno));
+	zmq_msg_close(&msg);
+	return rc == -1 ? -1 : 0;
+}
 
-	zmq_getsockopt(in, ZMQ_RCVMORE, &rcvmore, &size);
-	if(mon) {
-		flags = (rcvmore ? ZMQ_SNDMORE : 0) | (monnoblock ? ZMQ_NOBLOCK : 0);
-		zmq_msg_t monmsg;
-		zmq_msg_init(&monmsg);
-		zmq_msg_copy(&monmsg, &tmpmsg);
-		if(zmq_msg_send(&monmsg, mon, flags) == -1) {
-			logit(WARN, "Error sending message: %s", zmq_strerror(errno));
-			zmq_msg_close(&monmsg);
-			return;
+static void publish_stats(struct device * devices, size_t ndevices) {
+	size_t i;
+
+	pthread_mutex_lock(&statslock);
+	for(i = 0; i < ndevices; i++) {
+		if(devices[i].terminated)
+			continue;
+		if(send_string(statssock, "mqbroker_stats", ZMQ_SNDMORE, 0) == 0)
+			send_string(statssock, device_stats(&devices[i]), 0, 1);
+	}
+	pthread_mutex_unlock(&statslock);
+}
+
+static void close_device(struct device * d) {
+	if(d->frontend)
+		zmq_close(d->frontend);
+	if(d->backend)
+		zmq_close(d->backend);
+	if(d->monitor)
+		zmq_close(d->monitor);
+	if(d->control)
+		zmq_close(d->control);
+	d->frontend = d->backend = d->monitor = d->control = NULL;
+	lb_free(d->lb);
+	d->lb = NULL;
+	d->terminated = 1;
+}
+
+// Answers the commands waiting on a device's control socket, the way
+// zmq_proxy_steerable does: PAUSE stops forwarding until RESUME, leaving
+// messages queued in the device's sockets, TERMINATE closes the device,
+// and STATISTICS replies with its counters as JSON. Returns 1 if the
+// device was paused, resumed or closed.
+static int handle_control(struct device * d) {
+	int changed = 0;
+
+	while(!d->terminated) {
+		zmq_msg_t msg;
+		char command[32];
+		size_t len;
+		int more;
+#if ZMQ_VERSION_MAJOR == 2
+		int64_t rcvmore;
+#elif ZMQ_VERSION_MAJOR >= 3
+		int rcvmore;
+#endif
+		size_t size = sizeof(rcvmore);
+
+		zmq_msg_init(&msg);
+		if(zmq_msg_recv(&msg, d->control, ZMQ_DONTWAIT) == -1) {
+			zmq_msg_close(&msg);
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != ETERM)
+				logit(WARN, "Error receiving control message: %s",
+					zmq_strerror(errno));
+			break;
+		}
+		len = zmq_msg_size(&msg);
+		if(len >= sizeof(command))
+			len = sizeof(command) - 1;
+		memcpy(command, zmq_msg_data(&msg), len);
+		command[len] = '\0';
+		zmq_msg_close(&msg);
+
+		// Only the first frame of a command is looked at
+		zmq_getsockopt(d->control, ZMQ_RCVMORE, &rcvmore, &size);
+		more = rcvmore;
+		while(more) {
+			zmq_msg_init(&msg);
+			if(zmq_msg_recv(&msg, d->control, 0) == -1 && errno != EINTR) {
+				zmq_msg_close(&msg);
+				return changed;
+			}
+			zmq_msg_close(&msg);
+			size = sizeof(rcvmore);
+			zmq_getsockopt(d->control, ZMQ_RCVMORE, &rcvmore, &size);
+			more = rcvmore;
+		}
+
+		if(strcasecmp(command, "STATISTICS") == 0) {
+			send_string(d->control, device_stats(d), 0, 1);
+			continue;
 		}
-		zmq_msg_close(&monmsg);
+		if(strcasecmp(command, "PAUSE") == 0) {
+			if(!d->paused)
+				logit(INFO, "Pausing device %s", d->name);
+			changed |= !d->paused;
+			d->paused = 1;
+		} else if(strcasecmp(command, "RESUME") == 0) {
+			if(d->paused)
+				logit(INFO, "Resuming device %s", d->name);
+			changed |= d->paused;
+			d->paused = 0;
+		} else if(strcasecmp(command, "TERMINATE") == 0) {
+			logit(INFO, "Terminating device %s", d->name);
+			send_string(d->control, "OK", 0, 0);
+			close_device(d);
+			return 1;
+		} else {
+			logit(WARN, "Unknown command for device %s: %s", d->name, command);
+			send_string(d->control, "ERROR Unknown command", 0, 0);
+			continue;
+		}
+		send_string(d->control, "OK", 0, 0);
 	}
-	flags = (rcvmore ? ZMQ_SNDMORE : 0) | (noblock ? ZMQ_NOBLOCK : 0);
-	if(zmq_msg_send(&tmpmsg, out, flags) == -1) {
-		logit(WARN, "Error sending message: %s", zmq_strerror(errno));
-		zmq_msg_close(&tmpmsg);
-		return;
+	return changed;
+}
+
+// Fills in the sockets to poll: the control socket of every device that
+// hasn't been terminated, and the readable sockets of those that aren't
+// paused either. A balancing device keeps reading its backend while it's
+// paused, so its workers aren't taken for dead.
+static int setup_pollables(struct device * devices, size_t ndevices,
+	zmq_pollitem_t * pollables) {
+	size_t i;
+	int x = 0;
+
+	for(i = 0; i < ndevices; i++) {
+		struct device * d = &devices[i];
+		d->frontpoll = d->backpoll = d->controlpoll = NULL;
+		if(d->terminated)
+			continue;
+		if(d->control) {
+			memset(&pollables[x], 0, sizeof(zmq_pollitem_t));
+			pollables[x].socket = d->control;
+			pollables[x].events = ZMQ_POLLIN;
+			d->controlpoll = &pollables[x++];
+		}
+		if(d->paused && !d->lb)
+			continue;
+		if(d->frontread && !d->paused) {
+			memset(&pollables[x], 0, sizeof(zmq_pollitem_t));
+			pollables[x].socket = d->frontend;
+			pollables[x].events = ZMQ_POLLIN;
+			d->frontpoll = &pollables[x++];
+		}
+		if(d->backread) {
+			memset(&pollables[x], 0, sizeof(zmq_pollitem_t));
+			pollables[x].socket = d->backend;
+			pollables[x].events = ZMQ_POLLIN;
+			d->backpoll = &pollables[x++];
+		}
 	}
-	zmq_msg_close(&tmpmsg);
+	return x;
 }
 
-void handle_kill(int signum) {
-	keeprunning = 0;
+// A socket that polled readable, and how much more of its budget is left
+struct flow {
+	struct device * dev;
+	int backward;
+	int left;
+	int sent;
+};
+
+static int forward_flow(struct flow * f) {
+	struct device * d = f->dev;
+
+	if(d->lb)
+		return f->backward ? lb_handle_worker(d) : lb_take_job(d);
+	if(f->backward)
+		return do_forward(d->backend, d->frontend, d->monitor,
+			d->frontnoblock, d->monnoblock, &d->fromback);
+	return do_forward(d->frontend, d->backend, d->monitor,
+		d->backnoblock, d->monnoblock, &d->fromfront);
 }
 
 void * broker_loop(void * param) {
 	json_t * devarray = (json_t*)param;
 	zmq_pollitem_t * pollables;
-	size_t ndevices;
-	size_t i = 0, x = 0;
-	int rc;
-
-	struct device {
-		void * frontend;
-		void * backend;
-		void * monitor;
-		zmq_pollitem_t * frontpoll;
-		zmq_pollitem_t * backpoll;
-		int frontnoblock;
-		int backnoblock;
-		int monnoblock;
-	} * devices = NULL;
+	struct flow * ready;
+	size_t ndevices, first = 0, nrunning;
+	size_t i = 0;
+	int rc, x;
+	double nextstats = now() + stats_interval;
+	struct device * devices = NULL;
 
 	if(!json_is_array(devarray)) {
 		logit(ERR, "Device array is not an array!");
 		exit(1);
 	}
 
-	// Allocate one poll item for the frontend, backend, and monitor sockets
+	// Allocate one poll item for the frontend, backend, and control sockets
 	// of each device
 	ndevices = json_array_size(devarray);
 	devices = malloc(sizeof(struct device) * ndevices);
@@ -270,55 +515,88 @@ void * broker_loop(void * param) {
 
 	for(i = 0; i < ndevices; i++) {
 		json_t * device = json_array_get(devarray, i);
-		json_t * frontend, *backend, *monitor = NULL;
-		if(json_unpack(device, "{so so s?o}",
+		json_t * frontend, *backend, *monitor = NULL, *control = NULL;
+		const char * name = NULL, *type = NULL;
+		devices[i].budget = DEFAULT_BUDGET;
+		if(json_unpack(device, "{so so s?o s?i s?o s?s s?s}",
 			"frontend", &frontend, "backend", &backend,
-			"monitor", &monitor) != 0) {
+			"monitor", &monitor, "budget", &devices[i].budget,
+			"control", &control, "name", &name, "type", &type) != 0) {
 			logit(ERR, "Error unpacking device %d", i);
 			exit(1);
 		}
+		if(devices[i].budget < 1) {
+			logit(ERR, "Budget for device %d must be at least 1", i);
+			exit(1);
+		}
+		if(name)
+			devices[i].name = strdup(name);
+		else {
+			devices[i].name = malloc(24);
+			snprintf(devices[i].name, 24, "%lu", (unsigned long)i);
+		}
 		zmq_pollitem_t pollitem;
 		parse_sock_directive(frontend, &pollitem, &devices[i].frontnoblock);
 		devices[i].frontend = pollitem.socket;
-		if(pollitem.events == ZMQ_POLLIN) {
-			// For now these pointers are used as boolean
-			// values - they'll be swapped with real pointers
-			// in the next step
-			devices[i].frontpoll = (void*)1;
-			x++;
-		}
+		devices[i].frontread = pollitem.events == ZMQ_POLLIN;
 		parse_sock_directive(backend, &pollitem, &devices[i].backnoblock);
 		devices[i].backend = pollitem.socket;
-		if(pollitem.events == ZMQ_POLLIN) {
-			devices[i].backpoll = (void*)1;
-			x++;
-		}
+		devices[i].backread = pollitem.events == ZMQ_POLLIN;
 		if(monitor) {
 			parse_sock_directive(monitor, &pollitem, &devices[i].monnoblock);
 			devices[i].monitor = pollitem.socket;
 		}
-	}
-
-	pollables = malloc(sizeof(zmq_pollitem_t) * x);
-	memset(pollables, 0, sizeof(zmq_pollitem_t) * x);
-	x = 0;
-	for(i = 0; i < ndevices; i++) {
-		if(devices[i].frontpoll) {
-			pollables[x].socket = devices[i].frontend;
-			pollables[x].events = ZMQ_POLLIN;
-			devices[i].frontpoll = &pollables[x++];
+		if(control) {
+			int type = -1, noblock;
+			size_t typesize = sizeof(type);
+			parse_sock_directive(control, &pollitem, &noblock);
+			zmq_getsockopt(pollitem.socket, ZMQ_TYPE, &type, &typesize);
+			if(type != ZMQ_REP) {
+				logit(ERR, "Control socket for device %d must be a rep socket", i);
+				exit(1);
+			}
+			devices[i].control = pollitem.socket;
 		}
-		if(devices[i].backpoll) {
-			pollables[x].socket = devices[i].backend;
-			pollables[x].events = ZMQ_POLLIN;
-			devices[i].backpoll = &pollables[x++];
+		if(type && (strcasecmp(type, "balance") == 0 ||
+			strcasecmp(type, "shard") == 0)) {
+			if((devices[i].lb = lb_new(device, &devices[i],
+				strcasecmp(type, "shard") == 0)) == NULL)
+				exit(1);
+		} else if(type && strcasecmp(type, "forward") != 0) {
+			logit(ERR, "Invalid type for device %s: %s", devices[i].name, type);
+			exit(1);
 		}
 	}
 
 	json_decref(devarray);
+	pollables = malloc(sizeof(zmq_pollitem_t) * ndevices * 3);
+	ready = malloc(sizeof(struct flow) * ndevices * 2);
+	x = setup_pollables(devices, ndevices, pollables);
+	nrunning = ndevices;
 
 	do {
-		rc = zmq_poll(pollables, x, -1);
+		size_t n, nready = 0, active;
+		long timeout = -1;
+		double at = now(), wake = statssock ? nextstats : 0;
+
+		// Balancing devices have heartbeats to send, and only read
+		// jobs while some worker has room for them
+		for(n = 0; n < ndevices; n++) {
+			struct device * d = &devices[n];
+			double next;
+			if(!d->lb)
+				continue;
+			next = lb_timer(d, at);
+			if(wake == 0 || next < wake)
+				wake = next;
+			if(d->frontpoll)
+				d->frontpoll->events = lb_wants_jobs(d) ? ZMQ_POLLIN : 0;
+		}
+		if(wake > 0) {
+			double left = wake - at;
+			timeout = left > 0 ? (long)(left * 1000) * ZMQ_POLL_MSEC : 0;
+		}
+		rc = zmq_poll(pollables, x, timeout);
 		if(rc < 0) {
 			rc = errno;
 			if(rc == ETERM)
@@ -326,40 +604,80 @@ void * broker_loop(void * param) {
 			logit(WARN, "Received error from poll: %s",
 				zmq_strerror(rc));
 		}
+		if(statssock && now() >= nextstats) {
+			publish_stats(devices, ndevices);
+			nextstats = now() + stats_interval;
+		}
 		if(rc < 1)
 			continue;
 
-		size_t i;
-		for(i = 0; i < ndevices; i++) {
-			if(devices[i].frontpoll && devices[i].frontpoll->revents & ZMQ_POLLIN) {
-				logit(DEBUG, "Received message from frontend for device %d", i);
-				do_forward(
-					devices[i].frontend,
-					devices[i].backend,
-					devices[i].monitor,
-					devices[i].backnoblock,
-					devices[i].monnoblock);
+		// The device that goes first moves along each time, so no device
+		// always has its messages sent ahead of the others
+		for(n = 0; n < ndevices; n++) {
+			struct device * d = &devices[(first + n) % ndevices];
+			if(d->frontpoll && d->frontpoll->revents & ZMQ_POLLIN) {
+				ready[nready].dev = d;
+				ready[nready].backward = 0;
+				ready[nready].left = d->budget;
+				ready[nready++].sent = 0;
 			}
-			if(devices[i].backpoll && devices[i].backpoll->revents & ZMQ_POLLIN) {
-				logit(DEBUG, "Received message from backend for device %d", i);
-				do_forward(
-					devices[i].backend,
-					devices[i].frontend,
-					devices[i].monitor,
-					devices[i].frontnoblock,
-					devices[i].monnoblock);
+			if(d->backpoll && d->backpoll->revents & ZMQ_POLLIN) {
+				ready[nready].dev = d;
+				ready[nready].backward = 1;
+				ready[nready].left = d->budget;
+				ready[nready++].sent = 0;
 			}
 		}
-	} while(keeprunning);
+		first = (first + 1) % ndevices;
+
+		// Take one message from each readable socket in turn until each
+		// has nothing more waiting or has used up its budget. Whatever is
+		// left over is picked up after the next poll.
+		active = nready;
+		while(active > 0) {
+			for(n = 0; n < nready; n++) {
+				struct flow * f = &ready[n];
+				if(f->left == 0)
+					continue;
+				if(forward_flow(f) < 1)
+					f->left = 0;
+				else {
+					f->left--;
+					f->sent++;
+				}
+				if(f->left == 0)
+					active--;
+			}
+		}
+
+		for(n = 0; n < nready; n++) {
+			logit(DEBUG, "Forwarded %d messages from %s for device %s",
+				ready[n].sent, ready[n].backward ? "backend" : "frontend",
+				ready[n].dev->name);
+		}
+
+		// Commands are handled once the messages that were waiting have
+		// been forwarded, since pausing or closing a device changes what
+		// gets polled
+		rc = 0;
+		for(n = 0; n < ndevices; n++) {
+			struct device * d = &devices[n];
+			if(d->controlpoll && d->controlpoll->revents & ZMQ_POLLIN) {
+				rc |= handle_control(d);
+				if(d->terminated)
+					nrunning--;
+			}
+		}
+		if(rc)
+			x = setup_pollables(devices, ndevices, pollables);
+	} while(keeprunning && nrunning > 0);
 
 	for(i = 0; i < ndevices; i++) {
-		if(devices[i].frontend)
-			zmq_close(devices[i].frontend);
-		if(devices[i].backend)
-			zmq_close(devices[i].backend);
-		if(devices[i].monitor)
-			zmq_close(devices[i].monitor);
+		if(!devices[i].terminated)
+			close_device(&devices[i]);
+		free(devices[i].name);
 	}
+	free(ready);
 	free(pollables);
 	free(devices);
 	return 0;
@@ -367,7 +685,7 @@ void * broker_loop(void * param) {
 
 int main(int argc, char ** argv) {
 	json_error_t config_err;
-	json_t * config, *confarray = NULL;
+	json_t * config, *confarray = NULL, *stats = NULL;
 	int daemonize = 0, iothreads = 1;
 	char ch, * configname = "devices";
 	pthread_t * threads = NULL;
@@ -413,8 +731,9 @@ int main(int argc, char ** argv) {
 		exit(1);
 	}
 
-	if(json_unpack(config, "{s?:i s:O}", "iothreads", &iothreads,
-		configname, &confarray) != 0) {
+	if(json_unpack(config, "{s?:i s:O s?:O s?:i}", "iothreads", &iothreads,
+		configname, &confarray, "stats", &stats,
+		"stats_interval", &stats_interval) != 0) {
 		logit(ERR, "Error getting config while setting up context");
 		exit(1);
 	}
@@ -436,6 +755,24 @@ int main(int argc, char ** argv) {
 		exit(1);
 	}
 
+	if(stats) {
+		zmq_pollitem_t pollitem;
+		int noblock, type = -1;
+		size_t typesize = sizeof(type);
+		if(stats_interval < 1) {
+			logit(ERR, "The stats interval must be at least 1 second");
+			exit(1);
+		}
+		parse_sock_directive(stats, &pollitem, &noblock);
+		zmq_getsockopt(pollitem.socket, ZMQ_TYPE, &type, &typesize);
+		if(type != ZMQ_PUB) {
+			logit(ERR, "The stats socket must be a pub socket");
+			exit(1);
+		}
+		statssock = pollitem.socket;
+		json_decref(stats);
+	}
+
 	struct sigaction killaction, oldaction;
 	killaction.sa_handler = handle_kill;
 	sigemptyset(&killaction.sa_mask);
@@ -466,6 +803,8 @@ int main(int argc, char ** argv) {
 			pthread_join(threads[i], NULL);
 	}
 
+	if(statssock)
+		zmq_close(statssock);
 	zmq_term(zmqctx);
 	return 0;
 }
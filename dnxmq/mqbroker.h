@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <zmq.h>
+#include <jansson.h>
+#include "zmq3compat.h"
+
+// Logging functions
+#define WARN 3
+#define ERR 2
+#define DEBUG 1
+#define INFO 0
+void logit(int level, char * fmt, ...);
+
+// What went through a device in one direction. Messages the other side
+// (or the monitor) wouldn't take, like sends to a full noblock socket, are
+// counted as dropped.
+struct traffic {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t dropped;
+	uint64_t monitor_dropped;
+};
+
+struct balancer;
+
+struct device {
+	char * name;
+	void * frontend;
+	void * backend;
+	void * monitor;
+	void * control;
+	zmq_pollitem_t * frontpoll;
+	zmq_pollitem_t * backpoll;
+	zmq_pollitem_t * controlpoll;
+	int frontread;
+	int backread;
+	int frontnoblock;
+	int backnoblock;
+	int monnoblock;
+	int budget;
+	int paused;
+	int terminated;
+	struct traffic fromfront;
+	struct traffic fromback;
+	// Set for "balance" devices
+	struct balancer * lb;
+};
+
+double now();
+int send_string(void * sock, char * str, int flags, int owned);
+
+// Load balancing device functions
+struct balancer * lb_new(json_t * def, struct device * d, int sharded);
+void lb_free(struct balancer * lb);
+int lb_take_job(struct device * d);
+int lb_handle_worker(struct device * d);
+int lb_wants_jobs(struct device * d);
+double lb_timer(struct device * d, double at);
+void lb_stats(struct device * d, json_t * stats);
+
+// Consistent hashing functions for "shard" devices
+struct shard;
+struct shard * shard_new(json_t * def, const char * name);
+void shard_free(struct shard * s);
+void shard_add(struct shard * s, const char * name, size_t len, void * owner);
+void shard_remove(struct shard * s, void * owner);
+int shard_empty(struct shard * s);
+void * shard_owner(struct shard * s, uint32_t hash);
+int shard_key(struct shard * s, zmq_msg_t * frames, int nframes,
+	uint32_t * hash);
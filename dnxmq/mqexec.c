@@ -15,19 +15,18 @@
 #include "mqexec.h"
 
 void * zmqctx;
-// Worker Sockets
+// Worker Sockets. With "threads", each worker thread has its own pair
+// connected to the main thread, which holds the upstream ones.
 int pullsock_type = ZMQ_PULL;
-void * pullsock = NULL;
-void * pushsock = NULL;
+__thread void * pullsock = NULL;
+__thread void * pushsock = NULL;
 // Broker Sockets
 int usesyslog = 0, verbose = 0;
 char myfqdn[255];
 char mynodename[255];
-uint32_t runningjobs = 0;
-ev_io pullio;
-char * rootpath = NULL, *unprivpath = NULL;
-size_t rootpathlen = 0, unprivpathlen = 0;
-uid_t runas = 0;
+__thread uint32_t runningjobs = 0;
+__thread ev_io pullio;
+__thread unsigned long jobs_received = 0, results_sent = 0;
 #if ZMQ_VERSION_MAJOR > 3
 char * curve_private = NULL, *curve_public = NULL, *curve_server = NULL;
 #endif
@@ -37,6 +36,11 @@ ev_io pullmonio, pushmonio;
 int reconnect_ivl = 1000, reconnect_ivl_max = 0;
 int config_heartbeat_interval = -1;
 int config_heartbeat_timeout = -1;
+// Result batching
+int batch_size = 0, batch_interval = 1000;
+static __thread struct resultbuf batch;
+static __thread size_t batch_count = 0;
+static __thread ev_timer batchtimer;
 
 void logit(int level, char * fmt, ...) {
 	int err;
@@ -77,39 +81,14 @@ void free_cb(void * data, void * hint) {
 	free(data);
 }
 
-void obj_for_ending(struct child_job * j, const char * output,
-	int return_code, int early_timeout, int exited_ok) {
+// Sends a serialized message and takes ownership of its buffer
+static void send_result(struct resultbuf * rb) {
 	zmq_msg_t outmsg;
-	const char * keys[] = { "host_name", "service_description",
-		"check_options", "scheduled_check", "reschedule_check",
-		"early_timeout", "check_type", NULL };
-	struct timeval finish;
-	int i, rc, retry_count = 0;
-
-	if(j->start.tv_sec == 0)
-		gettimeofday(&j->start, NULL);
-	gettimeofday(&finish, NULL);
-	json_t * jout = json_pack(
-		"{ s:s s:i s:i s:i s:{ s:i s:i } s:{ s:i s:i } s:s s:f }",
-		"output", output, "return_code", return_code,
-		"exited_ok", exited_ok, "early_timeout", early_timeout,
-		"start_time", "tv_sec", j->start.tv_sec,
-		"tv_usec", j->start.tv_usec, "finish_time", "tv_sec",
-		finish.tv_sec, "tv_usec", finish.tv_usec, "type",
-		j->service ? "service_check_processed":"host_check_processed",
-		"latency", j->latency);
-
-	for(i = 0; keys[i] != NULL; i++) {
-		json_t * val = json_object_get(j->input, keys[i]);
-		if(val)
-			json_object_set(jout, keys[i], val);
-	}
+	int rc;
 
-	logit(DEBUG, "Sending result for %s %s: %s %i", j->host_name,
-		j->service_description, output, return_code);
-	char * strout= json_dumps(jout, JSON_COMPACT);
-	json_decref(jout);
-	zmq_msg_init_data(&outmsg, strout, strlen(strout), free_cb, NULL);
+	zmq_msg_init_data(&outmsg, rb->data, rb->len, free_cb, NULL);
+	rb->data = NULL;
+	rb->len = rb->size = 0;
 
 	// This loop will terminate based on whether the send was successful
 	// It's just here to make sure signals can't drop check results.
@@ -117,8 +96,10 @@ void obj_for_ending(struct child_job * j, const char * output,
 		if((rc = zmq_msg_send(&outmsg, pushsock, 0) == -1)) {
 			// We get lots of signals because we're waiting on tons of children
 			// best to just try again.
-			if(errno == EINTR)
+			if(errno == EINTR) {
+				thread_stats->send_retries++;
 				continue;
+			}
 
 			// We don't need to log anything for ETERM, because it's a normal
 			// event that means "just quit now"
@@ -133,20 +114,125 @@ void obj_for_ending(struct child_job * j, const char * output,
 	zmq_msg_close(&outmsg);
 }
 
+void flush_batch(struct ev_loop * loop) {
+	ev_timer_stop(loop, &batchtimer);
+	if(batch_count == 0)
+		return;
+
+	logit(DEBUG, "Sending batch of %lu results", (unsigned long)batch_count);
+	rb_append(&batch, "]}", 2);
+	send_result(&batch);
+	batch_count = 0;
+}
+
+static void batch_timer_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	flush_batch(loop);
+}
+
+void obj_for_ending(struct ev_loop * loop, struct child_job * j,
+	const char * output, int return_code, int early_timeout, int exited_ok) {
+	const char * keys[] = { "host_name", "service_description",
+		"check_options", "scheduled_check", "reschedule_check",
+		"early_timeout", "check_type", NULL };
+	struct resultbuf single = { NULL, 0, 0 }, *rb = &single;
+	struct timeval finish;
+	int i;
+
+	if(early_timeout)
+		thread_stats->timed_out++;
+	if(j->start.tv_sec == 0)
+		gettimeofday(&j->start, NULL);
+	gettimeofday(&finish, NULL);
+
+	// Results are written directly into the batch when batching, so a
+	// batch is one buffer no matter how many results are in it.
+	if(batch_size > 1) {
+		rb = &batch;
+		if(batch_count == 0)
+			rb_append(rb,
+				"{\"type\":\"check_result_batch\",\"results\":[", 40);
+		else
+			rb_append(rb, ",", 1);
+	}
+
+	rb_append(rb, "{", 1);
+	rb_append_key(rb, "output", 1);
+	rb_append_string(rb, output, strlen(output));
+	rb_append_key(rb, "return_code", 0);
+	rb_append_int(rb, return_code);
+	rb_append_key(rb, "exited_ok", 0);
+	rb_append_int(rb, exited_ok);
+	// An early_timeout in the job overrides ours, as it always has
+	if(json_object_get(j->input, "early_timeout") == NULL) {
+		rb_append_key(rb, "early_timeout", 0);
+		rb_append_int(rb, early_timeout);
+	}
+	rb_append_timeval(rb, "start_time", &j->start);
+	rb_append_timeval(rb, "finish_time", &finish);
+	rb_append_key(rb, "type", 0);
+	if(j->service)
+		rb_append(rb, "\"service_check_processed\"", 25);
+	else
+		rb_append(rb, "\"host_check_processed\"", 22);
+	rb_append_key(rb, "latency", 0);
+	rb_append_real(rb, j->latency);
+	if(j->have_rusage) {
+		struct rusage * ru = &j->rusage;
+		rb_append_key(rb, "rusage", 0);
+		rb_append(rb, "{", 1);
+		rb_append_key(rb, "utime", 1);
+		rb_append_real(rb, ru->ru_utime.tv_sec +
+			(ru->ru_utime.tv_usec / 1000000.0));
+		rb_append_key(rb, "stime", 0);
+		rb_append_real(rb, ru->ru_stime.tv_sec +
+			(ru->ru_stime.tv_usec / 1000000.0));
+		rb_append_key(rb, "maxrss", 0);
+		rb_append_int(rb, ru->ru_maxrss);
+		rb_append_key(rb, "nvcsw", 0);
+		rb_append_int(rb, ru->ru_nvcsw);
+		rb_append_key(rb, "nivcsw", 0);
+		rb_append_int(rb, ru->ru_nivcsw);
+		rb_append(rb, "}", 1);
+	}
+
+	for(i = 0; keys[i] != NULL; i++) {
+		json_t * val = json_object_get(j->input, keys[i]);
+		if(val) {
+			rb_append_key(rb, keys[i], 0);
+			rb_append_json(rb, val);
+		}
+	}
+	rb_append(rb, "}", 1);
+
+	logit(DEBUG, "Sending result for %s %s: %s %i", j->host_name,
+		j->service_description, output, return_code);
+	results_sent++;
+
+	if(rb == &single)
+		send_result(rb);
+	// Send the batch once it's full, or once the oldest result in it has
+	// waited batch_interval milliseconds.
+	else if(++batch_count >= batch_size)
+		flush_batch(loop);
+	else if(!ev_is_active(&batchtimer)) {
+		ev_timer_set(&batchtimer, batch_interval / 1000.0, 0);
+		ev_timer_start(loop, &batchtimer);
+	}
+	stats_job_finished(j);
+}
+
 void child_io_cb(struct ev_loop * loop, ev_io * i, int event) {
 	struct child_job * j = (struct child_job*)i->data;
+	char chunk[4096];
 	ssize_t r;
 
-	do {
-		r = read(i->fd, j->buffer + j->bufused,
-			sizeof(j->buffer) - j->bufused - 1);
-		if(r > 0)
-			j->bufused += r;
-	} while(r > 0 && j->bufused < sizeof(j->buffer) - 1);
+	// Output past max_output is still read, so the child doesn't block
+	// on a full pipe, but it's dropped.
+	while((r = read(i->fd, chunk, sizeof(chunk))) > 0)
+		output_append(j, chunk, r);
 
-	// If we've filled up the check result buffer, just stop reading from
-	// the child.
-	if(j->bufused == sizeof(j->buffer) - 1)
+	// The pipe stays readable at EOF; wait for the child to be reaped
+	if(r == 0)
 		ev_io_stop(loop, i);
 }
 
@@ -159,34 +245,30 @@ void child_timeout_cb(struct ev_loop * loop, ev_timer * t, int event) {
 		return;
 	} else
 		ev_timer_stop(loop, t);
+	j->times.exited = stats_clock();
 	ev_io_stop(loop, &j->io);
 	close(j->io.fd);
 
-	// If the child is in our list of children, kill it.
-	// This will also remove the child from the list of children.
-	if(get_child(j->pid)) {
-		kill(j->pid, SIGTERM);
-	}
+	kill_child(loop, j);
 
 	if(j->service >= 0) {
-		obj_for_ending(j, "Check timed out", 3, 1, 1);
+		obj_for_ending(loop, j, "Check timed out", 3, 1, 1);
+		finish_waiters(loop, j, "Check timed out", 3, 1, 1);
 		logit(DEBUG, "Child %d timed out. Sending timeout message upstream",
 			j->pid);
 	} else
 		logit(DEBUG, "Non-check child %d timed out. Output so far: %s",
 			j->pid, j->buffer);
 
-	json_decref(j->input);
-	free(j);
+	job_done(loop, j);
 	if(--runningjobs == 0 && !pullsock)
 		ev_break(loop, EVBREAK_ALL);
 }
 
-void child_end_cb(struct ev_loop * loop, ev_child * c, int event) {
-	struct child_job * j = get_child(c->rpid);
-	if(!j)
-		return;
-
+// Called once a child has been reaped, by whichever way children are
+// being tracked.
+void child_exited(struct ev_loop * loop, struct child_job * j, int status) {
+	j->times.exited = stats_clock();
 	ev_timer_stop(loop, &j->timer);
 	// If the I/O watcher is still active, call the callback one more
 	// time to make sure the buffer is flushed.
@@ -196,26 +278,22 @@ void child_end_cb(struct ev_loop * loop, ev_child * c, int event) {
 	close(j->io.fd);
 	ev_io_stop(loop, &j->io);
 
-	// If there's nothing in the I/O buffer, write an empty string so
-	// there's something to pack into the JSON response.
-	if(j->bufused == 0)
-		strcpy(j->buffer, "");
-
 	if(j->service >= 0) {
-		obj_for_ending(j, j->buffer, WEXITSTATUS(c->rstatus), 0, 1);
+		obj_for_ending(loop, j, j->buffer, WEXITSTATUS(status), 0, 1);
+		finish_waiters(loop, j, j->buffer, WEXITSTATUS(status), 0, 1);
 		logit(DEBUG, "Child %d ended with %d. Sending \"%s\" upstream",
-			c->rpid, c->rstatus, j->buffer);
+			j->pid, status, j->buffer);
 	} else
 		logit(DEBUG, "Non-check child %d ended with %d. It said \"%s\"",
-			c->rpid, c->rstatus, j->buffer);
-	json_decref(j->input);
-	free(j);
+			j->pid, status, j->buffer);
+	job_done(loop, j);
 	if(--runningjobs == 0 && !pullsock)
 		ev_break(loop, EVBREAK_ALL);
 }
 
 void recv_job_cb(struct ev_loop * loop, ev_io * i, int event) {
-	while(1) {
+	// Admission control stops the watcher when the job queue fills up
+	while(ev_is_active(i)) {
 		zmq_msg_t inmsg;
 #if ZMQ_VERSION_MAJOR == 2
 		int64_t rcvmore = 0;
@@ -247,14 +325,54 @@ void recv_job_cb(struct ev_loop * loop, ev_io * i, int event) {
 		// A NagMQ invariant is that the last frame of multi-part messages
 		// will always be JSON.
 		if(rcvmore) {
+			// Jobs taken with credits come to worker threads behind
+			// the broker's id for them
+			if(credits > 0)
+				credit_read_id(&inmsg);
 			zmq_msg_close(&inmsg);
 			continue;
 		}
 
+		// The main thread hands jobs to the worker threads
+		if(forwarding_jobs) {
+			forward_job(loop, &inmsg, 0);
+			continue;
+		}
+		jobs_received++;
 		do_kickoff(loop, &inmsg);
 	}
 }
 
+// Starts taking jobs from sock on loop, in whichever thread runs jobs
+void start_job_loop(struct ev_loop * loop, void * sock) {
+	int fd = -1;
+	size_t fdsize = sizeof(fd);
+
+	zmq_getsockopt(sock, ZMQ_FD, &fd, &fdsize);
+	ev_io_init(&pullio, recv_job_cb, fd, EV_READ);
+	pullio.data = sock;
+	ev_io_start(loop, &pullio);
+	ev_init(&batchtimer, batch_timer_cb);
+	// The fd is edge triggered, so pick up anything already waiting
+	ev_feed_event(loop, &pullio, EV_READ);
+}
+
+// Takes jobs from a new upstream socket. If taking jobs is paused, it
+// stays paused until there's room again.
+static void replace_job_socket(struct ev_loop * loop, void * sock) {
+	int fd = -1, active = ev_is_active(&pullio);
+	size_t fdsize = sizeof(fd);
+
+	zmq_getsockopt(sock, ZMQ_FD, &fd, &fdsize);
+	ev_io_stop(loop, &pullio);
+	ev_io_set(&pullio, fd, EV_READ);
+	pullio.data = sock;
+	if(active) {
+		ev_io_start(loop, &pullio);
+		ev_feed_event(loop, &pullio, EV_READ);
+	}
+}
+
 #if ZMQ_VERSION_MAJOR >= 3
 void sock_monitor_cb(struct ev_loop * loop, ev_io * i, int event) {
 	while(1) {
@@ -396,12 +514,341 @@ void setup_sockmonitor(struct ev_loop * loop, ev_io * ioev, void * sock) {
 }
 #endif
 
+// Settings read from the config file. The whole file is read again on
+// SIGHUP, but only the filter, jail, limits, batching, logging and sockets
+// change on a reload; the rest need a restart.
+struct exec_config {
+	json_t * root;
+	json_t * jobs, *results, *publisher, *filter, *plugin_hosts, *stats;
+	char * rootpath, *unprivpath, *unprivuser, *cgroup;
+	char * curve_public, *curve_private, *curve_server, *credit_name;
+	int iothreads, threads, verbose, usesyslog;
+	int reconnect_ivl, reconnect_ivl_max, heartbeat, heartbeat_timeout;
+	int batch_size, batch_interval, argv_cache_size, max_output;
+	int max_running, max_running_per_host, max_running_per_command;
+	int max_queued, coalesce, process_groups, kill_grace;
+	int credits, credit_heartbeat, credit_liveness;
+};
+
+static char * config_path, *configobj = "executor";
+// Built-in defaults, and the config mqexec is running with
+static struct exec_config default_config, running_config;
+
+static void get_defaults(struct exec_config * c) {
+	memset(c, 0, sizeof(struct exec_config));
+	c->iothreads = 1;
+	c->threads = 1;
+	c->verbose = verbose;
+	c->usesyslog = usesyslog;
+	c->reconnect_ivl = reconnect_ivl;
+	c->reconnect_ivl_max = reconnect_ivl_max;
+	c->heartbeat = config_heartbeat_interval;
+	c->heartbeat_timeout = config_heartbeat_timeout;
+	c->batch_size = batch_size;
+	c->batch_interval = batch_interval;
+	c->argv_cache_size = argv_cache_size;
+	c->max_output = max_output;
+	c->max_running = max_running;
+	c->max_running_per_host = max_running_per_host;
+	c->max_running_per_command = max_running_per_command;
+	c->max_queued = max_queued;
+	c->coalesce = coalesce_checks;
+	c->process_groups = process_groups;
+	c->kill_grace = kill_grace;
+	c->credits = credits;
+	c->credit_heartbeat = credit_heartbeat;
+	c->credit_liveness = credit_liveness;
+}
+
+// Loads and unpacks the config file. Settings it leaves out get their
+// defaults. Returns 0, or -1 after logging what's wrong.
+static int read_config(struct exec_config * c) {
+	json_error_t err;
+
+	*c = default_config;
+	c->root = json_load_file(config_path, JSON_DISABLE_EOF_CHECK, &err);
+	if(c->root == NULL) {
+		logit(ERR, "Error parsing config: %s: (line: %d column: %d)",
+			err.text, err.line, err.column);
+		return -1;
+	}
+
+#if ZMQ_VERSION_MAJOR < 4
+	if(json_unpack_ex(c->root, &err, 0,
+		"{s:{s?:o s?:o s?i s?b s?b s?:o s?o s?s s?s s?s s?i s?i s?i s?i s?i s?i s?o s?i s?i s?i s?i s?i s?i s?b s?b s?s s?i s?o s?i s?i s?i s?s}}",
+		configobj, "jobs", &c->jobs, "results", &c->results,
+		"iothreads", &c->iothreads, "verbose", &c->verbose,
+		"syslog", &c->usesyslog, "filter", &c->filter,
+		"publisher", &c->publisher, "rootpath", &c->rootpath,
+		"unprivpath", &c->unprivpath, "unprivuser", &c->unprivuser,
+		"reconnect_ivl", &c->reconnect_ivl,
+		"reconnect_ivl_max", &c->reconnect_ivl_max,
+		"heartbeat", &c->heartbeat,
+		"batch_size", &c->batch_size, "batch_interval", &c->batch_interval,
+		"argv_cache_size", &c->argv_cache_size,
+		"plugin_hosts", &c->plugin_hosts, "max_running", &c->max_running,
+		"max_running_per_host", &c->max_running_per_host,
+		"max_running_per_command", &c->max_running_per_command,
+		"max_queued", &c->max_queued, "max_output", &c->max_output,
+		"threads", &c->threads, "coalesce", &c->coalesce,
+		"process_groups", &c->process_groups, "cgroup", &c->cgroup,
+		"kill_grace", &c->kill_grace, "stats", &c->stats,
+		"credits", &c->credits, "credit_heartbeat", &c->credit_heartbeat,
+		"credit_liveness", &c->credit_liveness,
+		"credit_name", &c->credit_name) != 0) {
+		logit(ERR, "Error getting config %s", err.text);
+		json_decref(c->root);
+		return -1;
+	}
+#else
+	if(json_unpack_ex(c->root, &err, 0,
+		"{s:{s?:o s?:o s?i s?b s?b s?:o s?o s?s s?s s?s s?{s:s s:s s:s} s?i s?i s?i s?i s?i s?i s?i s?o s?i s?i s?i s?i s?i s?i s?b s?b s?s s?i s?o s?i s?i s?i s?s}}",
+		configobj, "jobs", &c->jobs, "results", &c->results,
+		"iothreads", &c->iothreads, "verbose", &c->verbose,
+		"syslog", &c->usesyslog, "filter", &c->filter,
+		"publisher", &c->publisher, "rootpath", &c->rootpath,
+		"unprivpath", &c->unprivpath, "unprivuser", &c->unprivuser,
+		"curve", "publickey", &c->curve_public,
+		"privatekey", &c->curve_private, "serverkey", &c->curve_server,
+		"reconnect_ivl", &c->reconnect_ivl,
+		"reconnect_ivl_max", &c->reconnect_ivl_max,
+		"heartbeat", &c->heartbeat,
+		"heartbeat_timeout", &c->heartbeat_timeout,
+		"batch_size", &c->batch_size, "batch_interval", &c->batch_interval,
+		"argv_cache_size", &c->argv_cache_size,
+		"plugin_hosts", &c->plugin_hosts, "max_running", &c->max_running,
+		"max_running_per_host", &c->max_running_per_host,
+		"max_running_per_command", &c->max_running_per_command,
+		"max_queued", &c->max_queued, "max_output", &c->max_output,
+		"threads", &c->threads, "coalesce", &c->coalesce,
+		"process_groups", &c->process_groups, "cgroup", &c->cgroup,
+		"kill_grace", &c->kill_grace, "stats", &c->stats,
+		"credits", &c->credits, "credit_heartbeat", &c->credit_heartbeat,
+		"credit_liveness", &c->credit_liveness,
+		"credit_name", &c->credit_name) != 0) {
+		logit(ERR, "Error getting config: %s", err.text);
+		json_decref(c->root);
+		return -1;
+	}
+#endif
+
+	if(c->results == NULL) {
+		logit(ERR, "Must supply a results socket for worker");
+		json_decref(c->root);
+		return -1;
+	}
+	if(c->jobs == NULL && c->publisher == NULL) {
+		logit(ERR, "Must supply either a jobs or publisher socket for worker");
+		json_decref(c->root);
+		return -1;
+	}
+	if(c->credits > 0 && (c->jobs == NULL || c->credit_heartbeat < 1 ||
+		c->credit_liveness < 1)) {
+		logit(ERR, "Taking jobs with credits needs a jobs socket, and a "
+			"credit_heartbeat and credit_liveness of at least 1");
+		json_decref(c->root);
+		return -1;
+	}
+	return 0;
+}
+
+// Compiles the filter and looks up the jail user. Returns NULL if either
+// is wrong.
+static struct job_rules * build_rules(struct exec_config * c) {
+	struct filter * filter;
+	uid_t uid = 0;
+	int err;
+
+	filter = compile_filter(c->filter, &err);
+	if(err)
+		return NULL;
+	if(c->unprivuser) {
+		struct passwd * pwdent = getpwnam(c->unprivuser);
+		if(pwdent == NULL) {
+			logit(ERR, "Error looking up user %s: %d", c->unprivuser, errno);
+			free_filter(filter);
+			return NULL;
+		}
+		uid = pwdent->pw_uid;
+	}
+	return new_rules(filter, c->rootpath, c->unprivpath, uid);
+}
+
+static char * replace_string(char * old, const char * val) {
+	free(old);
+	return val ? strdup(val) : NULL;
+}
+
+// Applies the plain settings that can change while jobs are running
+static void apply_settings(struct exec_config * c) {
+	verbose = c->verbose;
+	reconnect_ivl = c->reconnect_ivl;
+	reconnect_ivl_max = c->reconnect_ivl_max;
+	config_heartbeat_interval = c->heartbeat;
+	config_heartbeat_timeout = c->heartbeat_timeout;
+#if ZMQ_VERSION_MAJOR > 3
+	curve_public = replace_string(curve_public, c->curve_public);
+	curve_private = replace_string(curve_private, c->curve_private);
+	curve_server = replace_string(curve_server, c->curve_server);
+#endif
+	batch_size = c->batch_size;
+	batch_interval = c->batch_interval;
+	argv_cache_size = c->argv_cache_size > 0 ? c->argv_cache_size : 0;
+	max_running = c->max_running;
+	max_running_per_host = c->max_running_per_host;
+	max_running_per_command = c->max_running_per_command;
+	max_queued = c->max_queued;
+	kill_grace = c->kill_grace;
+}
+
+static void * open_job_socket(struct exec_config * c) {
+	// With credits the jobs socket talks to an mqbroker balance device
+	void * sock = zmq_socket(zmqctx, c->credits > 0 ? ZMQ_DEALER :
+		(c->jobs ? ZMQ_PULL : ZMQ_SUB));
+
+	if(sock == NULL) {
+		logit(ERR, "Error creating %s socket %d",
+			c->jobs ? "jobs" : "publisher", errno);
+		return NULL;
+	}
+	parse_sock_directive(sock, c->jobs ? c->jobs : c->publisher, 0);
+	logit(DEBUG, "Setup worker pull sock");
+	return sock;
+}
+
+static void * open_result_socket(struct exec_config * c) {
+	void * sock = zmq_socket(zmqctx, ZMQ_PUSH);
+
+	if(sock == NULL) {
+		logit(ERR, "Error creating results socket %d", errno);
+		return NULL;
+	}
+	parse_sock_directive(sock, c->results, 0);
+	logit(DEBUG, "Setup worker push socket");
+	return sock;
+}
+
+static int same_json(json_t * a, json_t * b) {
+	if(a == NULL || b == NULL)
+		return a == b;
+	return json_equal(a, b);
+}
+
+static int same_string(const char * a, const char * b) {
+	if(a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+// Picks up reloaded settings in a thread that runs jobs, between jobs
+void reload_thread(struct ev_loop * loop) {
+	adopt_rules();
+	flush_batch(loop);
+	if(!forwarding_jobs)
+		admission_reload(loop);
+}
+
+// Re-reads the config on SIGHUP. Nothing changes unless the whole config
+// is good. Sockets are only rebuilt when their definitions (or the
+// options every socket gets) changed, so peers don't see a reconnect
+// for every reload.
+static void reload_config(struct ev_loop * loop, ev_signal * w, int revents) {
+	struct exec_config c, *old = &running_config;
+	struct job_rules * r;
+	int sockopts_changed;
+	void * sock;
+
+	// Shutting down already
+	if(pullsock == NULL)
+		return;
+	logit(INFO, "Reloading config from %s", config_path);
+	if(read_config(&c) != 0)
+		return;
+	if((r = build_rules(&c)) == NULL) {
+		logit(ERR, "Not reloading config because of errors");
+		json_decref(c.root);
+		return;
+	}
+	if(c.threads != old->threads || c.iothreads != old->iothreads ||
+		c.max_output != old->max_output || c.coalesce != old->coalesce ||
+		c.process_groups != old->process_groups ||
+		c.credits != old->credits ||
+		c.credit_heartbeat != old->credit_heartbeat ||
+		c.credit_liveness != old->credit_liveness ||
+		!same_string(c.credit_name, old->credit_name) ||
+		!same_string(c.cgroup, old->cgroup) ||
+		!same_json(c.plugin_hosts, old->plugin_hosts))
+		logit(INFO, "Changes to threads, iothreads, max_output, coalesce, "
+			"process_groups, cgroup, plugin_hosts and credits need a restart");
+
+	sockopts_changed = c.reconnect_ivl != old->reconnect_ivl ||
+		c.reconnect_ivl_max != old->reconnect_ivl_max ||
+		c.heartbeat != old->heartbeat ||
+		c.heartbeat_timeout != old->heartbeat_timeout ||
+		!same_string(c.curve_public, old->curve_public) ||
+		!same_string(c.curve_private, old->curve_private) ||
+		!same_string(c.curve_server, old->curve_server);
+	apply_settings(&c);
+	publish_rules(r);
+
+	if(sockopts_changed || !same_json(c.jobs, old->jobs) ||
+		!same_json(c.publisher, old->publisher)) {
+		// The broker keeps track of jobs by connection, so swapping the
+		// socket would strand the jobs taken on the old one
+		if(credits > 0)
+			logit(INFO, "Job socket changes need a restart when taking jobs "
+				"with credits");
+		else if((sock = open_job_socket(&c)) != NULL) {
+			logit(INFO, "Job socket changed. Reconnecting");
+			zmq_close(pullsock);
+			pullsock = sock;
+			replace_job_socket(loop, sock);
+#if ZMQ_VERSION_MAJOR >= 3
+			setup_sockmonitor(loop, &pullmonio, pullsock);
+#endif
+		}
+	}
+	if(sockopts_changed || !same_json(c.results, old->results)) {
+		if((sock = open_result_socket(&c)) != NULL) {
+			logit(INFO, "Results socket changed. Reconnecting");
+			// Results already queued on the old socket still go out
+			zmq_close(pushsock);
+			pushsock = sock;
+#if ZMQ_VERSION_MAJOR >= 3
+			setup_sockmonitor(loop, &pushmonio, pushsock);
+#endif
+		}
+	}
+	if(sockopts_changed || !same_json(c.stats, old->stats)) {
+		stats_close(loop);
+		if(c.stats)
+			stats_open(loop, c.stats);
+	}
+
+	reload_thread(loop);
+	if(nworkers > 0)
+		reload_workers();
+	json_decref(old->root);
+	running_config = c;
+	logit(INFO, "Reloaded config");
+}
+
 void handle_end(struct ev_loop * loop, ev_signal * w, int revents) {
-	zmq_close(pullsock);
+	// Don't hold finished results back while the running jobs drain
+	flush_batch(loop);
+	// The broker needs to hear which jobs are still coming back, so the
+	// socket stays open until the end
+	if(credits > 0)
+		credit_stop(loop);
+	else
+		zmq_close(pullsock);
 	pullsock = NULL;
 	ev_io_stop(loop, &pullio);
 	ev_signal_stop(loop, w);
-	if(runningjobs == 0)
+	if(nworkers > 0) {
+		logit(INFO, "Exit signal received. Waiting for worker threads to finish");
+		stop_workers(loop);
+	} else if(runningjobs == 0)
 		ev_break(loop, EVBREAK_ALL);
 	else
 		logit(INFO, "Exit signal received. Waiting for %u jobs to finish", runningjobs);
@@ -411,14 +858,9 @@ int main(int argc, char ** argv) {
 	ev_signal termhandler, huphandler;
 	ev_child child_handler;
 	struct ev_loop * loop;
-	json_t * jobs = NULL, * results, *publisher = NULL;
-	int pullfd = -1, i, daemonize = 0, iothreads = 1, ch;
-	size_t pullfds = sizeof(pullfd);
-	json_t * config, *filter = NULL;
-	json_error_t config_err;
-	char *configobj = "executor", *tmprootpath = NULL,
-		*tmpunprivpath = NULL, *tmpunprivuser = NULL;
-	json_error_t jsonerr;
+	struct exec_config * c = &running_config;
+	struct job_rules * r;
+	int i, daemonize = 0, ch, threads;
 
 	while((ch = getopt(argc, argv, "vsdhc:")) != -1) {
 		switch(ch) {
@@ -453,54 +895,44 @@ int main(int argc, char ** argv) {
 		logit(ERR, "Must supply path to executor config!");
 		exit(1);
 	}
+	config_path = argv[0];
 
-	config = json_load_file(argv[0], JSON_DISABLE_EOF_CHECK, &config_err);
-	if(config == NULL) {
-		logit(ERR, "Error parsing config: %s: (line: %d column: %d)",
-			config_err.text, config_err.line, config_err.column);
+	arena_install();
+	get_defaults(&default_config);
+	if(read_config(c) != 0)
 		exit(1);
-	}
+	usesyslog = c->usesyslog;
 
 	if(daemonize && daemon(0, 0) < 0) {
 		logit(ERR, "Error daemonizing: %s", strerror(errno));
 		exit(1);
 	}
 
-#if ZMQ_VERSION_MAJOR < 4
-	if(json_unpack_ex(config, &jsonerr, 0,
-		"{s:{s?:o s:o s?i s?b s?b s?:o s?o s?s s?s s?s s?i s?i s?i s?i}}",
-		configobj, "jobs", &jobs, "results", &results,
-		"iothreads", &iothreads, "verbose", &verbose,
-		"syslog", &usesyslog, "filter", &filter,
-		"publisher", &publisher, "rootpath", &tmprootpath,
-		"unprivpath", &tmpunprivpath, "unprivuser", &tmpunprivuser,
-		"reconnect_ivl", &reconnect_ivl,
-		"reconnect_ivl_max", &reconnect_ivl_max,
-		"heartbeat", &config_heartbeat_interval) != 0) {
-		logit(ERR, "Error getting config %s", jsonerr.text);
+	if((r = build_rules(c)) == NULL)
 		exit(-1);
-	}
-#else
-	if(json_unpack_ex(config, &jsonerr, 0,
-		"{s:{s?:o s:o s?i s?b s?b s?:o s?o s?s s?s s?s s?{s:s s:s s:s} s?i s?i s?i s?i}}",
-		configobj, "jobs", &jobs, "results", &results,
-		"iothreads", &iothreads, "verbose", &verbose,
-		"syslog", &usesyslog, "filter", &filter,
-		"publisher", &publisher, "rootpath", &tmprootpath,
-		"unprivpath", &tmpunprivpath, "unprivuser", &tmpunprivuser,
-		"curve", "publickey", &curve_public, "privatekey", &curve_private,
-		"serverkey", &curve_server, "reconnect_ivl", &reconnect_ivl,
-		"reconnect_ivl_max", &reconnect_ivl_max,
-		"heartbeat", &config_heartbeat_interval,
-        "heartbeat_timeout", &config_heartbeat_timeout) != 0) {
-		logit(ERR, "Error getting config: %s", jsonerr.text);
+	publish_rules(r);
+	adopt_rules();
+	apply_settings(c);
+	if(c->max_output > 0)
+		max_output = c->max_output;
+	coalesce_checks = c->coalesce;
+	process_groups = c->process_groups;
+	credits = c->credits;
+	credit_heartbeat = c->credit_heartbeat;
+	credit_liveness = c->credit_liveness;
+	threads = c->threads;
+	if(parse_plugin_hosts(c->plugin_hosts) != 0)
 		exit(-1);
-	}
-#endif
-
-	parse_filter(filter,0);
 
 	gethostname(myfqdn, sizeof(myfqdn));
+	// Executors on one host need different names to get their own share
+	// of a shard device's keys, so the default includes the config object
+	if(c->credit_name)
+		credit_name = strdup(c->credit_name);
+	else {
+		credit_name = malloc(strlen(myfqdn) + strlen(configobj) + 2);
+		sprintf(credit_name, "%s:%s", myfqdn, configobj);
+	}
 	gethostname(mynodename, sizeof(mynodename));
 	for(i = 0; i < sizeof(mynodename); i++) {
 		if(mynodename[i] == '.') {
@@ -509,84 +941,49 @@ int main(int argc, char ** argv) {
 		}
 	}
 
-	if(tmprootpath) {
-		rootpath = strdup(tmprootpath);
-		rootpathlen = strlen(rootpath);
-	}
-
-	if(tmpunprivpath) {
-		unprivpath = strdup(tmpunprivpath);
-		unprivpathlen = strlen(unprivpath);
-	}
-
-	if(tmpunprivuser) {
-		struct passwd * pwdent = getpwnam(tmpunprivuser);
-		if(pwdent == NULL) {
-			logit(ERR, "Error looking up user %s: %d", tmpunprivuser, errno);
-			exit(-1);
-		}
-		runas = pwdent->pw_uid;
-	}
-
-#if ZMQ_VERSION_MAJOR > 3
-	if(curve_public)
-		curve_public = strdup(curve_public);
-	if(curve_private)
-		curve_private = strdup(curve_private);
-	if(curve_server)
-		curve_server = strdup(curve_server);
-#endif
+	if(c->cgroup)
+		cgroup_root = strdup(c->cgroup);
 
-	zmqctx = zmq_init(iothreads);
+	zmqctx = zmq_init(c->iothreads);
 	if(zmqctx == NULL)
 		exit(-1);
 
-	loop = ev_default_loop(0);
-
-	pushsock = zmq_socket(zmqctx, ZMQ_PUSH);
-	if(pushsock == NULL) {
-		logit(ERR, "Error creating results socket %d", errno);
-		exit(-1);
-	}
-	parse_sock_directive(pushsock, results, 0);
-	logit(DEBUG, "Setup worker push socket");
-
-	if(jobs) {
-		pullsock = zmq_socket(zmqctx, ZMQ_PULL);
-		if(pullsock == NULL) {
-			logit(ERR, "Error creating jobs socket %d", errno);
-			exit(-1);
-		}
-		parse_sock_directive(pullsock, jobs, 0);
-		logit(DEBUG, "Setup worker pull sock");
-	} else if(publisher) {
-		pullsock = zmq_socket(zmqctx, ZMQ_SUB);
-		if(pullsock == NULL) {
-			logit(ERR, "Error creating publisher socket %d", errno);
-			exit(-1);
-		}
-		parse_sock_directive(pullsock, publisher, 0);
-		logit(DEBUG, "Setup worker pull sock");
-	} else {
-		logit(ERR, "Must supply either a jobs or publisher socket for worker");
-		exit(-1);
-	}
+	// The default loop reaps every child on SIGCHLD, which would race
+	// with reaping through pidfds.
+	if((use_pidfd = pidfd_supported()))
+		loop = ev_loop_new(EVFLAG_AUTO);
+	else
+		loop = ev_default_loop(0);
+	logit(DEBUG, "Tracking children with %s",
+		use_pidfd ? "pidfds" : "SIGCHLD");
 
-	zmq_getsockopt(pullsock, ZMQ_FD, &pullfd, &pullfds);
-	if(pullfd == -1) {
-		logit(ERR, "Error getting fd for pullsock");
+	if((pushsock = open_result_socket(c)) == NULL ||
+		(pullsock = open_job_socket(c)) == NULL)
 		exit(-1);
-	}
-	ev_io_init(&pullio, recv_job_cb, pullfd, EV_READ);
-	pullio.data = pullsock;
-	ev_io_start(loop, &pullio);
 
 	ev_signal_init(&termhandler, handle_end, SIGTERM);
 	ev_signal_start(loop, &termhandler);
-	ev_signal_init(&huphandler, handle_end, SIGHUP);
+	ev_signal_init(&huphandler, reload_config, SIGHUP);
 	ev_signal_start(loop, &huphandler);
-	ev_child_init(&child_handler, child_end_cb, 0, 0);
-	ev_child_start(loop, &child_handler);
+	if(!use_pidfd) {
+		ev_child_init(&child_handler, child_end_cb, 0, 0);
+		ev_child_start(loop, &child_handler);
+	}
+
+	stats_thread_init(loop);
+	// Worker threads are started after the signal watchers so they
+	// inherit a mask that leaves signals to the main thread.
+	if(threads > 1 && !use_pidfd) {
+		logit(INFO, "Worker threads need pidfd support. Running one thread");
+		threads = 1;
+	}
+	if(threads > 1 && start_workers(loop, threads, c->plugin_hosts) != 0)
+		exit(-1);
+	start_job_loop(loop, pullsock);
+	if(credits > 0)
+		credit_start(loop, pullsock);
+	if(c->stats && stats_open(loop, c->stats) != 0)
+		exit(-1);
 
 #if ZMQ_VERSION_MAJOR >= 3
 	setup_sockmonitor(loop, &pullmonio, pullsock);
@@ -596,12 +993,32 @@ int main(int argc, char ** argv) {
 	logit(INFO, "Starting mqexec event loop");
 	ev_run(loop, 0);
 	logit(INFO, "mexec event loop terminated");
-
-	if(pullsock)
+	logit(INFO, "Check output: %lu buffers spilled, %lu reused, "
+		"%lu truncated, %lu bytes peak", output_stats.spills,
+		output_stats.reuses, output_stats.truncated,
+		(unsigned long)output_stats.peak_held);
+	flush_batch(loop);
+	stop_plugin_hosts(loop);
+	if(nworkers > 0)
+		join_workers(loop);
+	else
+		logit(INFO, "Ran %lu jobs and sent %lu results", jobs_received,
+			results_sent);
+	if(nworkers == 0 && coalesce_checks)
+		logit(INFO, "Coalesced %lu of %lu checks", coalesce_hits,
+			coalesce_hits + coalesce_misses);
+	if(nworkers == 0 && filter_cache_hits + filter_cache_misses > 0)
+		logit(INFO, "Filter cache hits/misses: %lu/%lu", filter_cache_hits,
+			filter_cache_misses);
+
+	stats_close(loop);
+	if(credits > 0)
+		credit_close(loop);
+	else if(pullsock)
 		zmq_close(pullsock);
 	zmq_close(pushsock);
 	zmq_term(zmqctx);
 
-	json_decref(config);
+	json_decref(c->root);
 	return 0;
 }
@@ -6,28 +6,63 @@
 #endif
 #include <zmq.h>
 #include <jansson.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <wordexp.h>
 #include "zmq3compat.h"
 
 #ifndef MAX_PLUGIN_OUTPUT_LENGTH
 #define MAX_PLUGIN_OUTPUT_LENGTH 8192
 #endif
+#define OUTPUT_INLINE_SIZE 256
+
+// When a job reached each stage, from stats_clock(). Stages a job didn't
+// get to are 0.
+struct job_times {
+	double received, parsed, filtered, started, spawned, first_output, exited;
+};
 
 // The child job structure (where all the good stuff happens)
 struct child_job {
 	json_t * input;
-	char buffer[MAX_PLUGIN_OUTPUT_LENGTH];
-	size_t bufused;
+	char * buffer;
+	size_t bufsize, bufused;
+	int truncated;
+	char inline_output[OUTPUT_INLINE_SIZE];
 	struct timeval start;
 	double latency;
 	int service;
 	int timeout;
 	pid_t pid;
+	int pidfd;
+	char * cgroup;
+	struct rusage rusage;
+	int have_rusage;
 	ev_io io;
+	ev_io exitio;
 	ev_timer timer;
 	struct child_job * next;
 	char * host_name;
 	char * service_description;
 	char * type;
+	char * command_line;
+	struct timeval server_start;
+	// Admission and queueing state
+	int priority;
+	int admitted;
+	int heap_index;
+	unsigned long seq;
+	ev_tstamp queued_at;
+	// Coalescing state: a running leader is in the leaders table and has
+	// the jobs waiting on its result chained off waiters.
+	int leader;
+	uint32_t command_hash;
+	struct child_job * waiters;
+	struct child_job * coalesce_next;
+	struct job_times times;
+	// The broker's id for the job when taking jobs with credits
+	uint64_t credit_id;
 };
 
 // Logging functions
@@ -37,15 +72,167 @@ struct child_job {
 void logit(int level, char * fmt, ...);
 
 // Filter functions
-int parse_filter(json_t * in, int or);
-int match_filter(json_t * input);
+struct filter;
+struct filter * compile_filter(json_t * in, int * err);
+void free_filter(struct filter * f);
+int match_filter(struct filter * f, json_t * input);
+extern __thread unsigned long filter_cache_hits, filter_cache_misses;
+
+// Reloadable job rules
+struct job_rules {
+	int refs;
+	struct filter * filter;
+	char * rootpath, *unprivpath;
+	size_t rootpathlen, unprivpathlen;
+	uid_t runas;
+};
+extern __thread struct job_rules * rules;
+struct job_rules * new_rules(struct filter * filter, const char * rootpath,
+	const char * unprivpath, uid_t runas);
+void release_rules(struct job_rules * r);
+void publish_rules(struct job_rules * r);
+void adopt_rules();
 
 // Kickoff functions
 void do_kickoff(struct ev_loop * loop, zmq_msg_t * inmsg);
+void start_job(struct ev_loop * loop, struct child_job * j);
+void mark_job_start(struct child_job * j);
+
+// cgroup v2 functions
+extern char * cgroup_root;
+int cgroup_create(struct child_job * j);
+void cgroup_kill(const char * leaf);
+void cgroup_release(struct ev_loop * loop, char * leaf);
+
+// Check coalescing functions
+extern int coalesce_checks;
+extern __thread unsigned long coalesce_hits, coalesce_misses;
+int coalesce_job(struct child_job * j);
+void add_leader(struct child_job * j);
+void finish_waiters(struct ev_loop * loop, struct child_job * j,
+	const char * output, int return_code, int early_timeout, int exited_ok);
+
+// Check output buffer functions
+struct output_stats {
+	size_t held;		// bytes in spilled buffers owned by running jobs
+	size_t pooled;		// bytes in idle buffers kept for reuse
+	size_t peak_held;
+	unsigned long spills, reuses, truncated;
+};
+extern __thread struct output_stats output_stats;
+extern size_t max_output;
+void output_init(struct child_job * j);
+void output_append(struct child_job * j, const char * data, size_t len);
+void output_release(struct child_job * j);
+
+// Admission control functions
+extern int max_running, max_running_per_host, max_running_per_command;
+extern int max_queued;
+void set_job_watcher(ev_io * io);
+void queue_job(struct ev_loop * loop, struct child_job * j);
+size_t queue_length();
+void job_done(struct ev_loop * loop, struct child_job * j);
+void admission_reload(struct ev_loop * loop);
+
+// Plugin host pool functions
+int parse_plugin_hosts(json_t * def);
+int submit_plugin_job(struct ev_loop * loop, struct child_job * j,
+	char ** argv, int timeout);
+void stop_plugin_hosts(struct ev_loop * loop);
+
+// Command line expansion cache
+extern size_t argv_cache_size;
+extern __thread unsigned long argv_cache_hits, argv_cache_misses;
+char ** get_argv(const char * command_line, int * err);
+int wordexp_locked(const char * words, wordexp_t * exp, int flags);
+void wordfree_locked(wordexp_t * exp);
+
+// jansson arena functions
+void arena_install();
+void arena_uninstall();
+void arena_begin();
+void arena_pause();
+void arena_reset();
+
+// Worker thread functions
+extern int nworkers;
+extern __thread int forwarding_jobs;
+int start_workers(struct ev_loop * loop, int count, json_t * plugin_hosts);
+void stop_workers(struct ev_loop * loop);
+void join_workers(struct ev_loop * loop);
+void forward_job(struct ev_loop * loop, zmq_msg_t * msg, uint64_t id);
+void start_job_loop(struct ev_loop * loop, void * sock);
+void reload_workers();
+void reload_thread(struct ev_loop * loop);
+
+// Credit-based job flow functions
+extern int credits, credit_heartbeat, credit_liveness;
+extern char * credit_name;
+extern __thread uint64_t credit_id;
+void credit_start(struct ev_loop * loop, void * sock);
+void credit_stop(struct ev_loop * loop);
+void credit_close(struct ev_loop * loop);
+void credit_done(uint64_t id);
+void credit_read_id(zmq_msg_t * msg);
 
 // Child management functions
-void add_child(struct child_job * job);
-struct child_job * get_child(pid_t pid);
+extern int use_pidfd, process_groups, kill_grace;
+int pidfd_supported();
+int watch_child(struct ev_loop * loop, struct child_job * j);
+int kill_child(struct ev_loop * loop, struct child_job * j);
+void child_exited(struct ev_loop * loop, struct child_job * j, int status);
+
+// Stats functions
+enum stats_stage {
+	STAGE_PARSE, STAGE_FILTER, STAGE_QUEUE, STAGE_SPAWN, STAGE_FIRST_OUTPUT,
+	STAGE_RUN, STAGE_RESULT, STAGE_TOTAL, STAGE_LATENCY, STATS_NSTAGES
+};
+#define HIST_SUB_BITS 5
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+// Values are in microseconds and top out at about 19 hours
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+struct histogram {
+	uint64_t count, total, min, max;
+	uint64_t counts[HIST_BUCKETS];
+};
+struct thread_stats {
+	int id;
+	// Gauges
+	unsigned long running, queued;
+	// Counters
+	unsigned long received, parse_errors, filtered, timed_out;
+	unsigned long spawn_failures, send_retries, results;
+	struct histogram stages[STATS_NSTAGES];
+	struct thread_stats * next;
+};
+extern __thread struct thread_stats * thread_stats;
+double stats_clock();
+void stats_thread_init(struct ev_loop * loop);
+void stats_record(int stage, double seconds);
+void stats_job_finished(struct child_job * j);
+json_t * stats_snapshot();
+int stats_open(struct ev_loop * loop, json_t * def);
+void stats_close(struct ev_loop * loop);
+
+// Result serializer functions
+struct resultbuf {
+	char * data;
+	size_t len, size;
+};
+void rb_append(struct resultbuf * rb, const char * data, size_t len);
+void rb_append_string(struct resultbuf * rb, const char * str, size_t len);
+void rb_append_key(struct resultbuf * rb, const char * key, int first);
+void rb_append_int(struct resultbuf * rb, long long val);
+void rb_append_real(struct resultbuf * rb, double val);
+void rb_append_json(struct resultbuf * rb, json_t * val);
+void rb_append_timeval(struct resultbuf * rb, const char * key,
+	struct timeval * tv);
+
+// Result functions
+void obj_for_ending(struct ev_loop * loop, struct child_job * j,
+	const char * output, int return_code, int early_timeout, int exited_ok);
+void flush_batch(struct ev_loop * loop);
 
 // Socket setup functions
 void parse_sock_directive(void * socket, json_t * arg, int bind);
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// Check output starts in a small buffer inside the child_job. Output that
+// doesn't fit spills into power-of-two buffers, or a buffer of exactly
+// max_output bytes once it gets that big, that are kept on per-size free
+// lists when the job ends, up to OUTPUT_POOL_RETAIN idle bytes in total.
+// Output past max_output is read and thrown away so the plugin isn't
+// blocked writing to a full pipe.
+
+#define OUTPUT_MIN_CLASS 9	// 512 bytes
+#define OUTPUT_MAX_CLASS 24	// 16 MB
+#define OUTPUT_POOL_RETAIN (4 * 1024 * 1024)
+
+struct free_buf {
+	struct free_buf * next;
+};
+
+// The pools and stats belong to the worker thread using them
+static __thread struct free_buf * freelists[OUTPUT_MAX_CLASS + 1];
+static __thread struct free_buf * capped;
+size_t max_output = MAX_PLUGIN_OUTPUT_LENGTH;
+__thread struct output_stats output_stats;
+
+static int size_class(size_t size) {
+	int c = OUTPUT_MIN_CLASS;
+	while(((size_t)1 << c) < size)
+		c++;
+	return c;
+}
+
+static struct free_buf ** freelist_for(size_t size) {
+	if(size == max_output + 1)
+		return &capped;
+	if(size >= ((size_t)1 << OUTPUT_MIN_CLASS) &&
+		size <= ((size_t)1 << OUTPUT_MAX_CLASS) && (size & (size - 1)) == 0)
+		return &freelists[size_class(size)];
+	return NULL;
+}
+
+static char * get_buf(size_t size) {
+	struct free_buf ** list = freelist_for(size), *b;
+
+	if(list && (b = *list) != NULL) {
+		*list = b->next;
+		output_stats.pooled -= size;
+		output_stats.reuses++;
+		return (char*)b;
+	}
+	return malloc(size);
+}
+
+static void put_buf(char * buf, size_t size) {
+	struct free_buf ** list = freelist_for(size), *b;
+
+	if(list && output_stats.pooled + size <= OUTPUT_POOL_RETAIN) {
+		b = (struct free_buf*)buf;
+		b->next = *list;
+		*list = b;
+		output_stats.pooled += size;
+		return;
+	}
+	free(buf);
+}
+
+void output_init(struct child_job * j) {
+	j->buffer = j->inline_output;
+	j->bufsize = sizeof(j->inline_output);
+	j->bufused = 0;
+	j->buffer[0] = '\0';
+}
+
+// Makes room for at least one more byte of output, up to max_output.
+// Returns the free space in the buffer.
+static size_t output_reserve(struct child_job * j, size_t want) {
+	size_t room = j->bufsize - j->bufused - 1, limit, newsize;
+	char * newbuf;
+
+	if(j->bufused >= max_output)
+		return 0;
+	limit = max_output - j->bufused;
+	if(room > 0)
+		return room < limit ? room : limit;
+
+	newsize = (size_t)1 << size_class(j->bufused + want + 1);
+	if(newsize > max_output + 1)
+		newsize = max_output + 1;
+	if((newbuf = get_buf(newsize)) == NULL)
+		return 0;
+	memcpy(newbuf, j->buffer, j->bufused + 1);
+	if(j->buffer != j->inline_output) {
+		output_stats.held -= j->bufsize;
+		put_buf(j->buffer, j->bufsize);
+	} else
+		output_stats.spills++;
+	output_stats.held += newsize;
+	if(output_stats.held > output_stats.peak_held)
+		output_stats.peak_held = output_stats.held;
+	j->buffer = newbuf;
+	j->bufsize = newsize;
+	room = newsize - j->bufused - 1;
+	return room < limit ? room : limit;
+}
+
+void output_append(struct child_job * j, const char * data, size_t len) {
+	if(j->times.first_output == 0 && len > 0)
+		j->times.first_output = stats_clock();
+	while(len > 0) {
+		size_t room = output_reserve(j, len);
+		if(room == 0) {
+			if(!j->truncated)
+				output_stats.truncated++;
+			j->truncated = 1;
+			return;
+		}
+		if(room > len)
+			room = len;
+		memcpy(j->buffer + j->bufused, data, room);
+		j->bufused += room;
+		j->buffer[j->bufused] = '\0';
+		data += room;
+		len -= room;
+	}
+}
+
+void output_release(struct child_job * j) {
+	if(j->buffer && j->buffer != j->inline_output) {
+		output_stats.held -= j->bufsize;
+		put_buf(j->buffer, j->bufsize);
+	}
+	j->buffer = NULL;
+}
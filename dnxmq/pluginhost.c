@@ -0,0 +1,532 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <time.h>
+#include <wordexp.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mqexec.h"
+
+extern __thread uint32_t runningjobs;
+extern __thread void * pullsock;
+extern char ** environ;
+
+// Jobs whose executable starts with a pool's prefix are handed to one of
+// the pool's long-running host processes instead of being spawned. Each
+// host runs one job at a time, talking over its stdin and stdout:
+//
+//   mqexec -> host: "JOB <id> <timeout> <length>\n" followed by <length>
+//                   bytes of arguments, each terminated by a NUL
+//   host -> mqexec: "RESULT <id> <return code> <length>\n" followed by
+//                   <length> bytes of plugin output
+//
+// A host that exits, answers garbage, or runs past a job's timeout is
+// killed and started again for the next job. A pool whose hosts keep
+// dying is disabled and its jobs are spawned normally. Jobs that run as
+// the jail's unprivileged user never go to a host. A host's stdin is
+// non-blocking and written from the event loop, so a host that's slow to
+// read a job doesn't hold up the rest of the thread.
+
+#define HOST_RESTART_LIMIT 5
+#define HOST_RESTART_WINDOW 60
+#define HOST_HEADER_MAX 128
+// How long hosts get to exit after their stdin is closed on shutdown
+#define HOST_STOP_GRACE 1.0
+
+struct plugin_pool;
+
+struct pool_job {
+	struct child_job * j;
+	struct plugin_pool * pool;
+	struct plugin_host * host;
+	unsigned long id;
+	char * frame;
+	size_t framelen;
+	ev_timer timer;
+	struct pool_job * next;
+};
+
+struct plugin_host {
+	struct plugin_pool * pool;
+	pid_t pid;
+	int tohost, fromhost;
+	ev_io io, wio;
+	struct pool_job * job;
+	// How much of the job's frame has been written to the host
+	size_t written;
+	unsigned long jobid;
+	// The header line is collected in hdr, then the body goes straight
+	// into the job's output buffer.
+	char hdr[HOST_HEADER_MAX];
+	size_t hdrused, remaining;
+	int in_body, code;
+};
+
+struct plugin_pool {
+	char * prefix;
+	size_t prefixlen;
+	wordexp_t command;
+	int size;
+	struct plugin_host * hosts;
+	struct pool_job * queue, *queuetail;
+	time_t window_start;
+	int restarts;
+	int disabled;
+	struct plugin_pool * next;
+};
+
+// Each worker thread runs its own hosts
+static __thread struct plugin_pool * pools = NULL;
+static __thread unsigned long next_jobid = 1;
+
+static void dispatch(struct ev_loop * loop, struct plugin_pool * pool);
+
+static void finish_job(struct ev_loop * loop, struct pool_job * pj,
+	const char * output, int return_code, int early_timeout, int exited_ok) {
+	struct child_job * j = pj->j;
+
+	ev_timer_stop(loop, &pj->timer);
+	if(j->times.spawned > 0)
+		j->times.exited = stats_clock();
+	if(j->service >= 0)
+		obj_for_ending(loop, j, output, return_code, early_timeout, exited_ok);
+	else
+		logit(DEBUG, "Non-check plugin host job ended with %d. It said \"%s\"",
+			return_code, output);
+	job_done(loop, j);
+	free(pj->frame);
+	free(pj);
+	if(--runningjobs == 0 && !pullsock)
+		ev_break(loop, EVBREAK_ALL);
+}
+
+static void stop_host(struct ev_loop * loop, struct plugin_host * h) {
+	if(h->pid == 0)
+		return;
+	ev_io_stop(loop, &h->io);
+	ev_io_stop(loop, &h->wio);
+	close(h->tohost);
+	close(h->fromhost);
+	// Hosts aren't tracked as children, so they're reaped here
+	kill(h->pid, SIGKILL);
+	while(waitpid(h->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	h->pid = 0;
+	h->hdrused = 0;
+	h->in_body = 0;
+}
+
+static void host_io_cb(struct ev_loop * loop, ev_io * i, int event);
+static void host_write_cb(struct ev_loop * loop, ev_io * i, int event);
+
+// Hosts start with no signals blocked, like spawned checks, since worker
+// threads block the ones the main thread handles.
+static int start_host(struct ev_loop * loop, struct plugin_host * h) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t nomask;
+	int to[2], from[2], rc;
+
+	if(pipe(to) < 0)
+		return errno;
+	if(pipe(from) < 0) {
+		rc = errno;
+		close(to[0]);
+		close(to[1]);
+		return rc;
+	}
+	fcntl(to[1], F_SETFD, FD_CLOEXEC);
+	fcntl(to[1], F_SETFL, O_NONBLOCK);
+	fcntl(from[0], F_SETFD, FD_CLOEXEC);
+	fcntl(from[0], F_SETFL, O_NONBLOCK);
+
+	sigemptyset(&nomask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &nomask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, to[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, from[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&actions, to[0]);
+	posix_spawn_file_actions_addclose(&actions, from[1]);
+	rc = posix_spawn(&h->pid, h->pool->command.we_wordv[0], &actions, &attr,
+		h->pool->command.we_wordv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(to[0]);
+	close(from[1]);
+	if(rc != 0) {
+		h->pid = 0;
+		close(to[1]);
+		close(from[0]);
+		return rc;
+	}
+
+	h->tohost = to[1];
+	h->fromhost = from[0];
+	h->hdrused = 0;
+	h->in_body = 0;
+	ev_io_init(&h->io, host_io_cb, h->fromhost, EV_READ);
+	h->io.data = h;
+	ev_io_start(loop, &h->io);
+	ev_io_init(&h->wio, host_write_cb, h->tohost, EV_WRITE);
+	h->wio.data = h;
+	logit(DEBUG, "Started plugin host %d for %s", h->pid, h->pool->prefix);
+	return 0;
+}
+
+// Kills a misbehaving host, fails its job, and disables the pool if its
+// hosts have died too often lately.
+static void host_failed(struct ev_loop * loop, struct plugin_host * h,
+	const char * why) {
+	struct plugin_pool * pool = h->pool;
+	struct pool_job * pj = h->job;
+	time_t now = time(NULL);
+
+	logit(ERR, "Plugin host %d for %s failed: %s", h->pid, pool->prefix, why);
+	stop_host(loop, h);
+	h->job = NULL;
+	if(pj)
+		finish_job(loop, pj, why, 3, 0, 0);
+
+	if(now - pool->window_start > HOST_RESTART_WINDOW) {
+		pool->window_start = now;
+		pool->restarts = 0;
+	}
+	if(++pool->restarts > HOST_RESTART_LIMIT && !pool->disabled) {
+		logit(ERR, "Plugin hosts for %s failed %d times in %d seconds. "
+			"Spawning its jobs directly instead", pool->prefix,
+			pool->restarts, HOST_RESTART_WINDOW);
+		pool->disabled = 1;
+		// The jobs that were waiting for a host go back through
+		// start_job, which spawns them now the pool is disabled
+		while((pj = pool->queue) != NULL) {
+			struct child_job * j = pj->j;
+			pool->queue = pj->next;
+			ev_timer_stop(loop, &pj->timer);
+			free(pj->frame);
+			free(pj);
+			runningjobs--;
+			start_job(loop, j);
+		}
+		pool->queuetail = NULL;
+		if(runningjobs == 0 && !pullsock)
+			ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+// Writes as much of the current job as the pipe takes, and waits for it
+// to be writable again if there's more
+static void write_job(struct ev_loop * loop, struct plugin_host * h) {
+	struct pool_job * pj = h->job;
+
+	while(h->written < pj->framelen) {
+		ssize_t w = write(h->tohost, pj->frame + h->written,
+			pj->framelen - h->written);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN) {
+				ev_io_start(loop, &h->wio);
+				return;
+			}
+			host_failed(loop, h, "Error sending job to plugin host");
+			return;
+		}
+		h->written += w;
+	}
+	ev_io_stop(loop, &h->wio);
+}
+
+static void host_write_cb(struct ev_loop * loop, ev_io * i, int event) {
+	struct plugin_host * h = i->data;
+
+	if(h->job == NULL) {
+		ev_io_stop(loop, i);
+		return;
+	}
+	write_job(loop, h);
+}
+
+static void send_job(struct ev_loop * loop, struct plugin_host * h,
+	struct pool_job * pj) {
+	int rc;
+
+	if(h->pid == 0 && (rc = start_host(loop, h)) != 0) {
+		logit(ERR, "Error starting plugin host for %s: %s",
+			h->pool->prefix, strerror(rc));
+		h->job = pj;
+		host_failed(loop, h, "Error starting plugin host");
+		return;
+	}
+
+	h->job = pj;
+	pj->host = h;
+	h->jobid = pj->id;
+	h->written = 0;
+	write_job(loop, h);
+}
+
+static void dispatch(struct ev_loop * loop, struct plugin_pool * pool) {
+	int i;
+
+	for(i = 0; i < pool->size && pool->queue && !pool->disabled; i++) {
+		struct plugin_host * h = &pool->hosts[i];
+		struct pool_job * pj;
+
+		if(h->job)
+			continue;
+		pj = pool->queue;
+		pool->queue = pj->next;
+		if(!pool->queue)
+			pool->queuetail = NULL;
+		pj->next = NULL;
+		send_job(loop, h, pj);
+	}
+}
+
+static void host_io_cb(struct ev_loop * loop, ev_io * i, int event) {
+	struct plugin_host * h = i->data;
+	char chunk[4096], *p;
+	unsigned long id;
+	int hdrlen = 0;
+	size_t len;
+	ssize_t r;
+
+	r = read(h->fromhost, chunk, sizeof(chunk));
+	if(r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(r <= 0) {
+		host_failed(loop, h, "Plugin host exited");
+		return;
+	}
+
+	p = chunk;
+	if(!h->in_body) {
+		char * nl = memchr(p, '\n', r);
+		len = nl ? nl - p : r;
+		if(h->hdrused + len >= sizeof(h->hdr)) {
+			host_failed(loop, h, "Invalid response from plugin host");
+			return;
+		}
+		memcpy(h->hdr + h->hdrused, p, len);
+		h->hdrused += len;
+		if(nl == NULL)
+			return;
+		h->hdr[h->hdrused] = '\0';
+		if(sscanf(h->hdr, "RESULT %lu %d %zu%n", &id, &h->code, &len,
+			&hdrlen) != 3 || hdrlen != h->hdrused || h->job == NULL ||
+			id != h->jobid) {
+			host_failed(loop, h, "Invalid response from plugin host");
+			return;
+		}
+		h->in_body = 1;
+		h->remaining = len;
+		r -= (nl + 1) - p;
+		p = nl + 1;
+	}
+
+	// Hosts answer one job at a time, so nothing should follow the body
+	if(r > h->remaining) {
+		host_failed(loop, h, "Invalid response from plugin host");
+		return;
+	}
+	output_append(h->job->j, p, r);
+	h->remaining -= r;
+	if(h->remaining > 0)
+		return;
+
+	struct pool_job * pj = h->job;
+	h->job = NULL;
+	h->hdrused = 0;
+	h->in_body = 0;
+	finish_job(loop, pj, pj->j->buffer, h->code, 0, 1);
+	dispatch(loop, h->pool);
+}
+
+static void pool_timeout_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	struct pool_job * pj = t->data, **link;
+	struct plugin_pool * pool = pj->pool;
+
+	if(pj->host) {
+		struct plugin_host * h = pj->host;
+		logit(DEBUG, "Plugin host %d timed out. Restarting it", h->pid);
+		stop_host(loop, h);
+		h->job = NULL;
+	} else {
+		struct pool_job * prev = NULL;
+		for(link = &pool->queue; *link != pj; link = &(*link)->next)
+			prev = *link;
+		*link = pj->next;
+		if(pool->queuetail == pj)
+			pool->queuetail = prev;
+	}
+	finish_job(loop, pj, "Check timed out", 3, 1, 1);
+	dispatch(loop, pool);
+}
+
+// Returns 1 if the job was taken by a plugin host pool, 0 if it should be
+// spawned as usual.
+int submit_plugin_job(struct ev_loop * loop, struct child_job * j,
+	char ** argv, int timeout) {
+	struct plugin_pool * pool;
+	struct pool_job * pj;
+	size_t arglen = 0, off;
+	int i;
+
+	for(pool = pools; pool != NULL; pool = pool->next) {
+		if(!pool->disabled &&
+			strncmp(argv[0], pool->prefix, pool->prefixlen) == 0)
+			break;
+	}
+	if(pool == NULL)
+		return 0;
+
+	for(i = 0; argv[i]; i++)
+		arglen += strlen(argv[i]) + 1;
+
+	pj = calloc(1, sizeof(struct pool_job));
+	pj->frame = malloc(HOST_HEADER_MAX + arglen);
+	if(pj->frame == NULL) {
+		free(pj);
+		return 0;
+	}
+	pj->id = next_jobid++;
+	off = snprintf(pj->frame, HOST_HEADER_MAX, "JOB %lu %d %lu\n",
+		pj->id, timeout, (unsigned long)arglen);
+	for(i = 0; argv[i]; i++) {
+		size_t len = strlen(argv[i]) + 1;
+		memcpy(pj->frame + off, argv[i], len);
+		off += len;
+	}
+	pj->framelen = off;
+	pj->j = j;
+	pj->pool = pool;
+
+	ev_init(&pj->timer, pool_timeout_cb);
+	pj->timer.data = pj;
+	if(timeout > 0) {
+		ev_timer_set(&pj->timer, timeout, 0);
+		ev_timer_start(loop, &pj->timer);
+		j->timeout = timeout;
+	}
+
+	// The job counts as running from here on, since dispatching it can
+	// finish it straight away if its host fails to start
+	j->times.spawned = stats_clock();
+	logit(DEBUG, "Handed %s %s to a plugin host", j->host_name,
+		j->service_description);
+	runningjobs++;
+
+	if(pool->queuetail)
+		pool->queuetail->next = pj;
+	else
+		pool->queue = pj;
+	pool->queuetail = pj;
+	dispatch(loop, pool);
+	return 1;
+}
+
+int parse_plugin_hosts(json_t * def) {
+	size_t i;
+	json_t * el;
+
+	if(def == NULL)
+		return 0;
+
+	json_array_foreach(def, i, el) {
+		char * prefix, *command;
+		int processes = 1, rc;
+		json_error_t err;
+		struct plugin_pool * pool;
+
+		if(json_unpack_ex(el, &err, 0, "{s:s s:s s?i}",
+			"prefix", &prefix, "command", &command,
+			"processes", &processes) != 0) {
+			logit(ERR, "Error parsing plugin host config: %s", err.text);
+			return -1;
+		}
+
+		pool = calloc(1, sizeof(struct plugin_pool));
+		if((rc = wordexp_locked(command, &pool->command, WRDE_NOCMD)) != 0 ||
+			pool->command.we_wordc == 0) {
+			logit(ERR, "Error parsing plugin host command %s", command);
+			free(pool);
+			return -1;
+		}
+		pool->prefix = strdup(prefix);
+		pool->prefixlen = strlen(prefix);
+		pool->size = processes > 0 ? processes : 1;
+		pool->hosts = calloc(pool->size, sizeof(struct plugin_host));
+		for(rc = 0; rc < pool->size; rc++)
+			pool->hosts[rc].pool = pool;
+		pool->next = pools;
+		pools = pool;
+		logit(DEBUG, "Running %s* with %d copies of %s", pool->prefix,
+			pool->size, command);
+	}
+
+	// A host that dies mid-write shouldn't take mqexec with it
+	if(pools)
+		signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+// Waits for a host that's been told to exit, and kills it if it takes
+// longer than until. A host the SIGCHLD watcher reaped first is already
+// gone.
+static void reap_host(pid_t pid, ev_tstamp until) {
+	struct timespec nap = { 0, 10000000 };
+	pid_t rc;
+
+	for(;;) {
+		if((rc = waitpid(pid, NULL, WNOHANG)) < 0 && errno == EINTR)
+			continue;
+		if(rc != 0 || ev_time() >= until)
+			break;
+		nanosleep(&nap, NULL);
+	}
+	if(rc != 0)
+		return;
+	logit(DEBUG, "Plugin host %d didn't exit. Killing it", pid);
+	kill(pid, SIGKILL);
+	while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		;
+}
+
+// Closing their stdin tells the hosts to exit. They're all told first,
+// then reaped, so they shut down together.
+void stop_plugin_hosts(struct ev_loop * loop) {
+	struct plugin_pool * pool;
+	ev_tstamp until = ev_time() + HOST_STOP_GRACE;
+	int i;
+
+	for(pool = pools; pool != NULL; pool = pool->next) {
+		for(i = 0; i < pool->size; i++) {
+			struct plugin_host * h = &pool->hosts[i];
+			if(h->pid == 0)
+				continue;
+			ev_io_stop(loop, &h->io);
+			ev_io_stop(loop, &h->wio);
+			close(h->tohost);
+			close(h->fromhost);
+		}
+	}
+	for(pool = pools; pool != NULL; pool = pool->next) {
+		for(i = 0; i < pool->size; i++) {
+			struct plugin_host * h = &pool->hosts[i];
+			if(h->pid == 0)
+				continue;
+			reap_host(h->pid, until);
+			h->pid = 0;
+		}
+	}
+}
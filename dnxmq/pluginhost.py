@@ -0,0 +1,55 @@
+# A sample mqexec plugin host that runs Python plugins inside one
+# long-lived interpreter instead of starting a new one for every check.
+# Configure it in the executor config with something like:
+#
+#   "plugin_hosts": [ { "prefix": "/usr/lib/nagios/plugins/python/",
+#       "command": "/usr/bin/python /usr/lib/nagios/pluginhost.py",
+#       "processes": 4 } ]
+#
+# Plugins are run with runpy as if they were __main__; their exit status
+# is the check's return code and whatever they print is its output.
+import sys, io, runpy, traceback
+
+try:
+	stdin, stdout = sys.stdin.buffer, sys.stdout.buffer
+except AttributeError:
+	stdin, stdout = sys.stdin, sys.stdout
+
+def run_plugin(argv):
+	saved_argv, saved_stdout = sys.argv, sys.stdout
+	out = io.StringIO() if str is not bytes else io.BytesIO()
+	sys.argv, sys.stdout = argv, out
+	code = 0
+	try:
+		runpy.run_path(argv[0], run_name='__main__')
+	except SystemExit as e:
+		if e.code is None:
+			code = 0
+		elif isinstance(e.code, int):
+			code = e.code
+		else:
+			out.write(str(e.code))
+			code = 3
+	except Exception:
+		out.write(traceback.format_exc())
+		code = 3
+	finally:
+		sys.argv, sys.stdout = saved_argv, saved_stdout
+	output = out.getvalue()
+	if not isinstance(output, bytes):
+		output = output.encode('utf-8', 'replace')
+	return code, output
+
+while True:
+	header = stdin.readline()
+	if not header:
+		break
+	verb, jobid, timeout, length = header.split()
+	args = stdin.read(int(length)).split(b'\0')[:-1]
+	if str is not bytes:
+		args = [ a.decode('utf-8', 'replace') for a in args ]
+	code, output = run_plugin(args)
+	stdout.write(('RESULT %d %d %d\n' % (int(jobid), code,
+		len(output))).encode())
+	stdout.write(output)
+	stdout.flush()
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// Results are written as JSON text straight into a growable buffer instead
+// of being built as a jansson object and dumped. Strings are escaped as
+// they're copied in, and bytes that aren't valid UTF-8 are replaced with
+// U+FFFD so the receiving end can always parse what we send.
+
+static void rb_reserve(struct resultbuf * rb, size_t len) {
+	size_t newsize = rb->size ? rb->size : 512;
+
+	if(rb->len + len <= rb->size)
+		return;
+	while(newsize < rb->len + len)
+		newsize *= 2;
+	rb->data = realloc(rb->data, newsize);
+	rb->size = newsize;
+}
+
+void rb_append(struct resultbuf * rb, const char * data, size_t len) {
+	rb_reserve(rb, len);
+	memcpy(rb->data + rb->len, data, len);
+	rb->len += len;
+}
+
+// Returns the length of the UTF-8 sequence at s, or 0 if it's invalid
+static size_t utf8_len(const unsigned char * s, size_t avail) {
+	size_t n, i;
+	uint32_t cp;
+
+	if(s[0] < 0xC2)
+		return 0;
+	else if(s[0] < 0xE0) {
+		n = 2;
+		cp = s[0] & 0x1F;
+	} else if(s[0] < 0xF0) {
+		n = 3;
+		cp = s[0] & 0x0F;
+	} else if(s[0] < 0xF5) {
+		n = 4;
+		cp = s[0] & 0x07;
+	} else
+		return 0;
+	if(n > avail)
+		return 0;
+	for(i = 1; i < n; i++) {
+		if((s[i] & 0xC0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+	if((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+		(cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+		return 0;
+	return n;
+}
+
+void rb_append_string(struct resultbuf * rb, const char * str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char * s = (const unsigned char *)str, *end = s + len;
+	char * out;
+
+	// At worst every byte becomes a six byte escape
+	rb_reserve(rb, (len * 6) + 2);
+	out = rb->data + rb->len;
+	*out++ = '"';
+	while(s < end) {
+		const unsigned char * run = s;
+		size_t n;
+
+		while(s < end && *s >= 0x20 && *s < 0x80 && *s != '"' && *s != '\\')
+			s++;
+		memcpy(out, run, s - run);
+		out += s - run;
+		if(s == end)
+			break;
+
+		if(*s >= 0x80) {
+			if((n = utf8_len(s, end - s)) > 0) {
+				memcpy(out, s, n);
+				out += n;
+				s += n;
+			} else {
+				memcpy(out, "\\ufffd", 6);
+				out += 6;
+				s++;
+			}
+			continue;
+		}
+
+		*out++ = '\\';
+		switch(*s) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '\n': *out++ = 'n'; break;
+			case '\r': *out++ = 'r'; break;
+			case '\t': *out++ = 't'; break;
+			case '\b': *out++ = 'b'; break;
+			case '\f': *out++ = 'f'; break;
+			default:
+				*out++ = 'u';
+				*out++ = '0';
+				*out++ = '0';
+				*out++ = hex[*s >> 4];
+				*out++ = hex[*s & 0xF];
+				break;
+		}
+		s++;
+	}
+	*out++ = '"';
+	rb->len = out - rb->data;
+}
+
+// Appends ,"key": (or just "key": for the first member of an object)
+void rb_append_key(struct resultbuf * rb, const char * key, int first) {
+	size_t len = strlen(key);
+
+	rb_reserve(rb, len + 4);
+	if(!first)
+		rb->data[rb->len++] = ',';
+	rb->data[rb->len++] = '"';
+	memcpy(rb->data + rb->len, key, len);
+	rb->len += len;
+	rb->data[rb->len++] = '"';
+	rb->data[rb->len++] = ':';
+}
+
+void rb_append_int(struct resultbuf * rb, long long val) {
+	rb_reserve(rb, 24);
+	rb->len += sprintf(rb->data + rb->len, "%lld", val);
+}
+
+// Reals always get a decimal point or exponent so they're read back as
+// reals, like jansson does.
+void rb_append_real(struct resultbuf * rb, double val) {
+	char * start;
+	int len;
+
+	// JSON has no nan or inf (a latency from a clock that jumped, say),
+	// and the whole result would be rejected, so they're sent as 0
+	if(!isfinite(val))
+		val = 0;
+	rb_reserve(rb, 32);
+	start = rb->data + rb->len;
+	len = sprintf(start, "%.17g", val);
+	if(strspn(start, "-0123456789") == (size_t)len) {
+		memcpy(start + len, ".0", 2);
+		len += 2;
+	}
+	rb->len += len;
+}
+
+void rb_append_json(struct resultbuf * rb, json_t * val) {
+	char * dumped;
+
+	switch(json_typeof(val)) {
+		case JSON_STRING:
+			rb_append_string(rb, json_string_value(val),
+				strlen(json_string_value(val)));
+			break;
+		case JSON_INTEGER:
+			rb_append_int(rb, json_integer_value(val));
+			break;
+		case JSON_REAL:
+			rb_append_real(rb, json_real_value(val));
+			break;
+		case JSON_TRUE:
+			rb_append(rb, "true", 4);
+			break;
+		case JSON_FALSE:
+			rb_append(rb, "false", 5);
+			break;
+		case JSON_NULL:
+			rb_append(rb, "null", 4);
+			break;
+		default:
+			dumped = json_dumps(val, JSON_COMPACT);
+			if(dumped) {
+				rb_append(rb, dumped, strlen(dumped));
+				free(dumped);
+			} else
+				rb_append(rb, "null", 4);
+			break;
+	}
+}
+
+void rb_append_timeval(struct resultbuf * rb, const char * key,
+	struct timeval * tv) {
+	rb_append_key(rb, key, 0);
+	rb_append(rb, "{\"tv_sec\":", 10);
+	rb_append_int(rb, tv->tv_sec);
+	rb_append(rb, ",\"tv_usec\":", 11);
+	rb_append_int(rb, tv->tv_usec);
+	rb_append(rb, "}", 1);
+}
@@ -0,0 +1,69 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// The filter and jail settings are read by every thread that runs jobs,
+// and are replaced as a whole when the config is reloaded. Each thread
+// holds a reference to the rules it's using and only switches between
+// jobs, when its loop calls adopt_rules, so a job is never checked
+// against half of one config and half of another. The last thread to let
+// go of old rules frees them.
+
+__thread struct job_rules * rules = NULL;
+
+static pthread_mutex_t rules_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct job_rules * current = NULL;
+
+struct job_rules * new_rules(struct filter * filter, const char * rootpath,
+	const char * unprivpath, uid_t runas) {
+	struct job_rules * r = calloc(1, sizeof(struct job_rules));
+
+	r->refs = 1;
+	r->filter = filter;
+	if(rootpath) {
+		r->rootpath = strdup(rootpath);
+		r->rootpathlen = strlen(rootpath);
+	}
+	if(unprivpath) {
+		r->unprivpath = strdup(unprivpath);
+		r->unprivpathlen = strlen(unprivpath);
+	}
+	r->runas = runas;
+	return r;
+}
+
+void release_rules(struct job_rules * r) {
+	if(r == NULL || __sync_sub_and_fetch(&r->refs, 1) > 0)
+		return;
+	free_filter(r->filter);
+	free(r->rootpath);
+	free(r->unprivpath);
+	free(r);
+}
+
+// Makes r the rules every thread should switch to, taking over the
+// caller's reference.
+void publish_rules(struct job_rules * r) {
+	struct job_rules * old;
+
+	pthread_mutex_lock(&rules_lock);
+	old = current;
+	current = r;
+	pthread_mutex_unlock(&rules_lock);
+	release_rules(old);
+}
+
+// Switches the calling thread to the latest rules
+void adopt_rules() {
+	struct job_rules * r;
+
+	pthread_mutex_lock(&rules_lock);
+	r = current;
+	__sync_add_and_fetch(&r->refs, 1);
+	pthread_mutex_unlock(&rules_lock);
+	release_rules(rules);
+	rules = r;
+}
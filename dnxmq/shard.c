@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqbroker.h"
+
+// A "shard" device sends every job with the same key to the same executor,
+// so checks for one host keep finding that executor's connections and
+// caches warm. The key is a field of the job's JSON body ("key", default
+// host_name), or with "topic_word" set, that word of the topic frame, which
+// saves parsing the body ("type host_name service" for NagMQ events, so 1
+// is the host name). Executors sit at "vnodes" points (default 160) on a
+// ring of hashes, placed by their name, and a key belongs to the first
+// executor point at or after its hash. An executor joining or leaving only
+// moves the keys between its points and the ones before them.
+
+#define DEFAULT_VNODES 160
+
+struct ring_point {
+	uint32_t hash;
+	void * owner;
+};
+
+struct shard {
+	struct ring_point * points;
+	size_t npoints, size;
+	int vnodes;
+	char * key;
+	int topic_word;
+};
+
+// FNV-1a with a final mix, since FNV alone spreads names that differ in
+// their last few characters poorly around the ring
+static uint32_t mix(uint32_t hash) {
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static uint32_t fnv(uint32_t hash, const void * data, size_t len) {
+	const uint8_t * p = data;
+	while(len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static uint32_t shard_hash(const char * key, size_t len) {
+	return mix(fnv(2166136261, key, len));
+}
+
+struct shard * shard_new(json_t * def, const char * name) {
+	struct shard * s;
+	const char * key = "host_name";
+	int vnodes = DEFAULT_VNODES, topic_word = -1;
+
+	if(json_unpack(def, "{s?s s?i s?i}", "key", &key,
+		"topic_word", &topic_word, "vnodes", &vnodes) != 0 || vnodes < 1) {
+		logit(ERR, "Invalid key, topic_word or vnodes for device %s", name);
+		return NULL;
+	}
+	s = calloc(1, sizeof(struct shard));
+	s->key = strdup(key);
+	s->vnodes = vnodes;
+	s->topic_word = topic_word;
+	return s;
+}
+
+void shard_free(struct shard * s) {
+	if(s == NULL)
+		return;
+	free(s->points);
+	free(s->key);
+	free(s);
+}
+
+static int point_cmp(const void * a, const void * b) {
+	const struct ring_point * pa = a, *pb = b;
+	if(pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return 0;
+}
+
+// Places an executor on the ring by its name
+void shard_add(struct shard * s, const char * name, size_t len, void * owner) {
+	uint32_t base = fnv(2166136261, name, len);
+	uint32_t i;
+
+	if(s->npoints + s->vnodes > s->size) {
+		s->size = s->npoints + s->vnodes;
+		s->points = realloc(s->points, sizeof(struct ring_point) * s->size);
+	}
+	for(i = 0; i < (uint32_t)s->vnodes; i++) {
+		s->points[s->npoints].hash = mix(fnv(base, &i, sizeof(i)));
+		s->points[s->npoints++].owner = owner;
+	}
+	qsort(s->points, s->npoints, sizeof(struct ring_point), point_cmp);
+}
+
+void shard_remove(struct shard * s, void * owner) {
+	size_t i, n = 0;
+
+	for(i = 0; i < s->npoints; i++) {
+		if(s->points[i].owner != owner)
+			s->points[n++] = s->points[i];
+	}
+	s->npoints = n;
+}
+
+int shard_empty(struct shard * s) {
+	return s->npoints == 0;
+}
+
+// The executor a key hash belongs to, or NULL if there aren't any
+void * shard_owner(struct shard * s, uint32_t hash) {
+	size_t lo = 0, hi = s->npoints;
+
+	if(s->npoints == 0)
+		return NULL;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(s->points[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return s->points[lo == s->npoints ? 0 : lo].owner;
+}
+
+// Hashes a job's key. Jobs without one all hash as an empty key, so they
+// still go to one executor rather than nowhere. Returns 0 for those.
+int shard_key(struct shard * s, zmq_msg_t * frames, int nframes,
+	uint32_t * hash) {
+	const char * data, *end, *space;
+	json_t * body, *value;
+	int word, found = 0;
+
+	*hash = shard_hash("", 0);
+	if(s->topic_word >= 0) {
+		if(nframes < 2)
+			return 0;
+		data = zmq_msg_data(&frames[0]);
+		end = data + zmq_msg_size(&frames[0]);
+		for(word = 0; word < s->topic_word && data < end; data++) {
+			if(*data == ' ')
+				word++;
+		}
+		if(data >= end)
+			return 0;
+		if((space = memchr(data, ' ', end - data)) != NULL)
+			end = space;
+		*hash = shard_hash(data, end - data);
+		return 1;
+	}
+
+	body = json_loadb(zmq_msg_data(&frames[nframes - 1]),
+		zmq_msg_size(&frames[nframes - 1]), 0, NULL);
+	if(body == NULL)
+		return 0;
+	value = json_object_get(body, s->key);
+	if(json_is_string(value)) {
+		*hash = shard_hash(json_string_value(value),
+			strlen(json_string_value(value)));
+		found = 1;
+	}
+	json_decref(body);
+	return found;
+}
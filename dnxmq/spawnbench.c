@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <wordexp.h>
+#include <sys/wait.h>
+#include "mqexec.h"
+
+// Measures how many checks per second can be started and reaped by
+// fork+wordexp (how mqexec used to run checks), by posix_spawn with a
+// wordexp per spawn, and by posix_spawn with the argv cache.
+//
+//   spawnbench [spawns] [ballast MB] [command line]
+//
+// The ballast is touched memory that makes this process look like a busy
+// mqexec, whose page tables fork has to copy.
+
+extern char ** environ;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+void logit(int level, char * fmt, ...) { }
+
+static void reap(pid_t pid) {
+	int status;
+	while(waitpid(pid, &status, 0) < 0)
+		;
+}
+
+static pid_t run_fork(const char * cmdline, int devnull) {
+	pid_t pid = fork();
+	if(pid == 0) {
+		wordexp_t expvec;
+		dup2(devnull, fileno(stdout));
+		dup2(devnull, fileno(stdin));
+		if(wordexp(cmdline, &expvec, WRDE_NOCMD) != 0)
+			exit(127);
+		execv(expvec.we_wordv[0], expvec.we_wordv);
+		exit(127);
+	}
+	return pid;
+}
+
+static pid_t spawn(char ** argv, int devnull) {
+	posix_spawn_file_actions_t actions;
+	pid_t pid = -1;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+		"/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, devnull, STDOUT_FILENO);
+	if(posix_spawn(&pid, argv[0], &actions, NULL, argv, environ) != 0)
+		pid = -1;
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
+}
+
+static pid_t run_spawn(const char * cmdline, int devnull) {
+	wordexp_t expvec;
+	pid_t pid;
+
+	if(wordexp(cmdline, &expvec, WRDE_NOCMD) != 0)
+		return -1;
+	pid = spawn(expvec.we_wordv, devnull);
+	wordfree(&expvec);
+	return pid;
+}
+
+static pid_t run_cached(const char * cmdline, int devnull) {
+	int err;
+	char ** argv = get_argv(cmdline, &err);
+	return argv ? spawn(argv, devnull) : -1;
+}
+
+static double run(pid_t (*fn)(const char*, int), const char * cmdline,
+	int devnull, long spawns) {
+	double start = now();
+	long i;
+
+	for(i = 0; i < spawns; i++) {
+		pid_t pid = fn(cmdline, devnull);
+		if(pid < 0) {
+			fprintf(stderr, "Error starting %s\n", cmdline);
+			exit(1);
+		}
+		reap(pid);
+	}
+	return spawns / (now() - start);
+}
+
+int main(int argc, char ** argv) {
+	long spawns = 2000, ballast = 256;
+	const char * cmdline = "/bin/true -H web01.example.com -w 2 -c 5";
+	int devnull = open("/dev/null", O_WRONLY);
+	char * mem;
+
+	if(argc > 1)
+		spawns = atol(argv[1]);
+	if(argc > 2)
+		ballast = atol(argv[2]);
+	if(argc > 3)
+		cmdline = argv[3];
+
+	mem = malloc(ballast * 1024 * 1024);
+	if(mem)
+		memset(mem, 1, ballast * 1024 * 1024);
+
+	double forked = run(run_fork, cmdline, devnull, spawns);
+	double spawned = run(run_spawn, cmdline, devnull, spawns);
+	double cached = run(run_cached, cmdline, devnull, spawns);
+
+	printf("%ld spawns of \"%s\" with %ld MB resident\n",
+		spawns, cmdline, ballast);
+	printf("fork+wordexp:        %.0f spawns/sec\n", forked);
+	printf("posix_spawn+wordexp: %.0f spawns/sec (%.2fx)\n",
+		spawned, spawned / forked);
+	printf("posix_spawn+cache:   %.0f spawns/sec (%.2fx)\n",
+		cached, cached / forked);
+	free(mem);
+	return 0;
+}
@@ -0,0 +1,281 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// Every thread that handles jobs keeps its own counters and a histogram of
+// how long jobs spend in each stage, so recording never takes a lock. The
+// histograms are log-linear, like HdrHistogram: each power of two of
+// microseconds is split into HIST_HALF buckets, which keeps every value
+// within about 3% for a few kilobytes per stage. With a "stats" socket
+// configured, the main thread answers each request on it with a JSON
+// snapshot summed over all threads. A snapshot is read while the threads
+// keep running, so counters in it can be a job or two apart.
+
+static const char * stage_names[STATS_NSTAGES] = {
+	"parse", "filter", "queue", "spawn", "first_output", "run", "result",
+	"total", "latency"
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats * registry = NULL;
+static int nthreads = 0;
+static double started_at;
+
+__thread struct thread_stats * thread_stats = NULL;
+static __thread ev_prepare gauge_watcher;
+
+extern __thread uint32_t runningjobs;
+extern void * zmqctx;
+
+static void * statsock = NULL;
+static ev_io statsio;
+
+double stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static int hist_index(uint64_t v) {
+	int shift;
+
+	if(v >= (1ULL << HIST_MAX_BITS))
+		v = (1ULL << HIST_MAX_BITS) - 1;
+	if(v < HIST_HALF * 2)
+		return v;
+	shift = (63 - __builtin_clzll(v)) - (HIST_SUB_BITS - 1);
+	return ((shift + 1) * HIST_HALF) + (int)((v >> shift) - HIST_HALF);
+}
+
+// The highest value that lands in bucket i
+static uint64_t hist_value(int i) {
+	int shift;
+
+	if(i < HIST_HALF * 2)
+		return i;
+	shift = (i / HIST_HALF) - 1;
+	return (((uint64_t)(i % HIST_HALF) + HIST_HALF + 1) << shift) - 1;
+}
+
+void stats_record(int stage, double seconds) {
+	struct histogram * h;
+	uint64_t usec;
+
+	if(seconds < 0)
+		return;
+	h = &thread_stats->stages[stage];
+	usec = (uint64_t)(seconds * 1000000.0);
+	if(h->count == 0 || usec < h->min)
+		h->min = usec;
+	if(usec > h->max)
+		h->max = usec;
+	h->count++;
+	h->total += usec;
+	h->counts[hist_index(usec)]++;
+}
+
+static void record_between(int stage, double from, double to) {
+	if(from > 0 && to > 0)
+		stats_record(stage, to - from);
+}
+
+// Records the stages a job went through once its result has been sent.
+// Jobs that never got as far as running only have some of them.
+void stats_job_finished(struct child_job * j) {
+	struct job_times * t = &j->times;
+	double now = stats_clock();
+
+	record_between(STAGE_QUEUE, t->filtered, t->started);
+	record_between(STAGE_SPAWN, t->started, t->spawned);
+	record_between(STAGE_FIRST_OUTPUT, t->spawned, t->first_output);
+	record_between(STAGE_RUN, t->spawned, t->exited);
+	record_between(STAGE_RESULT, t->exited, now);
+	record_between(STAGE_TOTAL, t->received, now);
+	if(t->started > 0)
+		stats_record(STAGE_LATENCY, j->latency);
+	thread_stats->results++;
+}
+
+static void gauge_cb(struct ev_loop * loop, ev_prepare * p, int event) {
+	thread_stats->running = runningjobs;
+	thread_stats->queued = queue_length();
+}
+
+// Sets up the calling thread's stats. The gauges are brought up to date
+// whenever the thread's loop is about to wait.
+void stats_thread_init(struct ev_loop * loop) {
+	struct thread_stats * s = calloc(1, sizeof(struct thread_stats));
+
+	pthread_mutex_lock(&registry_lock);
+	if(registry == NULL)
+		started_at = stats_clock();
+	s->id = nthreads++;
+	s->next = registry;
+	registry = s;
+	pthread_mutex_unlock(&registry_lock);
+	thread_stats = s;
+
+	ev_prepare_init(&gauge_watcher, gauge_cb);
+	ev_prepare_start(loop, &gauge_watcher);
+}
+
+static json_t * counters_json(struct thread_stats * s) {
+	return json_pack("{s:I s:I s:I s:I s:I s:I s:I s:I s:I}",
+		"running", (json_int_t)s->running, "queued", (json_int_t)s->queued,
+		"received", (json_int_t)s->received,
+		"parse_errors", (json_int_t)s->parse_errors,
+		"filtered", (json_int_t)s->filtered,
+		"timed_out", (json_int_t)s->timed_out,
+		"spawn_failures", (json_int_t)s->spawn_failures,
+		"send_retries", (json_int_t)s->send_retries,
+		"results", (json_int_t)s->results);
+}
+
+static double hist_percentile(struct histogram * h, double pct) {
+	double rank = (pct / 100.0) * h->count;
+	uint64_t want = (uint64_t)rank, seen = 0, val;
+	int i;
+
+	if(want < rank || want == 0)
+		want++;
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		if((seen += h->counts[i]) >= want)
+			break;
+	}
+	val = i < HIST_BUCKETS ? hist_value(i) : h->max;
+	if(val > h->max)
+		val = h->max;
+	return val / 1000000.0;
+}
+
+static json_t * histogram_json(struct histogram * h) {
+	if(h->count == 0)
+		return json_pack("{s:i}", "count", 0);
+	return json_pack("{s:I s:f s:f s:f s:f s:f s:f s:f}",
+		"count", (json_int_t)h->count,
+		"mean", (h->total / (double)h->count) / 1000000.0,
+		"min", h->min / 1000000.0, "max", h->max / 1000000.0,
+		"p50", hist_percentile(h, 50), "p90", hist_percentile(h, 90),
+		"p99", hist_percentile(h, 99), "p999", hist_percentile(h, 99.9));
+}
+
+static void add_histogram(struct histogram * sum, struct histogram * h) {
+	int i;
+
+	if(h->count == 0)
+		return;
+	if(sum->count == 0 || h->min < sum->min)
+		sum->min = h->min;
+	if(h->max > sum->max)
+		sum->max = h->max;
+	sum->count += h->count;
+	sum->total += h->total;
+	for(i = 0; i < HIST_BUCKETS; i++)
+		sum->counts[i] += h->counts[i];
+}
+
+json_t * stats_snapshot() {
+	struct thread_stats * sum = calloc(1, sizeof(struct thread_stats)), *s;
+	json_t * ret, *stages = json_object(), *threads = json_array();
+	int i;
+
+	pthread_mutex_lock(&registry_lock);
+	for(s = registry; s != NULL; s = s->next) {
+		json_t * counters = counters_json(s);
+		sum->running += s->running;
+		sum->queued += s->queued;
+		sum->received += s->received;
+		sum->parse_errors += s->parse_errors;
+		sum->filtered += s->filtered;
+		sum->timed_out += s->timed_out;
+		sum->spawn_failures += s->spawn_failures;
+		sum->send_retries += s->send_retries;
+		sum->results += s->results;
+		for(i = 0; i < STATS_NSTAGES; i++)
+			add_histogram(&sum->stages[i], &s->stages[i]);
+		json_object_set_new(counters, "id", json_integer(s->id));
+		json_array_append_new(threads, counters);
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	for(i = 0; i < STATS_NSTAGES; i++)
+		json_object_set_new(stages, stage_names[i],
+			histogram_json(&sum->stages[i]));
+	ret = counters_json(sum);
+	json_object_set_new(ret, "type", json_string("mqexec_stats"));
+	json_object_set_new(ret, "uptime", json_real(stats_clock() - started_at));
+	json_object_set_new(ret, "stages", stages);
+	json_object_set_new(ret, "threads", threads);
+	free(sum);
+	return ret;
+}
+
+static void stats_request_cb(struct ev_loop * loop, ev_io * i, int event) {
+	while(1) {
+		zmq_msg_t msg;
+		json_t * snapshot;
+		char * text;
+
+		// The request itself doesn't matter, but all of it has to be read
+		zmq_msg_init(&msg);
+		if(zmq_msg_recv(&msg, statsock, ZMQ_DONTWAIT) == -1) {
+			zmq_msg_close(&msg);
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != ETERM)
+				logit(ERR, "Error receiving stats request: %s",
+					zmq_strerror(errno));
+			return;
+		}
+		if(zmq_msg_more(&msg)) {
+			zmq_msg_close(&msg);
+			continue;
+		}
+		zmq_msg_close(&msg);
+
+		snapshot = stats_snapshot();
+		text = json_dumps(snapshot, JSON_COMPACT);
+		json_decref(snapshot);
+		zmq_msg_init_data(&msg, text, strlen(text), free_cb, NULL);
+		while(zmq_msg_send(&msg, statsock, 0) == -1) {
+			if(errno == EINTR)
+				continue;
+			if(errno != ETERM)
+				logit(ERR, "Error sending stats: %s", zmq_strerror(errno));
+			break;
+		}
+		zmq_msg_close(&msg);
+	}
+}
+
+int stats_open(struct ev_loop * loop, json_t * def) {
+	int fd = -1;
+	size_t fdsize = sizeof(fd);
+
+	if((statsock = zmq_socket(zmqctx, ZMQ_REP)) == NULL) {
+		logit(ERR, "Error creating stats socket: %s", zmq_strerror(errno));
+		return -1;
+	}
+	parse_sock_directive(statsock, def, 1);
+	zmq_getsockopt(statsock, ZMQ_FD, &fd, &fdsize);
+	ev_io_init(&statsio, stats_request_cb, fd, EV_READ);
+	ev_io_start(loop, &statsio);
+	ev_feed_event(loop, &statsio, EV_READ);
+	logit(DEBUG, "Setup stats socket");
+	return 0;
+}
+
+void stats_close(struct ev_loop * loop) {
+	if(statsock == NULL)
+		return;
+	ev_io_stop(loop, &statsio);
+	zmq_close(statsock);
+	statsock = NULL;
+}
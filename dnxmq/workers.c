@@ -0,0 +1,337 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mqexec.h"
+
+// With "threads" set above 1, the main thread only moves messages: it
+// reads jobs from the upstream socket and pushes them round-robin over
+// inproc to the worker threads, and forwards their results upstream.
+// Each worker runs its own event loop with its own job queue, children,
+// output buffers, argv cache, plugin hosts and result batch. Children are
+// watched through pidfds, so each thread reaps only its own.
+
+#define JOBS_ENDPOINT "inproc://mqexec.jobs"
+#define RESULTS_ENDPOINT "inproc://mqexec.results"
+// Jobs waiting on their way to one worker before it's skipped
+#define WORKER_JOB_HWM 64
+
+struct worker {
+	int id;
+	pthread_t thread;
+	struct ev_loop * loop;
+	ev_async stop;
+	ev_async reload;
+	// Filled in when the thread exits
+	unsigned long jobs, results, argv_hits, argv_misses;
+	unsigned long coalesce_hits, coalesce_misses;
+	unsigned long filter_hits, filter_misses;
+	struct output_stats output;
+};
+
+extern void * zmqctx;
+extern __thread void * pullsock, *pushsock;
+extern __thread uint32_t runningjobs;
+extern __thread ev_io pullio;
+extern __thread unsigned long jobs_received, results_sent;
+
+int nworkers = 0;
+// Set in the main thread once it's handing jobs to workers
+__thread int forwarding_jobs = 0;
+static struct worker * workers = NULL;
+static struct ev_loop * mainloop;
+static json_t * worker_plugin_hosts;
+static void * jobsock = NULL, *resultsock = NULL;
+static ev_io resultio;
+static ev_async workers_done;
+static ev_timer retrytimer;
+static zmq_msg_t pending;
+// The broker's id for the pending job, sent ahead of it
+static uint64_t pending_id = 0;
+static int have_pending = 0, finished = 0, stopping = 0;
+
+static void * open_inproc(int type, const char * endpoint, int bind) {
+	void * sock = zmq_socket(zmqctx, type);
+	int hwm = WORKER_JOB_HWM;
+
+	if(sock == NULL)
+		return NULL;
+	if(strcmp(endpoint, JOBS_ENDPOINT) == 0) {
+#if ZMQ_VERSION_MAJOR == 2
+		uint64_t hwm2 = hwm;
+		zmq_setsockopt(sock, ZMQ_HWM, &hwm2, sizeof(hwm2));
+#else
+		zmq_setsockopt(sock, type == ZMQ_PUSH ? ZMQ_SNDHWM : ZMQ_RCVHWM,
+			&hwm, sizeof(hwm));
+#endif
+	}
+	if((bind ? zmq_bind(sock, endpoint) : zmq_connect(sock, endpoint)) != 0) {
+		logit(ERR, "Error setting up %s: %s", endpoint, zmq_strerror(errno));
+		zmq_close(sock);
+		return NULL;
+	}
+	return sock;
+}
+
+static void worker_stop_cb(struct ev_loop * loop, ev_async * a, int event) {
+	ev_async_stop(loop, a);
+	flush_batch(loop);
+	if(pullsock) {
+		ev_io_stop(loop, &pullio);
+		zmq_close(pullsock);
+		pullsock = NULL;
+	}
+	if(runningjobs == 0)
+		ev_break(loop, EVBREAK_ALL);
+	else
+		logit(DEBUG, "Worker waiting for %u jobs to finish", runningjobs);
+}
+
+static void worker_reload_cb(struct ev_loop * loop, ev_async * a, int event) {
+	reload_thread(loop);
+}
+
+static void * worker_main(void * arg) {
+	struct worker * w = arg;
+	struct ev_loop * loop = w->loop;
+	sigset_t mask;
+
+	// Signals are the main thread's business
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pushsock = open_inproc(ZMQ_PUSH, RESULTS_ENDPOINT, 0);
+	pullsock = open_inproc(ZMQ_PULL, JOBS_ENDPOINT, 0);
+	if(pushsock == NULL || pullsock == NULL)
+		exit(-1);
+	if(parse_plugin_hosts(worker_plugin_hosts) != 0)
+		exit(-1);
+
+	stats_thread_init(loop);
+	adopt_rules();
+	start_job_loop(loop, pullsock);
+	logit(DEBUG, "Worker thread %d started", w->id);
+	ev_run(loop, 0);
+
+	flush_batch(loop);
+	stop_plugin_hosts(loop);
+	w->jobs = jobs_received;
+	w->results = results_sent;
+	w->argv_hits = argv_cache_hits;
+	w->argv_misses = argv_cache_misses;
+	w->output = output_stats;
+	w->coalesce_hits = coalesce_hits;
+	w->coalesce_misses = coalesce_misses;
+	w->filter_hits = filter_cache_hits;
+	w->filter_misses = filter_cache_misses;
+	if(pullsock)
+		zmq_close(pullsock);
+	ev_async_stop(loop, &w->reload);
+	release_rules(rules);
+	// Blocks until the results have been handed to the main thread
+	zmq_close(pushsock);
+
+	__sync_fetch_and_add(&finished, 1);
+	ev_async_send(mainloop, &workers_done);
+	return NULL;
+}
+
+static void forward_results_cb(struct ev_loop * loop, ev_io * i, int event) {
+	while(1) {
+		zmq_msg_t msg;
+
+		zmq_msg_init(&msg);
+		if(zmq_msg_recv(&msg, resultsock, ZMQ_DONTWAIT) == -1) {
+			zmq_msg_close(&msg);
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != ETERM)
+				logit(ERR, "Error receiving result from worker: %s",
+					zmq_strerror(errno));
+			break;
+		}
+		while(zmq_msg_send(&msg, pushsock, 0) == -1) {
+			if(errno == EINTR) {
+				thread_stats->send_retries++;
+				continue;
+			}
+			if(errno != ETERM)
+				logit(ERR, "Error sending message: %s", zmq_strerror(errno));
+			break;
+		}
+		zmq_msg_close(&msg);
+	}
+}
+
+static int send_pending() {
+	if(pending_id) {
+		char buf[24];
+		zmq_msg_t idmsg;
+
+		snprintf(buf, sizeof(buf), "%llu", (unsigned long long)pending_id);
+		zmq_msg_init_size(&idmsg, strlen(buf));
+		memcpy(zmq_msg_data(&idmsg), buf, strlen(buf));
+		while(zmq_msg_send(&idmsg, jobsock, ZMQ_SNDMORE|ZMQ_DONTWAIT) == -1) {
+			if(errno == EINTR)
+				continue;
+			zmq_msg_close(&idmsg);
+			if(errno == EAGAIN) {
+				thread_stats->send_retries++;
+				return 0;
+			}
+			logit(ERR, "Error passing job to worker: %s", zmq_strerror(errno));
+			zmq_msg_close(&pending);
+			have_pending = 0;
+			return 1;
+		}
+		zmq_msg_close(&idmsg);
+		pending_id = 0;
+	}
+	// With the id queued, the rest of the message always goes through
+	while(zmq_msg_send(&pending, jobsock, ZMQ_DONTWAIT) == -1) {
+		if(errno == EINTR)
+			continue;
+		if(errno == EAGAIN) {
+			thread_stats->send_retries++;
+			return 0;
+		}
+		logit(ERR, "Error passing job to worker: %s", zmq_strerror(errno));
+		break;
+	}
+	zmq_msg_close(&pending);
+	have_pending = 0;
+	return 1;
+}
+
+// Every worker's queue is full. Stop reading upstream until one has room.
+static void retry_cb(struct ev_loop * loop, ev_timer * t, int event) {
+	if(!have_pending || !send_pending())
+		return;
+	ev_timer_stop(loop, t);
+	if(pullsock) {
+		ev_io_start(loop, &pullio);
+		ev_feed_event(loop, &pullio, EV_READ);
+	}
+}
+
+void forward_job(struct ev_loop * loop, zmq_msg_t * msg, uint64_t id) {
+	zmq_msg_init(&pending);
+	zmq_msg_move(&pending, msg);
+	zmq_msg_close(msg);
+	pending_id = id;
+	have_pending = 1;
+	jobs_received++;
+	if(send_pending())
+		return;
+	ev_io_stop(loop, &pullio);
+	ev_timer_again(loop, &retrytimer);
+}
+
+static void workers_done_cb(struct ev_loop * loop, ev_async * a, int event) {
+	if(finished == nworkers)
+		ev_break(loop, EVBREAK_ALL);
+}
+
+int start_workers(struct ev_loop * loop, int count, json_t * plugin_hosts) {
+	int i, fd = -1;
+	size_t fdsize = sizeof(fd);
+
+	mainloop = loop;
+	forwarding_jobs = 1;
+	// Kept even if a reload frees the config it came from
+	worker_plugin_hosts = json_incref(plugin_hosts);
+	if((jobsock = open_inproc(ZMQ_PUSH, JOBS_ENDPOINT, 1)) == NULL ||
+		(resultsock = open_inproc(ZMQ_PULL, RESULTS_ENDPOINT, 1)) == NULL)
+		return -1;
+
+	zmq_getsockopt(resultsock, ZMQ_FD, &fd, &fdsize);
+	ev_io_init(&resultio, forward_results_cb, fd, EV_READ);
+	ev_io_start(loop, &resultio);
+	ev_async_init(&workers_done, workers_done_cb);
+	ev_async_start(loop, &workers_done);
+	ev_init(&retrytimer, retry_cb);
+	retrytimer.repeat = 0.01;
+
+	workers = calloc(count, sizeof(struct worker));
+	for(i = 0; i < count; i++) {
+		struct worker * w = &workers[i];
+		w->id = i;
+		w->loop = ev_loop_new(EVFLAG_AUTO);
+		if(w->loop == NULL) {
+			logit(ERR, "Error creating worker event loop");
+			return -1;
+		}
+		// Started before the thread is, so a stop can't be missed
+		ev_async_init(&w->stop, worker_stop_cb);
+		ev_async_start(w->loop, &w->stop);
+		ev_async_init(&w->reload, worker_reload_cb);
+		ev_async_start(w->loop, &w->reload);
+		if((errno = pthread_create(&w->thread, NULL, worker_main, w)) != 0) {
+			logit(ERR, "Error starting worker thread: %s", strerror(errno));
+			return -1;
+		}
+		nworkers++;
+	}
+	logit(INFO, "Started %d worker threads", nworkers);
+	return 0;
+}
+
+// Tells the workers to pick up a reloaded config
+void reload_workers() {
+	int i;
+
+	for(i = 0; i < nworkers; i++)
+		ev_async_send(workers[i].loop, &workers[i].reload);
+}
+
+// Tells the workers to stop taking jobs; the main loop ends once they've
+// all finished their running jobs.
+void stop_workers(struct ev_loop * loop) {
+	int i;
+
+	if(stopping)
+		return;
+	stopping = 1;
+	if(have_pending) {
+		zmq_msg_close(&pending);
+		have_pending = 0;
+	}
+	ev_timer_stop(loop, &retrytimer);
+	for(i = 0; i < nworkers; i++)
+		ev_async_send(workers[i].loop, &workers[i].stop);
+	if(finished == nworkers)
+		ev_break(loop, EVBREAK_ALL);
+}
+
+void join_workers(struct ev_loop * loop) {
+	int i;
+
+	for(i = 0; i < nworkers; i++) {
+		struct worker * w = &workers[i];
+		pthread_join(w->thread, NULL);
+		ev_loop_destroy(w->loop);
+		logit(INFO, "Worker %d: %lu jobs, %lu results, %lu/%lu argv cache "
+			"hits/misses, %lu output buffers spilled, %lu truncated",
+			w->id, w->jobs, w->results, w->argv_hits, w->argv_misses,
+			w->output.spills, w->output.truncated);
+		if(coalesce_checks)
+			logit(INFO, "Worker %d: coalesced %lu of %lu checks", w->id,
+				w->coalesce_hits, w->coalesce_hits + w->coalesce_misses);
+		if(w->filter_hits + w->filter_misses > 0)
+			logit(INFO, "Worker %d: %lu/%lu filter cache hits/misses", w->id,
+				w->filter_hits, w->filter_misses);
+	}
+	// Whatever the workers sent while they were finishing up
+	forward_results_cb(loop, &resultio, EV_READ);
+	ev_io_stop(loop, &resultio);
+	json_decref(worker_plugin_hosts);
+	zmq_close(jobsock);
+	zmq_close(resultsock);
+}
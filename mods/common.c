@@ -45,6 +45,7 @@ int nebmodule_deinit(int flags, int reason) {
 	neb_deregister_module_callbacks(nagmq_handle);
 	if(config)
 		json_decref(config);
+	arena_uninstall();
 #ifdef HAVE_SHUTDOWN_COMMAND_FILE_WORKER
     shutdown_command_file_worker();
 #endif
@@ -138,32 +139,115 @@ int handle_timedevent(int which, void * obj) {
 }
 #endif
 
-void input_reaper(void * insock) {
-	while(1) {
-		zmq_msg_t input;
-		zmq_msg_init(&input);
+struct input_source pull_source = { "pull", 1000, 100 },
+	req_source = { "reply", 1000, 100 };
+static int reaper_rearmed = 0;
+static void rearmed_input_reaper(void * unused);
 
-		if(zmq_msg_recv(&input, insock, ZMQ_DONTWAIT) == -1) {
-			if(errno == EAGAIN)
-				break;
-			else if(errno == EINTR)
-				continue;
-			const char * whichsockstr = (insock == pullsock) ? "command" : "state";
+// Receive and handle one message from sock. Returns 0 when there was
+// nothing to read.
+static int reap_one(void * sock) {
+	zmq_msg_t input;
+
+	zmq_msg_init(&input);
+	while(zmq_msg_recv(&input, sock, ZMQ_DONTWAIT) == -1) {
+		if(errno == EINTR)
+			continue;
+		if(errno != EAGAIN) {
+			const char * whichsockstr = (sock == pullsock) ? "command" : "state";
 			logit(NSLOG_RUNTIME_WARNING, TRUE,
 				"Error receiving message from %s socket: %s",
 				whichsockstr, zmq_strerror(errno));
-			continue;
 		}
+		zmq_msg_close(&input);
+		return 0;
+	}
 
-		if(insock == pullsock)
-			process_pull_msg(&input);
-		else if(insock == reqsock)
-			process_req_msg(&input);
+	if(sock == pullsock)
+		process_pull_msg(&input);
+	else if(sock == reqsock)
+		process_req_msg(&input);
 
-		zmq_msg_close(&input);
+	zmq_msg_close(&input);
+	return 1;
+}
+
+// Drains the pull and reply sockets one message at a time in turn, so a
+// burst on one can't starve the other. Each socket stops when it's empty
+// or has used up its message or time budget for this wakeup. If work is
+// left over a zero-delay event is scheduled to pick it up, since the
+// ZMQ_FD won't signal again for messages that are already queued.
+void input_reaper(void * unused) {
+	struct input_source * sources[2] = { &pull_source, &req_source };
+	void * socks[2] = { pullsock, reqsock };
+#ifdef HAVE_PULL_INGEST
+	// The ingest thread owns the pull socket while it's running
+	if(pull_ingest_running)
+		socks[0] = NULL;
+#endif
+	int active[2], left[2] = { 0, 0 }, i, nactive = 0;
+	struct timeval start, now;
+
+	gettimeofday(&start, NULL);
+	for(i = 0; i < 2; i++) {
+		sources[i]->batch = 0;
+		active[i] = socks[i] != NULL;
+		nactive += active[i];
+	}
+
+	while(nactive > 0) {
+		for(i = 0; i < 2; i++) {
+			struct input_source * src = sources[i];
+			long elapsed;
+
+			if(!active[i])
+				continue;
+			if(!reap_one(socks[i])) {
+				active[i] = 0;
+				nactive--;
+				continue;
+			}
+			src->batch++;
+
+			gettimeofday(&now, NULL);
+			elapsed = ((now.tv_sec - start.tv_sec) * 1000) +
+				((now.tv_usec - start.tv_usec) / 1000);
+			if((src->max_messages > 0 && src->batch >= src->max_messages) ||
+				(src->max_time > 0 && elapsed >= src->max_time)) {
+				src->budget_exhausted++;
+				active[i] = 0;
+				left[i] = 1;
+				nactive--;
+			}
+		}
+	}
+
+	for(i = 0; i < 2; i++) {
+		struct input_source * src = sources[i];
+		src->backlogged = left[i];
+		if(!socks[i] || src->batch == 0)
+			continue;
+		src->last_batch = src->batch;
+		src->wakeups++;
+		src->messages += src->batch;
+		if(src->batch > src->max_batch)
+			src->max_batch = src->batch;
+	}
+
+	if((left[0] || left[1]) && !reaper_rearmed) {
+		reaper_rearmed = 1;
+		for(i = 0; i < 2; i++)
+			sources[i]->rearms += left[i];
+		schedule_new_event(EVENT_USER_FUNCTION, 1, time(NULL), 0, 0,
+			NULL, 0, rearmed_input_reaper, NULL, 0);
 	}
 }
 
+static void rearmed_input_reaper(void * unused) {
+	reaper_rearmed = 0;
+	input_reaper(NULL);
+}
+
 #ifdef HAVE_NAGIOS4
 int brokered_input_reaper(int sd, int events, void * arg) {
 	input_reaper(arg);
@@ -173,6 +257,26 @@ int brokered_input_reaper(int sd, int events, void * arg) {
 extern iobroker_set *nagios_iobs;
 #endif
 
+struct nagmq_config {
+	int iothreads;
+	json_t * publish, *pull, *reply, *curve;
+};
+
+#define CONFIG_FIELD(member, type) \
+	JSON_FIELD(struct nagmq_config, member, #member, type, 0)
+
+static const struct json_field nagmq_config_fields[] = {
+	CONFIG_FIELD(iothreads, JSON_INTEGER),
+	CONFIG_FIELD(publish, JSON_OBJECT),
+	CONFIG_FIELD(pull, JSON_OBJECT),
+	CONFIG_FIELD(reply, JSON_OBJECT),
+#if ZMQ_VERSION_MAJOR > 3
+	CONFIG_FIELD(curve, JSON_OBJECT),
+#endif
+};
+static struct json_schema nagmq_config_schema =
+	JSON_SCHEMA(nagmq_config_fields);
+
 int handle_startup(int which, void * obj) {
 	struct nebstruct_process_struct *ps = (struct nebstruct_process_struct *)obj;
 	time_t now = ps->timestamp.tv_sec;
@@ -187,20 +291,18 @@ int handle_startup(int which, void * obj) {
 
 			log_debug_info(DEBUGL_PROCESS, DEBUGV_BASIC,
 			 	"Initializing NagMQ in process %u\n", getpid());
-			if(get_values(config,
-				"iothreads", JSON_INTEGER, 0, &numthreads,
-				"publish", JSON_OBJECT, 0, &pubdef,
-				"pull", JSON_OBJECT, 0, &pulldef,
-				"reply", JSON_OBJECT, 0, &reqdef,
-#if ZMQ_VERSION_MAJOR > 3
-				"curve", JSON_OBJECT, 0, &curvedef,
-#endif
-				NULL) != 0) {
+			struct nagmq_config cfg = { 1, NULL, NULL, NULL, NULL };
+			if(get_fields(config, &nagmq_config_schema, &cfg) != 0) {
 				logit(NSLOG_CONFIG_ERROR, TRUE,
 					"Invalid parameters in NagMQ configuration");
 				exit(1);
 				return -1;
 			}
+			numthreads = cfg.iothreads;
+			pubdef = cfg.publish;
+			pulldef = cfg.pull;
+			reqdef = cfg.reply;
+			curvedef = cfg.curve;
 		
 			if(!pubdef && !pulldef && !reqdef)
 				return 0;
@@ -215,10 +317,14 @@ int handle_startup(int which, void * obj) {
 
 #if ZMQ_VERSION_MAJOR > 3
 			if(curvedef) {
+				int zap_workers = 1;
 				if(get_values(curvedef,
 					"publickey", JSON_STRING, 1, &curve_publickey,
 					"privatekey", JSON_STRING, 1, &curve_privatekey,
 					"clientkeyfile", JSON_STRING, 0, &curve_knownhosts,
+					"workers", JSON_INTEGER, 0, &zap_workers,
+					"refresh_interval", JSON_INTEGER, 0,
+						&keyfile_refresh_interval,
 					NULL) != 0) {
 					logit(NSLOG_RUNTIME_ERROR, TRUE,
 						"Error getting public/private key for NagMQ curve security");
@@ -226,33 +332,18 @@ int handle_startup(int which, void * obj) {
 					return -1;
 				}
 
-				if(curve_knownhosts) {
-					pthread_t tid;
-
-					void * zapsock = zmq_socket(zmq_ctx, ZMQ_REP);
-					if(zapsock == NULL) {
-						logit(NSLOG_RUNTIME_ERROR, TRUE,
-							"Error creating NagMQ authentication socket: %s",
-							zmq_strerror(errno));
-						exit(1);
-						return -1;
-					}
+				// 0 would re-read the keyfile in a busy loop
+				if(keyfile_refresh_interval < 1) {
+					logit(NSLOG_CONFIG_ERROR, TRUE,
+						"NagMQ curve refresh_interval must be at least 1 second");
+					exit(1);
+					return -1;
+				}
 
-					if(zmq_bind(zapsock, "inproc://zeromq.zap.01") != 0) {
-						logit(NSLOG_RUNTIME_ERROR, TRUE,
-							"Error binding to NagMQ authentication endpoint: %s",
-							zmq_strerror(errno));
-						exit(1);
-						return -1;
-					}
-					int rc = pthread_create(&tid, NULL, zap_handler, zapsock);
-					if(rc != 0) {
-						logit(NSLOG_RUNTIME_ERROR, TRUE,
-							"Error starting NagMQ authentication thread?: %s",
-							strerror(errno));
-						exit(1);
-						return -1;
-					}
+				if(curve_knownhosts &&
+					start_zap_handler(zmq_ctx, zap_workers) != 0) {
+					exit(1);
+					return -1;
 				}
 			}
 #endif
@@ -264,13 +355,34 @@ int handle_startup(int which, void * obj) {
 
 			if(pulldef) {
 				unsigned long interval = 2;
+				int ingest_thread = 0, ingest_max_pending = 10000;
 				get_values(pulldef,
 					"interval", JSON_INTEGER, 0, &interval,
+					"max_messages", JSON_INTEGER, 0, &pull_source.max_messages,
+					"max_time", JSON_INTEGER, 0, &pull_source.max_time,
+					"ingest_thread", JSON_TRUE, 0, &ingest_thread,
+					"ingest_max_pending", JSON_INTEGER, 0, &ingest_max_pending,
 					NULL);
 				if((pullsock = getsock("pull", ZMQ_PULL, pulldef)) == NULL) {
 					exit(1);
 					return -1;
 				}
+#ifdef HAVE_PULL_INGEST
+				// The ingest thread owns the pull socket from here on, so
+				// the monitor has to be set up first.
+				if(ingest_thread) {
+					setup_sockmonitor(pullsock);
+					if(start_pull_ingest(pullsock, ingest_max_pending) != 0) {
+						exit(1);
+						return -1;
+					}
+					goto pull_done;
+				}
+#else
+				if(ingest_thread)
+					logit(NSLOG_CONFIG_WARNING, TRUE,
+						"NagMQ pull ingest thread needs Nagios 4 and eventfd, ignoring it");
+#endif
 #ifdef HAVE_NAGIOS4
 				int fd;
 				size_t throwaway = sizeof(fd);
@@ -284,12 +396,18 @@ int handle_startup(int which, void * obj) {
 				// Call the input_reaper once manually to clear out any
 				// level-triggered polling problems.
 				input_reaper(pullsock);
+#ifdef HAVE_PULL_INGEST
+pull_done:
+				;
+#endif
 			}
 
 			if(reqdef) {
 				unsigned long interval = 2;
 				get_values(reqdef,
 					"interval", JSON_INTEGER, 0, &interval,
+					"max_messages", JSON_INTEGER, 0, &req_source.max_messages,
+					"max_time", JSON_INTEGER, 0, &req_source.max_time,
 					NULL);
 				if((reqsock = getsock("reply", ZMQ_REP, reqdef)) == NULL) {
 					exit(1);
@@ -326,6 +444,9 @@ int handle_startup(int which, void * obj) {
 				process_payload(payload);
 			}
 			if(pullsock) {
+#ifdef HAVE_PULL_INGEST
+				stop_pull_ingest();
+#endif
 #ifdef HAVE_NAGIOS4
 				int fd;
 				size_t throwaway = sizeof(fd);
@@ -403,6 +524,7 @@ int nebmodule_init(int flags, char * localargs, nebmodule * lhandle) {
 	neb_set_module_info(handle, NEBMODULE_MODINFO_DESC,
 		"Provides interface into Nagios via ZeroMQ");
 
+	arena_install();
 	config = json_load_file(localargs, 0, &loaderr);
 	if(config == NULL) {
 		logit(NSLOG_RUNTIME_ERROR, TRUE, "Error loading NagMQ config: %s (at %d:%d)",
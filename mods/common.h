@@ -1,10 +1,39 @@
 void process_pull_msg(zmq_msg_t * payload_msg);
+
+// Per-wakeup budgets and counters for the pull and reply sockets
+struct input_source {
+	const char * name;
+	int max_messages;
+	int max_time;
+	unsigned long batch, last_batch, max_batch;
+	unsigned long long messages, wakeups, budget_exhausted, rearms;
+	int backlogged;
+};
+extern struct input_source pull_source, req_source;
+
+#if defined(HAVE_NAGIOS4) && defined(HAVE_SYS_EVENTFD_H)
+#define HAVE_PULL_INGEST
+int start_pull_ingest(void * sock, int max_pending);
+void stop_pull_ingest();
+extern int pull_ingest_running;
+#endif
 int handle_timedevent(int which, void * obj);
 void free_cb(void * ptr, void * hint);
 void process_req_msg(zmq_msg_t * reqmsg);
 void * getsock(char * what, int type, json_t * def);
 void process_payload(struct payload * payload);
-void * zap_handler(void* zapsock);
+int start_zap_handler(void * ctx, int workers);
+
+// Counters for the curve authentication (ZAP) handler. Latencies are in
+// microseconds from receiving a request to sending its reply.
+struct zap_stats {
+	unsigned long long requests, accepted, rejected;
+	unsigned long long latency_total, latency_max;
+	unsigned long long reloads, reload_errors;
+	unsigned int keys;
+	int workers;
+};
+extern struct zap_stats zap_stats;
 void setup_sockmonitor(void * sock);
 int handle_pubstartup(json_t * def);
 
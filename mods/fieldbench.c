@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json.h"
+#include "statedata.h"
+
+// Compares get_values and get_fields on a state_data bulk payload, the
+// widest message the pull socket handles.
+//
+//   fieldbench [elements] [rounds]
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static json_t * make_element(int i) {
+	char name[64];
+
+	snprintf(name, sizeof(name), "svc%05d", i);
+	return json_pack("{s:s s:s s:s s:s s:n s:s s:i s:i s:i s:b s:b s:b s:b "
+		"s:b s:b s:b s:i s:b s:f s:f s:i s:i s:i s:i s:i s:i}",
+		"type", "service",
+		"host_name", "web01.example.com",
+		"service_description", name,
+		"plugin_output", "HTTP OK: HTTP/1.1 200 OK - 1543 bytes",
+		"long_output",
+		"perf_data", "time=0.021s;2.000;5.000;0.000 size=1543B;;;0",
+		"current_state", 0, "current_attempt", 1, "state_type", 1,
+		"is_flapping", 0, "notifications_enabled", 1, "checks_enabled", 1,
+		"event_handler_enabled", 1, "flap_detection_enabled", 1,
+		"problem_has_been_acknowledged", 0, "accept_passive_checks", 1,
+		"last_check", 1500000000, "has_been_checked", 1,
+		"latency", 0.012, "execution_time", 0.021,
+		"last_notification", 0, "last_state_change", 1499990000,
+		// Keys the reader doesn't ask for still have to be walked past
+		"max_attempts", 3, "check_interval", 5, "retry_interval", 1,
+		"current_notification_number", 0);
+}
+
+static double run_values(json_t * data, int rounds) {
+	size_t i, max = json_array_size(data);
+	double start = now();
+	long sum = 0;
+	int r;
+
+	for(r = 0; r < rounds; r++) {
+		for(i = 0; i < max; i++) {
+			struct state_data sd;
+			memset(&sd, 0, sizeof(sd));
+			if(get_values(json_array_get(data, i),
+				"host_name", JSON_STRING, 1, &sd.host_name,
+				"service_description", JSON_STRING, 0, &sd.service_description,
+				"plugin_output", JSON_STRING, 1, &sd.plugin_output,
+				"long_output", JSON_STRING, 0, &sd.long_output,
+				"perf_data", JSON_STRING, 0, &sd.perf_data,
+				"current_state", JSON_INTEGER, 1, &sd.state,
+				"current_attempt", JSON_INTEGER, 1, &sd.current_attempt,
+				"state_type", JSON_INTEGER, 1, &sd.state_type,
+				"is_flapping", JSON_TRUE, 1, &sd.is_flapping,
+				"notifications_enabled", JSON_TRUE, 1, &sd.notifications_enabled,
+				"checks_enabled", JSON_TRUE, 1, &sd.checks_enabled,
+				"event_handler_enabled", JSON_TRUE, 1, &sd.event_handler_enabled,
+				"flap_detection_enabled", JSON_TRUE, 1, &sd.flap_detection_enabled,
+				"problem_has_been_acknowledged", JSON_TRUE, 1, &sd.acknowledged,
+				"accept_passive_checks", JSON_TRUE, 0, &sd.passive_checks_enabled,
+				"type", JSON_STRING, 1, &sd.type,
+				"last_check", JSON_INTEGER, 1, &sd.last_check,
+				"has_been_checked", JSON_TRUE, 1, &sd.has_been_checked,
+				"latency", JSON_REAL, 1, &sd.latency,
+				"execution_time", JSON_REAL, 1, &sd.execution_time,
+				"last_notification", JSON_INTEGER, 1, &sd.last_notification,
+				"last_state_change", JSON_INTEGER, 1, &sd.last_state_change,
+				NULL) != 0) {
+				fprintf(stderr, "get_values rejected element %lu\n",
+					(unsigned long)i);
+				exit(1);
+			}
+			sum += sd.current_attempt;
+		}
+	}
+	if(sum != (long)max * rounds)
+		exit(1);
+	return (max * rounds) / (now() - start);
+}
+
+static double run_fields(json_t * data, int rounds) {
+	size_t i, max = json_array_size(data);
+	double start = now();
+	long sum = 0;
+	int r;
+
+	for(r = 0; r < rounds; r++) {
+		for(i = 0; i < max; i++) {
+			struct state_data sd;
+			memset(&sd, 0, sizeof(sd));
+			if(get_fields(json_array_get(data, i),
+				&state_data_schema, &sd) != 0) {
+				fprintf(stderr, "get_fields rejected element %lu\n",
+					(unsigned long)i);
+				exit(1);
+			}
+			sum += sd.current_attempt;
+		}
+	}
+	if(sum != (long)max * rounds)
+		exit(1);
+	return (max * rounds) / (now() - start);
+}
+
+int main(int argc, char ** argv) {
+	int elements = 10000, rounds = 20, i;
+	json_t * data;
+
+	if(argc > 1)
+		elements = atoi(argv[1]);
+	if(argc > 2)
+		rounds = atoi(argv[2]);
+
+	data = json_array();
+	for(i = 0; i < elements; i++)
+		json_array_append_new(data, make_element(i));
+
+	run_values(data, 1);
+	run_fields(data, 1);
+
+	double values = run_values(data, rounds);
+	double fields = run_fields(data, rounds);
+
+	printf("%d state_data elements, %d rounds\n", elements, rounds);
+	printf("get_values: %.0f elements/sec\n", values);
+	printf("get_fields: %.0f elements/sec (%.2fx)\n", fields, fields / values);
+	json_decref(data);
+	return 0;
+}
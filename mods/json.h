@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stddef.h>
 #include "jansson.h"
 
 struct payload {
@@ -8,6 +9,8 @@ struct payload {
 	char * pong_target;
 	char * json_buf;
 	uint32_t hashed_keys[23];
+	// Requested keys that aren't generated ones (custom variables)
+	json_t * extra_keys;
 	char use_hash;
 	size_t buflen, bufused;
 	char keep_auxdata;
@@ -32,4 +35,41 @@ void payload_end_array(struct payload * po);
 int payload_start_object(struct payload * po, char * key);
 void payload_end_object(struct payload * po);
 int payload_has_keys(struct payload * po, ...);
+int payload_has_key_list(struct payload * po, const char ** keys);
 int get_values(json_t * input, ...);
+
+// Compiled field extraction, see get_fields
+#define JSON_SCHEMA_MAX_FIELDS 64
+
+struct json_field {
+	const char * key;
+	int type;
+	int required;
+	size_t offset;
+};
+
+struct json_schema {
+	const struct json_field * fields;
+	size_t nfields;
+	int compiled;
+	uint32_t mask;
+	uint32_t hashes[JSON_SCHEMA_MAX_FIELDS];
+	uint8_t next[JSON_SCHEMA_MAX_FIELDS];
+	uint8_t slots[JSON_SCHEMA_MAX_FIELDS * 2];
+};
+
+// The field count is checked at compile time, since hashes, next, slots
+// and get_fields' seen mask only have room for JSON_SCHEMA_MAX_FIELDS.
+#define JSON_SCHEMA_NFIELDS(fields) (sizeof(fields) / sizeof(fields[0]))
+#define JSON_SCHEMA(fields) { fields, JSON_SCHEMA_NFIELDS(fields) + \
+	0 * sizeof(char[JSON_SCHEMA_NFIELDS(fields) <= JSON_SCHEMA_MAX_FIELDS ? 1 : -1]) }
+#define JSON_FIELD(type, member, key, jtype, required) \
+	{ key, jtype, required, offsetof(type, member) }
+
+int get_fields(json_t * input, struct json_schema * schema, void * out);
+
+void arena_install();
+void arena_uninstall();
+void arena_begin();
+void arena_pause();
+void arena_reset();
@@ -39,9 +39,18 @@ int payload_add_key(struct payload * po, char * key) {
 		return 1;
 	size_t keylen = strlen(key);
 	if(po->use_hash) {
-		unsigned int hashval = hash_output_key(key, keylen);
-		if(!(po->hashed_keys[WORD_OFFSET(hashval)] & (1 << BIT_OFFSET(hashval))))
-			return 0;
+		unsigned int hashval;
+		// Keys outside the generated set (custom variables) can collide
+		// with generated ones, so they're matched by name instead
+		if(!in_output_word_set(key, keylen)) {
+			if(po->extra_keys == NULL ||
+				json_object_get(po->extra_keys, key) == NULL)
+				return 0;
+		} else {
+			hashval = hash_output_key(key, keylen);
+			if(!(po->hashed_keys[WORD_OFFSET(hashval)] & (1 << BIT_OFFSET(hashval))))
+				return 0;
+		}
 	}
 
 	adjust_payload_len(po, keylen + sizeof("\"\": "));
@@ -220,7 +229,7 @@ void payload_hash_key(struct payload * po, const char * key) {
 	size_t keylen = strlen(key);
 	unsigned int hashval;
 
-	if(!in_output_word_set(key, keylen))
+	if(keylen == 0)
 		return;
 
 	if(!po->use_hash) {
@@ -228,6 +237,14 @@ void payload_hash_key(struct payload * po, const char * key) {
 		po->use_hash = 1;
 	}
 
+	// Anything else could be a custom variable
+	if(!in_output_word_set(key, keylen)) {
+		if(po->extra_keys == NULL)
+			po->extra_keys = json_object();
+		json_object_set_new(po->extra_keys, key, json_true());
+		return;
+	}
+
 	hashval = hash_output_key(key, keylen);
 	po->hashed_keys[WORD_OFFSET(hashval)] |= (1 << BIT_OFFSET(hashval));
 }
@@ -250,3 +267,15 @@ int payload_has_keys(struct payload * po, ...) {
     va_end(ap);
 	return okay;
 }
+
+int payload_has_key_list(struct payload * po, const char ** keys) {
+	if(!po->use_hash)
+		return 1;
+
+	for(; *keys != NULL; keys++) {
+		unsigned int hashval = hash_output_key(*keys, strlen(*keys));
+		if(po->hashed_keys[WORD_OFFSET(hashval)] & (1 << BIT_OFFSET(hashval)))
+			return 1;
+	}
+	return 0;
+}
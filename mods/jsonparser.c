@@ -1,8 +1,63 @@
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "json.h"
 #include "jansson.h"
 
+// Stores found into dest according to type. Returns -1 if found isn't
+// of that type, without touching dest.
+static int store_value(json_t * found, int type, void * dest) {
+	int foundtype = json_typeof(found);
+
+	if(type == JSON_TIMEVAL) {
+		if(foundtype != JSON_REAL && foundtype != JSON_OBJECT)
+			return -1;
+	} else if(type == JSON_TRUE) {
+		if(!json_is_boolean(found))
+			return -1;
+	} else if(type != foundtype)
+		return -1;
+
+	switch(type) {
+		case JSON_STRING:
+			*((const char**)dest) = json_string_value(found);
+			break;
+		case JSON_OBJECT:
+		case JSON_ARRAY:
+			*((json_t**)dest) = found;
+			break;
+		case JSON_INTEGER:
+			*((int*)dest) = json_integer_value(found);
+			break;
+		case JSON_REAL:
+			*((double*)dest) = json_real_value(found);
+			break;
+		case JSON_TRUE:
+		case JSON_FALSE:
+			*((int*)dest) = json_is_true(found) ? 1 : 0;
+			break;
+		case JSON_TIMEVAL: {
+			struct timeval * tv = (struct timeval*)dest;
+			memset(tv, 0, sizeof(struct timeval));
+			double tv_sec;
+			switch(foundtype) {
+				case JSON_REAL:
+					tv->tv_usec = modf(json_real_value(found), &tv_sec) * 1000000;
+					tv->tv_sec = tv_sec;
+					break;
+				case JSON_OBJECT:
+					if(json_unpack(found, "{ s:i s?:i }",
+						"tv_sec", &tv->tv_sec,
+						"tv_usec", &tv->tv_usec) != 0)
+						return -1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
 int get_values(json_t * input, ...) {
 	va_list ap;
 	char * key;
@@ -17,80 +72,119 @@ int get_values(json_t * input, ...) {
 	while(key) {
 		void *uncast;
 		json_t * found;
-		int foundtype;
 		
 		type = va_arg(ap, int);
 		required = va_arg(ap, int);
 		uncast = va_arg(ap, void*);
 		found = json_object_get(input, key);
-		if(found == NULL) {
-			if(required)
-				return -1;
-			key = va_arg(ap, char*);
-			continue;
+		if((found == NULL || store_value(found, type, uncast) != 0) &&
+			required) {
+			va_end(ap);
+			return -1;
 		}
+		key = va_arg(ap, char*);
+	}
+	va_end(ap);
+	return 0;
+}
 
-		foundtype = json_typeof(found);
-		if(type == JSON_TIMEVAL &&
-			foundtype != JSON_REAL && foundtype != JSON_OBJECT) {
-			if(required)
-				return -1;
-			key = va_arg(ap, char*);
-			continue;
-		} else if(type == JSON_TRUE) {
-			if(!json_is_boolean(found)) {
-				if(required)
-					return -1;
-				key = va_arg(ap, char*);
-				continue;
-			}
-		} else if(type != JSON_TIMEVAL && type != foundtype) {
-			if(required)
-				return -1;
-			key = va_arg(ap, char*);
-			continue;
-		} 
+static uint32_t field_hash(const char * key) {
+	uint32_t h = 2166136261u;
+	while(*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619;
+	}
+	return h;
+}
 
-		switch(type) {
-			case JSON_STRING:
-				*((const char**)uncast) = json_string_value(found);
-				break;
-			case JSON_OBJECT:
-			case JSON_ARRAY:
-				*((json_t**)uncast) = found;
-				break;
-			case JSON_INTEGER:
-				*((int*)uncast) = json_integer_value(found);
-				break;
-			case JSON_REAL:
-				*((double*)uncast) = json_real_value(found);
-				break;
-			case JSON_TRUE:
-			case JSON_FALSE:
-				*((int*)uncast) = json_is_true(found) ? 1 : 0;
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Builds the key lookup table for a schema. Fields that share a key are
+// chained together so one key can fill several fields, e.g. with
+// different types. Returns -1 for a schema with more fields than the
+// table has room for, which JSON_SCHEMA otherwise catches at compile time.
+static int compile_schema(struct json_schema * schema) {
+	size_t i, j, nslots = 8;
+
+	if(schema->nfields > JSON_SCHEMA_MAX_FIELDS)
+		return -1;
+
+	pthread_mutex_lock(&schema_lock);
+	if(schema->compiled) {
+		pthread_mutex_unlock(&schema_lock);
+		return 0;
+	}
+
+	while(nslots < schema->nfields * 2)
+		nslots <<= 1;
+	schema->mask = nslots - 1;
+	memset(schema->slots, 0, sizeof(schema->slots));
+
+	for(i = 0; i < schema->nfields; i++) {
+		uint32_t h = field_hash(schema->fields[i].key);
+		schema->hashes[i] = h;
+		schema->next[i] = 0;
+
+		for(j = 0; j < i; j++) {
+			if(schema->hashes[j] == h &&
+				strcmp(schema->fields[j].key, schema->fields[i].key) == 0)
 				break;
-			case JSON_TIMEVAL: {
-				struct timeval * tv = (struct timeval*)uncast;
-				memset(tv, 0, sizeof(struct timeval));
-				double tv_usec;
-				int rc;
-				switch(foundtype) {
-					case JSON_REAL:
-						tv->tv_sec = modf(json_real_value(found), &tv_usec);
-						tv->tv_usec = tv_usec * 100000;
-						break;
-					case JSON_OBJECT:
-						rc = json_unpack(found, "{ s:i s?:i }",
-							"tv_sec", &tv->tv_sec,
-							"tv_usec", &tv->tv_usec);
-						if(rc != 0 && required)
-							return -1;
-				}
+		}
+		if(j < i) {
+			// Append to the chain for this key
+			while(schema->next[j])
+				j = schema->next[j] - 1;
+			schema->next[j] = i + 1;
+			continue;
+		}
+
+		uint32_t slot = h & schema->mask;
+		while(schema->slots[slot])
+			slot = (slot + 1) & schema->mask;
+		schema->slots[slot] = i + 1;
+	}
+	__atomic_store_n(&schema->compiled, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&schema_lock);
+	return 0;
+}
+
+// Like get_values, but driven by a static field table. It makes one pass
+// over the object's members instead of one lookup per wanted key, and
+// writes each value at its field's offset into out.
+int get_fields(json_t * input, struct json_schema * schema, void * out) {
+	const char * key;
+	json_t * value;
+	uint64_t seen = 0;
+	size_t i;
+
+	if(!input || !json_is_object(input))
+		return -1;
+	if(!__atomic_load_n(&schema->compiled, __ATOMIC_ACQUIRE) &&
+		compile_schema(schema) != 0)
+		return -1;
+
+	json_object_foreach(input, key, value) {
+		uint32_t h = field_hash(key);
+		uint32_t slot = h & schema->mask;
+		unsigned int idx;
+
+		while((idx = schema->slots[slot]) != 0) {
+			if(schema->hashes[idx - 1] == h &&
+				strcmp(schema->fields[idx - 1].key, key) == 0)
 				break;
-			}
+			slot = (slot + 1) & schema->mask;
 		}
-		key = va_arg(ap, char*);
+
+		for(; idx != 0; idx = schema->next[idx - 1]) {
+			const struct json_field * f = &schema->fields[idx - 1];
+			if(store_value(value, f->type, (char*)out + f->offset) == 0)
+				seen |= (uint64_t)1 << (idx - 1);
+		}
+	}
+
+	for(i = 0; i < schema->nfields; i++) {
+		if(schema->fields[i].required && !(seen & ((uint64_t)1 << i)))
+			return -1;
 	}
-    va_end(ap);
 	return 0;
 }
@@ -5,6 +5,14 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #define NSCORE 1
 #include "nebstructs.h"
 #include "nebcallbacks.h"
@@ -22,6 +30,7 @@
 #include <zmq.h>
 #include "json.h"
 #include "common.h"
+#include "statedata.h"
 
 extern int errno;
 
@@ -72,123 +81,90 @@ static void process_bulkstate(json_t * payload) {
 	max = json_array_size(statedata);
 
 	for(i = 0; i < max; i++) {
-		char * service_description = NULL, * host_name, *type;
-		char * plugin_output, * long_output = NULL, *perf_data = NULL;
-		int state, current_attempt, acknowledged, state_type;
-		int is_flapping, notifications_enabled, checks_enabled;
-		int passive_checks_enabled = -1, event_handler_enabled;
-		int flap_detection_enabled, has_been_checked;
-		time_t last_check, last_state_change, last_notification;
-		double latency, execution_time;
-
-		if(get_values(json_array_get(statedata, i),
-			"host_name", JSON_STRING, 1, &host_name,
-			"service_description", JSON_STRING, 0, &service_description,
-			"plugin_output", JSON_STRING, 1, &plugin_output,
-			"long_output", JSON_STRING, 0, &long_output,
-			"perf_data", JSON_STRING, 0, &perf_data,
-			"current_state", JSON_INTEGER, 1, &state,
-			"current_attempt", JSON_INTEGER, 1, &current_attempt,
-			"state_type", JSON_INTEGER, 1, &state_type,
-			"is_flapping", JSON_TRUE, 1, &is_flapping,
-			"notifications_enabled", JSON_TRUE, 1, &notifications_enabled,
-			"checks_enabled", JSON_TRUE, 1, &checks_enabled,
-			"event_handler_enabled", JSON_TRUE, 1, &event_handler_enabled,
-			"flap_detection_enabled", JSON_TRUE, 1, &flap_detection_enabled,
-			"problem_has_been_acknowledged", JSON_TRUE, 1, &acknowledged,
-#ifdef HAVE_NAGIOS4
-			"accept_passive_checks", JSON_TRUE, 0, &passive_checks_enabled,
-#else
-			"accept_passive_service_checks", JSON_TRUE, 0, &passive_checks_enabled,
-			"accept_passive_host_checks", JSON_TRUE, 0, &passive_checks_enabled,
-#endif
-			"type", JSON_STRING, 1, &type,
-			"last_check", JSON_INTEGER, 1, &last_check,
-			"has_been_checked", JSON_TRUE, 1, &has_been_checked,
-			"latency", JSON_REAL, 1, &latency,
-			"execution_time", JSON_REAL, 1, &execution_time,
-			"last_notification", JSON_INTEGER, 1, &last_notification,
-			"last_state_change", JSON_INTEGER, 1, &last_state_change,
-			NULL) != 0)
+		struct state_data sd;
+
+		memset(&sd, 0, sizeof(sd));
+		sd.passive_checks_enabled = -1;
+		if(get_fields(json_array_get(statedata, i), &state_data_schema, &sd) != 0)
 			continue;
 
-		if(passive_checks_enabled < 0)
+		if(sd.passive_checks_enabled < 0)
 			continue;
 
-		if(strcmp(type, "host") != 0 && strcmp(type, "service") != 0)
+		if(strcmp(sd.type, "host") != 0 && strcmp(sd.type, "service") != 0)
 			continue;
 
-		if(service_description) {
-			service * svctarget = find_service(host_name, service_description);
+		if(sd.service_description) {
+			service * svctarget = find_service(sd.host_name, sd.service_description);
 			if(!svctarget)
 				continue;
-			svctarget->current_state = state;
-			svctarget->current_attempt = current_attempt;
-			svctarget->state_type = state_type;
-			svctarget->is_flapping = is_flapping;
-			svctarget->notifications_enabled = notifications_enabled;
-			svctarget->checks_enabled = checks_enabled;
-			svctarget->event_handler_enabled = event_handler_enabled;
-			svctarget->flap_detection_enabled = flap_detection_enabled;
-			svctarget->problem_has_been_acknowledged = acknowledged;
+			svctarget->current_state = sd.state;
+			svctarget->current_attempt = sd.current_attempt;
+			svctarget->state_type = sd.state_type;
+			svctarget->is_flapping = sd.is_flapping;
+			svctarget->notifications_enabled = sd.notifications_enabled;
+			svctarget->checks_enabled = sd.checks_enabled;
+			svctarget->event_handler_enabled = sd.event_handler_enabled;
+			svctarget->flap_detection_enabled = sd.flap_detection_enabled;
+			svctarget->problem_has_been_acknowledged = sd.acknowledged;
 #ifdef HAVE_NAGIOS4
-			svctarget->accept_passive_checks = passive_checks_enabled;
+			svctarget->accept_passive_checks = sd.passive_checks_enabled;
 #else
-			svctarget->accept_passive_service_checks = passive_checks_enabled;
+			svctarget->accept_passive_service_checks = sd.passive_checks_enabled;
 #endif
 			if(svctarget->plugin_output)
 				free(svctarget->plugin_output);
-			svctarget->plugin_output = strdup(plugin_output);
+			svctarget->plugin_output = strdup(sd.plugin_output);
 			if(svctarget->long_plugin_output)
 				free(svctarget->long_plugin_output);
-			svctarget->long_plugin_output = long_output ? strdup(long_output) : NULL;
+			svctarget->long_plugin_output = sd.long_output ? strdup(sd.long_output) : NULL;
 			if(svctarget->perf_data)
 				free(svctarget->perf_data);
-			svctarget->perf_data = perf_data ? strdup(perf_data) : NULL;
-			svctarget->last_check = last_check;
-			svctarget->last_state_change = last_state_change;
-			svctarget->has_been_checked = has_been_checked;
-			svctarget->last_notification = last_notification;
-			svctarget->latency = latency;
-			svctarget->execution_time = execution_time;
+			svctarget->perf_data = sd.perf_data ? strdup(sd.perf_data) : NULL;
+			svctarget->last_check = sd.last_check;
+			svctarget->last_state_change = sd.last_state_change;
+			svctarget->has_been_checked = sd.has_been_checked;
+			svctarget->last_notification = sd.last_notification;
+			svctarget->latency = sd.latency;
+			svctarget->execution_time = sd.execution_time;
 		}			
 		else {
-			host * hsttarget = find_host(host_name);
+			host * hsttarget = find_host(sd.host_name);
 			if(!hsttarget)
 				continue;
-			hsttarget->current_state = state;
-			hsttarget->current_attempt = current_attempt;
-			hsttarget->state_type = state_type;
-			hsttarget->is_flapping = is_flapping;
-			hsttarget->notifications_enabled = notifications_enabled;
-			hsttarget->checks_enabled = checks_enabled;
-			hsttarget->event_handler_enabled = event_handler_enabled;
-			hsttarget->flap_detection_enabled = flap_detection_enabled;
-			hsttarget->problem_has_been_acknowledged = acknowledged;
+			hsttarget->current_state = sd.state;
+			hsttarget->current_attempt = sd.current_attempt;
+			hsttarget->state_type = sd.state_type;
+			hsttarget->is_flapping = sd.is_flapping;
+			hsttarget->notifications_enabled = sd.notifications_enabled;
+			hsttarget->checks_enabled = sd.checks_enabled;
+			hsttarget->event_handler_enabled = sd.event_handler_enabled;
+			hsttarget->flap_detection_enabled = sd.flap_detection_enabled;
+			hsttarget->problem_has_been_acknowledged = sd.acknowledged;
 #ifdef HAVE_NAGIOS4
-			hsttarget->accept_passive_checks = passive_checks_enabled;
+			hsttarget->accept_passive_checks = sd.passive_checks_enabled;
 #else
-			hsttarget->accept_passive_host_checks = passive_checks_enabled;
+			hsttarget->accept_passive_host_checks = sd.passive_checks_enabled;
 #endif
 			if(hsttarget->plugin_output)
 				free(hsttarget->plugin_output);
-			hsttarget->plugin_output = strdup(plugin_output);
+			hsttarget->plugin_output = strdup(sd.plugin_output);
 			if(hsttarget->long_plugin_output)
 				free(hsttarget->long_plugin_output);
-			hsttarget->long_plugin_output = long_output ? strdup(long_output) : NULL;
+			hsttarget->long_plugin_output = sd.long_output ? strdup(sd.long_output) : NULL;
 			if(hsttarget->perf_data)
 				free(hsttarget->perf_data);
-			hsttarget->perf_data = perf_data ? strdup(perf_data) : NULL;
-			hsttarget->last_check = last_check;
-			hsttarget->last_state_change = last_state_change;
-			hsttarget->has_been_checked = has_been_checked;
+			hsttarget->perf_data = sd.perf_data ? strdup(sd.perf_data) : NULL;
+			hsttarget->last_check = sd.last_check;
+			hsttarget->last_state_change = sd.last_state_change;
+			hsttarget->has_been_checked = sd.has_been_checked;
 #ifdef HAVE_NAGIOS4
-			hsttarget->last_notification = last_notification;
+			hsttarget->last_notification = sd.last_notification;
 #else
-			hsttarget->last_host_notification = last_notification;
+			hsttarget->last_host_notification = sd.last_notification;
 #endif
-			hsttarget->latency = latency;
-			hsttarget->execution_time = execution_time;
+			hsttarget->latency = sd.latency;
+			hsttarget->execution_time = sd.execution_time;
 		}
 	}
 }
@@ -208,70 +184,160 @@ struct check_engine nagmq_check_engine = {
 };
 #endif
 
-static void process_status(json_t * payload) {
-	char * host_name, *service_description = NULL, *output = NULL;
-	check_result newcr;
+#define CHECK_RESULT_OK 0
+#define CHECK_RESULT_INVALID -1
+#define CHECK_RESULT_NO_OBJECT -2
 
-	init_check_result(&newcr);
-	newcr.output_file = NULL;
-	newcr.output_file_fp = NULL;
+// Fills in newcr from a check result message. The strings are copied, so
+// newcr doesn't depend on the message afterwards. This doesn't touch any
+// Nagios state, so it's safe to call off the main thread.
+struct check_result_msg {
+	char * host_name, *service_description, *output;
+	check_result cr;
+};
 
-	if(get_values(payload,
-		"host_name", JSON_STRING, 1, &host_name,
-		"service_description", JSON_STRING, 0, &service_description,
-		"output", JSON_STRING, 1, &output,
-		"return_code", JSON_INTEGER, 1, &newcr.return_code,
-		"start_time", JSON_TIMEVAL, 0, &newcr.start_time,
-		"finish_time", JSON_TIMEVAL, 1, &newcr.finish_time,
-		"check_type", JSON_INTEGER, 1, &newcr.check_type,
-		"check_options", JSON_INTEGER, 0, &newcr.check_options,
-		"scheduled_check", JSON_INTEGER, 0, &newcr.scheduled_check,
-		"reschedule_check", JSON_INTEGER, 0, &newcr.reschedule_check,
-		"latency", JSON_REAL, 0, &newcr.latency,
-		"early_timeout", JSON_INTEGER, 0, &newcr.early_timeout,
-		"exited_ok", JSON_INTEGER, 0, &newcr.exited_ok,
-		NULL) != 0) {
-		logit(NSLOG_RUNTIME_WARNING, FALSE, "Invalid parameters in NagMQ check result");
-		return;
-	}
+#define CR_FIELD(member, key, type, required) \
+	JSON_FIELD(struct check_result_msg, member, key, type, required)
 
-	service * service_target = NULL;
-	if(service_description)
-		service_target = find_service(host_name, service_description);
-	host * host_target = find_host(host_name);
-	if(host_target == NULL || (service_description && !service_target)) {
-		logit(NSLOG_RUNTIME_WARNING, FALSE,
-			"NagMQ received a check result for an invalid object");
-		return;
+static const struct json_field check_result_fields[] = {
+	CR_FIELD(host_name, "host_name", JSON_STRING, 1),
+	CR_FIELD(service_description, "service_description", JSON_STRING, 0),
+	CR_FIELD(output, "output", JSON_STRING, 1),
+	CR_FIELD(cr.return_code, "return_code", JSON_INTEGER, 1),
+	CR_FIELD(cr.start_time, "start_time", JSON_TIMEVAL, 0),
+	CR_FIELD(cr.finish_time, "finish_time", JSON_TIMEVAL, 1),
+	CR_FIELD(cr.check_type, "check_type", JSON_INTEGER, 1),
+	CR_FIELD(cr.check_options, "check_options", JSON_INTEGER, 0),
+	CR_FIELD(cr.scheduled_check, "scheduled_check", JSON_INTEGER, 0),
+	CR_FIELD(cr.reschedule_check, "reschedule_check", JSON_INTEGER, 0),
+	CR_FIELD(cr.latency, "latency", JSON_REAL, 0),
+	CR_FIELD(cr.early_timeout, "early_timeout", JSON_INTEGER, 0),
+	CR_FIELD(cr.exited_ok, "exited_ok", JSON_INTEGER, 0),
+};
+static struct json_schema check_result_schema =
+	JSON_SCHEMA(check_result_fields);
+
+static int decode_check_result(json_t * payload, check_result * newcr) {
+	struct check_result_msg m;
+
+	m.host_name = m.service_description = m.output = NULL;
+	init_check_result(&m.cr);
+	m.cr.output_file = NULL;
+	m.cr.output_file_fp = NULL;
+
+	if(get_fields(payload, &check_result_schema, &m) != 0)
+		return CHECK_RESULT_INVALID;
+
+	*newcr = m.cr;
+	newcr->host_name = strdup(m.host_name);
+	if(m.service_description) {
+		newcr->service_description = strdup(m.service_description);
+		newcr->object_check_type = SERVICE_CHECK;
 	}
+	newcr->output = strdup(m.output);
+	return CHECK_RESULT_OK;
+}
 
-	newcr.host_name = strdup(host_name);
-	if(service_target) {
-		newcr.service_description = strdup(service_description);
-		newcr.object_check_type = SERVICE_CHECK;
+// Hands a decoded check result to Nagios, which takes ownership of it.
+static int submit_check_result(check_result * newcr) {
+	service * service_target = NULL;
+	if(newcr->service_description)
+		service_target = find_service(newcr->host_name,
+			newcr->service_description);
+	host * host_target = find_host(newcr->host_name);
+	if(host_target == NULL ||
+		(newcr->service_description && !service_target)) {
+		free_check_result(newcr);
+		return CHECK_RESULT_NO_OBJECT;
 	}
-	newcr.output = strdup(output);
 
 	const char * debug_service_name = service_target ? 
-		newcr.service_description : "(N/A)";
+		newcr->service_description : "(N/A)";
 	log_debug_info(DEBUGL_CHECKS, DEBUGV_BASIC,
 		"Received a check result via NagMQ for %s %s\n",
-		newcr.host_name, debug_service_name);
+		newcr->host_name, debug_service_name);
 
 #ifdef HAVE_NAGIOS4
-	newcr.engine = &nagmq_check_engine;
-	process_check_result(&newcr);
-	free_check_result(&newcr);
+	newcr->engine = &nagmq_check_engine;
+	process_check_result(newcr);
+	free_check_result(newcr);
 #else
 	check_result *crcopy = NULL;
 	crcopy = calloc(1, sizeof(check_result));
-	memcpy(crcopy, &newcr, sizeof(check_result));
+	memcpy(crcopy, newcr, sizeof(check_result));
 #ifdef HAVE_ADD_CHECK_RESULT_ONE
 	add_check_result_to_list(crcopy);
 #elif defined(HAVE_ADD_CHECK_RESULT_TWO)
 	add_check_result_to_list(&check_result_list, crcopy);
 #endif
 #endif
+	return CHECK_RESULT_OK;
+}
+
+static int apply_check_result(json_t * payload) {
+	check_result newcr;
+
+	if(decode_check_result(payload, &newcr) != CHECK_RESULT_OK)
+		return CHECK_RESULT_INVALID;
+	return submit_check_result(&newcr);
+}
+
+static void log_check_result(int rc) {
+	switch(rc) {
+		case CHECK_RESULT_INVALID:
+			logit(NSLOG_RUNTIME_WARNING, FALSE,
+				"Invalid parameters in NagMQ check result");
+			break;
+		case CHECK_RESULT_NO_OBJECT:
+			logit(NSLOG_RUNTIME_WARNING, FALSE,
+				"NagMQ received a check result for an invalid object");
+			break;
+	}
+}
+
+static void log_check_result_batch(size_t max, size_t invalid,
+	size_t noobject) {
+	if(invalid || noobject)
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ rejected %lu of %lu check results in a batch "
+			"(%lu invalid, %lu for unknown objects)",
+			(unsigned long)(invalid + noobject), (unsigned long)max,
+			(unsigned long)invalid, (unsigned long)noobject);
+	log_debug_info(DEBUGL_CHECKS, DEBUGV_BASIC,
+		"Received a batch of %lu check results via NagMQ\n",
+		(unsigned long)max);
+}
+
+static void process_status(json_t * payload) {
+	log_check_result(apply_check_result(payload));
+}
+
+static void process_status_batch(json_t * payload) {
+	json_t * results;
+	size_t max, i, invalid = 0, noobject = 0;
+
+	if(get_values(payload,
+		"results", JSON_ARRAY, 1, &results,
+		NULL) != 0) {
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ received a check result batch without a results array");
+		return;
+	}
+
+	// Errors are counted rather than logged per item so a bad batch
+	// can't flood the log with thousands of identical warnings.
+	max = json_array_size(results);
+	for(i = 0; i < max; i++) {
+		switch(apply_check_result(json_array_get(results, i))) {
+			case CHECK_RESULT_INVALID:
+				invalid++;
+				break;
+			case CHECK_RESULT_NO_OBJECT:
+				noobject++;
+				break;
+		}
+	}
+	log_check_result_batch(max, invalid, noobject);
 }
 
 static void process_acknowledgement(json_t * payload) {
@@ -386,221 +452,495 @@ static void process_downtime(json_t * payload) {
 		host_name, service_description ? service_description : "(n/a)");
 }
 
-static void process_cmd(json_t * payload) {
-	host * host_target = NULL;
-	service * service_target = NULL;
-	char * host_name = NULL, *service_description = NULL, *cmd_name;
+// Command dispatch
+//
+// Commands are looked up in a perfect hash table built the first time a
+// command is received. Host and service commands can be applied to many
+// objects in one message; see resolve_targets for the selectors.
+
+enum cmd_target {
+	CMD_GLOBAL,
+	CMD_HOST,
+	CMD_SERVICE,
+	// Applies to services when a service is selected, hosts otherwise.
+	CMD_OBJECT
+};
+
+struct cmd_def;
+typedef int (*cmd_custom_fn)(json_t * payload, const struct cmd_def * cmd,
+	host * host_target, service * service_target);
 
+struct cmd_def {
+	char * name;
+	int target;
+	void (*global_fn)(void);
+	void (*host_fn)(host *);
+	void (*service_fn)(service *);
+	cmd_custom_fn custom_fn;
+};
+
+static int cmd_schedule_check(json_t * payload, const struct cmd_def * cmd,
+	host * host_target, service * service_target) {
+	time_t next_check;
+	int force_execution = 0, freshness_check = 0, orphan_check = 0;
 	if(get_values(payload,
-		"host_name", JSON_STRING, 1, &host_name,
-		"service_description", JSON_STRING, 0, &service_description,
-		"command_name", JSON_STRING, 1, &cmd_name,
-		NULL) != 0) {
-		logit(NSLOG_RUNTIME_WARNING, FALSE,
-			"NagMQ received a command with invalid parameters");
-		return;
+		"next_check", JSON_INTEGER, 1, &next_check,
+		"force_execution", JSON_TRUE, 0, &force_execution,
+		"freshness_check", JSON_TRUE, 0, &freshness_check,
+		"orphan_check", JSON_TRUE, 0, &orphan_check,
+		NULL) != 0)
+		return -1;
+	int flags = CHECK_OPTION_NONE;
+	if(force_execution)
+		flags |= CHECK_OPTION_FORCE_EXECUTION;
+	if(freshness_check)
+		flags |= CHECK_OPTION_FRESHNESS_CHECK;
+	if(orphan_check)
+		flags |= CHECK_OPTION_ORPHAN_CHECK;
+	if(service_target)
+		schedule_service_check(service_target, next_check, flags);
+	else
+		schedule_host_check(host_target, next_check, flags);
+	return 0;
+}
+
+static int cmd_propagate_notifications(json_t * payload,
+	const struct cmd_def * cmd, host * host_target,
+	service * service_target) {
+	int affect_top_host = 0, affect_hosts = 0, affect_services = 0,
+		level = 0;
+	if(get_values(payload,
+		"affect_top_host", JSON_TRUE, 0, &affect_top_host,
+		"affect_hosts", JSON_TRUE, 0, &affect_hosts,
+		"affect_services", JSON_TRUE, 0, &affect_services,
+		"level", JSON_INTEGER, 0, &level,
+		NULL) != 0)
+		return -1;
+	if(strcmp(cmd->name, "disable_and_propagate_notifications") == 0)
+		disable_and_propagate_notifications(host_target, level,
+			affect_top_host, affect_hosts, affect_services);
+	else
+		enable_and_propagate_notifications(host_target, level,
+			affect_top_host, affect_hosts, affect_services);
+	return 0;
+}
+
+#ifdef HAVE_DELETE_DOWNTIME_LONGNAME
+static int cmd_delete_downtime(json_t * payload, const struct cmd_def * cmd,
+	host * host_target, service * service_target) {
+	char * comment = NULL;
+	time_t start_time = 0;
+	get_values(payload,
+		"comment", JSON_STRING, 0, &comment,
+		"start_time", JSON_INTEGER, 0, &start_time,
+		NULL);
+	delete_downtime_by_hostname_service_description_start_time_comment(
+		host_target->name,
+		service_target ? service_target->description : NULL,
+		start_time, comment);
+	return 0;
+}
+#endif
+
+#define CMD_GLOBAL_DEF(name) { #name, CMD_GLOBAL, name, NULL, NULL, NULL }
+#define CMD_HOST_DEF(name) { #name, CMD_HOST, NULL, name, NULL, NULL }
+#define CMD_SERVICE_DEF(name) { #name, CMD_SERVICE, NULL, NULL, name, NULL }
+
+static const struct cmd_def cmd_defs[] = {
+	CMD_SERVICE_DEF(disable_service_checks),
+	CMD_SERVICE_DEF(enable_service_checks),
+	CMD_GLOBAL_DEF(enable_all_notifications),
+	// The misspelled name is what older clients send.
+	{ "disable_all_notification", CMD_GLOBAL,
+		disable_all_notifications, NULL, NULL, NULL },
+	CMD_GLOBAL_DEF(disable_all_notifications),
+	CMD_SERVICE_DEF(enable_service_notifications),
+	CMD_SERVICE_DEF(disable_service_notifications),
+	CMD_HOST_DEF(enable_host_notifications),
+	CMD_HOST_DEF(disable_host_notifications),
+	CMD_HOST_DEF(remove_host_acknowledgement),
+	CMD_SERVICE_DEF(remove_service_acknowledgement),
+	CMD_GLOBAL_DEF(start_executing_service_checks),
+	CMD_GLOBAL_DEF(stop_executing_service_checks),
+	CMD_GLOBAL_DEF(start_accepting_passive_service_checks),
+	CMD_GLOBAL_DEF(stop_accepting_passive_service_checks),
+	CMD_SERVICE_DEF(enable_passive_service_checks),
+	CMD_SERVICE_DEF(disable_passive_service_checks),
+	CMD_GLOBAL_DEF(start_using_event_handlers),
+	CMD_GLOBAL_DEF(stop_using_event_handlers),
+	CMD_SERVICE_DEF(enable_service_event_handler),
+	CMD_SERVICE_DEF(disable_service_event_handler),
+	CMD_HOST_DEF(enable_host_event_handler),
+	CMD_HOST_DEF(disable_host_event_handler),
+	CMD_HOST_DEF(enable_host_checks),
+	CMD_HOST_DEF(disable_host_checks),
+	CMD_GLOBAL_DEF(enable_service_freshness_checks),
+	CMD_SERVICE_DEF(start_obsessing_over_service),
+	CMD_SERVICE_DEF(stop_obsessing_over_service),
+	CMD_HOST_DEF(start_obsessing_over_host),
+	CMD_HOST_DEF(stop_obsessing_over_host),
+	CMD_GLOBAL_DEF(enable_performance_data),
+	CMD_GLOBAL_DEF(disable_performance_data),
+	CMD_GLOBAL_DEF(start_executing_host_checks),
+	CMD_GLOBAL_DEF(stop_executing_host_checks),
+	CMD_GLOBAL_DEF(start_accepting_passive_host_checks),
+	CMD_GLOBAL_DEF(stop_accepting_passive_host_checks),
+	CMD_HOST_DEF(enable_passive_host_checks),
+	CMD_HOST_DEF(disable_passive_host_checks),
+	CMD_HOST_DEF(enable_host_flap_detection),
+	CMD_HOST_DEF(disable_host_flap_detection),
+	CMD_SERVICE_DEF(enable_service_flap_detection),
+	CMD_SERVICE_DEF(disable_service_flap_detection),
+	{ "schedule_host_check", CMD_HOST, NULL, NULL, NULL,
+		cmd_schedule_check },
+	{ "schedule_service_check", CMD_SERVICE, NULL, NULL, NULL,
+		cmd_schedule_check },
+	{ "disable_and_propagate_notifications", CMD_HOST, NULL, NULL, NULL,
+		cmd_propagate_notifications },
+	{ "enable_and_propagate_notifications", CMD_HOST, NULL, NULL, NULL,
+		cmd_propagate_notifications },
+#ifdef HAVE_DELETE_DOWNTIME_LONGNAME
+	{ "delete_downtime", CMD_OBJECT, NULL, NULL, NULL,
+		cmd_delete_downtime },
+#endif
+	{ NULL }
+};
+
+// Must be a power of two larger than the number of commands
+#define CMD_TABLE_SIZE 256
+static const struct cmd_def * cmd_table[CMD_TABLE_SIZE];
+static uint32_t cmd_seed;
+static int cmd_table_ready = 0;
+
+static uint32_t cmd_hash(const char * name, uint32_t seed) {
+	uint32_t h = seed;
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619;
 	}
+	// Finalize so every seed bit reaches the low bits used for the slot
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h & (CMD_TABLE_SIZE - 1);
+}
 
-	log_debug_info(DEBUGL_EXTERNALCOMMANDS, DEBUGV_BASIC,
-		"Received command %s via NagMQ for %s %s\n",
-		cmd_name, host_name, service_description ? service_description : "(n/a)");
+// Search for an FNV seed that puts every command name in its own slot,
+// so a lookup is one hash and one strcmp.
+static void build_cmd_table() {
+	uint32_t seed;
+	const struct cmd_def * c;
 
-	if(host_name) {
-		host_target = find_host(host_name);
-		if(host_target == NULL) {
-			logit(NSLOG_RUNTIME_WARNING, FALSE,
-				"NagMQ received command %s for host %s, but host isn't defined",
-				cmd_name, host_name);
+	for(seed = 2166136261u; seed != 2166136261u + 65536; seed++) {
+		memset(cmd_table, 0, sizeof(cmd_table));
+		for(c = cmd_defs; c->name != NULL; c++) {
+			uint32_t slot = cmd_hash(c->name, seed);
+			if(cmd_table[slot])
+				break;
+			cmd_table[slot] = c;
+		}
+		if(c->name == NULL) {
+			cmd_seed = seed;
+			cmd_table_ready = 1;
 			return;
 		}
 	}
-	if(host_target && service_description) {
-		service_target = find_service(host_name, service_description);
-		if(service_target == NULL) {
-			logit(NSLOG_RUNTIME_WARNING, FALSE,
-				"NagMQ received command %s for service %s %s, but service isn't defined",
-				cmd_name, host_name, service_description);
-			return;
+	logit(NSLOG_RUNTIME_ERROR, FALSE,
+		"NagMQ couldn't build its command table. Commands are disabled");
+	memset(cmd_table, 0, sizeof(cmd_table));
+	cmd_table_ready = 1;
+}
+
+static const struct cmd_def * find_cmd(const char * name) {
+	if(!cmd_table_ready)
+		build_cmd_table();
+	const struct cmd_def * c = cmd_table[cmd_hash(name, cmd_seed)];
+	if(c && strcmp(c->name, name) == 0)
+		return c;
+	return NULL;
+}
+
+struct cmd_ctx {
+	json_t * payload;
+	const struct cmd_def * cmd;
+	int glob, all_services;
+	// Objects already applied to, so overlapping selectors only apply
+	// the command once. Open addressing on the object pointer.
+	void ** seen;
+	size_t seen_size, seen_used;
+	size_t applied, failed;
+};
+
+static uint32_t ptr_hash(void * ptr) {
+	uintptr_t h = (uintptr_t)ptr;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return (uint32_t)h;
+}
+
+// Returns 1 if obj was already applied to, otherwise remembers it
+static int cmd_seen(struct cmd_ctx * ctx, void * obj) {
+	size_t i, slot;
+
+	if((ctx->seen_used + 1) * 2 > ctx->seen_size) {
+		size_t size = ctx->seen_size ? ctx->seen_size * 2 : 64;
+		void ** seen = calloc(size, sizeof(void*));
+		if(seen == NULL)
+			return 0;
+		for(i = 0; i < ctx->seen_size; i++) {
+			if(ctx->seen[i] == NULL)
+				continue;
+			slot = ptr_hash(ctx->seen[i]) & (size - 1);
+			while(seen[slot])
+				slot = (slot + 1) & (size - 1);
+			seen[slot] = ctx->seen[i];
 		}
+		free(ctx->seen);
+		ctx->seen = seen;
+		ctx->seen_size = size;
 	}
 
-	if(strcmp(cmd_name, "disable_service_checks") == 0 && service_target)
-		disable_service_checks(service_target);
-	else if(strcmp(cmd_name, "enable_service_checks") == 0 && service_target)
-		enable_service_checks(service_target);
-	else if(strcmp(cmd_name, "enable_all_notifications") == 0)
-		enable_all_notifications();
-	else if(strcmp(cmd_name, "disable_all_notification") == 0)
-		disable_all_notifications();
-	else if(strcmp(cmd_name, "enable_service_notifications") == 0 && service_target)
-		enable_service_notifications(service_target);
-	else if(strcmp(cmd_name, "disable_service_notifications") == 0 && service_target)
-		disable_service_notifications(service_target);
-	else if(strcmp(cmd_name, "enable_host_notifications") == 0 && host_target)
-		enable_host_notifications(host_target);
-	else if(strcmp(cmd_name, "disable_host_notifications") == 0 && host_target)
-		disable_host_notifications(host_target);
-	else if(strcmp(cmd_name, "remove_host_acknowledgement") == 0 && host_target)
-		remove_host_acknowledgement(host_target);
-	else if(strcmp(cmd_name, "remove_service_acknowledgement") == 0 && service_target)
-		remove_service_acknowledgement(service_target);
-	else if(strcmp(cmd_name, "start_executing_service_checks") == 0)
-		start_executing_service_checks();
-	else if(strcmp(cmd_name, "stop_executing_service_checks") == 0)
-		stop_executing_service_checks();
-	else if(strcmp(cmd_name, "start_accepting_passive_service_checks") == 0)
-		start_accepting_passive_service_checks();
-	else if(strcmp(cmd_name, "stop_accepting_passive_service_checks") == 0)
-		stop_accepting_passive_service_checks();
-	else if(strcmp(cmd_name, "enable_passive_service_checks") == 0 && service_target)
-		enable_passive_service_checks(service_target);
-	else if(strcmp(cmd_name, "disable_passive_service_checks") == 0 && service_target)
-		disable_passive_service_checks(service_target);
-	else if(strcmp(cmd_name, "start_using_event_handlers") == 0)
-		start_using_event_handlers();
-	else if(strcmp(cmd_name, "stop_using_event_handlers") == 0)
-		stop_using_event_handlers();
-	else if(strcmp(cmd_name, "enable_service_event_handler") == 0 && service_target)
-		enable_service_event_handler(service_target);
-	else if(strcmp(cmd_name, "disable_service_event_handler") == 0 && service_target)
-		disable_service_event_handler(service_target);
-	else if(strcmp(cmd_name, "enable_host_event_handler") == 0 && host_target)
-		enable_host_event_handler(host_target);
-	else if(strcmp(cmd_name, "disable_host_event_handler") == 0 && host_target)
-		disable_host_event_handler(host_target);
-	else if(strcmp(cmd_name, "enable_host_checks") == 0 && host_target)
-		enable_host_checks(host_target);
-	else if(strcmp(cmd_name, "disable_host_checks") == 0 && host_target)
-		disable_host_checks(host_target);
-	else if(strcmp(cmd_name, "enable_service_freshness_checks") == 0)
-		enable_service_freshness_checks();
-	else if(strcmp(cmd_name, "start_obsessing_over_service") == 0 && service_target)
-		start_obsessing_over_service(service_target);
-	else if(strcmp(cmd_name, "stop_obsessing_over_service") == 0 && service_target)
-		stop_obsessing_over_service(service_target);
-	else if(strcmp(cmd_name, "start_obsessing_over_host") == 0 && host_target)
-		start_obsessing_over_host(host_target);
-	else if(strcmp(cmd_name, "stop_obsessing_over_host") == 0 && host_target)
-		stop_obsessing_over_host(host_target);
-	else if(strcmp(cmd_name, "enable_performance_data") == 0)
-		enable_performance_data();
-	else if(strcmp(cmd_name, "disable_performance_data") == 0)
-		disable_performance_data();
-	else if(strcmp(cmd_name, "start_executing_host_checks") == 0)
-		start_executing_host_checks();
-	else if(strcmp(cmd_name, "stop_executing_host_checks") == 0)
-		stop_executing_host_checks();
-	else if(strcmp(cmd_name, "start_accepting_passive_host_checks") == 0)
-		start_accepting_passive_host_checks();
-	else if(strcmp(cmd_name, "stop_accepting_passive_host_checks") == 0)
-		stop_accepting_passive_host_checks();
-	else if(strcmp(cmd_name, "enable_passive_host_checks") == 0 && host_target)
-		enable_passive_host_checks(host_target);
-	else if(strcmp(cmd_name, "disable_passive_host_checks") == 0 && host_target)
-		disable_passive_host_checks(host_target);
-	else if(strcmp(cmd_name, "enable_host_flap_detection") == 0 && host_target)
-		enable_host_flap_detection(host_target);
-	else if(strcmp(cmd_name, "disable_host_flap_detection") == 0 && host_target)
-		disable_host_flap_detection(host_target);
-	else if(strcmp(cmd_name, "enable_service_flap_detection") == 0 && service_target)
-		enable_service_flap_detection(service_target);
-	else if(strcmp(cmd_name, "disable_service_flap_detection") == 0 && service_target)
-		disable_service_flap_detection(service_target);
-	else if((strcmp(cmd_name, "schedule_host_check") == 0 && host_target) ||
-		(strcmp(cmd_name, "schedule_service_check") == 0&& service_target)) {
-		time_t next_check;
-		int force_execution = 0, freshness_check = 0, orphan_check = 0;
-		if(get_values(payload,
-			"next_check", JSON_INTEGER, 1, &next_check,
-			"force_execution", JSON_TRUE, 0, &force_execution,
-			"freshness_check", JSON_TRUE, 0, &freshness_check,
-			"orphan_check", JSON_TRUE, 0, &orphan_check,
-			NULL) != 0) {
-			logit(NSLOG_RUNTIME_WARNING, FALSE,
-				"Received a %s request via NagMQ for %s %s, but a parameter was missing or invalid",
-				cmd_name, host_name, service_description ? service_description : "(n/a)");
+	slot = ptr_hash(obj) & (ctx->seen_size - 1);
+	while(ctx->seen[slot]) {
+		if(ctx->seen[slot] == obj)
+			return 1;
+		slot = (slot + 1) & (ctx->seen_size - 1);
+	}
+	ctx->seen[slot] = obj;
+	ctx->seen_used++;
+	return 0;
+}
+
+static int name_matches(struct cmd_ctx * ctx, const char * pattern,
+	const char * name) {
+	if(ctx->glob)
+		return fnmatch(pattern, name, 0) == 0;
+	return strcmp(pattern, name) == 0;
+}
+
+static void apply_cmd(struct cmd_ctx * ctx, host * host_target,
+	service * service_target) {
+	const struct cmd_def * cmd = ctx->cmd;
+
+	if(cmd_seen(ctx, service_target ? (void*)service_target : (void*)host_target))
+		return;
+	if(cmd->custom_fn) {
+		if(cmd->custom_fn(ctx->payload, cmd, host_target, service_target) != 0) {
+			ctx->failed++;
 			return;
 		}
-		int flags = CHECK_OPTION_NONE;
-		if(force_execution)
-			flags |= CHECK_OPTION_FORCE_EXECUTION;
-		if(freshness_check)
-			flags |= CHECK_OPTION_FRESHNESS_CHECK;
-		if(orphan_check)
-			flags |= CHECK_OPTION_ORPHAN_CHECK;
-		if(service_target)
-			schedule_service_check(service_target, next_check, flags);
-		else
-			schedule_host_check(host_target, next_check, flags);
-	}
-	else if((strcmp(cmd_name, "disable_and_propagate_notifications") == 0||
-		strcmp(cmd_name, "enable_and_propagate_notifications") == 0) &&
-		host_target) {
-		int affect_top_host = 0, affect_hosts = 0, affect_services = 0,
-			level = 0;
-		if(get_values(payload,
-			"affect_top_host", JSON_TRUE, 0, &affect_top_host,
-			"affect_hosts", JSON_TRUE, 0, &affect_hosts,
-			"affect_services", JSON_TRUE, 0, &affect_services,
-			"level", JSON_INTEGER, 0, &level,
+	} else if(service_target)
+		cmd->service_fn(service_target);
+	else
+		cmd->host_fn(host_target);
+	ctx->applied++;
+}
+
+// A host selected for a service command stands for its services matching
+// svcname. Without svcname it only stands for all of them if the command
+// has "all_services" set; otherwise the target is incomplete and fails.
+static void apply_host_target(struct cmd_ctx * ctx, host * host_target,
+	const char * svcname) {
+	servicesmember * slck;
+
+	if(ctx->cmd->target == CMD_HOST ||
+		(ctx->cmd->target == CMD_OBJECT && !svcname)) {
+		apply_cmd(ctx, host_target, NULL);
+		return;
+	}
+	if(!svcname && !ctx->all_services) {
+		ctx->failed++;
+		return;
+	}
+
+	for(slck = host_target->services; slck; slck = slck->next) {
+		service * svc = slck->service_ptr;
+		if(svcname && !name_matches(ctx, svcname, svc->description))
+			continue;
+		apply_cmd(ctx, host_target, svc);
+	}
+}
+
+// A service selected for a host command stands for its host.
+static void apply_service_target(struct cmd_ctx * ctx,
+	service * service_target) {
+	host * host_target = service_target->host_ptr;
+
+	if(ctx->cmd->target == CMD_HOST)
+		apply_cmd(ctx, host_target, NULL);
+	else
+		apply_cmd(ctx, host_target, service_target);
+}
+
+static void apply_host_name(struct cmd_ctx * ctx, char * host_name,
+	const char * svcname) {
+	host * hlck;
+
+	if(!ctx->glob) {
+		if((hlck = find_host(host_name)) != NULL)
+			apply_host_target(ctx, hlck, svcname);
+		return;
+	}
+
+	for(hlck = host_list; hlck; hlck = hlck->next) {
+		if(name_matches(ctx, host_name, hlck->name))
+			apply_host_target(ctx, hlck, svcname);
+	}
+}
+
+// Targets can be selected with any combination of
+//  - "host_name" and "service_description"
+//  - "targets", an array of host names or of objects with "host_name"
+//    and optionally "service_description"
+//  - "hostgroup_name" and "servicegroup_name"
+// If "glob" is true, host and service names are fnmatch patterns. A
+// service command given only hosts needs "all_services" set to apply to
+// every service on them. Each object is applied to at most once.
+static int resolve_targets(struct cmd_ctx * ctx) {
+	char * host_name = NULL, *service_description = NULL,
+		*hostgroup_name = NULL, *servicegroup_name = NULL;
+	json_t * targets = NULL;
+	hostgroup * hg = NULL;
+	servicegroup * sg = NULL;
+	size_t i;
+
+	if(get_values(ctx->payload,
+		"host_name", JSON_STRING, 0, &host_name,
+		"service_description", JSON_STRING, 0, &service_description,
+		"targets", JSON_ARRAY, 0, &targets,
+		"hostgroup_name", JSON_STRING, 0, &hostgroup_name,
+		"servicegroup_name", JSON_STRING, 0, &servicegroup_name,
+		"glob", JSON_TRUE, 0, &ctx->glob,
+		"all_services", JSON_TRUE, 0, &ctx->all_services,
+		NULL) != 0)
+		return -1;
+
+	// Groups are looked up before anything is applied, so a bad name
+	// doesn't leave the command half done
+	if(hostgroup_name && (hg = find_hostgroup(hostgroup_name)) == NULL)
+		return -1;
+	if(servicegroup_name &&
+		(sg = find_servicegroup(servicegroup_name)) == NULL)
+		return -1;
+
+	if(host_name)
+		apply_host_name(ctx, host_name, service_description);
+
+	for(i = 0; targets && i < json_array_size(targets); i++) {
+		json_t * target = json_array_get(targets, i);
+		char * target_host = NULL, *target_service = NULL;
+
+		if(json_is_string(target))
+			target_host = (char*)json_string_value(target);
+		else if(get_values(target,
+			"host_name", JSON_STRING, 1, &target_host,
+			"service_description", JSON_STRING, 0, &target_service,
 			NULL) != 0) {
-			logit(NSLOG_RUNTIME_WARNING, FALSE,
-				"Received a %s request via NagMQ for %s %s, but a parameter was missing or invalid",
-				cmd_name, host_name, service_description ? service_description : "(n/a)");
-			return;
+			ctx->failed++;
+			continue;
 		}
-		if(strcmp(cmd_name, "disable_and_propagate_notifications") == 0)
-			disable_and_propagate_notifications(host_target, level,
-				affect_top_host, affect_hosts, affect_services);
-		else if(strcmp(cmd_name, "enable_and_propagate_notifications") == 0)
-			enable_and_propagate_notifications(host_target, level,
-				affect_top_host, affect_hosts, affect_services);
+		apply_host_name(ctx, target_host, target_service);
 	}
-#ifdef HAVE_DELETE_DOWNTIME_LONGNAME
-	else if(strcmp(cmd_name, "delete_downtime") == 0) {
-		char * comment = NULL;
-		time_t start_time = 0;
-		get_values(payload,
-			"comment", JSON_STRING, 0, &comment,
-			"start_time", JSON_INTEGER, 0, &start_time,
-			NULL);
-		delete_downtime_by_hostname_service_description_start_time_comment(
-			host_name, service_description, start_time, comment);
+
+	if(hg) {
+		hostsmember * hlck;
+		for(hlck = hg->members; hlck; hlck = hlck->next)
+			apply_host_target(ctx, hlck->host_ptr, service_description);
 	}
-#endif
+
+	if(sg) {
+		servicesmember * slck;
+		for(slck = sg->members; slck; slck = slck->next)
+			apply_service_target(ctx, slck->service_ptr);
+	}
+
+	return 0;
 }
 
-void process_pull_msg(zmq_msg_t * payload_msg) {
-	char * type = NULL;
-	json_error_t errobj;
+static void send_cmd_summary(const char * target, const char * cmd_name,
+	size_t applied, size_t failed) {
+	struct payload * po = payload_new();
+	if(po == NULL)
+		return;
 
-	// Silently discard any empty messages.
-	if(zmq_msg_size(payload_msg) == 0)
+	payload_new_string(po, "type", "command_result");
+	payload_new_string(po, "pong_target", (char*)target);
+	payload_new_string(po, "command_name", (char*)cmd_name);
+	payload_new_integer(po, "applied", applied);
+	payload_new_integer(po, "failed", failed);
+	payload_finalize(po);
+	process_payload(po);
+}
+
+static void process_cmd(json_t * payload) {
+	char * cmd_name, *replyto = NULL;
+	struct cmd_ctx ctx;
+
+	if(get_values(payload,
+		"command_name", JSON_STRING, 1, &cmd_name,
+		"replyto", JSON_STRING, 0, &replyto,
+		NULL) != 0) {
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ received a command with invalid parameters");
 		return;
+	}
 
-	json_t * payload = json_loadb(zmq_msg_data(payload_msg),
-		zmq_msg_size(payload_msg), 0, &errobj);
-	if(payload == NULL) {
+	const struct cmd_def * cmd = find_cmd(cmd_name);
+	if(cmd == NULL) {
 		logit(NSLOG_RUNTIME_WARNING, FALSE,
-			"NagMQ received a command, but it wasn't valid JSON. %s at position %d",
-			errobj.text, errobj.position);
+			"NagMQ received unknown command %s", cmd_name);
 		return;
 	}
 
-	if(get_values(payload,
-		"type", JSON_STRING, 1, &type,
-		NULL) != 0) {
+	log_debug_info(DEBUGL_EXTERNALCOMMANDS, DEBUGV_BASIC,
+		"Received command %s via NagMQ\n", cmd_name);
+
+	if(cmd->target == CMD_GLOBAL) {
+		cmd->global_fn();
+		if(replyto)
+			send_cmd_summary(replyto, cmd_name, 1, 0);
+		return;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.payload = payload;
+	ctx.cmd = cmd;
+	if(resolve_targets(&ctx) != 0) {
 		logit(NSLOG_RUNTIME_WARNING, FALSE,
-			"NagMQ received an invalid command - it had no type field");
-		json_decref(payload);
+			"NagMQ received command %s with invalid or undefined targets",
+			cmd_name);
+		// Nothing was applied
+		if(replyto)
+			send_cmd_summary(replyto, cmd_name, 0, 1);
+		free(ctx.seen);
 		return;
 	}
+	free(ctx.seen);
+
+	if(ctx.applied == 0 || ctx.failed > 0)
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ applied command %s to %lu objects (%lu failed)",
+			cmd_name, (unsigned long)ctx.applied, (unsigned long)ctx.failed);
+	else
+		log_debug_info(DEBUGL_EXTERNALCOMMANDS, DEBUGV_BASIC,
+			"Applied command %s via NagMQ to %lu objects\n",
+			cmd_name, (unsigned long)ctx.applied);
 
+	if(replyto)
+		send_cmd_summary(replyto, cmd_name, ctx.applied, ctx.failed);
+}
+
+static void dispatch_pull_msg(json_t * payload, const char * type) {
 	if(strcmp(type, "command") == 0)
 		process_cmd(payload);
 	else if(strcmp(type, "host_check_processed") == 0 ||
 		strcmp(type, "service_check_processed") == 0)
 		process_status(payload);
+	else if(strcmp(type, "check_result_batch") == 0)
+		process_status_batch(payload);
 	else if(strcmp(type, "acknowledgement") == 0)
 		process_acknowledgement(payload);
 	else if(strcmp(type, "comment_add") == 0)
@@ -611,6 +951,425 @@ void process_pull_msg(zmq_msg_t * payload_msg) {
 		process_bulkstate(payload);
 	else if(strcmp(type, "ping") == 0)
 		process_ping(payload);
+}
+
+static void handle_pull_msg(zmq_msg_t * payload_msg) {
+	char * type = NULL;
+	json_error_t errobj;
+
+	// Silently discard any empty messages.
+	if(zmq_msg_size(payload_msg) == 0)
+		return;
+
+	json_t * payload = json_loadb(zmq_msg_data(payload_msg),
+		zmq_msg_size(payload_msg), 0, &errobj);
+	if(payload == NULL) {
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ received a command, but it wasn't valid JSON. %s at position %d",
+			errobj.text, errobj.position);
+		return;
+	}
+
+	if(get_values(payload,
+		"type", JSON_STRING, 1, &type,
+		NULL) != 0) {
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"NagMQ received an invalid command - it had no type field");
+		json_decref(payload);
+		return;
+	}
+
+	dispatch_pull_msg(payload, type);
 	json_decref(payload);
 	return;
 }
+
+// Nothing parsed from a pull message is kept once it's been handled, so
+// the whole message is parsed into the jansson arena.
+void process_pull_msg(zmq_msg_t * payload_msg) {
+	arena_begin();
+	handle_pull_msg(payload_msg);
+	arena_reset();
+}
+
+#ifdef HAVE_PULL_INGEST
+// Pull socket ingest thread
+//
+// When "ingest_thread" is set in the pull config, a separate thread owns
+// the pull socket. It parses each message and decodes check results into
+// records, then hands the records to the main thread through a lock-free
+// queue and wakes it with an eventfd registered with the iobroker. Object
+// lookups still happen on the main thread, since the object lists aren't
+// safe to read while Nagios reloads them. Once "ingest_max_pending" records
+// are waiting (default 10000), the thread stops reading until the main
+// thread has caught up to half of that, so the pull socket's high water
+// mark pushes back on senders instead of records piling up in memory.
+
+struct ingest_node {
+	struct ingest_node * next;
+};
+
+struct ingest_record {
+	struct ingest_node node;
+	// A message for the main thread to dispatch, when it isn't a check result
+	json_t * payload;
+	// A message to log instead of applying anything
+	char * error;
+	int batch;
+	size_t total, invalid, nresults;
+	check_result results[];
+};
+
+// Intrusive multi-producer single-consumer queue after Dmitry Vyukov's
+static struct ingest_node * ingest_head, * ingest_tail, ingest_stub;
+
+static void ingest_push(struct ingest_node * n) {
+	struct ingest_node * prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&ingest_head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static struct ingest_record * ingest_pop() {
+	struct ingest_node * tail = ingest_tail, *head;
+	struct ingest_node * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if(tail == &ingest_stub) {
+		if(next == NULL)
+			return NULL;
+		ingest_tail = tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if(next) {
+		ingest_tail = next;
+		return (struct ingest_record*)tail;
+	}
+
+	// The producer is between the exchange and the store in ingest_push.
+	// It'll signal the eventfd when it's done, so come back then.
+	head = __atomic_load_n(&ingest_head, __ATOMIC_ACQUIRE);
+	if(tail != head)
+		return NULL;
+
+	ingest_push(&ingest_stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next) {
+		ingest_tail = next;
+		return (struct ingest_record*)tail;
+	}
+	return NULL;
+}
+
+extern iobroker_set *nagios_iobs;
+static pthread_t ingest_tid;
+static int ingest_fd = -1, ingest_stop = 0;
+static void * ingest_sock = NULL;
+static int ingest_pending = 0, ingest_max_pending = 10000;
+static pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ingest_drained = PTHREAD_COND_INITIALIZER;
+int pull_ingest_running = 0;
+
+static struct ingest_record * new_ingest_record(size_t nresults) {
+	return calloc(1, sizeof(struct ingest_record) +
+		(nresults * sizeof(check_result)));
+}
+
+static struct ingest_record * ingest_error(const char * fmt, ...) {
+	struct ingest_record * rec = new_ingest_record(0);
+	char buf[512];
+	va_list ap;
+
+	if(rec == NULL)
+		return NULL;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	rec->error = strdup(buf);
+	return rec;
+}
+
+static struct ingest_record * ingest_decode(zmq_msg_t * msg) {
+	struct ingest_record * rec = NULL;
+	json_t * payload, *results;
+	json_error_t errobj;
+	char * type;
+	size_t i;
+
+	if(zmq_msg_size(msg) == 0)
+		return NULL;
+
+	arena_begin();
+	payload = json_loadb(zmq_msg_data(msg), zmq_msg_size(msg), 0, &errobj);
+	if(payload == NULL)
+		rec = ingest_error(
+			"NagMQ received a command, but it wasn't valid JSON. %s at position %d",
+			errobj.text, errobj.position);
+	else if(get_values(payload,
+		"type", JSON_STRING, 1, &type,
+		NULL) != 0)
+		rec = ingest_error(
+			"NagMQ received an invalid command - it had no type field");
+	else if(strcmp(type, "host_check_processed") == 0 ||
+		strcmp(type, "service_check_processed") == 0) {
+		if((rec = new_ingest_record(1)) != NULL) {
+			rec->total = 1;
+			if(decode_check_result(payload, &rec->results[0]) == CHECK_RESULT_OK)
+				rec->nresults = 1;
+			else
+				rec->invalid = 1;
+		}
+	} else if(strcmp(type, "check_result_batch") == 0) {
+		if(get_values(payload,
+			"results", JSON_ARRAY, 1, &results,
+			NULL) != 0)
+			rec = ingest_error(
+				"NagMQ received a check result batch without a results array");
+		else if((rec = new_ingest_record(json_array_size(results))) != NULL) {
+			rec->batch = 1;
+			rec->total = json_array_size(results);
+			for(i = 0; i < rec->total; i++) {
+				if(decode_check_result(json_array_get(results, i),
+					&rec->results[rec->nresults]) == CHECK_RESULT_OK)
+					rec->nresults++;
+				else
+					rec->invalid++;
+			}
+		}
+	} else if((rec = new_ingest_record(0)) != NULL) {
+		// Everything else is dispatched on the main thread, so it has to
+		// be copied out of this thread's arena.
+		arena_pause();
+		rec->payload = json_deep_copy(payload);
+	}
+	arena_reset();
+
+	return rec;
+}
+
+// Waits for the main thread to apply records until no more than half of
+// ingest_max_pending are left, or the thread is told to stop.
+static void ingest_wait_drained() {
+	struct timespec until;
+
+	pthread_mutex_lock(&ingest_lock);
+	while(__atomic_load_n(&ingest_pending, __ATOMIC_ACQUIRE) >
+		ingest_max_pending / 2 &&
+		!__atomic_load_n(&ingest_stop, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += 500000000;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ingest_drained, &ingest_lock, &until);
+	}
+	pthread_mutex_unlock(&ingest_lock);
+}
+
+// Called on the main thread for each record it's done with
+static void ingest_release() {
+	if(__atomic_sub_fetch(&ingest_pending, 1, __ATOMIC_ACQ_REL) ==
+		ingest_max_pending / 2) {
+		pthread_mutex_lock(&ingest_lock);
+		pthread_cond_signal(&ingest_drained);
+		pthread_mutex_unlock(&ingest_lock);
+	}
+}
+
+#define INGEST_BATCH 64
+
+static void * ingest_main(void * unused) {
+	zmq_pollitem_t item;
+	uint64_t one = 1;
+
+	memset(&item, 0, sizeof(item));
+	item.socket = ingest_sock;
+	item.events = ZMQ_POLLIN;
+
+	while(!__atomic_load_n(&ingest_stop, __ATOMIC_ACQUIRE)) {
+		int queued = 0;
+		int rc;
+
+		if(__atomic_load_n(&ingest_pending, __ATOMIC_ACQUIRE) >=
+			ingest_max_pending) {
+			ingest_wait_drained();
+			continue;
+		}
+		rc = zmq_poll(&item, 1, 500 * ZMQ_POLL_MSEC);
+		if(rc == -1 && errno == ETERM)
+			break;
+		if(rc < 1)
+			continue;
+
+		// Wake the main thread after every few records rather than after
+		// the whole burst, and leave the rest in the socket at the limit.
+		while(queued < INGEST_BATCH &&
+			__atomic_load_n(&ingest_pending, __ATOMIC_ACQUIRE) <
+			ingest_max_pending) {
+			zmq_msg_t input;
+			struct ingest_record * rec;
+
+			zmq_msg_init(&input);
+			if(zmq_msg_recv(&input, ingest_sock, ZMQ_DONTWAIT) == -1) {
+				zmq_msg_close(&input);
+				if(errno == EINTR)
+					continue;
+				break;
+			}
+			rec = ingest_decode(&input);
+			zmq_msg_close(&input);
+			if(rec) {
+				__atomic_add_fetch(&ingest_pending, 1, __ATOMIC_ACQ_REL);
+				ingest_push(&rec->node);
+				queued++;
+			}
+		}
+
+		if(queued && write(ingest_fd, &one, sizeof(one)) < 0 &&
+			errno != EAGAIN)
+			break;
+	}
+	return NULL;
+}
+
+static void apply_ingest_record(struct ingest_record * rec) {
+	size_t i, noobject = 0;
+	char * type;
+
+	if(rec->error)
+		logit(NSLOG_RUNTIME_WARNING, FALSE, "%s", rec->error);
+	else if(rec->payload) {
+		if(get_values(rec->payload,
+			"type", JSON_STRING, 1, &type,
+			NULL) == 0)
+			dispatch_pull_msg(rec->payload, type);
+		json_decref(rec->payload);
+	} else {
+		for(i = 0; i < rec->nresults; i++) {
+			if(submit_check_result(&rec->results[i]) == CHECK_RESULT_NO_OBJECT)
+				noobject++;
+		}
+		if(rec->batch)
+			log_check_result_batch(rec->total, rec->invalid, noobject);
+		else if(rec->invalid)
+			log_check_result(CHECK_RESULT_INVALID);
+		else if(noobject)
+			log_check_result(CHECK_RESULT_NO_OBJECT);
+	}
+
+	free(rec->error);
+	free(rec);
+}
+
+// Applies queued records on the main thread, within the pull socket's
+// budget. If records are left over, the eventfd is signalled again so
+// the iobroker calls back on its next pass.
+static int ingest_reaper(int sd, int events, void * arg) {
+	struct ingest_record * rec;
+	struct timeval start, now;
+	uint64_t count, one = 1;
+	struct input_source * src = &pull_source;
+
+	while(read(sd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+
+	gettimeofday(&start, NULL);
+	src->batch = 0;
+	src->backlogged = 0;
+	while((rec = ingest_pop()) != NULL) {
+		apply_ingest_record(rec);
+		ingest_release();
+		src->batch++;
+
+		gettimeofday(&now, NULL);
+		long elapsed = ((now.tv_sec - start.tv_sec) * 1000) +
+			((now.tv_usec - start.tv_usec) / 1000);
+		if((src->max_messages > 0 && src->batch >= src->max_messages) ||
+			(src->max_time > 0 && elapsed >= src->max_time)) {
+			src->budget_exhausted++;
+			src->rearms++;
+			src->backlogged = 1;
+			if(write(sd, &one, sizeof(one)) < 0)
+				logit(NSLOG_RUNTIME_WARNING, FALSE,
+					"Error re-signalling NagMQ ingest queue: %s", strerror(errno));
+			break;
+		}
+	}
+
+	if(src->batch > 0) {
+		src->last_batch = src->batch;
+		src->wakeups++;
+		src->messages += src->batch;
+		if(src->batch > src->max_batch)
+			src->max_batch = src->batch;
+	}
+	return 0;
+}
+
+int start_pull_ingest(void * sock, int max_pending) {
+	int rc;
+
+	if(max_pending < 1) {
+		logit(NSLOG_CONFIG_ERROR, TRUE,
+			"NagMQ ingest_max_pending must be at least 1");
+		return -1;
+	}
+
+	ingest_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(ingest_fd < 0) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error creating NagMQ ingest eventfd: %s", strerror(errno));
+		return -1;
+	}
+
+	ingest_stub.next = NULL;
+	ingest_head = ingest_tail = &ingest_stub;
+	ingest_sock = sock;
+	ingest_stop = 0;
+	ingest_pending = 0;
+	ingest_max_pending = max_pending;
+
+	if(iobroker_register(nagios_iobs, ingest_fd, NULL, ingest_reaper) != 0) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error registering NagMQ ingest eventfd with the iobroker");
+		close(ingest_fd);
+		ingest_fd = -1;
+		return -1;
+	}
+
+	if((rc = pthread_create(&ingest_tid, NULL, ingest_main, NULL)) != 0) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error starting NagMQ ingest thread: %s", strerror(rc));
+		iobroker_unregister(nagios_iobs, ingest_fd);
+		close(ingest_fd);
+		ingest_fd = -1;
+		return -1;
+	}
+
+	pull_ingest_running = 1;
+	return 0;
+}
+
+// Stops the ingest thread and applies anything it had already queued.
+// The pull socket belongs to the main thread again afterwards.
+void stop_pull_ingest() {
+	struct ingest_record * rec;
+
+	if(!pull_ingest_running)
+		return;
+
+	__atomic_store_n(&ingest_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(ingest_tid, NULL);
+	pull_ingest_running = 0;
+
+	while((rec = ingest_pop()) != NULL) {
+		apply_ingest_record(rec);
+		ingest_release();
+	}
+
+	iobroker_unregister(nagios_iobs, ingest_fd);
+	close(ingest_fd);
+	ingest_fd = -1;
+}
+#endif
@@ -38,6 +38,300 @@ static contact * for_user = NULL;
 static service * cur_service = NULL;
 static host * cur_host = NULL;
 
+// Scalar sections of the object serializers. When a request has a "keys"
+// projection, each section is checked once per request and skipped
+// entirely if none of its keys were asked for.
+enum {
+	HOST_CONFIG,
+	HOST_STATE,
+	HOST_CHECK,
+	HOST_NOTIFICATION,
+	HOST_FLAPPING,
+	SERVICE_CONFIG,
+	SERVICE_STATE,
+	SERVICE_CHECK,
+	SERVICE_FLAPPING,
+	CONTACT_PERIODS,
+	PROJECTION_SECTIONS
+};
+
+static const char * host_config_keys[] = {
+	"initial_state",
+	"check_interval",
+	"retry_interval",
+	"max_attempts",
+	"event_handler",
+	"notification_interval",
+	"first_notification_delay",
+	"notification_period",
+	"check_period",
+	"flap_detection_enabled",
+	"low_flap_threshold",
+	"high_flap_threshold",
+	"check_freshness",
+	"freshness_threshold",
+	"process_performance_data",
+	"checks_enabled",
+	"event_handler_enabled",
+#ifndef HAVE_NAGIOS4
+	"failure_prediction_enabled",
+	"failure_prediction_options",
+	"circular_path_checked",
+	"contains_circular_path",
+#endif
+	"notes",
+	"notes_url",
+	"action_url",
+	"icon_image",
+	"icon_image_alt",
+	"vrml_image",
+	"statusmap_image",
+	"have_2d_coords",
+	"x_2d",
+	"y_2d",
+	"have_3d_coords",
+	"x_3d",
+	"y_3d",
+	"z_3d",
+	"should_be_drawn",
+	"retain_status_information",
+	"retain_nonstatus_information",
+	NULL
+};
+
+static const char * host_state_keys[] = {
+	"modified_attributes",
+	"problem_has_been_acknowledged",
+	"current_state",
+	"current_state_str",
+	"last_state",
+	"last_state_str",
+	"last_hard_state",
+	"last_hard_state_str",
+	"plugin_output",
+	"long_plugin_output",
+	"perf_data",
+	"state_type",
+	"current_attempt",
+	"current_event_id",
+	"last_event_id",
+	"current_problem_id",
+	"last_problem_id",
+	NULL
+};
+
+static const char * host_check_keys[] = {
+	"latency",
+	"execution_time",
+	"is_executing",
+	"check_options",
+	"notifications_enabled",
+	"next_check",
+	"should_be_scheduled",
+	"last_check",
+	"last_state_change",
+	"last_hard_state_change",
+	"last_time_up",
+	"last_time_down",
+	"last_time_unreachable",
+	"has_been_checked",
+	"is_being_freshened",
+	NULL
+};
+
+static const char * host_notification_keys[] = {
+#ifdef HAVE_NAGIOS4
+	"notified_on",
+	"notification_options",
+	"flap_detection_options",
+	"stalking_options",
+	"last_notification",
+	"next_notification",
+	"accept_passive_checks",
+	"obsess",
+	"check_command",
+#else
+	"notified_on_down",
+	"notified_on_unreachable",
+	"notify_on_down",
+	"notify_on_unreachable",
+	"notify_on_recovery",
+	"notify_on_flapping",
+	"notify_on_downtime",
+	"flap_detection_on_up",
+	"flap_detection_on_down",
+	"flap_detection_on_unreachable",
+	"stalk_on_up",
+	"stalk_on_down",
+	"stalk_on_unreachable",
+	"last_notification",
+	"next_notification",
+	"accept_passive_host_checks",
+	"obsess_over_host",
+	"check_command",
+#endif
+	"current_notification_number",
+	"no_more_notifications",
+	"current_notification_id",
+	"check_flapping_recovery_notification",
+	"scheduled_downtime_depth",
+	"pending_flex_downtime",
+	NULL
+};
+
+static const char * host_flapping_keys[] = {
+	"last_state_history_update",
+	"is_flapping",
+	"flapping_comment_id",
+	"percent_state_change",
+	"total_service_check_interval",
+	NULL
+};
+
+static const char * service_config_keys[] = {
+	"notification_interval",
+	"first_notification_delay",
+#ifdef HAVE_NAGIOS4
+	"notification_options",
+	"stalking_options",
+	"flap_detection_options",
+	"notified_on",
+	"obsess",
+	"check_command",
+	"accept_passive_checks",
+#else
+	"notify_on_unknown",
+	"notify_on_warning",
+	"notify_on_critical",
+	"notify_on_recovery",
+	"notify_on_flapping",
+	"notify_on_downtime",
+	"stalk_on_ok",
+	"stalk_on_warning",
+	"stalk_on_unknown",
+	"stalk_on_critical",
+	"flap_detection_on_ok",
+	"flap_detection_on_warning",
+	"flap_detection_on_unknown",
+	"flap_detection_on_critical",
+	"notified_on_unknown",
+	"notified_on_warning",
+	"notified_on_critical",
+	"obsess_over_service",
+	"check_command",
+	"accept_passive_service_checks",
+#endif
+	"is_volatile",
+	"notification_period",
+	"check_period",
+	"flap_detection_enabled",
+	"low_flap_threshold",
+	"high_flap_threshold",
+	"process_performance_data",
+	"check_freshness",
+	"freshness_threshold",
+	"event_handler_enabled",
+	"checks_enabled",
+	"notifications_enabled",
+#ifndef HAVE_NAGIOS4
+	"failure_prediction_enabled",
+	"failure_prediction_options",
+#endif
+	"notes",
+	"notes_url",
+	"action_url",
+	"icon_image",
+	"icon_image_alt",
+	NULL
+};
+
+static const char * service_state_keys[] = {
+	"modified_attributes",
+	"retain_status_information",
+	"retain_nonstatus_information",
+	"problem_has_been_acknowledged",
+	"host_problem_at_last_check",
+	"current_state",
+	"current_state_str",
+	"last_state",
+	"last_state_str",
+	"last_hard_state",
+	"last_hard_state_str",
+	"plugin_output",
+	"long_plugin_output",
+	"perf_data",
+	"state_type",
+	NULL
+};
+
+static const char * service_check_keys[] = {
+	"next_check",
+	"should_be_scheduled",
+	"last_check",
+	"current_attempt",
+	"current_event_id",
+	"last_event_id",
+	"current_problem_id",
+	"last_problem_id",
+	"last_notification",
+	"next_notification",
+	"no_more_notifications",
+	"check_flapping_recovery_notification",
+	"last_state_change",
+	"last_hard_state_change",
+	"last_time_ok",
+	"last_time_warning",
+	"last_time_unknown",
+	"last_time_critical",
+	"has_been_checked",
+	"is_being_freshened",
+	"current_notification_number",
+	"current_notification_id",
+	"latency",
+	"execution_time",
+	"is_executing",
+	"check_options",
+	"scheduled_downtime_depth",
+	"pending_flex_downtime",
+	NULL
+};
+
+static const char * service_flapping_keys[] = {
+	"is_flapping",
+	"flapping_comment_id",
+	"percent_state_change",
+	NULL
+};
+
+static const char * contact_period_keys[] = {
+	"in_host_notification_period",
+	"in_service_notification_period",
+	"next_host_notification_time",
+	"next_service_notification_time",
+	NULL
+};
+
+static const char ** projection_keys[PROJECTION_SECTIONS] = {
+	host_config_keys,
+	host_state_keys,
+	host_check_keys,
+	host_notification_keys,
+	host_flapping_keys,
+	service_config_keys,
+	service_state_keys,
+	service_check_keys,
+	service_flapping_keys,
+	contact_period_keys
+};
+
+static int projection[PROJECTION_SECTIONS];
+
+static void compute_projection(struct payload * po) {
+	int i;
+	for(i = 0; i < PROJECTION_SECTIONS; i++)
+		projection[i] = payload_has_key_list(po, projection_keys[i]);
+}
+
 static void parse_service(service * state, struct payload * ret);
 static void parse_host(host * state, struct payload * ret);
 static void parse_contact(contact * state, struct payload * ret);
@@ -45,6 +339,8 @@ static void parse_contactgroup(contactgroup * state, struct payload * ret);
 
 static void parse_custom_variables(struct payload * ret,
 	customvariablesmember * cvl) {
+	// Requested variable names are kept by name, so each variable goes
+	// through the same projection in payload_add_key as any other key.
 	while(cvl) {
 		payload_new_string(ret, cvl->variable_name, cvl->variable_value);
 		cvl = cvl->next;
@@ -179,11 +475,13 @@ static void parse_timeperiod(timeperiod * state, struct payload * ret) {
 		}
 	}
 
-	time(&now);
-	payload_new_boolean(ret, "in_timeperiod",
-		(check_time_against_period(now, state) == 0));
-	get_next_valid_time(now, &now, state);
-	payload_new_integer(ret, "next_valid_time", now);
+	if(payload_has_keys(ret, "in_timeperiod", "next_valid_time", NULL)) {
+		time(&now);
+		payload_new_boolean(ret, "in_timeperiod",
+			(check_time_against_period(now, state) == 0));
+		get_next_valid_time(now, &now, state);
+		payload_new_integer(ret, "next_valid_time", now);
+	}
 	
 	timeperiodexclusion * tpelck = state->exclusions;
 	if(tpelck && payload_start_array(ret, "exclusions")) {
@@ -268,114 +566,122 @@ static void parse_host(host * state, struct payload * ret) {
 	} else
 		payload_new_string(ret, "hostgroups", NULL);
 
-	payload_new_integer(ret, "initial_state", state->initial_state);
-	payload_new_double(ret, "check_interval", state->check_interval);
-	payload_new_double(ret, "retry_interval", state->retry_interval);
-	payload_new_integer(ret, "max_attempts", state->max_attempts);
-	payload_new_string(ret, "event_handler", state->event_handler);
-	payload_new_double(ret, "notification_interval", state->notification_interval);
-	payload_new_double(ret, "first_notification_delay", state->first_notification_delay);
-	payload_new_string(ret, "notification_period", state->notification_period);
-	payload_new_string(ret, "check_period", state->check_period);
-	payload_new_boolean(ret, "flap_detection_enabled", state->flap_detection_enabled);
-	payload_new_double(ret, "low_flap_threshold", state->low_flap_threshold);
-	payload_new_double(ret, "high_flap_threshold", state->high_flap_threshold);
-	payload_new_boolean(ret, "check_freshness", state->check_freshness);
-	payload_new_integer(ret, "freshness_threshold", state->freshness_threshold);
-	payload_new_boolean(ret, "process_performance_data", state->process_performance_data);
-	payload_new_boolean(ret, "checks_enabled", state->checks_enabled);
-	payload_new_boolean(ret, "event_handler_enabled", state->event_handler_enabled);
+	if(projection[HOST_CONFIG]) {
+		payload_new_integer(ret, "initial_state", state->initial_state);
+		payload_new_double(ret, "check_interval", state->check_interval);
+		payload_new_double(ret, "retry_interval", state->retry_interval);
+		payload_new_integer(ret, "max_attempts", state->max_attempts);
+		payload_new_string(ret, "event_handler", state->event_handler);
+		payload_new_double(ret, "notification_interval", state->notification_interval);
+		payload_new_double(ret, "first_notification_delay", state->first_notification_delay);
+		payload_new_string(ret, "notification_period", state->notification_period);
+		payload_new_string(ret, "check_period", state->check_period);
+		payload_new_boolean(ret, "flap_detection_enabled", state->flap_detection_enabled);
+		payload_new_double(ret, "low_flap_threshold", state->low_flap_threshold);
+		payload_new_double(ret, "high_flap_threshold", state->high_flap_threshold);
+		payload_new_boolean(ret, "check_freshness", state->check_freshness);
+		payload_new_integer(ret, "freshness_threshold", state->freshness_threshold);
+		payload_new_boolean(ret, "process_performance_data", state->process_performance_data);
+		payload_new_boolean(ret, "checks_enabled", state->checks_enabled);
+		payload_new_boolean(ret, "event_handler_enabled", state->event_handler_enabled);
 #ifndef HAVE_NAGIOS4
-	payload_new_boolean(ret, "failure_prediction_enabled", state->failure_prediction_enabled);
-	payload_new_string(ret, "failure_prediction_options", state->failure_prediction_options);
-	payload_new_integer(ret, "circular_path_checked", state->circular_path_checked);
-	payload_new_integer(ret, "contains_circular_path", state->contains_circular_path);
+		payload_new_boolean(ret, "failure_prediction_enabled", state->failure_prediction_enabled);
+		payload_new_string(ret, "failure_prediction_options", state->failure_prediction_options);
+		payload_new_integer(ret, "circular_path_checked", state->circular_path_checked);
+		payload_new_integer(ret, "contains_circular_path", state->contains_circular_path);
 #endif
-	payload_new_string(ret, "notes", state->notes);
-	payload_new_string(ret, "notes_url", state->notes_url);
-	payload_new_string(ret, "action_url", state->action_url);
-	payload_new_string(ret, "icon_image", state->icon_image);
-	payload_new_string(ret, "icon_image_alt", state->icon_image_alt);
-	payload_new_string(ret, "vrml_image", state->vrml_image);
-	payload_new_string(ret, "statusmap_image", state->statusmap_image);
-	payload_new_integer(ret, "have_2d_coords", state->have_2d_coords);
-	payload_new_integer(ret, "x_2d", state->x_2d);
-	payload_new_integer(ret, "y_2d", state->y_2d);
-	payload_new_integer(ret, "have_3d_coords", state->have_3d_coords);
-	payload_new_double(ret, "x_3d", state->x_3d);
-	payload_new_double(ret, "y_3d", state->y_3d);
-	payload_new_double(ret, "z_3d", state->z_3d);
-	payload_new_integer(ret, "should_be_drawn", state->should_be_drawn);
-	payload_new_boolean(ret, "retain_status_information", state->retain_status_information);
-	payload_new_boolean(ret, "retain_nonstatus_information", state->retain_nonstatus_information);
-	payload_new_integer(ret, "modified_attributes", state->modified_attributes);
-	payload_new_boolean(ret, "problem_has_been_acknowledged", state->problem_has_been_acknowledged);
-	payload_new_integer(ret, "current_state", state->current_state);
-	payload_new_statestr(ret, "current_state_str", state->current_state, state->has_been_checked, 0);
-	payload_new_integer(ret, "last_state", state->last_state);
-	payload_new_statestr(ret, "last_state_str", state->current_state, state->has_been_checked, 0);
-	payload_new_integer(ret, "last_hard_state", state->last_hard_state);
-	payload_new_statestr(ret, "last_hard_state_str", state->last_hard_state, state->has_been_checked, 0);
-	payload_new_string(ret, "plugin_output", state->plugin_output);
-	payload_new_string(ret, "long_plugin_output", state->long_plugin_output);
-	payload_new_string(ret, "perf_data", state->perf_data);
-	payload_new_integer(ret, "state_type", state->state_type);
-	payload_new_integer(ret, "current_attempt", state->current_attempt);
-	payload_new_integer(ret, "current_event_id", state->current_event_id);
-	payload_new_integer(ret, "last_event_id", state->last_event_id);
-	payload_new_integer(ret, "current_problem_id", state->current_problem_id);
-	payload_new_integer(ret, "last_problem_id", state->last_problem_id);
-	payload_new_double(ret, "latency", state->latency);
-	payload_new_double(ret, "execution_time", state->execution_time);
-	payload_new_boolean(ret, "is_executing", state->is_executing);
-	payload_new_integer(ret, "check_options", state->check_options);
-	payload_new_boolean(ret, "notifications_enabled", state->notifications_enabled);
-	payload_new_integer(ret, "next_check", state->next_check);
-	payload_new_boolean(ret, "should_be_scheduled", state->should_be_scheduled);
-	payload_new_integer(ret, "last_check", state->last_check);
-	payload_new_integer(ret, "last_state_change", state->last_state_change);
-	payload_new_integer(ret, "last_hard_state_change", state->last_hard_state_change);
-	payload_new_integer(ret, "last_time_up", state->last_time_up);
-	payload_new_integer(ret, "last_time_down", state->last_time_down);
-	payload_new_integer(ret, "last_time_unreachable", state->last_time_unreachable);
-	payload_new_boolean(ret, "has_been_checked", state->has_been_checked);
-	payload_new_boolean(ret, "is_being_freshened", state->is_being_freshened);
+		payload_new_string(ret, "notes", state->notes);
+		payload_new_string(ret, "notes_url", state->notes_url);
+		payload_new_string(ret, "action_url", state->action_url);
+		payload_new_string(ret, "icon_image", state->icon_image);
+		payload_new_string(ret, "icon_image_alt", state->icon_image_alt);
+		payload_new_string(ret, "vrml_image", state->vrml_image);
+		payload_new_string(ret, "statusmap_image", state->statusmap_image);
+		payload_new_integer(ret, "have_2d_coords", state->have_2d_coords);
+		payload_new_integer(ret, "x_2d", state->x_2d);
+		payload_new_integer(ret, "y_2d", state->y_2d);
+		payload_new_integer(ret, "have_3d_coords", state->have_3d_coords);
+		payload_new_double(ret, "x_3d", state->x_3d);
+		payload_new_double(ret, "y_3d", state->y_3d);
+		payload_new_double(ret, "z_3d", state->z_3d);
+		payload_new_integer(ret, "should_be_drawn", state->should_be_drawn);
+		payload_new_boolean(ret, "retain_status_information", state->retain_status_information);
+		payload_new_boolean(ret, "retain_nonstatus_information", state->retain_nonstatus_information);
+	}
+	if(projection[HOST_STATE]) {
+		payload_new_integer(ret, "modified_attributes", state->modified_attributes);
+		payload_new_boolean(ret, "problem_has_been_acknowledged", state->problem_has_been_acknowledged);
+		payload_new_integer(ret, "current_state", state->current_state);
+		payload_new_statestr(ret, "current_state_str", state->current_state, state->has_been_checked, 0);
+		payload_new_integer(ret, "last_state", state->last_state);
+		payload_new_statestr(ret, "last_state_str", state->current_state, state->has_been_checked, 0);
+		payload_new_integer(ret, "last_hard_state", state->last_hard_state);
+		payload_new_statestr(ret, "last_hard_state_str", state->last_hard_state, state->has_been_checked, 0);
+		payload_new_string(ret, "plugin_output", state->plugin_output);
+		payload_new_string(ret, "long_plugin_output", state->long_plugin_output);
+		payload_new_string(ret, "perf_data", state->perf_data);
+		payload_new_integer(ret, "state_type", state->state_type);
+		payload_new_integer(ret, "current_attempt", state->current_attempt);
+		payload_new_integer(ret, "current_event_id", state->current_event_id);
+		payload_new_integer(ret, "last_event_id", state->last_event_id);
+		payload_new_integer(ret, "current_problem_id", state->current_problem_id);
+		payload_new_integer(ret, "last_problem_id", state->last_problem_id);
+	}
+	if(projection[HOST_CHECK]) {
+		payload_new_double(ret, "latency", state->latency);
+		payload_new_double(ret, "execution_time", state->execution_time);
+		payload_new_boolean(ret, "is_executing", state->is_executing);
+		payload_new_integer(ret, "check_options", state->check_options);
+		payload_new_boolean(ret, "notifications_enabled", state->notifications_enabled);
+		payload_new_integer(ret, "next_check", state->next_check);
+		payload_new_boolean(ret, "should_be_scheduled", state->should_be_scheduled);
+		payload_new_integer(ret, "last_check", state->last_check);
+		payload_new_integer(ret, "last_state_change", state->last_state_change);
+		payload_new_integer(ret, "last_hard_state_change", state->last_hard_state_change);
+		payload_new_integer(ret, "last_time_up", state->last_time_up);
+		payload_new_integer(ret, "last_time_down", state->last_time_down);
+		payload_new_integer(ret, "last_time_unreachable", state->last_time_unreachable);
+		payload_new_boolean(ret, "has_been_checked", state->has_been_checked);
+		payload_new_boolean(ret, "is_being_freshened", state->is_being_freshened);
+	}
+	if(projection[HOST_NOTIFICATION]) {
 #ifdef HAVE_NAGIOS4
-	payload_new_integer(ret, "notified_on", state->notified_on);
-	payload_new_integer(ret, "notification_options", state->notification_options);
-	payload_new_integer(ret, "flap_detection_options", state->flap_detection_options);
-	payload_new_integer(ret, "stalking_options", state->stalking_options);
-	payload_new_integer(ret, "last_notification", state->last_notification);
-	payload_new_integer(ret, "next_notification", state->next_notification);
-	payload_new_boolean(ret, "accept_passive_checks", state->accept_passive_checks);
-	payload_new_boolean(ret, "obsess", state->obsess);
-	payload_new_string(ret, "check_command", state->check_command);
+		payload_new_integer(ret, "notified_on", state->notified_on);
+		payload_new_integer(ret, "notification_options", state->notification_options);
+		payload_new_integer(ret, "flap_detection_options", state->flap_detection_options);
+		payload_new_integer(ret, "stalking_options", state->stalking_options);
+		payload_new_integer(ret, "last_notification", state->last_notification);
+		payload_new_integer(ret, "next_notification", state->next_notification);
+		payload_new_boolean(ret, "accept_passive_checks", state->accept_passive_checks);
+		payload_new_boolean(ret, "obsess", state->obsess);
+		payload_new_string(ret, "check_command", state->check_command);
 #else
-	payload_new_boolean(ret, "notified_on_down", state->notified_on_down);
-	payload_new_boolean(ret, "notified_on_unreachable", state->notified_on_unreachable);
-	payload_new_boolean(ret, "notify_on_down", state->notify_on_down);
-	payload_new_boolean(ret, "notify_on_unreachable", state->notify_on_unreachable);
-	payload_new_boolean(ret, "notify_on_recovery", state->notify_on_recovery);
-	payload_new_boolean(ret, "notify_on_flapping", state->notify_on_flapping);
-	payload_new_boolean(ret, "notify_on_downtime", state->notify_on_downtime);
-	payload_new_boolean(ret, "flap_detection_on_up", state->flap_detection_on_up);
-	payload_new_boolean(ret, "flap_detection_on_down", state->flap_detection_on_down);
-	payload_new_boolean(ret, "flap_detection_on_unreachable", state->flap_detection_on_unreachable);
-	payload_new_boolean(ret, "stalk_on_up", state->stalk_on_up);
-	payload_new_boolean(ret, "stalk_on_down", state->stalk_on_down);
-	payload_new_boolean(ret, "stalk_on_unreachable", state->stalk_on_unreachable);
-	payload_new_integer(ret, "last_notification", state->last_host_notification);
-	payload_new_integer(ret, "next_notification", state->next_host_notification);
-	payload_new_boolean(ret, "accept_passive_host_checks", state->accept_passive_host_checks);
-	payload_new_boolean(ret, "obsess_over_host", state->obsess_over_host);
-	payload_new_string(ret, "check_command", state->host_check_command);
+		payload_new_boolean(ret, "notified_on_down", state->notified_on_down);
+		payload_new_boolean(ret, "notified_on_unreachable", state->notified_on_unreachable);
+		payload_new_boolean(ret, "notify_on_down", state->notify_on_down);
+		payload_new_boolean(ret, "notify_on_unreachable", state->notify_on_unreachable);
+		payload_new_boolean(ret, "notify_on_recovery", state->notify_on_recovery);
+		payload_new_boolean(ret, "notify_on_flapping", state->notify_on_flapping);
+		payload_new_boolean(ret, "notify_on_downtime", state->notify_on_downtime);
+		payload_new_boolean(ret, "flap_detection_on_up", state->flap_detection_on_up);
+		payload_new_boolean(ret, "flap_detection_on_down", state->flap_detection_on_down);
+		payload_new_boolean(ret, "flap_detection_on_unreachable", state->flap_detection_on_unreachable);
+		payload_new_boolean(ret, "stalk_on_up", state->stalk_on_up);
+		payload_new_boolean(ret, "stalk_on_down", state->stalk_on_down);
+		payload_new_boolean(ret, "stalk_on_unreachable", state->stalk_on_unreachable);
+		payload_new_integer(ret, "last_notification", state->last_host_notification);
+		payload_new_integer(ret, "next_notification", state->next_host_notification);
+		payload_new_boolean(ret, "accept_passive_host_checks", state->accept_passive_host_checks);
+		payload_new_boolean(ret, "obsess_over_host", state->obsess_over_host);
+		payload_new_string(ret, "check_command", state->host_check_command);
 #endif
-	payload_new_integer(ret, "current_notification_number", state->current_notification_number);
-	payload_new_boolean(ret, "no_more_notifications", state->no_more_notifications);
-	payload_new_integer(ret, "current_notification_id", state->current_notification_id);
-	payload_new_boolean(ret, "check_flapping_recovery_notification", state->check_flapping_recovery_notification);
-	payload_new_integer(ret, "scheduled_downtime_depth", state->scheduled_downtime_depth);
-	payload_new_integer(ret, "pending_flex_downtime", state->pending_flex_downtime);
+		payload_new_integer(ret, "current_notification_number", state->current_notification_number);
+		payload_new_boolean(ret, "no_more_notifications", state->no_more_notifications);
+		payload_new_integer(ret, "current_notification_id", state->current_notification_id);
+		payload_new_boolean(ret, "check_flapping_recovery_notification", state->check_flapping_recovery_notification);
+		payload_new_integer(ret, "scheduled_downtime_depth", state->scheduled_downtime_depth);
+		payload_new_integer(ret, "pending_flex_downtime", state->pending_flex_downtime);
+	}
 	if(payload_start_array(ret, "state_history")) {
 		int i;
 		for(i = 0; i < state->state_history_index; i++) {
@@ -383,11 +689,13 @@ static void parse_host(host * state, struct payload * ret) {
 		}
 		payload_end_array(ret);
 	}
-	payload_new_integer(ret, "last_state_history_update", state->last_state_history_update);
-	payload_new_boolean(ret, "is_flapping", state->is_flapping);
-	payload_new_integer(ret, "flapping_comment_id", state->flapping_comment_id);
-	payload_new_double(ret, "percent_state_change", state->percent_state_change);
-	payload_new_integer(ret, "total_service_check_interval", state->total_service_check_interval);
+	if(projection[HOST_FLAPPING]) {
+		payload_new_integer(ret, "last_state_history_update", state->last_state_history_update);
+		payload_new_boolean(ret, "is_flapping", state->is_flapping);
+		payload_new_integer(ret, "flapping_comment_id", state->flapping_comment_id);
+		payload_new_double(ret, "percent_state_change", state->percent_state_change);
+		payload_new_integer(ret, "total_service_check_interval", state->total_service_check_interval);
+	}
 	parse_custom_variables(ret, state->custom_variables);
 	payload_end_object(ret);
 
@@ -477,114 +785,122 @@ static void parse_service(service * state, struct payload * ret) {
 		}
 		payload_end_array(ret);
 	} else
-		payload_new_string(ret, "parents", NULL);
+		payload_new_string(ret, "children", NULL);
 #endif
 
-	payload_new_double(ret, "notification_interval", state->notification_interval);
-	payload_new_double(ret, "first_notification_delay", state->first_notification_delay);
+	if(projection[SERVICE_CONFIG]) {
+		payload_new_double(ret, "notification_interval", state->notification_interval);
+		payload_new_double(ret, "first_notification_delay", state->first_notification_delay);
 #ifdef HAVE_NAGIOS4
-	payload_new_integer(ret, "notification_options", state->notification_options);
-	payload_new_integer(ret, "stalking_options", state->stalking_options);
-	payload_new_integer(ret, "flap_detection_options", state->flap_detection_options);
-	payload_new_integer(ret, "notified_on", state->notified_on);
-	payload_new_boolean(ret, "obsess", state->obsess);
-	payload_new_string(ret, "check_command", state->check_command);
-	payload_new_boolean(ret, "accept_passive_checks", state->accept_passive_checks);
+		payload_new_integer(ret, "notification_options", state->notification_options);
+		payload_new_integer(ret, "stalking_options", state->stalking_options);
+		payload_new_integer(ret, "flap_detection_options", state->flap_detection_options);
+		payload_new_integer(ret, "notified_on", state->notified_on);
+		payload_new_boolean(ret, "obsess", state->obsess);
+		payload_new_string(ret, "check_command", state->check_command);
+		payload_new_boolean(ret, "accept_passive_checks", state->accept_passive_checks);
 #else
-	payload_new_boolean(ret, "notify_on_unknown", state->notify_on_unknown);
-	payload_new_boolean(ret, "notify_on_warning", state->notify_on_warning);
-	payload_new_boolean(ret, "notify_on_critical", state->notify_on_critical);
-	payload_new_boolean(ret, "notify_on_recovery", state->notify_on_recovery);
-	payload_new_boolean(ret, "notify_on_flapping", state->notify_on_flapping);
-	payload_new_boolean(ret, "notify_on_downtime", state->notify_on_downtime);
-	payload_new_boolean(ret, "stalk_on_ok", state->stalk_on_ok);
-	payload_new_boolean(ret, "stalk_on_warning", state->stalk_on_warning);
-	payload_new_boolean(ret, "stalk_on_unknown", state->stalk_on_unknown);
-	payload_new_boolean(ret, "stalk_on_critical", state->stalk_on_critical);
-	payload_new_boolean(ret, "flap_detection_on_ok", state->flap_detection_on_ok);
-	payload_new_boolean(ret, "flap_detection_on_warning", state->flap_detection_on_warning);
-	payload_new_boolean(ret, "flap_detection_on_unknown", state->flap_detection_on_unknown);
-	payload_new_boolean(ret, "flap_detection_on_critical", state->flap_detection_on_critical);
-	payload_new_boolean(ret, "notified_on_unknown", state->notified_on_unknown);
-	payload_new_boolean(ret, "notified_on_warning", state->notified_on_warning);
-	payload_new_boolean(ret, "notified_on_critical", state->notified_on_critical);
-	payload_new_boolean(ret, "obsess_over_service", state->obsess_over_service);
-	payload_new_string(ret, "check_command", state->service_check_command);
-	payload_new_boolean(ret, "accept_passive_service_checks", state->accept_passive_service_checks);
+		payload_new_boolean(ret, "notify_on_unknown", state->notify_on_unknown);
+		payload_new_boolean(ret, "notify_on_warning", state->notify_on_warning);
+		payload_new_boolean(ret, "notify_on_critical", state->notify_on_critical);
+		payload_new_boolean(ret, "notify_on_recovery", state->notify_on_recovery);
+		payload_new_boolean(ret, "notify_on_flapping", state->notify_on_flapping);
+		payload_new_boolean(ret, "notify_on_downtime", state->notify_on_downtime);
+		payload_new_boolean(ret, "stalk_on_ok", state->stalk_on_ok);
+		payload_new_boolean(ret, "stalk_on_warning", state->stalk_on_warning);
+		payload_new_boolean(ret, "stalk_on_unknown", state->stalk_on_unknown);
+		payload_new_boolean(ret, "stalk_on_critical", state->stalk_on_critical);
+		payload_new_boolean(ret, "flap_detection_on_ok", state->flap_detection_on_ok);
+		payload_new_boolean(ret, "flap_detection_on_warning", state->flap_detection_on_warning);
+		payload_new_boolean(ret, "flap_detection_on_unknown", state->flap_detection_on_unknown);
+		payload_new_boolean(ret, "flap_detection_on_critical", state->flap_detection_on_critical);
+		payload_new_boolean(ret, "notified_on_unknown", state->notified_on_unknown);
+		payload_new_boolean(ret, "notified_on_warning", state->notified_on_warning);
+		payload_new_boolean(ret, "notified_on_critical", state->notified_on_critical);
+		payload_new_boolean(ret, "obsess_over_service", state->obsess_over_service);
+		payload_new_string(ret, "check_command", state->service_check_command);
+		payload_new_boolean(ret, "accept_passive_service_checks", state->accept_passive_service_checks);
 #endif
-	payload_new_boolean(ret, "is_volatile", state->is_volatile);
-	payload_new_string(ret, "notification_period", state->notification_period);
-	payload_new_string(ret, "check_period", state->check_period);
-	payload_new_boolean(ret, "flap_detection_enabled", state->flap_detection_enabled);
-	payload_new_double(ret, "low_flap_threshold", state->low_flap_threshold);
-	payload_new_double(ret, "high_flap_threshold", state->high_flap_threshold);
-	payload_new_boolean(ret, "process_performance_data", state->process_performance_data);
-	payload_new_integer(ret, "check_freshness", state->check_freshness);
-	payload_new_integer(ret, "freshness_threshold", state->freshness_threshold);
-	payload_new_boolean(ret, "event_handler_enabled", state->event_handler_enabled);
-	payload_new_boolean(ret, "checks_enabled", state->checks_enabled);
-	payload_new_boolean(ret, "notifications_enabled", state->notifications_enabled);
+		payload_new_boolean(ret, "is_volatile", state->is_volatile);
+		payload_new_string(ret, "notification_period", state->notification_period);
+		payload_new_string(ret, "check_period", state->check_period);
+		payload_new_boolean(ret, "flap_detection_enabled", state->flap_detection_enabled);
+		payload_new_double(ret, "low_flap_threshold", state->low_flap_threshold);
+		payload_new_double(ret, "high_flap_threshold", state->high_flap_threshold);
+		payload_new_boolean(ret, "process_performance_data", state->process_performance_data);
+		payload_new_integer(ret, "check_freshness", state->check_freshness);
+		payload_new_integer(ret, "freshness_threshold", state->freshness_threshold);
+		payload_new_boolean(ret, "event_handler_enabled", state->event_handler_enabled);
+		payload_new_boolean(ret, "checks_enabled", state->checks_enabled);
+		payload_new_boolean(ret, "notifications_enabled", state->notifications_enabled);
 #ifndef HAVE_NAGIOS4
-	payload_new_boolean(ret, "failure_prediction_enabled", state->failure_prediction_enabled);
-	payload_new_string(ret, "failure_prediction_options", state->failure_prediction_options);
+		payload_new_boolean(ret, "failure_prediction_enabled", state->failure_prediction_enabled);
+		payload_new_string(ret, "failure_prediction_options", state->failure_prediction_options);
 #endif
-	payload_new_string(ret, "notes", state->notes);
-	payload_new_string(ret, "notes_url", state->notes_url);
-	payload_new_string(ret, "action_url", state->action_url);
-	payload_new_string(ret, "icon_image", state->icon_image);
-	payload_new_string(ret, "icon_image_alt", state->icon_image_alt);
-	payload_new_integer(ret, "modified_attributes", state->modified_attributes);
-	payload_new_boolean(ret, "retain_status_information", state->retain_status_information);
-	payload_new_boolean(ret, "retain_nonstatus_information", state->retain_nonstatus_information);
-	payload_new_boolean(ret, "problem_has_been_acknowledged", state->problem_has_been_acknowledged);
-	payload_new_integer(ret, "host_problem_at_last_check", state->host_problem_at_last_check);
-	payload_new_integer(ret, "current_state", state->current_state);
-	payload_new_statestr(ret, "current_state_str", state->current_state, state->has_been_checked, 1);
-	payload_new_integer(ret, "last_state", state->last_state);
-	payload_new_statestr(ret, "last_state_str", state->last_state, state->has_been_checked, 1);
-	payload_new_integer(ret, "last_hard_state", state->last_hard_state);
-	payload_new_statestr(ret, "last_hard_state_str", state->last_hard_state, state->has_been_checked, 1);
-	payload_new_string(ret, "plugin_output", state->plugin_output);
-	payload_new_string(ret, "long_plugin_output", state->long_plugin_output);
-	payload_new_string(ret, "perf_data", state->perf_data);
-	payload_new_integer(ret, "state_type", state->state_type);
-	payload_new_integer(ret, "next_check", state->next_check);
-	payload_new_boolean(ret, "should_be_scheduled", state->should_be_scheduled);
-	payload_new_integer(ret, "last_check", state->last_check);
-	payload_new_integer(ret, "current_attempt", state->current_attempt);
-	payload_new_integer(ret, "current_event_id", state->current_event_id);
-	payload_new_integer(ret, "last_event_id", state->last_event_id);
-	payload_new_integer(ret, "current_problem_id", state->current_problem_id);
-	payload_new_integer(ret, "last_problem_id", state->last_problem_id);
-	payload_new_integer(ret, "last_notification", state->last_notification);
-	payload_new_integer(ret, "next_notification", state->next_notification);
-	payload_new_boolean(ret, "no_more_notifications", state->no_more_notifications);
-	payload_new_integer(ret, "check_flapping_recovery_notification", state->check_flapping_recovery_notification);
-	payload_new_integer(ret, "last_state_change", state->last_state_change);
-	payload_new_integer(ret, "last_hard_state_change", state->last_hard_state_change);
-	payload_new_integer(ret, "last_time_ok", state->last_time_ok);
-	payload_new_integer(ret, "last_time_warning", state->last_time_warning);
-	payload_new_integer(ret, "last_time_unknown", state->last_time_unknown);
-	payload_new_integer(ret, "last_time_critical", state->last_time_critical);
-	payload_new_boolean(ret, "has_been_checked", state->has_been_checked);
-	payload_new_boolean(ret, "is_being_freshened", state->is_being_freshened);
-	payload_new_integer(ret, "current_notification_number", state->current_notification_number);
-	payload_new_integer(ret, "current_notification_id", state->current_notification_id);
-	payload_new_double(ret, "latency", state->latency);
-	payload_new_double(ret, "execution_time", state->execution_time);
-	payload_new_boolean(ret, "is_executing", state->is_executing);
-	payload_new_integer(ret, "check_options", state->check_options);
-	payload_new_integer(ret, "scheduled_downtime_depth", state->scheduled_downtime_depth);
-	payload_new_boolean(ret, "pending_flex_downtime", state->pending_flex_downtime);
+		payload_new_string(ret, "notes", state->notes);
+		payload_new_string(ret, "notes_url", state->notes_url);
+		payload_new_string(ret, "action_url", state->action_url);
+		payload_new_string(ret, "icon_image", state->icon_image);
+		payload_new_string(ret, "icon_image_alt", state->icon_image_alt);
+	}
+	if(projection[SERVICE_STATE]) {
+		payload_new_integer(ret, "modified_attributes", state->modified_attributes);
+		payload_new_boolean(ret, "retain_status_information", state->retain_status_information);
+		payload_new_boolean(ret, "retain_nonstatus_information", state->retain_nonstatus_information);
+		payload_new_boolean(ret, "problem_has_been_acknowledged", state->problem_has_been_acknowledged);
+		payload_new_integer(ret, "host_problem_at_last_check", state->host_problem_at_last_check);
+		payload_new_integer(ret, "current_state", state->current_state);
+		payload_new_statestr(ret, "current_state_str", state->current_state, state->has_been_checked, 1);
+		payload_new_integer(ret, "last_state", state->last_state);
+		payload_new_statestr(ret, "last_state_str", state->last_state, state->has_been_checked, 1);
+		payload_new_integer(ret, "last_hard_state", state->last_hard_state);
+		payload_new_statestr(ret, "last_hard_state_str", state->last_hard_state, state->has_been_checked, 1);
+		payload_new_string(ret, "plugin_output", state->plugin_output);
+		payload_new_string(ret, "long_plugin_output", state->long_plugin_output);
+		payload_new_string(ret, "perf_data", state->perf_data);
+		payload_new_integer(ret, "state_type", state->state_type);
+	}
+	if(projection[SERVICE_CHECK]) {
+		payload_new_integer(ret, "next_check", state->next_check);
+		payload_new_boolean(ret, "should_be_scheduled", state->should_be_scheduled);
+		payload_new_integer(ret, "last_check", state->last_check);
+		payload_new_integer(ret, "current_attempt", state->current_attempt);
+		payload_new_integer(ret, "current_event_id", state->current_event_id);
+		payload_new_integer(ret, "last_event_id", state->last_event_id);
+		payload_new_integer(ret, "current_problem_id", state->current_problem_id);
+		payload_new_integer(ret, "last_problem_id", state->last_problem_id);
+		payload_new_integer(ret, "last_notification", state->last_notification);
+		payload_new_integer(ret, "next_notification", state->next_notification);
+		payload_new_boolean(ret, "no_more_notifications", state->no_more_notifications);
+		payload_new_integer(ret, "check_flapping_recovery_notification", state->check_flapping_recovery_notification);
+		payload_new_integer(ret, "last_state_change", state->last_state_change);
+		payload_new_integer(ret, "last_hard_state_change", state->last_hard_state_change);
+		payload_new_integer(ret, "last_time_ok", state->last_time_ok);
+		payload_new_integer(ret, "last_time_warning", state->last_time_warning);
+		payload_new_integer(ret, "last_time_unknown", state->last_time_unknown);
+		payload_new_integer(ret, "last_time_critical", state->last_time_critical);
+		payload_new_boolean(ret, "has_been_checked", state->has_been_checked);
+		payload_new_boolean(ret, "is_being_freshened", state->is_being_freshened);
+		payload_new_integer(ret, "current_notification_number", state->current_notification_number);
+		payload_new_integer(ret, "current_notification_id", state->current_notification_id);
+		payload_new_double(ret, "latency", state->latency);
+		payload_new_double(ret, "execution_time", state->execution_time);
+		payload_new_boolean(ret, "is_executing", state->is_executing);
+		payload_new_integer(ret, "check_options", state->check_options);
+		payload_new_integer(ret, "scheduled_downtime_depth", state->scheduled_downtime_depth);
+		payload_new_boolean(ret, "pending_flex_downtime", state->pending_flex_downtime);
+	}
 	if(payload_start_array(ret, "state_history")) {
 		int i;
 		for(i = 0; i < state->state_history_index; i++)
 			payload_new_integer(ret, NULL, state->state_history[i]);
 		payload_end_array(ret);
 	}
-	payload_new_boolean(ret, "is_flapping", state->is_flapping);
-	payload_new_integer(ret, "flapping_comment_id", state->flapping_comment_id);
-	payload_new_double(ret, "percent_state_change", state->percent_state_change);
+	if(projection[SERVICE_FLAPPING]) {
+		payload_new_boolean(ret, "is_flapping", state->is_flapping);
+		payload_new_integer(ret, "flapping_comment_id", state->flapping_comment_id);
+		payload_new_double(ret, "percent_state_change", state->percent_state_change);
+	}
 	parse_custom_variables(ret, state->custom_variables);
 	payload_end_object(ret);
 
@@ -810,17 +1126,19 @@ static void parse_contact(contact * state, struct payload * ret) {
 	payload_new_integer(ret, "modified_service_attributes", state->modified_service_attributes);
 	parse_custom_variables(ret, state->custom_variables);
 
-	time_t now = time(NULL);
-	payload_new_boolean(ret, "in_host_notification_period",
-		check_time_against_period(now, state->host_notification_period_ptr) == 0);
-	payload_new_boolean(ret, "in_service_notification_period",
-		check_time_against_period(now, state->service_notification_period_ptr) == 0);
-
-	time_t nexttime;
-	get_next_valid_time(now, &nexttime, state->host_notification_period_ptr);
-	payload_new_integer(ret, "next_host_notification_time", nexttime);
-	get_next_valid_time(now, &nexttime, state->service_notification_period_ptr);
-	payload_new_integer(ret, "next_service_notification_time", nexttime);
+	if(projection[CONTACT_PERIODS]) {
+		time_t now = time(NULL);
+		payload_new_boolean(ret, "in_host_notification_period",
+			check_time_against_period(now, state->host_notification_period_ptr) == 0);
+		payload_new_boolean(ret, "in_service_notification_period",
+			check_time_against_period(now, state->service_notification_period_ptr) == 0);
+
+		time_t nexttime;
+		get_next_valid_time(now, &nexttime, state->host_notification_period_ptr);
+		payload_new_integer(ret, "next_host_notification_time", nexttime);
+		get_next_valid_time(now, &nexttime, state->service_notification_period_ptr);
+		payload_new_integer(ret, "next_service_notification_time", nexttime);
+	}
 	
 	payload_end_object(ret);
 }
@@ -1146,6 +1464,8 @@ static void send_msg(struct payload * po) {
 		free(po->service_description);
 	if(po->host_name)
 		free(po->host_name);
+	if(po->extra_keys)
+		json_decref(po->extra_keys);
 	free(po);
 }
 
@@ -1179,7 +1499,407 @@ static void err_msg(struct payload * po, char * msg, ...) {
 	payload_end_object(po);
 }
 
-void process_req_msg(zmq_msg_t * reqmsg) {
+// Aggregate requests summarize hosts or services per group in a single
+// pass over the object lists, so clients that only want counts or latency
+// numbers don't have to download every object.
+#define AGG_MAX_PERCENTILES 16
+
+struct aggregate {
+	const char * group_name;
+	unsigned long count;
+	unsigned long states[4];
+	unsigned long pending;
+	unsigned long hard;
+	unsigned long soft;
+	unsigned long acknowledged;
+	unsigned long problems;
+	unsigned long unhandled;
+	// Samples from checked objects only
+	double * latency;
+	double * execution_time;
+	size_t nvalues, allocated;
+	int nomem;
+};
+
+static int compare_doubles(const void * a, const void * b) {
+	double da = *(const double*)a, db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+static void aggregate_add(struct aggregate * agg, int state, int checked,
+	int state_type, int acked, int in_downtime, double latency,
+	double execution_time) {
+	agg->count++;
+
+	// Objects that were never checked have no latency or execution time
+	if(!checked) {
+		agg->pending++;
+		return;
+	}
+	if(agg->nomem)
+		return;
+	if(agg->nvalues == agg->allocated) {
+		size_t allocated = agg->allocated ? agg->allocated * 2 : 64;
+		double * tmp;
+		if((tmp = realloc(agg->latency, allocated * sizeof(double))) == NULL) {
+			agg->nomem = 1;
+			return;
+		}
+		agg->latency = tmp;
+		if((tmp = realloc(agg->execution_time,
+			allocated * sizeof(double))) == NULL) {
+			agg->nomem = 1;
+			return;
+		}
+		agg->execution_time = tmp;
+		agg->allocated = allocated;
+	}
+	agg->latency[agg->nvalues] = latency;
+	agg->execution_time[agg->nvalues++] = execution_time;
+
+	if(state >= 0 && state < 4)
+		agg->states[state]++;
+	if(state_type == HARD_STATE)
+		agg->hard++;
+	else
+		agg->soft++;
+	if(acked)
+		agg->acknowledged++;
+	if(state != 0) {
+		agg->problems++;
+		if(!acked && !in_downtime)
+			agg->unhandled++;
+	}
+}
+
+static void aggregate_add_host(struct aggregate * agg, host * hst) {
+	if(for_user && !is_contact_for_host(hst, for_user))
+		return;
+	aggregate_add(agg, hst->current_state, hst->has_been_checked,
+		hst->state_type, hst->problem_has_been_acknowledged,
+		hst->scheduled_downtime_depth > 0, hst->latency,
+		hst->execution_time);
+}
+
+static void aggregate_add_service(struct aggregate * agg, service * svc) {
+	if(for_user && !is_contact_for_service(svc, for_user))
+		return;
+	aggregate_add(agg, svc->current_state, svc->has_been_checked,
+		svc->state_type, svc->problem_has_been_acknowledged,
+		svc->scheduled_downtime_depth > 0, svc->latency,
+		svc->execution_time);
+}
+
+static void aggregate_add_host_services(struct aggregate * agg, host * hst) {
+	servicesmember * slck;
+	for(slck = hst->services; slck != NULL; slck = slck->next)
+		aggregate_add_service(agg, slck->service_ptr);
+}
+
+static void emit_summary(struct payload * po, char * key, double * values,
+	size_t nvalues, double * percentiles, size_t npercentiles) {
+	size_t i;
+	double sum = 0;
+	char pkey[32];
+
+	if(!payload_start_object(po, key))
+		return;
+	if(nvalues == 0) {
+		payload_end_object(po);
+		return;
+	}
+
+	qsort(values, nvalues, sizeof(double), compare_doubles);
+	for(i = 0; i < nvalues; i++)
+		sum += values[i];
+	payload_new_double(po, "min", values[0]);
+	payload_new_double(po, "max", values[nvalues - 1]);
+	payload_new_double(po, "avg", sum / nvalues);
+	for(i = 0; i < npercentiles; i++) {
+		// Nearest-rank percentile
+		double exact = (percentiles[i] / 100.0) * nvalues;
+		size_t rank = (size_t)exact;
+		if(rank < exact)
+			rank++;
+		if(rank > 0)
+			rank--;
+		if(rank >= nvalues)
+			rank = nvalues - 1;
+		snprintf(pkey, sizeof(pkey), "p%g", percentiles[i]);
+		payload_new_double(po, pkey, values[rank]);
+	}
+	payload_end_object(po);
+}
+
+// Returns -1 without emitting anything if the samples couldn't be stored
+static int emit_aggregate(struct payload * po, struct aggregate * agg,
+	const char * object_type, const char * group_by,
+	double * percentiles, size_t npercentiles) {
+	char * service_state_strings[] = { "OK", "WARNING", "CRITICAL", "UNKNOWN" };
+	char * host_state_strings[] = { "UP", "DOWN", "UNREACHABLE" };
+	int svc = strcmp(object_type, "service") == 0, i;
+
+	if(agg->nomem) {
+		free(agg->latency);
+		free(agg->execution_time);
+		memset(agg, 0, sizeof(struct aggregate));
+		return -1;
+	}
+
+	payload_start_object(po, NULL);
+	payload_new_string(po, "type", "aggregate");
+	payload_new_string(po, "object_type", (char*)object_type);
+	payload_new_string(po, "group_by", (char*)group_by);
+	payload_new_string(po, "group_name", (char*)agg->group_name);
+	payload_new_integer(po, "count", agg->count);
+	if(payload_start_object(po, "states")) {
+		for(i = 0; i < (svc ? 4 : 3); i++)
+			payload_new_integer(po, svc ? service_state_strings[i] :
+				host_state_strings[i], agg->states[i]);
+		payload_new_integer(po, "PENDING", agg->pending);
+		payload_end_object(po);
+	}
+	if(payload_start_object(po, "state_types")) {
+		payload_new_integer(po, "hard", agg->hard);
+		payload_new_integer(po, "soft", agg->soft);
+		payload_end_object(po);
+	}
+	payload_new_integer(po, "acknowledged", agg->acknowledged);
+	payload_new_integer(po, "problems", agg->problems);
+	payload_new_integer(po, "unhandled_problems", agg->unhandled);
+	emit_summary(po, "latency", agg->latency, agg->nvalues,
+		percentiles, npercentiles);
+	emit_summary(po, "execution_time", agg->execution_time, agg->nvalues,
+		percentiles, npercentiles);
+	payload_end_object(po);
+
+	free(agg->latency);
+	free(agg->execution_time);
+	memset(agg, 0, sizeof(struct aggregate));
+	return 0;
+}
+
+static void emit_input_source(struct payload * po, struct input_source * src) {
+	if(!payload_start_object(po, (char*)src->name))
+		return;
+	payload_new_integer(po, "max_messages", src->max_messages);
+	payload_new_integer(po, "max_time", src->max_time);
+	payload_new_integer(po, "messages", src->messages);
+	payload_new_integer(po, "wakeups", src->wakeups);
+	payload_new_integer(po, "last_batch", src->last_batch);
+	payload_new_integer(po, "max_batch", src->max_batch);
+	payload_new_integer(po, "budget_exhausted", src->budget_exhausted);
+	payload_new_integer(po, "rearms", src->rearms);
+	payload_new_boolean(po, "backlogged", src->backlogged);
+	payload_end_object(po);
+}
+
+static void do_input_stats(struct payload * po, json_t * req) {
+	int get_input_stats = 0, saved_use_hash;
+	get_values(req,
+		"input_stats", JSON_TRUE, 0, &get_input_stats,
+		NULL);
+	if(!get_input_stats)
+		return;
+
+	// None of these keys are in the output key hash
+	saved_use_hash = po->use_hash;
+	po->use_hash = 0;
+	payload_start_object(po, NULL);
+	payload_new_string(po, "type", "input_stats");
+	emit_input_source(po, &pull_source);
+	emit_input_source(po, &req_source);
+	payload_end_object(po);
+	po->use_hash = saved_use_hash;
+}
+
+static void do_auth_stats(struct payload * po, json_t * req) {
+#if ZMQ_VERSION_MAJOR > 3
+	int get_auth_stats = 0, saved_use_hash;
+	get_values(req,
+		"auth_stats", JSON_TRUE, 0, &get_auth_stats,
+		NULL);
+	if(!get_auth_stats)
+		return;
+
+	// None of these keys are in the output key hash
+	saved_use_hash = po->use_hash;
+	po->use_hash = 0;
+	payload_start_object(po, NULL);
+	payload_new_string(po, "type", "auth_stats");
+	payload_new_integer(po, "workers", zap_stats.workers);
+	payload_new_integer(po, "keys", zap_stats.keys);
+	payload_new_integer(po, "requests", zap_stats.requests);
+	payload_new_integer(po, "accepted", zap_stats.accepted);
+	payload_new_integer(po, "rejected", zap_stats.rejected);
+	payload_new_integer(po, "latency_total", zap_stats.latency_total);
+	payload_new_integer(po, "latency_max", zap_stats.latency_max);
+	payload_new_integer(po, "reloads", zap_stats.reloads);
+	payload_new_integer(po, "reload_errors", zap_stats.reload_errors);
+	payload_end_object(po);
+	po->use_hash = saved_use_hash;
+#endif
+}
+
+static void do_aggregate(struct payload * po, json_t * req) {
+	json_t * aggdef = NULL, *pctarray = NULL;
+	char * object_type = NULL, *group_by = "none", *group_name = NULL;
+	double percentiles[AGG_MAX_PERCENTILES] = { 50, 90, 99 };
+	size_t npercentiles = 3, i;
+	struct aggregate agg;
+	int svc, saved_use_hash;
+
+	get_values(req,
+		"aggregate", JSON_OBJECT, 0, &aggdef,
+		NULL);
+	if(!aggdef)
+		return;
+
+	if(get_values(aggdef,
+		"object_type", JSON_STRING, 1, &object_type,
+		"group_by", JSON_STRING, 0, &group_by,
+		"group_name", JSON_STRING, 0, &group_name,
+		"percentiles", JSON_ARRAY, 0, &pctarray,
+		NULL) != 0) {
+		err_msg(po, "Error unpacking aggregate request", NULL);
+		return;
+	}
+
+	if(strcmp(object_type, "service") == 0)
+		svc = 1;
+	else if(strcmp(object_type, "host") == 0)
+		svc = 0;
+	else {
+		err_msg(po, "Invalid object type for aggregate",
+			"object_type", object_type, NULL);
+		return;
+	}
+
+	if(pctarray) {
+		npercentiles = 0;
+		for(i = 0; i < json_array_size(pctarray) &&
+			npercentiles < AGG_MAX_PERCENTILES; i++) {
+			json_t * pct = json_array_get(pctarray, i);
+			double val;
+			if(json_is_integer(pct))
+				val = json_integer_value(pct);
+			else if(json_is_real(pct))
+				val = json_real_value(pct);
+			else
+				continue;
+			if(val <= 0 || val > 100)
+				continue;
+			percentiles[npercentiles++] = val;
+		}
+	}
+
+	// The key names in aggregates aren't part of the output key hash,
+	// so projections don't apply to them.
+	saved_use_hash = po->use_hash;
+	po->use_hash = 0;
+	memset(&agg, 0, sizeof(agg));
+
+	if(strcmp(group_by, "none") == 0) {
+		agg.group_name = "all";
+		if(svc) {
+			service * tmp_svc;
+			for(tmp_svc = service_list; tmp_svc; tmp_svc = tmp_svc->next)
+				aggregate_add_service(&agg, tmp_svc);
+		} else {
+			host * tmp_host;
+			for(tmp_host = host_list; tmp_host; tmp_host = tmp_host->next)
+				aggregate_add_host(&agg, tmp_host);
+		}
+		if(emit_aggregate(po, &agg, object_type, group_by,
+			percentiles, npercentiles) != 0)
+			goto nomem;
+	} else if(strcmp(group_by, "host") == 0 && svc) {
+		host * tmp_host;
+		for(tmp_host = host_list; tmp_host; tmp_host = tmp_host->next) {
+			if(group_name && strcmp(group_name, tmp_host->name) != 0)
+				continue;
+			if(for_user && !is_contact_for_host(tmp_host, for_user))
+				continue;
+			agg.group_name = tmp_host->name;
+			aggregate_add_host_services(&agg, tmp_host);
+			if(emit_aggregate(po, &agg, object_type, group_by,
+				percentiles, npercentiles) != 0)
+				goto nomem;
+		}
+	} else if(strcmp(group_by, "hostgroup") == 0) {
+		hostgroup * tmp_hg;
+		for(tmp_hg = hostgroup_list; tmp_hg; tmp_hg = tmp_hg->next) {
+			hostsmember * hlck;
+			if(group_name && strcmp(group_name, tmp_hg->group_name) != 0)
+				continue;
+			agg.group_name = tmp_hg->group_name;
+			for(hlck = tmp_hg->members; hlck; hlck = hlck->next) {
+				if(svc)
+					aggregate_add_host_services(&agg, hlck->host_ptr);
+				else
+					aggregate_add_host(&agg, hlck->host_ptr);
+			}
+			if(emit_aggregate(po, &agg, object_type, group_by,
+				percentiles, npercentiles) != 0)
+				goto nomem;
+		}
+	} else if(strcmp(group_by, "servicegroup") == 0 && svc) {
+		servicegroup * tmp_sg;
+		for(tmp_sg = servicegroup_list; tmp_sg; tmp_sg = tmp_sg->next) {
+			servicesmember * slck;
+			if(group_name && strcmp(group_name, tmp_sg->group_name) != 0)
+				continue;
+			agg.group_name = tmp_sg->group_name;
+			for(slck = tmp_sg->members; slck; slck = slck->next)
+				aggregate_add_service(&agg, slck->service_ptr);
+			if(emit_aggregate(po, &agg, object_type, group_by,
+				percentiles, npercentiles) != 0)
+				goto nomem;
+		}
+	} else
+		err_msg(po, "Invalid grouping for aggregate", "group_by", group_by,
+			"object_type", object_type, NULL);
+
+	po->use_hash = saved_use_hash;
+	return;
+
+nomem:
+	err_msg(po, "Out of memory computing aggregate",
+		"object_type", object_type, "group_by", group_by, NULL);
+	po->use_hash = saved_use_hash;
+}
+
+struct state_request {
+	char * host_name, *service_description;
+	char * hostgroup_name, *servicegroup_name;
+	char * contact_name, *contactgroup_name;
+	char * timeperiod_name, *for_user;
+	int include_services, include_hosts, include_contacts, expand_lists;
+	json_t * keys;
+};
+
+#define REQ_FIELD(member, type) \
+	JSON_FIELD(struct state_request, member, #member, type, 0)
+
+static const struct json_field state_request_fields[] = {
+	REQ_FIELD(host_name, JSON_STRING),
+	REQ_FIELD(service_description, JSON_STRING),
+	REQ_FIELD(hostgroup_name, JSON_STRING),
+	REQ_FIELD(servicegroup_name, JSON_STRING),
+	REQ_FIELD(contact_name, JSON_STRING),
+	REQ_FIELD(contactgroup_name, JSON_STRING),
+	REQ_FIELD(include_services, JSON_TRUE),
+	REQ_FIELD(include_hosts, JSON_TRUE),
+	REQ_FIELD(include_contacts, JSON_TRUE),
+	REQ_FIELD(expand_lists, JSON_TRUE),
+	REQ_FIELD(keys, JSON_ARRAY),
+	REQ_FIELD(timeperiod_name, JSON_STRING),
+	REQ_FIELD(for_user, JSON_STRING),
+};
+static struct json_schema state_request_schema =
+	JSON_SCHEMA(state_request_fields);
+
+static void handle_req_msg(zmq_msg_t * reqmsg) {
 	json_t * req;
 	json_t *keys = NULL;
 	char * contact_name = NULL, *contactgroup_name = NULL,
@@ -1189,6 +1909,7 @@ void process_req_msg(zmq_msg_t * reqmsg) {
 	json_error_t err;
 	struct payload * po;
 	char * for_username = NULL;
+	struct state_request sr;
 
 	po = calloc(1, sizeof(struct payload));
 	payload_start_array(po, NULL);
@@ -1201,36 +1922,32 @@ void process_req_msg(zmq_msg_t * reqmsg) {
 		return;
 	}
 
-	host_name = NULL;
-	service_description = NULL;
-	include_services = 0;
-	include_hosts = 0;
-	include_contacts = 0;
 	cur_host = NULL;
 	cur_service = NULL;
 	for_user = NULL;
 
-	if(get_values(req,
-		"host_name", JSON_STRING, 0, &host_name,
-		"service_description", JSON_STRING, 0, &service_description,
-		"hostgroup_name", JSON_STRING, 0, &hostgroup_name,
-		"servicegroup_name", JSON_STRING, 0, &servicegroup_name,
-		"contact_name", JSON_STRING, 0, &contact_name,
-		"contactgroup_name", JSON_STRING, 0, &contactgroup_name,
-		"include_services", JSON_TRUE, 0, &include_services,
-		"include_hosts", JSON_TRUE, 0, &include_hosts,
-		"include_contacts", JSON_TRUE, 0, &include_contacts,
-		"expand_lists", JSON_TRUE, 0, &expand_lists,
-		"keys", JSON_ARRAY, 0, &keys,
-		"timeperiod_name", JSON_STRING, 0, &timeperiod_name,
-		"for_user", JSON_STRING, 0, &for_username,
-		NULL) != 0) {
+	memset(&sr, 0, sizeof(sr));
+	if(get_fields(req, &state_request_schema, &sr) != 0) {
 		json_decref(req);
 		err_msg(po, "Error unpacking request", NULL);
 		send_msg(po);
 		return;
 	}
 
+	host_name = sr.host_name;
+	service_description = sr.service_description;
+	hostgroup_name = sr.hostgroup_name;
+	servicegroup_name = sr.servicegroup_name;
+	contact_name = sr.contact_name;
+	contactgroup_name = sr.contactgroup_name;
+	timeperiod_name = sr.timeperiod_name;
+	for_username = sr.for_user;
+	include_services = sr.include_services;
+	include_hosts = sr.include_hosts;
+	include_contacts = sr.include_contacts;
+	expand_lists = sr.expand_lists;
+	keys = sr.keys;
+
 	if(for_username && (for_user = find_contact(for_username)) == NULL) {
 		err_msg(po, "Error finding contact for authorization",
 			"contact_name", for_user);
@@ -1248,8 +1965,11 @@ void process_req_msg(zmq_msg_t * reqmsg) {
 			payload_hash_key(po, json_string_value(keytmp));
 		}
 	}
+	compute_projection(po);
 
 	do_program_status(po, req);
+	do_input_stats(po, req);
+	do_auth_stats(po, req);
 
 	if(service_description) {
 		if(!host_name) {
@@ -1340,6 +2060,7 @@ void process_req_msg(zmq_msg_t * reqmsg) {
 	do_list_servicegroups(po, req);
 	do_list_comments(po, req);
 	do_list_downtimes(po, req);
+	do_aggregate(po, req);
 
 	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "Processed a NagMQ state request\n");
 
@@ -1347,3 +2068,11 @@ end:
 	json_decref(req);
 	send_msg(po);
 }
+
+// The request is only needed until the reply is sent, so it's parsed
+// into the jansson arena and released in one go afterwards.
+void process_req_msg(zmq_msg_t * reqmsg) {
+	arena_begin();
+	handle_req_msg(reqmsg);
+	arena_reset();
+}
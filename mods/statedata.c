@@ -0,0 +1,37 @@
+#include "config.h"
+#include "json.h"
+#include "statedata.h"
+
+#define STATE_FIELD(member, key, type, required) \
+	JSON_FIELD(struct state_data, member, key, type, required)
+
+static const struct json_field state_data_fields[] = {
+	STATE_FIELD(host_name, "host_name", JSON_STRING, 1),
+	STATE_FIELD(service_description, "service_description", JSON_STRING, 0),
+	STATE_FIELD(plugin_output, "plugin_output", JSON_STRING, 1),
+	STATE_FIELD(long_output, "long_output", JSON_STRING, 0),
+	STATE_FIELD(perf_data, "perf_data", JSON_STRING, 0),
+	STATE_FIELD(state, "current_state", JSON_INTEGER, 1),
+	STATE_FIELD(current_attempt, "current_attempt", JSON_INTEGER, 1),
+	STATE_FIELD(state_type, "state_type", JSON_INTEGER, 1),
+	STATE_FIELD(is_flapping, "is_flapping", JSON_TRUE, 1),
+	STATE_FIELD(notifications_enabled, "notifications_enabled", JSON_TRUE, 1),
+	STATE_FIELD(checks_enabled, "checks_enabled", JSON_TRUE, 1),
+	STATE_FIELD(event_handler_enabled, "event_handler_enabled", JSON_TRUE, 1),
+	STATE_FIELD(flap_detection_enabled, "flap_detection_enabled", JSON_TRUE, 1),
+	STATE_FIELD(acknowledged, "problem_has_been_acknowledged", JSON_TRUE, 1),
+#ifdef HAVE_NAGIOS4
+	STATE_FIELD(passive_checks_enabled, "accept_passive_checks", JSON_TRUE, 0),
+#else
+	STATE_FIELD(passive_checks_enabled, "accept_passive_service_checks", JSON_TRUE, 0),
+	STATE_FIELD(passive_checks_enabled, "accept_passive_host_checks", JSON_TRUE, 0),
+#endif
+	STATE_FIELD(type, "type", JSON_STRING, 1),
+	STATE_FIELD(last_check, "last_check", JSON_INTEGER, 1),
+	STATE_FIELD(has_been_checked, "has_been_checked", JSON_TRUE, 1),
+	STATE_FIELD(latency, "latency", JSON_REAL, 1),
+	STATE_FIELD(execution_time, "execution_time", JSON_REAL, 1),
+	STATE_FIELD(last_notification, "last_notification", JSON_INTEGER, 1),
+	STATE_FIELD(last_state_change, "last_state_change", JSON_INTEGER, 1),
+};
+struct json_schema state_data_schema = JSON_SCHEMA(state_data_fields);
@@ -0,0 +1,14 @@
+// Object state sent to the pull socket in "state_data" messages. The
+// schema lives on its own so fieldbench measures the one the module uses.
+struct state_data {
+	char * host_name, *service_description, *type;
+	char * plugin_output, *long_output, *perf_data;
+	int state, current_attempt, state_type, acknowledged;
+	int is_flapping, notifications_enabled, checks_enabled;
+	int passive_checks_enabled, event_handler_enabled;
+	int flap_detection_enabled, has_been_checked;
+	int last_check, last_state_change, last_notification;
+	double latency, execution_time;
+};
+
+extern struct json_schema state_data_schema;
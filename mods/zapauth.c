@@ -6,88 +6,133 @@
 #include <pthread.h>
 #include <signal.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #ifdef HAVE_ICINGA
 #include "icinga.h"
 #else
 #include "nagios.h"
 #endif
+#include "common.h"
 
 extern int keyfile_refresh_interval;
 extern char * curve_knownhosts;
 #if ZMQ_VERSION_MAJOR > 3
-struct keybag {
-	uint8_t key[32];
-	struct keybag * next;
+struct zap_stats zap_stats;
+
+// An immutable open-addressed set of client keys. Readers take a
+// reference with acquire_keyset; a reload builds a whole new set and
+// swaps it in, so a lookup never sees a half-read keyfile.
+struct keyset {
+	int refcount;
+	uint32_t mask;
+	uint32_t count;
+	uint8_t * used;
+	uint8_t (*keys)[32];
 };
 
-struct keybaghash {
-	int buckets;
-	int count;
-	struct keybag ** data;
-};
+static struct keyset * current_keys = NULL;
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
 
-uint32_t fnv_hash(uint8_t * key) {
+static uint32_t fnv_hash(const uint8_t * key) {
 	int i;
 	uint32_t hash = 2166136261; // offset_basis
 	for(i = 0; i < 32; i++) {
 		hash ^= key[i];
 		hash *= 16777619; //fnv_prime
 	}
-	hash =(hash>>16) ^ (hash & 0xffff);
-
 	return hash;
 }
 
-int rehash_keybags(struct keybaghash * o) {
-	if(!(o->count > o->buckets && o->count < (0xffff)))
-		return 0;
+static struct keyset * new_keyset(uint32_t count) {
+	uint32_t buckets = 16;
+	struct keyset * ks;
+
+	while(buckets < count * 2)
+		buckets <<= 1;
+
+	ks = calloc(1, sizeof(struct keyset) + buckets + (buckets * 32));
+	if(ks == NULL)
+		return NULL;
+	ks->refcount = 1;
+	ks->mask = buckets - 1;
+	ks->used = (uint8_t*)(ks + 1);
+	ks->keys = (uint8_t(*)[32])(ks->used + buckets);
+	return ks;
+}
 
-	int kiter;
-	int newsize = ((o->buckets + 1) << 2) - 1;
-
-	struct keybag ** newdata = calloc(newsize + 1, sizeof(struct keybag*));
-	if(newdata == NULL)
-		return -ENOMEM;
-
-	for(kiter = 0; kiter < o->buckets + 1; kiter++) {
-		struct keybag * curkey = o->data[kiter], *savekey;
-		while(curkey) {
-			uint32_t hash = fnv_hash(curkey->key) & newsize;
-			savekey = curkey->next;
-			curkey->next = newdata[hash];
-			newdata[hash] = curkey;
-			curkey = savekey;
-		}
-	}
+static int keyset_lookup(struct keyset * ks, const uint8_t * key) {
+	uint32_t i = fnv_hash(key) & ks->mask;
 
-	free(o->data);
-	o->buckets = newsize;
-	o->data = newdata;
+	while(ks->used[i]) {
+		if(memcmp(ks->keys[i], key, 32) == 0)
+			return 1;
+		i = (i + 1) & ks->mask;
+	}
 	return 0;
 }
 
-int read_keyfile(const char * path, struct keybaghash * o) {
+static void keyset_insert(struct keyset * ks, const uint8_t * key) {
+	uint32_t i = fnv_hash(key) & ks->mask;
+
+	while(ks->used[i]) {
+		if(memcmp(ks->keys[i], key, 32) == 0)
+			return;
+		i = (i + 1) & ks->mask;
+	}
+	ks->used[i] = 1;
+	memcpy(ks->keys[i], key, 32);
+	ks->count++;
+}
+
+static struct keyset * acquire_keyset() {
+	struct keyset * ks;
+
+	pthread_mutex_lock(&keys_lock);
+	if((ks = current_keys) != NULL)
+		__sync_add_and_fetch(&ks->refcount, 1);
+	pthread_mutex_unlock(&keys_lock);
+	return ks;
+}
+
+static void release_keyset(struct keyset * ks) {
+	if(ks && __sync_sub_and_fetch(&ks->refcount, 1) == 0)
+		free(ks);
+}
+
+static void swap_keyset(struct keyset * ks) {
+	struct keyset * old;
+
+	pthread_mutex_lock(&keys_lock);
+	old = current_keys;
+	current_keys = ks;
+	pthread_mutex_unlock(&keys_lock);
+	release_keyset(old);
+}
+
+// Parses the keyfile into a fresh keyset. Each non-comment line ends with
+// a Z85 encoded public key; anything before it is ignored.
+static struct keyset * read_keyfile(const char * path, int * err) {
 	char * buf = NULL;
-	size_t buflen = 0;
-	ssize_t readcount;
-	int i;
+	size_t buflen = 0, nkeys = 0, maxkeys = 64, i;
+	ssize_t readcount = 0;
+	uint8_t (*keys)[32];
+	struct keyset * ks;
 
 	FILE * fp = fopen(path, "r");
-	if(fp == NULL)
-		return errno;
-
-	for(i = 0; i < o->buckets; i++) {
-		while(o->data[i]) {
-			struct keybag * n = o->data[i]->next;
-			free(o->data[i]);
-			o->data[i] = n;
-		}
+	if(fp == NULL) {
+		*err = errno;
+		return NULL;
 	}
-	o->count = 0;
 
-	while((readcount = getline(&buf, &buflen, fp)) != -1) {
+	keys = malloc(maxkeys * 32);
+	while(keys && (readcount = getline(&buf, &buflen, fp)) != -1) {
 		char * end = buf + readcount, *front = buf;
-		buflen = buflen > readcount ? buflen : readcount;
 
 		while(front < end && isspace(*front))
 			front++;
@@ -96,36 +141,63 @@ int read_keyfile(const char * path, struct keybaghash * o) {
 
 		while(end - 1 > front && isspace(*(end - 1)))
 			end--;
-		if(isspace(*end))
-			*end = '\0';
+		*end = '\0';
 		end -= 40;
 
 		if(end < front)
 			continue;
 
-		struct keybag * nk = calloc(1, sizeof(struct keybag));
-
-		if(zmq_z85_decode(nk->key, end) == NULL) {
-			free(nk);
-			continue;
+		if(nkeys == maxkeys) {
+			uint8_t (*tmp)[32] = realloc(keys, maxkeys * 2 * 32);
+			if(tmp == NULL)
+				break;
+			keys = tmp;
+			maxkeys *= 2;
 		}
+		if(zmq_z85_decode(keys[nkeys], end) != NULL)
+			nkeys++;
+	}
 
-		uint32_t hashval = fnv_hash(nk->key) & o->buckets;
+	fclose(fp);
+	free(buf);
+	if(keys == NULL || readcount != -1) {
+		free(keys);
+		*err = ENOMEM;
+		return NULL;
+	}
 
-		nk->next = o->data[hashval];
-		o->data[hashval] = nk;
-		o->count++;
+	if((ks = new_keyset(nkeys)) == NULL) {
+		free(keys);
+		*err = ENOMEM;
+		return NULL;
+	}
+	for(i = 0; i < nkeys; i++)
+		keyset_insert(ks, keys[i]);
+	free(keys);
+	return ks;
+}
 
-		if(rehash_keybags(o) != 0)
-			return -ENOMEM;
+static void reload_keyfile() {
+	struct keyset * ks;
+	int err = 0;
+
+	if((ks = read_keyfile(curve_knownhosts, &err)) == NULL) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error reading known hosts file for NagMQ curve authentication: %s",
+			strerror(err));
+		__sync_add_and_fetch(&zap_stats.reload_errors, 1);
+		return;
 	}
 
-	fclose(fp);
-	free(buf);
-	return 0;
+	zap_stats.keys = ks->count;
+	__sync_add_and_fetch(&zap_stats.reloads, 1);
+	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
+		"Read %u keys from known hosts file for NagMQ curve authentication\n",
+		ks->count);
+	swap_keyset(ks);
 }
 
-int send_zap_resp(zmq_msg_t * reqid, char * code, char * text,
+static int send_zap_resp(zmq_msg_t * reqid, char * code, char * text,
 	char *user, void * sock) {
 	int i = 0;
 
@@ -156,118 +228,350 @@ int send_zap_resp(zmq_msg_t * reqid, char * code, char * text,
 	return 0;
 }
 
-void * zap_handler(void* zapsock) {
-	struct keybaghash bag;
-	bag.buckets = 63;
-	bag.data = calloc(64, sizeof(struct keybag*));
-	bag.count = 0;
-	time_t last_refresh = 0;
-	int keeprunning = 1, i;
+static void count_latency(struct timeval * start) {
+	struct timeval end;
+	unsigned long long elapsed, max;
+
+	gettimeofday(&end, NULL);
+	elapsed = ((end.tv_sec - start->tv_sec) * 1000000) +
+		(end.tv_usec - start->tv_usec);
+	__sync_add_and_fetch(&zap_stats.latency_total, elapsed);
+	while(elapsed > (max = zap_stats.latency_max) &&
+		!__sync_bool_compare_and_swap(&zap_stats.latency_max, max, elapsed))
+		;
+}
+
+// Reads one ZAP request from a REP socket and answers it. Returns -ETERM
+// when the context is shutting down.
+static int handle_zap_request(void * sock) {
+	zmq_msg_t reqid;
+	char mech[32] = "";
+	uint8_t creds[32];
+	size_t credslen = 0;
+	struct timeval start;
+	struct keyset * ks;
+	int i, rc, more = 1, found;
+
+	zmq_msg_init(&reqid);
+	for(i = 0; more; i++) {
+		zmq_msg_t curmsg;
+		size_t msglen;
+
+		zmq_msg_init(&curmsg);
+		rc = zmq_msg_recv(&curmsg, sock, 0);
+		if(rc == -1) {
+			zmq_msg_close(&curmsg);
+			zmq_msg_close(&reqid);
+			if(errno == ETERM)
+				return -ETERM;
+			logit(NSLOG_RUNTIME_ERROR, FALSE,
+				"Error receiving NagMQ authentication packet: %s",
+				zmq_strerror(errno));
+			return 0;
+		}
+		if(i == 0)
+			gettimeofday(&start, NULL);
+
+		msglen = zmq_msg_size(&curmsg);
+		if(i == 1) {
+			zmq_msg_init_size(&reqid, msglen);
+			memcpy(zmq_msg_data(&reqid), zmq_msg_data(&curmsg), msglen);
+		}
+		else if(i == 5) {
+			if(msglen >= sizeof(mech))
+				msglen = sizeof(mech) - 1;
+			memcpy(mech, zmq_msg_data(&curmsg), msglen);
+			mech[msglen] = '\0';
+		}
+		else if(i == 6 && msglen == sizeof(creds)) {
+			memcpy(creds, zmq_msg_data(&curmsg), msglen);
+			credslen = msglen;
+		}
+		more = zmq_msg_more(&curmsg);
+		zmq_msg_close(&curmsg);
+	}
+
+	__sync_add_and_fetch(&zap_stats.requests, 1);
+	if(i < 7 || strcmp(mech, "CURVE") != 0 || credslen != sizeof(creds)) {
+		rc = send_zap_resp(&reqid, "400",
+			"Must use curve auth", "", sock);
+		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
+			"NagMQ authentication request mechanism wasn't curve: %s\n", mech);
+		__sync_add_and_fetch(&zap_stats.rejected, 1);
+		goto cleanup;
+	}
+
+	ks = acquire_keyset();
+	found = ks && keyset_lookup(ks, creds);
+	release_keyset(ks);
+
+	if(!found) {
+		rc = send_zap_resp(&reqid, "400",
+			"No authorized key found", "", sock);
+		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
+			"Client not found in NagMQ authorized keys file!\n");
+		__sync_add_and_fetch(&zap_stats.rejected, 1);
+		goto cleanup;
+	}
+
+	rc = send_zap_resp(&reqid, "200",
+		"Authentication successful", "Authenticated User", sock);
+	__sync_add_and_fetch(&zap_stats.accepted, 1);
+
+	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
+		"Successfully authenticated client from authorized keys file!\n");
+cleanup:
+	count_latency(&start);
+	zmq_msg_close(&reqid);
+	return rc;
+}
+
+static void * zap_worker(void * zapsock) {
 	sigset_t sigset;
 
 	sigfillset(&sigset);
 	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
 
-	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "Starting NagMQ curve authentication thread\n");
+	while(handle_zap_request(zapsock) != -ETERM)
+		;
+	zmq_close(zapsock);
+	return NULL;
+}
 
-	for(;;) {
-		time_t now = time(NULL);
-		int rc;
-		if(rc = now - last_refresh > keyfile_refresh_interval) {
-			if((rc = read_keyfile(curve_knownhosts, &bag)) != 0)
-				logit(NSLOG_RUNTIME_ERROR, TRUE,
-					"Error reading known hosts file for NagMQ curve authentication: %s",
-					strerror(rc));
-			last_refresh = now;
-			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
-				"Read known hosts file for NagMQ curve authentication\n");
+// Moves one multi-part message between the ZAP frontend and the workers
+static int forward_msg(void * from, void * to) {
+	int more = 1;
+
+	while(more) {
+		zmq_msg_t part;
+		zmq_msg_init(&part);
+		if(zmq_msg_recv(&part, from, 0) == -1) {
+			zmq_msg_close(&part);
+			return errno == ETERM ? -ETERM : 0;
+		}
+		more = zmq_msg_more(&part);
+		if(zmq_msg_send(&part, to, more ? ZMQ_SNDMORE : 0) == -1) {
+			zmq_msg_close(&part);
+			return errno == ETERM ? -ETERM : 0;
 		}
+	}
+	return 0;
+}
 
-		zmq_msg_t reqid;
-		char mech[32], creds[255];
-		i = 0;
-
-		zmq_msg_init(&reqid);
-		for(i = 0; i < 7; i++) {
-			zmq_msg_t curmsg;
-
-			zmq_msg_init(&curmsg);
-			rc = zmq_msg_recv(&curmsg, zapsock, 0);
-			if(rc == -1) {
-				if(errno == ETERM) {
-					keeprunning = 0;
-					break;
-				}
-				else
-					break;
-				logit(NSLOG_RUNTIME_ERROR, FALSE,
-					"Error receiving NagMQ authentication packet");
-			}
+struct zap_watch {
+	int fd;
+	char * dir;
+	char * base;
+	struct stat last;
+};
+
+static void init_watch(struct zap_watch * w) {
+	char * dircopy = strdup(curve_knownhosts),
+		*basecopy = strdup(curve_knownhosts);
+
+	w->dir = strdup(dirname(dircopy));
+	w->base = strdup(basename(basecopy));
+	free(dircopy);
+	free(basecopy);
+	w->fd = -1;
+	memset(&w->last, 0, sizeof(w->last));
+	stat(curve_knownhosts, &w->last);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	// Watch the directory rather than the file so that keyfiles replaced
+	// by rename are picked up too.
+	if((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return;
+	if(inotify_add_watch(w->fd, w->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		logit(NSLOG_RUNTIME_WARNING, FALSE,
+			"Cannot watch %s for NagMQ known hosts changes, "
+			"polling every %d seconds instead: %s",
+			w->dir, keyfile_refresh_interval, strerror(errno));
+		close(w->fd);
+		w->fd = -1;
+	}
+#endif
+}
 
-			if(i == 1) {
-				size_t msglen = zmq_msg_size(&curmsg);
-				zmq_msg_init_size(&reqid, msglen);
-				memcpy(zmq_msg_data(&reqid), zmq_msg_data(&curmsg), msglen);
+// Returns true if the keyfile changed since it was last read
+static int check_watch(struct zap_watch * w) {
+	int changed = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+	if(w->fd >= 0) {
+		char buf[4096]
+			__attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t len;
+
+		while((len = read(w->fd, buf, sizeof(buf))) > 0) {
+			char * ptr = buf;
+			while(ptr < buf + len) {
+				struct inotify_event * ev = (struct inotify_event*)ptr;
+				if(ev->len && strcmp(ev->name, w->base) == 0)
+					changed = 1;
+				ptr += sizeof(struct inotify_event) + ev->len;
 			}
-			else if(i == 5)
-				strncpy(mech, zmq_msg_data(&curmsg), zmq_msg_size(&curmsg));
-			else if(i == 6)
-				memcpy(creds, zmq_msg_data(&curmsg), zmq_msg_size(&curmsg));
-			zmq_msg_close(&curmsg);
 		}
+		return changed;
+	}
+#endif
+	struct stat cur;
+	if(stat(curve_knownhosts, &cur) != 0)
+		return 0;
+	changed = cur.st_ino != w->last.st_ino ||
+		cur.st_size != w->last.st_size ||
+		cur.st_mtime != w->last.st_mtime;
+	w->last = cur;
+	return changed;
+}
 
-		if(keeprunning == 0)
-			break;
-		else if(i < 7)
-			continue;
+// Serves the ZAP endpoint and watches the keyfile. With one worker the
+// frontend is a REP socket answered here; with more it is a ROUTER that
+// hands requests to a pool of REP workers through a DEALER.
+static void * zap_main(void * arg) {
+	void ** socks = arg;
+	void * frontend = socks[0], *backend = socks[1];
+	struct zap_watch watch;
+	zmq_pollitem_t items[3];
+	int nitems = 0, watchitem = -1, rc;
+	time_t last_check = time(NULL);
+	sigset_t sigset;
 
-		if(strcmp(mech, "CURVE") != 0) {
-			rc = send_zap_resp(&reqid, "400",
-				"Must use curve auth", "", zapsock);
-			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
-				"NagMQ authentication request mechanism wasn't curve: %s\n", mech);
-			goto cleanup;
-		}
+	free(socks);
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
 
-		uint32_t hashval = fnv_hash(creds);
-		hashval &= bag.buckets;
+	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "Starting NagMQ curve authentication thread\n");
 
-		struct keybag * search = bag.data[hashval];
+	init_watch(&watch);
+	memset(items, 0, sizeof(items));
+	items[nitems].socket = frontend;
+	items[nitems++].events = ZMQ_POLLIN;
+	if(backend) {
+		items[nitems].socket = backend;
+		items[nitems++].events = ZMQ_POLLIN;
+	}
+	if(watch.fd >= 0) {
+		items[nitems].fd = watch.fd;
+		items[nitems].events = ZMQ_POLLIN;
+		watchitem = nitems++;
+	}
 
-		while(search && memcmp(search->key, creds, 32) != 0)
-			search = search->next;
+	for(;;) {
+		long timeout = watch.fd >= 0 ? -1 :
+			keyfile_refresh_interval * 1000 * ZMQ_POLL_MSEC;
 
-		if(search == NULL) {
-			rc = send_zap_resp(&reqid, "400",
-				"No authorized key found", "", zapsock);
-			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
-				"Client not found in NagMQ authorized keys file!\n");
-			goto cleanup;
+		rc = zmq_poll(items, nitems, timeout);
+		if(rc == -1) {
+			if(errno == EINTR)
+				continue;
+			if(errno != ETERM)
+				logit(NSLOG_RUNTIME_ERROR, FALSE,
+					"Error polling NagMQ authentication sockets: %s",
+					zmq_strerror(errno));
+			break;
 		}
 
-		rc = send_zap_resp(&reqid, "200",
-			"Authentication successful", "Authenticated User", zapsock);
-
-		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
-			"Successfully authenticated client from authorized keys file!\n");
-cleanup:
-		zmq_msg_close(&reqid);
-		if(rc == ETERM)
-			break;
-	}
+		if(watchitem != -1 && items[watchitem].revents & ZMQ_POLLIN) {
+			if(check_watch(&watch))
+				reload_keyfile();
+		} else if(watchitem == -1 &&
+			time(NULL) - last_check >= keyfile_refresh_interval) {
+			if(check_watch(&watch))
+				reload_keyfile();
+			last_check = time(NULL);
+		}
 
-	for(i = 0; i < bag.buckets; i++) {
-		while(bag.data[i]) {
-			struct keybag * n = bag.data[i]->next;
-			free(bag.data[i]);
-			bag.data[i] = n;
+		if(items[0].revents & ZMQ_POLLIN) {
+			if(backend)
+				rc = forward_msg(frontend, backend);
+			else
+				rc = handle_zap_request(frontend);
+			if(rc == -ETERM)
+				break;
+		}
+		if(backend && items[1].revents & ZMQ_POLLIN) {
+			if(forward_msg(backend, frontend) == -ETERM)
+				break;
 		}
 	}
 
 	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC,
 		"Ending NagMQ curve authentication thread\n");
-	free(bag.data);
-	zmq_close(zapsock);
+	if(watch.fd >= 0)
+		close(watch.fd);
+	free(watch.dir);
+	free(watch.base);
+	zmq_close(frontend);
+	if(backend)
+		zmq_close(backend);
+	swap_keyset(NULL);
 	return NULL;
 }
+
+static void * zap_socket(void * ctx, int type, const char * endpoint,
+	int bind) {
+	void * sock = zmq_socket(ctx, type);
+	int linger = 0;
+
+	if(sock == NULL) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error creating NagMQ authentication socket: %s",
+			zmq_strerror(errno));
+		return NULL;
+	}
+	zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(linger));
+	if((bind ? zmq_bind(sock, endpoint) : zmq_connect(sock, endpoint)) != 0) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error %s NagMQ authentication endpoint %s: %s",
+			bind ? "binding to" : "connecting to", endpoint,
+			zmq_strerror(errno));
+		zmq_close(sock);
+		return NULL;
+	}
+	return sock;
+}
+
+int start_zap_handler(void * ctx, int workers) {
+	void ** socks = calloc(2, sizeof(void*));
+	pthread_t tid;
+	int i, rc;
+
+	// Read the keyfile before any client can connect
+	reload_keyfile();
+	zap_stats.workers = workers > 1 ? workers : 1;
+
+	if(workers > 1) {
+		if((socks[0] = zap_socket(ctx, ZMQ_ROUTER,
+			"inproc://zeromq.zap.01", 1)) == NULL)
+			return -1;
+		if((socks[1] = zap_socket(ctx, ZMQ_DEALER,
+			"inproc://nagmq.zap.workers", 1)) == NULL)
+			return -1;
+
+		for(i = 0; i < workers; i++) {
+			void * worker = zap_socket(ctx, ZMQ_REP,
+				"inproc://nagmq.zap.workers", 0);
+			if(worker == NULL)
+				return -1;
+			if((rc = pthread_create(&tid, NULL, zap_worker, worker)) != 0) {
+				logit(NSLOG_RUNTIME_ERROR, TRUE,
+					"Error starting NagMQ authentication worker: %s",
+					strerror(rc));
+				return -1;
+			}
+			pthread_detach(tid);
+		}
+	} else if((socks[0] = zap_socket(ctx, ZMQ_REP,
+		"inproc://zeromq.zap.01", 1)) == NULL)
+		return -1;
+
+	if((rc = pthread_create(&tid, NULL, zap_main, socks)) != 0) {
+		logit(NSLOG_RUNTIME_ERROR, TRUE,
+			"Error starting NagMQ authentication thread: %s",
+			strerror(rc));
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
 #endif